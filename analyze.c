@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* sfs_analyze trace
+
+   Reports the access pattern of a block I/O trace (see disk_trace_start):
+   the reads and writes of every class of blocks, the working set (distinct
+   blocks accessed), the reuse distances and sequentiality. The reuse
+   distance of an access is the no of distinct blocks accessed since the
+   previous access to the same block, so an LRU cache of c blocks hits the
+   accesses with a distance under c: the hit ratio is reported for cache
+   sizes in powers of two. An access is sequential if it is to the block
+   after the previous access of the same kind (read or write). Exits with 0
+   on success and 1 on error.
+*/
+
+#define BUCKETS 33 // reuse distances: 0, [1, 2), [2, 4), ... [2^31, 2^32)
+
+char *class_names[SFS_BLOCK_CLASSES] = {"other",       "super",
+                                        "inode_bitmap", "data_bitmap",
+                                        "inode_table", "data",
+                                        "journal"};
+
+/* Fenwick tree over the positions of the accesses, 1 at the last access to
+   every block
+*/
+int *tree;
+uint64_t tree_size;
+
+void tree_add(uint64_t pos, int v) {
+    for (; pos <= tree_size; pos += pos & -pos) tree[pos] += v;
+}
+
+uint64_t tree_sum(uint64_t pos) {
+    uint64_t sum = 0;
+    for (; pos > 0; pos -= pos & -pos) sum += tree[pos];
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[1], "r");
+    disk_trace_header h;
+    if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1 ||
+        h.magic != DISK_TRACE_MAGIC ||
+        h.record_size != sizeof(disk_trace_record)) {
+        fprintf(stderr, "%s: %s is not a block I/O trace\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    uint64_t records = (ftell(fp) - sizeof(h)) / sizeof(disk_trace_record);
+    fseek(fp, sizeof(h), SEEK_SET);
+    tree_size = records;
+    tree = (int *)calloc(records + 1, sizeof(int));
+    uint64_t *last = (uint64_t *)calloc(h.blocks, sizeof(uint64_t));
+    unsigned char *touched = (unsigned char *)calloc(h.blocks, 1);
+    if (tree == NULL || last == NULL || touched == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t ops[3] = {0, 0, 0}, by_class[SFS_BLOCK_CLASSES][2];
+    uint64_t reuse[BUCKETS], cold = 0, accesses = 0, duration = 0;
+    uint64_t sequential[2] = {0, 0}, runs[2] = {0, 0};
+    uint64_t working[3] = {0, 0, 0}; // distinct blocks read, written, both
+    int64_t prev[2] = {-2, -2};
+    memset(by_class, 0, sizeof(by_class));
+    memset(reuse, 0, sizeof(reuse));
+
+    disk_trace_record r;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        if (r.op > DISK_TRACE_SYNC) continue;
+        ops[r.op]++;
+        duration = r.ns;
+        if (r.op == DISK_TRACE_SYNC || r.block >= h.blocks) continue;
+        by_class[r.cls < SFS_BLOCK_CLASSES ? r.cls : 0][r.op]++;
+
+        /* working set */
+        int bit = 1 << r.op;
+        if (touched[r.block] == 0) working[2]++;
+        if (!(touched[r.block] & bit)) working[r.op]++;
+        touched[r.block] |= bit;
+
+        /* reuse distance */
+        uint64_t pos = ++accesses;
+        if (last[r.block] == 0) {
+            cold++;
+        } else {
+            uint64_t distance = tree_sum(pos - 1) - tree_sum(last[r.block]);
+            int b = distance == 0 ? 0 : 64 - __builtin_clzll(distance);
+            reuse[b]++;
+            tree_add(last[r.block], -1);
+        }
+        tree_add(pos, 1);
+        last[r.block] = pos;
+
+        /* sequentiality */
+        if ((int64_t)r.block == prev[r.op] + 1)
+            sequential[r.op]++;
+        else
+            runs[r.op]++;
+        prev[r.op] = r.block;
+    }
+    fclose(fp);
+
+    printf("%lu reads, %lu writes, %lu syncs in %.3f s\n",
+           ops[DISK_TRACE_READ], ops[DISK_TRACE_WRITE], ops[DISK_TRACE_SYNC],
+           duration / 1e9);
+    printf("\n%-14s %12s %12s\n", "class", "reads", "writes");
+    for (int c = 0; c < SFS_BLOCK_CLASSES; ++c)
+        if (by_class[c][0] + by_class[c][1] > 0)
+            printf("%-14s %12lu %12lu\n", class_names[c], by_class[c][0],
+                   by_class[c][1]);
+
+    printf("\nworking set: %lu blocks (%.1f MB), %lu read, %lu written\n",
+           working[2], working[2] * (double)h.block_size / (1 << 20),
+           working[DISK_TRACE_READ], working[DISK_TRACE_WRITE]);
+
+    char *kind[2] = {"reads", "writes"};
+    for (int op = 0; op < 2; ++op)
+        if (ops[op] > 0)
+            printf("sequential %s: %.1f%%, %.1f blocks per run\n", kind[op],
+                   100.0 * sequential[op] / ops[op],
+                   1.0 * ops[op] / (runs[op] > 0 ? runs[op] : 1));
+
+    /* row b: accesses with a distance in [2^(b-1), 2^b), and the hit ratio
+       of an LRU cache of 2^b blocks */
+    printf("\n%-14s %12s %12s\n", "distance_under", "accesses", "lru_hit_%");
+    printf("%-14s %12lu\n", "first", cold);
+    uint64_t hits = 0;
+    for (int b = 0; b < BUCKETS && hits < accesses - cold; ++b) {
+        hits += reuse[b];
+        printf("%-14lu %12lu %12.1f\n", 1UL << b, reuse[b],
+               100.0 * hits / accesses);
+    }
+
+    free(tree);
+    free(last);
+    free(touched);
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+
+/* Benchmark suite. Runs a fixed set of workloads with fixed seeds on fresh
+   volumes and prints one JSON object per workload and line:
+     {"workload": name, "ops": n, "seconds": s, "ops_per_s": x,
+      "mb_per_s": x, "p50_us": x, "p90_us": x, "p99_us": x, "max_us": x,
+      "reads_per_op": x, "writes_per_op": x, "failed": n}
+   mb_per_s counts the file data moved and is 0 for metadata workloads, the
+   percentiles are of the latency of single operations and reads / writes
+   are block I/Os of the disk. The exit status is 1 if an operation failed.
+   The workloads are
+     seq_write_<size>, seq_read_<size>   write_i / read_i of files in order
+     rand_write_4k, rand_read_4k         write_i / read_i of random blocks
+     create, stat, delete                fs_create_file / fs_stat /
+                                         fs_remove_file storms
+     create_path                         write_file of new files in a
+                                         directory
+     lookup_deep, lookup_wide            name_to_inode of a deep path, of
+                                         random names of a large directory
+     remove_tree                         remove_dir of a large tree, one op
+                                         per entry removed (no percentiles)
+     format, format_lazy, mount          of a large image
+*/
+
+/* internal to sfs.c */
+int name_to_inode(sfs_fs *fs, char *path, int type);
+
+#define DISK_BYTES (256 * 1024 * 1024) // volume of the file workloads
+#define LARGE_BYTES (1024 * 1024 * 1024) // image of the format workloads
+#define FILE_BYTES (4 * 1024 * 1024) // size of the files read and written
+#define DATA_BYTES (64 * 1024 * 1024) // data moved by a sequential workload
+#define RANDOM_OPS 20000
+#define META_OPS 10000
+#define LOOKUP_OPS 50000
+#define DEPTH 16       // lookup_deep: directories in the path
+#define WIDE 10000     // lookup_wide: entries of the directory
+#define TREE_DIRS 50   // remove_tree: directories of the tree
+#define TREE_FILES 100 // remove_tree: files per directory
+#define FORMAT_RUNS 5
+
+disk *d;
+sfs_fs *fs;
+char *buf;
+int size;       // bytes per operation of the file workloads
+int files[DATA_BYTES / FILE_BYTES];
+int inodes[META_OPS];
+unsigned seed;
+char deep[DEPTH * 8 + 16];
+FILE *out; // the results, stdout of the file system goes to /dev/null
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs op for i in [0, ops) and prints the results of workload name.
+   bytes is the file data moved by one operation. Returns the no of failed
+   operations
+*/
+int measure(char *name, int ops, int bytes, int (*op)(int i)) {
+    double *lat = (double *)malloc(sizeof(double) * ops);
+    uint32_t reads = d->reads, writes = d->writes;
+    int failed = 0;
+    double start = now_us();
+    for (int i = 0; i < ops; ++i) {
+        double t = now_us();
+        failed += op(i) == -1;
+        lat[i] = now_us() - t;
+    }
+    double seconds = (now_us() - start) / 1e6;
+    qsort(lat, ops, sizeof(double), compare_double);
+    fprintf(out, "{\"workload\": \"%s\", \"ops\": %d, \"seconds\": %.6f, "
+           "\"ops_per_s\": %.1f, \"mb_per_s\": %.2f, \"p50_us\": %.2f, "
+           "\"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, "
+           "\"reads_per_op\": %.3f, \"writes_per_op\": %.3f, "
+           "\"failed\": %d}\n",
+           name, ops, seconds, ops / seconds,
+           1.0 * bytes * ops / (1024 * 1024) / seconds, lat[ops / 2],
+           lat[ops * 9 / 10], lat[ops * 99 / 100], lat[ops - 1],
+           1.0 * (d->reads - reads) / ops, 1.0 * (d->writes - writes) / ops,
+           failed);
+    fflush(out);
+    free(lat);
+    return failed;
+}
+
+/* Formats and mounts the volume of the file workloads */
+void fresh_volume() {
+    if (fs != NULL) fs_unmount(fs);
+    fs_format(d);
+    fs = fs_mount(d, MRD_Y);
+}
+
+/* Operation i of a sequential workload: the files are read / written in
+   order, size bytes at a time */
+int seq_write(int i) {
+    int per_file = FILE_BYTES / size;
+    return fs_write_i(fs, files[i / per_file], buf, size,
+                      i % per_file * size) == size
+               ? 0
+               : -1;
+}
+
+int seq_read(int i) {
+    int per_file = FILE_BYTES / size;
+    return fs_read_i(fs, files[i / per_file], buf, size,
+                     i % per_file * size) == size
+               ? 0
+               : -1;
+}
+
+int rand_write(int i) {
+    int block = rand_r(&seed) % (DATA_BYTES / BLOCKSIZE);
+    int per_file = FILE_BYTES / BLOCKSIZE;
+    return fs_write_i(fs, files[block / per_file], buf, BLOCKSIZE,
+                      block % per_file * BLOCKSIZE) == BLOCKSIZE
+               ? 0
+               : -1;
+}
+
+int rand_read(int i) {
+    int block = rand_r(&seed) % (DATA_BYTES / BLOCKSIZE);
+    int per_file = FILE_BYTES / BLOCKSIZE;
+    return fs_read_i(fs, files[block / per_file], buf, BLOCKSIZE,
+                     block % per_file * BLOCKSIZE) == BLOCKSIZE
+               ? 0
+               : -1;
+}
+
+int create(int i) {
+    inodes[i] = fs_create_file(fs);
+    return inodes[i] == -1 ? -1 : 0;
+}
+
+int stat_op(int i) {
+    return fs_stat(fs, inodes[rand_r(&seed) % META_OPS]) == -1 ? -1 : 0;
+}
+
+int delete(int i) { return fs_remove_file(fs, inodes[i]); }
+
+int create_path(int i) {
+    char path[64];
+    sprintf(path, "/new/f%d", i);
+    return fs_write_file(fs, path, buf, 0, 0);
+}
+
+int lookup_deep(int i) {
+    return name_to_inode(fs, deep, SFS_TYPE_F) == -1 ? -1 : 0;
+}
+
+int lookup_wide(int i) {
+    char path[64];
+    sprintf(path, "/wide/a file with a long name %d", rand_r(&seed) % WIDE);
+    return name_to_inode(fs, path, SFS_TYPE_F) == -1 ? -1 : 0;
+}
+
+int format_op(int i) { return fs_format(d); }
+
+int format_lazy(int i) { return fs_format_lazy(d); }
+
+int mount_op(int i) {
+    sfs_fs *m = fs_mount(d, MRD_N);
+    if (m == NULL) return -1;
+    fs_unmount(m);
+    return 0;
+}
+
+int main() {
+    int failed = 0;
+    char name[64], path[256];
+    buf = (char *)malloc(FILE_BYTES);
+    memset(buf, 'b', FILE_BYTES);
+    /* fs_stat and others print */
+    fflush(stdout);
+    out = fdopen(dup(1), "w");
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    close(null_fd);
+
+    remove("bench_data");
+    d = create_disk("bench_data", DISK_BYTES);
+
+    /* File data */
+    int sizes[] = {4096, 65536, 1024 * 1024};
+    for (int s = 0; s < 3; ++s) {
+        fresh_volume();
+        for (int f = 0; f < DATA_BYTES / FILE_BYTES; ++f)
+            files[f] = fs_create_file(fs);
+        size = sizes[s];
+        sprintf(name, "seq_write_%dk", size / 1024);
+        failed += measure(name, DATA_BYTES / size, size, seq_write);
+        sprintf(name, "seq_read_%dk", size / 1024);
+        failed += measure(name, DATA_BYTES / size, size, seq_read);
+    }
+    seed = 1;
+    failed += measure("rand_write_4k", RANDOM_OPS, BLOCKSIZE, rand_write);
+    seed = 2;
+    failed += measure("rand_read_4k", RANDOM_OPS, BLOCKSIZE, rand_read);
+
+    /* Metadata */
+    fresh_volume();
+    failed += measure("create", META_OPS, 0, create);
+    seed = 3;
+    failed += measure("stat", META_OPS, 0, stat_op);
+    failed += measure("delete", META_OPS, 0, delete);
+    fs_create_dir(fs, "/new");
+    failed += measure("create_path", META_OPS, 0, create_path);
+
+    /* Lookups */
+    fresh_volume();
+    strcpy(deep, "");
+    for (int level = 0; level < DEPTH; ++level) {
+        sprintf(deep + strlen(deep), "/d%d", level);
+        fs_create_dir(fs, deep);
+    }
+    strcat(deep, "/file");
+    fs_write_file(fs, deep, buf, 1, 0);
+    failed += measure("lookup_deep", LOOKUP_OPS, 0, lookup_deep);
+    fs_create_dir(fs, "/wide");
+    for (int i = 0; i < WIDE; ++i) {
+        sprintf(path, "/wide/a file with a long name %d", i);
+        fs_write_file(fs, path, buf, 0, 0);
+    }
+    seed = 4;
+    failed += measure("lookup_wide", LOOKUP_OPS, 0, lookup_wide);
+
+    /* Tree removal, reported per entry */
+    fresh_volume();
+    fs_create_dir(fs, "/tree");
+    for (int i = 0; i < TREE_DIRS; ++i) {
+        sprintf(path, "/tree/d%d", i);
+        fs_create_dir(fs, path);
+        for (int f = 0; f < TREE_FILES; ++f) {
+            sprintf(path, "/tree/d%d/f%d", i, f);
+            fs_write_file(fs, path, buf, BLOCKSIZE, 0);
+        }
+    }
+    uint32_t reads = d->reads, writes = d->writes;
+    double t = now_us();
+    int ret = fs_remove_dir(fs, "/tree");
+    t = (now_us() - t) / 1e6;
+    int entries = TREE_DIRS * (TREE_FILES + 1) + 1;
+    fprintf(out, "{\"workload\": \"remove_tree\", \"ops\": %d, "
+            "\"seconds\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": 0.00, "
+            "\"reads_per_op\": %.3f, \"writes_per_op\": %.3f, "
+            "\"failed\": %d}\n",
+            entries, t, entries / t, 1.0 * (d->reads - reads) / entries,
+            1.0 * (d->writes - writes) / entries, ret == -1);
+    failed += ret == -1;
+    fs_unmount(fs);
+    fclose(d->data);
+    free_disk(d);
+    remove("bench_data");
+
+    /* Format and mount of a large image */
+    remove("bench_large");
+    d = create_disk("bench_large", LARGE_BYTES);
+    failed += measure("format", FORMAT_RUNS, 0, format_op);
+    failed += measure("mount", FORMAT_RUNS, 0, mount_op);
+    failed += measure("format_lazy", FORMAT_RUNS, 0, format_lazy);
+    fclose(d->data);
+    free_disk(d);
+    remove("bench_large");
+
+    free(buf);
+    fclose(out);
+    return failed > 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+
+/* Path lookup benchmark. Builds volumes of growing size with the same
+   directory tree and measures the cost of resolving a deep path. Lookup cost
+   should depend on the depth of the path, not on the size of the volume.
+*/
+
+/* internal to sfs.c */
+int name_to_inode(sfs_fs *fs, char *path, int type);
+extern sfs_fs *mounted_fs;
+
+#define DEPTH 8
+#define LOOKUPS 20000
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void bench_volume(int nbytes) {
+    remove("lookup_bench_data");
+    disk *d = create_disk("lookup_bench_data", nbytes);
+    format(d);
+    mount(d, MRD_Y);
+
+    /* /d0/d1/.../d7/file with a few siblings at every level */
+    char path[256] = "";
+    for (int level = 0; level < DEPTH; ++level) {
+        char sibling[256];
+        for (int i = 0; i < 16; ++i) {
+            sprintf(sibling, "%s/s%d", path, i);
+            write_file(sibling, "x", 1, 0);
+        }
+        sprintf(path + strlen(path), "/d%d", level);
+        create_dir(path);
+    }
+    strcat(path, "/file");
+    write_file(path, "x", 1, 0);
+
+    /* Hot lookups of the same deep path */
+    uint32_t reads = d->reads;
+    double t = now_ns();
+    for (int i = 0; i < LOOKUPS; ++i)
+        name_to_inode(mounted_fs, path, SFS_TYPE_F);
+    double hot_ns = (now_ns() - t) / LOOKUPS;
+    double hot_reads = 1.0 * (d->reads - reads) / LOOKUPS;
+
+    /* Lookups of distinct missing names in the deepest directory */
+    char missing[300];
+    reads = d->reads;
+    t = now_ns();
+    for (int i = 0; i < LOOKUPS; ++i) {
+        sprintf(missing, "%s%d", path, i);
+        name_to_inode(mounted_fs, missing, SFS_TYPE_F);
+    }
+    double miss_ns = (now_ns() - t) / LOOKUPS;
+    double miss_reads = 1.0 * (d->reads - reads) / LOOKUPS;
+
+    super_block s;
+    char buf[BLOCKSIZE];
+    read_block(d, 0, buf);
+    s = *(super_block *)buf;
+    printf("%12d %8d %12.0f %10.2f %12.0f %10.2f\n", nbytes, s.inodes, hot_ns,
+           hot_reads, miss_ns, miss_reads);
+
+    fclose(d->data);
+    free_disk(d);
+    remove("lookup_bench_data");
+}
+
+int main() {
+    printf("%12s %8s %12s %10s %12s %10s\n", "bytes", "inodes", "hot_ns",
+           "hot_reads", "miss_ns", "miss_reads");
+    for (int mb = 4; mb <= 256; mb *= 4)
+        bench_volume(mb * 1024 * 1024);
+    return 0;
+}
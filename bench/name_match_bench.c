@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+
+/* Directory block scan microbenchmark. Fills a directory block with entries
+   and compares the slot at a time scan (db_find_scalar) with the vectorized
+   one (db_find), for names found at random positions and for missing names.
+*/
+
+/* internal to sfs.c */
+uint32_t name_hash(const char *name, int length);
+int db_find(char *block, uint32_t hash, const char *name, int length,
+            int type);
+int db_find_scalar(char *block, uint32_t hash, const char *name, int length,
+                   int type);
+
+#define LOOKUPS 1000000
+
+typedef int (*find_fn)(char *, uint32_t, const char *, int, int);
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fills block with entries named <prefix><i> until it is full. Returns the
+   no of entries
+*/
+int fill_block(char *block, char *prefix) {
+    memset(block, 0, BLOCKSIZE);
+    dirent_block *b = (dirent_block *)block;
+    dirent_slot *s = (dirent_slot *)(block + sizeof(dirent_block));
+    b->names = BLOCKSIZE;
+
+    char name[MAX_FILENAME + 1];
+    for (uint32_t i = 0;; ++i) {
+        int length = sprintf(name, "%s%u", prefix, i);
+        int size = sizeof(uint32_t) + length;
+        int slots_end = sizeof(dirent_block) + (b->count + 1) * sizeof(dirent_slot);
+        if (slots_end + size > b->names) break;
+
+        b->names -= size;
+        memcpy(block + b->names, &i, sizeof(uint32_t));
+        memcpy(block + b->names + sizeof(uint32_t), name, length);
+        s[b->count].hash = name_hash(name, length);
+        s[b->count].offset = b->names;
+        s[b->count].length = length;
+        s[b->count].type = SFS_TYPE_F;
+        b->count++;
+        b->live++;
+        b->used += size;
+    }
+    return b->count;
+}
+
+/* Returns the ns per lookup of find over the names in queries */
+double bench_find(find_fn find, char *block, char **queries, int nqueries,
+                  int *found) {
+    uint32_t hashes[nqueries];
+    int lengths[nqueries];
+    for (int i = 0; i < nqueries; ++i) {
+        lengths[i] = strlen(queries[i]);
+        hashes[i] = name_hash(queries[i], lengths[i]);
+    }
+
+    int hits = 0;
+    double t = now_ns();
+    for (int i = 0; i < LOOKUPS; ++i) {
+        int q = i % nqueries;
+        if (find(block, hashes[q], queries[q], lengths[q], SFS_TYPE_F) != -1)
+            hits++;
+    }
+    *found = hits;
+    return (now_ns() - t) / LOOKUPS;
+}
+
+void bench_block(char *prefix) {
+    char block[BLOCKSIZE];
+    int n = fill_block(block, prefix);
+
+    /* Random present names and absent names */
+    int nqueries = 256;
+    char *hit[nqueries], *miss[nqueries];
+    srand(1);
+    for (int i = 0; i < nqueries; ++i) {
+        hit[i] = (char *)malloc(MAX_FILENAME + 1);
+        miss[i] = (char *)malloc(MAX_FILENAME + 1);
+        sprintf(hit[i], "%s%d", prefix, rand() % n);
+        sprintf(miss[i], "%s%d", prefix, n + rand() % n);
+    }
+
+    int h0, h1, m0, m1;
+    double hs = bench_find(db_find_scalar, block, hit, nqueries, &h0);
+    double hv = bench_find(db_find, block, hit, nqueries, &h1);
+    double ms = bench_find(db_find_scalar, block, miss, nqueries, &m0);
+    double mv = bench_find(db_find, block, miss, nqueries, &m1);
+    if (h0 != LOOKUPS || h1 != LOOKUPS || m0 != 0 || m1 != 0)
+        printf("MISMATCH\n");
+
+    printf("%-12s %8d %10.1f %10.1f %10.1f %10.1f\n", prefix, n, hs, hv, ms,
+           mv);
+
+    for (int i = 0; i < nqueries; ++i) {
+        free(hit[i]);
+        free(miss[i]);
+    }
+}
+
+int main() {
+    printf("%-12s %8s %10s %10s %10s %10s\n", "prefix", "entries",
+           "hit_scalar", "hit_simd", "miss_scalar", "miss_simd");
+    bench_block("f");
+    bench_block("file_");
+    bench_block("a_longer_file_name_");
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+
+/* Multi-threaded stress benchmark. Runs the same workloads with 1, 2, 4 and
+   8 threads and reports the throughput and the speedup over one thread:
+     same_read  every thread reads random blocks of one shared file
+     file_read  every thread reads random blocks of its own file
+     lookup     path lookups spread over a shared directory tree
+     mixed      reads, rewrites of a thread's own files and file creations
+                in a shared directory
+     create     every thread creates one block files in its own directory
+   After the mixed workload the file contents and the shared directory are
+   checked, a failed check makes the benchmark exit with status 1.
+*/
+
+/* internal to sfs.c */
+int name_to_inode(sfs_fs *fs, char *path, int type);
+extern sfs_fs *mounted_fs;
+
+#define MAX_THREADS 8
+#define FILE_BLOCKS 64 // size of the test files in blocks
+#define OPS 20000      // operations per thread
+#define DIRS 16        // directories of the lookup tree
+#define DIR_FILES 64   // files in every directory of the lookup tree
+#define CREATE_EVERY 8 // mixed: one creation every CREATE_EVERY operations
+#define CREATES 1000   // create: files created per thread
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    unsigned seed;
+    int errors;
+} worker;
+
+int shared_inode;
+int own_inodes[MAX_THREADS];
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fills a block with the pattern of (file, block, version) */
+void pattern(char *buf, int file, int block, int version) {
+    for (int i = 0; i < BLOCKSIZE; ++i)
+        buf[i] = (char)(file * 31 + block * 7 + version + i);
+}
+
+void *same_read(void *arg) {
+    worker *w = (worker *)arg;
+    char buf[BLOCKSIZE];
+    for (int i = 0; i < OPS; ++i) {
+        int b = rand_r(&w->seed) % FILE_BLOCKS;
+        if (read_i(shared_inode, buf, BLOCKSIZE, b * BLOCKSIZE) != BLOCKSIZE)
+            w->errors++;
+    }
+    return NULL;
+}
+
+void *file_read(void *arg) {
+    worker *w = (worker *)arg;
+    char buf[BLOCKSIZE];
+    for (int i = 0; i < OPS; ++i) {
+        int b = rand_r(&w->seed) % FILE_BLOCKS;
+        if (read_i(own_inodes[w->id], buf, BLOCKSIZE, b * BLOCKSIZE) !=
+            BLOCKSIZE)
+            w->errors++;
+    }
+    return NULL;
+}
+
+void *lookup(void *arg) {
+    worker *w = (worker *)arg;
+    char path[64];
+    for (int i = 0; i < OPS; ++i) {
+        int d = rand_r(&w->seed) % DIRS;
+        int f = rand_r(&w->seed) % DIR_FILES;
+        sprintf(path, "/tree/d%d/f%d", d, f);
+        if (name_to_inode(mounted_fs, path, SFS_TYPE_F) == -1) w->errors++;
+    }
+    return NULL;
+}
+
+void *mixed(void *arg) {
+    worker *w = (worker *)arg;
+    char buf[BLOCKSIZE], path[64];
+    int created = 0;
+    for (int i = 0; i < OPS; ++i) {
+        int b = rand_r(&w->seed) % FILE_BLOCKS;
+        if (i % CREATE_EVERY == 0) {
+            sprintf(path, "/shared/t%d_%d", w->id, created++);
+            int fd = sfs_open(path, SFS_O_CREAT);
+            if (fd == -1 || sfs_close(fd) == -1) w->errors++;
+        } else if (i % 2 == 0) {
+            /* Rewrite a block of the own file with the next version */
+            pattern(buf, w->id, b, 1);
+            if (write_i(own_inodes[w->id], buf, BLOCKSIZE, b * BLOCKSIZE) !=
+                BLOCKSIZE)
+                w->errors++;
+        } else {
+            if (read_file("/file_shared", buf, BLOCKSIZE, b * BLOCKSIZE) !=
+                BLOCKSIZE)
+                w->errors++;
+        }
+    }
+    return NULL;
+}
+
+void *create(void *arg) {
+    worker *w = (worker *)arg;
+    char buf[BLOCKSIZE], path[64];
+    memset(buf, 'c', BLOCKSIZE);
+    for (int i = 0; i < CREATES; ++i) {
+        sprintf(path, "/ingest%d/f%d", w->id, i);
+        if (write_file(path, buf, BLOCKSIZE, 0) != BLOCKSIZE) w->errors++;
+    }
+    return NULL;
+}
+
+/* Runs fn on nthreads threads, each doing ops operations. Returns the no of
+   operations per second
+*/
+double run(void *(*fn)(void *), int nthreads, int ops, int *errors) {
+    worker workers[MAX_THREADS];
+    double t = now_ns();
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].id = i;
+        workers[i].seed = 1234 + i;
+        workers[i].errors = 0;
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        *errors += workers[i].errors;
+    }
+    return 1e9 * ops * nthreads / (now_ns() - t);
+}
+
+/* Creates a file of FILE_BLOCKS blocks filled with version 0 patterns.
+   Returns its inode
+*/
+int make_file(char *path, int id) {
+    char buf[BLOCKSIZE];
+    for (int b = 0; b < FILE_BLOCKS; ++b) {
+        pattern(buf, id, b, 0);
+        write_file(path, buf, BLOCKSIZE, b * BLOCKSIZE);
+    }
+    return name_to_inode(mounted_fs, path, SFS_TYPE_F);
+}
+
+/* Checks the contents of the files of the threads and the entries created
+   by the mixed workload. Returns the no of problems found
+*/
+int check(int nthreads) {
+    int problems = 0;
+    char buf[BLOCKSIZE], v0[BLOCKSIZE], v1[BLOCKSIZE];
+    for (int t = 0; t < MAX_THREADS; ++t) {
+        for (int b = 0; b < FILE_BLOCKS; ++b) {
+            pattern(v0, t, b, 0);
+            pattern(v1, t, b, 1);
+            if (read_i(own_inodes[t], buf, BLOCKSIZE, b * BLOCKSIZE) !=
+                    BLOCKSIZE ||
+                (memcmp(buf, v0, BLOCKSIZE) != 0 &&
+                 memcmp(buf, v1, BLOCKSIZE) != 0))
+                problems++;
+        }
+    }
+
+    int expected = nthreads * ((OPS + CREATE_EVERY - 1) / CREATE_EVERY);
+    int found = 0, n;
+    sfs_dirent entries[64];
+    int dd = sfs_opendir("/shared");
+    while ((n = sfs_readdir(dd, entries, 64)) > 0)
+        found += n;
+    sfs_closedir(dd);
+    if (found != expected) problems++;
+    return problems;
+}
+
+int main() {
+    remove("stress_bench_data");
+    disk *d = create_disk("stress_bench_data", 64 * 1024 * 1024);
+    format(d);
+    mount(d, MRD_Y);
+
+    char path[64];
+    shared_inode = make_file("/file_shared", MAX_THREADS);
+    for (int t = 0; t < MAX_THREADS; ++t) {
+        sprintf(path, "/file%d", t);
+        own_inodes[t] = make_file(path, t);
+    }
+    create_dir("/tree");
+    for (int i = 0; i < DIRS; ++i) {
+        sprintf(path, "/tree/d%d", i);
+        create_dir(path);
+        for (int f = 0; f < DIR_FILES; ++f) {
+            sprintf(path, "/tree/d%d/f%d", i, f);
+            write_file(path, "x", 1, 0);
+        }
+    }
+
+    struct {
+        char *name;
+        void *(*fn)(void *);
+        int ops;
+    } workloads[] = {{"same_read", same_read, OPS},
+                     {"file_read", file_read, OPS},
+                     {"lookup", lookup, OPS},
+                     {"mixed", mixed, OPS},
+                     {"create", create, CREATES}};
+
+    int failed = 0;
+    printf("%10s %8s %12s %8s %8s\n", "workload", "threads", "ops_per_s",
+           "speedup", "errors");
+    for (int w = 0; w < 5; ++w) {
+        double base = 0;
+        for (int nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+            if (workloads[w].fn == mixed) {
+                remove_dir("/shared");
+                create_dir("/shared");
+            }
+            for (int t = 0; workloads[w].fn == create && t < nthreads; ++t) {
+                sprintf(path, "/ingest%d", t);
+                remove_dir(path);
+                create_dir(path);
+            }
+            int errors = 0;
+            double ops = run(workloads[w].fn, nthreads, workloads[w].ops,
+                             &errors);
+            if (nthreads == 1) base = ops;
+            if (workloads[w].fn == mixed) errors += check(nthreads);
+            printf("%10s %8d %12.0f %8.2f %8d\n", workloads[w].name, nthreads,
+                   ops, ops / base, errors);
+            failed |= errors > 0;
+        }
+    }
+
+    fclose(d->data);
+    free_disk(d);
+    remove("stress_bench_data");
+    return failed;
+}
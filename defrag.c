@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* sfs_defrag [-n] [-v] [-r blocks-per-second] image
+
+   Reports the fragmentation of the SFS file system of a disk image (see
+   fs_fragmentation), then defragments it (see fs_defrag) and reports it
+   again. -n only reports, -v lists the files with more than one extent and
+   -r limits the rate at which blocks are moved. Exits with 0 on success and
+   1 on error.
+*/
+
+/* Lists a fragmented file */
+void print_file(void *arg, sfs_frag_file *f) {
+    if (f->extents > 1)
+        printf("inode %u: %u bytes, %u blocks in %u extents\n", f->inumber,
+               f->size, f->blocks, f->extents);
+}
+
+void print_report(char *when, sfs_frag_report *r) {
+    /* a file in one extent has all its blocks but the first contiguous */
+    uint32_t pairs = r->blocks - r->mapped;
+    printf("%s: %u files, %u fragmented, %u blocks in %u extents, "
+           "%.1f%% contiguous\n",
+           when, r->files, r->fragmented, r->blocks, r->extents,
+           pairs > 0 ? 100.0 * (r->blocks - r->extents) / pairs : 100.0);
+    printf("%s: %u free blocks in %u extents, largest %u\n", when,
+           r->free_blocks, r->free_extents, r->largest_free);
+}
+
+int main(int argc, char **argv) {
+    int report_only = 0, verbose = 0, rate = 0, opt, bad = 0;
+    while ((opt = getopt(argc, argv, "nvr:")) != -1) {
+        if (opt == 'n')
+            report_only = 1;
+        else if (opt == 'v')
+            verbose = 1;
+        else if (opt == 'r' && (rate = atoi(optarg)) > 0)
+            ;
+        else
+            bad = 1;
+    }
+    if (bad || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n] [-v] [-r blocks-per-second] image\n",
+                argv[0]);
+        return 1;
+    }
+
+    /* create_disk would create a missing image */
+    disk *d = access(argv[optind], R_OK | W_OK) == 0
+                  ? create_disk(argv[optind], 0)
+                  : NULL;
+    sfs_fs *fs = d != NULL ? fs_mount(d, MRD_N) : NULL;
+    if (fs == NULL) {
+        fprintf(stderr, "%s: can not mount %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+
+    sfs_frag_report r;
+    int ret = fs_fragmentation(fs, &r, verbose ? print_file : NULL, NULL);
+    if (ret != -1) print_report("before", &r);
+    int moved = 0;
+    if (ret != -1 && !report_only) {
+        moved = fs_defrag(fs, rate);
+        ret = moved == -1 ? -1 : fs_fragmentation(fs, &r, NULL, NULL);
+    }
+    if (ret != -1 && !report_only) {
+        printf("%d blocks moved\n", moved);
+        print_report("after", &r);
+    }
+    fs_unmount(fs);
+    fclose(d->data);
+    free_disk(d);
+    if (ret == -1) {
+        fprintf(stderr, "%s: I/O error on %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+    return 0;
+}
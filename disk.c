@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <errno.h>
 #include <error.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 typedef uint8_t byte;
 
@@ -27,9 +30,124 @@ int initialize_disk(disk *d) {
             return -1;
         }
     }
+    /* Blocks are accessed through the descriptor from now on */
+    fflush(fp);
+    return 0;
+}
+
+__thread uint64_t thread_reads = 0, thread_writes = 0;
+
+/* Block I/O trace. One disk is traced at a time, its records are buffered
+   and appended to the trace file TRACE_BUFFER at a time. Block classes are
+   given by the classifier registered for the disk, by the file system
+   mounted on it
+*/
+#define TRACE_BUFFER 4096 // records buffered before they are written
+
+disk *trace_disk = NULL; // the traced disk, read without the lock
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+FILE *trace_file;
+int64_t trace_start_ns;
+disk_trace_record trace_buf[TRACE_BUFFER];
+int trace_count;
+int trace_env_used = 0; // SFS_DISK_TRACE was applied
+
+struct {
+    disk *d;
+    int (*classify)(void *arg, int blocknr);
+    void *arg;
+} classifiers[DISK_CLASSIFIERS];
+
+int64_t trace_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Writes the buffered records. Called with the trace lock held */
+int trace_flush() {
+    int n = fwrite(trace_buf, sizeof(disk_trace_record), trace_count,
+                   trace_file);
+    int ret = n == trace_count ? 0 : -1;
+    trace_count = 0;
+    return ret;
+}
+
+/* Records an operation op on block blocknr of d if it is traced */
+void trace_record(disk *d, int op, int blocknr) {
+    if (__atomic_load_n(&trace_disk, __ATOMIC_RELAXED) != d) return;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_disk == d) {
+        disk_trace_record *r = &trace_buf[trace_count++];
+        memset(r, 0, sizeof(disk_trace_record));
+        r->ns = trace_clock_ns() - trace_start_ns;
+        r->block = blocknr;
+        r->op = op;
+        for (int i = 0; i < DISK_CLASSIFIERS && op != DISK_TRACE_SYNC; ++i)
+            if (classifiers[i].d == d)
+                r->cls = classifiers[i].classify(classifiers[i].arg, blocknr);
+        if (trace_count == TRACE_BUFFER) trace_flush();
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Starts tracing the block I/O of the disk to the file path (see
+   disk_trace_header). Only one disk is traced at a time. Returns -1 on
+   error
+*/
+int disk_trace_start(disk *diskptr, char *path) {
+    pthread_mutex_lock(&trace_lock);
+    FILE *fp = trace_disk == NULL ? fopen(path, "w") : NULL;
+    disk_trace_header h = {DISK_TRACE_MAGIC, BLOCKSIZE, diskptr->blocks,
+                           sizeof(disk_trace_record)};
+    if (fp == NULL || fwrite(&h, sizeof(h), 1, fp) != 1) {
+        if (fp != NULL) fclose(fp);
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_file = fp;
+    trace_count = 0;
+    trace_start_ns = trace_clock_ns();
+    __atomic_store_n(&trace_disk, diskptr, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
     return 0;
 }
 
+/* Stops tracing the disk, writing the records left. Returns -1 if it was
+   not traced or on error
+*/
+int disk_trace_stop(disk *diskptr) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_disk != diskptr) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    __atomic_store_n(&trace_disk, NULL, __ATOMIC_RELAXED);
+    int ret = trace_flush();
+    if (fclose(trace_file) != 0) ret = -1;
+    pthread_mutex_unlock(&trace_lock);
+    return ret;
+}
+
+/* Registers the function giving the class of the blocks of the disk in its
+   trace records, or removes it if classify is NULL
+*/
+void disk_trace_classify(disk *diskptr, int (*classify)(void *arg, int blocknr),
+                         void *arg) {
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < DISK_CLASSIFIERS; ++i)
+        if (classifiers[i].d == diskptr) classifiers[i].d = NULL;
+    for (int i = 0; i < DISK_CLASSIFIERS && classify != NULL; ++i) {
+        if (classifiers[i].d == NULL) {
+            classifiers[i].d = diskptr;
+            classifiers[i].classify = classify;
+            classifiers[i].arg = arg;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
 /*If @filename exists reads it, else creates file of @nbytes size */
 disk *create_disk(char *filename, int nbytes) {
     FILE *fp = fopen(filename, "r+");
@@ -53,25 +171,27 @@ disk *create_disk(char *filename, int nbytes) {
         if (ret == -1) return NULL;
     }
 
+    /* the first disk opened is traced if SFS_DISK_TRACE names a file */
+    char *trace = getenv("SFS_DISK_TRACE");
+    if (trace != NULL && !__atomic_exchange_n(&trace_env_used, 1,
+                                              __ATOMIC_RELAXED))
+        disk_trace_start(d, trace);
     return d;
 };
 
+/* Block I/O is positional (pread / pwrite on the underlying descriptor), so
+   blocks may be read and written from several threads at once */
 int read_block(disk *diskptr, int blocknr, void *block_data) {
     if (blocknr >= 0 && blocknr < diskptr->blocks) {
-        FILE *fp = diskptr->data;
-        int current = ftell(fp);
-        int dest = sizeof(disk) + blocknr * BLOCKSIZE;
-        int ret;
-        if (current != dest) {
-            ret = fseek(fp, dest - current, SEEK_CUR);
-            if (ret == -1) return -1;
-        }
-        ret = fread(block_data, sizeof(byte), BLOCKSIZE, fp);
-        if (ferror(fp)) return -1; // Any File IO error
-        if (ret != BLOCKSIZE) return -1;
+        int fd = fileno(diskptr->data);
+        off_t src = sizeof(disk) + (off_t)blocknr * BLOCKSIZE;
+        ssize_t ret = pread(fd, block_data, BLOCKSIZE, src);
+        if (ret != BLOCKSIZE) return -1; // Any File IO error
 
         /* All ok */
-        diskptr->reads++;
+        __sync_fetch_and_add(&diskptr->reads, 1);
+        thread_reads++;
+        trace_record(diskptr, DISK_TRACE_READ, blocknr);
         return 0;
     }
     return -1;
@@ -79,27 +199,29 @@ int read_block(disk *diskptr, int blocknr, void *block_data) {
 
 int write_block(disk *diskptr, int blocknr, void *block_data) {
     if (blocknr >= 0 && blocknr < diskptr->blocks) {
-        FILE *fp = diskptr->data;
-        int current = ftell(fp);
-        int src = sizeof(disk) + blocknr * BLOCKSIZE;
-        int ret;
-        if (current != src) {
-            ret = fseek(fp, src - current, SEEK_CUR);
-            if (ret == -1) return -1;
-        }
-        ret = fwrite(block_data, sizeof(byte), BLOCKSIZE, fp);
-        if (ferror(fp)) return -1; // Any FILE IO error
-        if (ret != BLOCKSIZE) return -1;
+        int fd = fileno(diskptr->data);
+        off_t dest = sizeof(disk) + (off_t)blocknr * BLOCKSIZE;
+        ssize_t ret = pwrite(fd, block_data, BLOCKSIZE, dest);
+        if (ret != BLOCKSIZE) return -1; // Any FILE IO error
 
         /* All ok */
-        diskptr->writes++;
-        fflush(fp);
+        __sync_fetch_and_add(&diskptr->writes, 1);
+        thread_writes++;
+        trace_record(diskptr, DISK_TRACE_WRITE, blocknr);
         return 0;
     }
     return -1;
 }
 
+int sync_disk(disk *diskptr) {
+    if (fdatasync(fileno(diskptr->data)) == -1) return -1;
+    trace_record(diskptr, DISK_TRACE_SYNC, 0);
+    return 0;
+}
+
 int free_disk(disk *diskptr) {
+    disk_trace_stop(diskptr);
+    disk_trace_classify(diskptr, NULL, NULL);
     free(diskptr);
     /* delete file */
 };
@@ -16,14 +16,50 @@ typedef struct disk {
     FILE *data;      // File pointer to persistant data
 } disk;
 
+/* Block I/O trace (see disk_trace_start). The file starts with a
+   disk_trace_header followed by a disk_trace_record per read, write or
+   sync of the disk, in the order they completed
+*/
+#define DISK_TRACE_MAGIC 0x44545243 // first word of a trace file
+#define DISK_TRACE_READ 0           // disk_trace_record op: read_block
+#define DISK_TRACE_WRITE 1          //                       write_block
+#define DISK_TRACE_SYNC 2           //                       sync_disk
+#define DISK_CLASSIFIERS 16         // max no of disks with a classifier
+
+typedef struct disk_trace_header {
+    uint32_t magic;       // DISK_TRACE_MAGIC
+    uint32_t block_size;  // BLOCKSIZE
+    uint32_t blocks;      // no of blocks of the traced disk
+    uint32_t record_size; // sizeof(disk_trace_record)
+} disk_trace_header;
+
+typedef struct disk_trace_record {
+    uint64_t ns;    // time since the trace started
+    uint32_t block; // block no, 0 for a sync
+    uint8_t op;     // DISK_TRACE_*
+    uint8_t cls;    // block class given by the classifier, 0 if none
+    uint16_t pad;
+} disk_trace_record;
+
+/* no of block reads / writes performed by the calling thread, on any disk */
+extern __thread uint64_t thread_reads, thread_writes;
+
 disk *create_disk(char *filename, int nbytes);
 
 int read_block(disk *diskptr, int blocknr, void *block_data);
 
 int write_block(disk *diskptr, int blocknr, void *block_data);
 
+/* Makes the blocks written so far durable. Returns -1 on error */
+int sync_disk(disk *diskptr);
+
 int free_disk(disk *diskptr);
 
 int update_disk_stats(disk *d);
 
+int disk_trace_start(disk *diskptr, char *path);
+int disk_trace_stop(disk *diskptr);
+void disk_trace_classify(disk *diskptr, int (*classify)(void *arg, int blocknr),
+                         void *arg);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* sfs_fsck [-r] [-t threads] image
+
+   Checks the SFS file system of a disk image (see fs_check), fixing what can
+   be fixed with -r. Exits with 0 if the file system is clean, 1 if every
+   problem was fixed, 4 if problems are left and 8 on error.
+*/
+
+int main(int argc, char **argv) {
+    int flags = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN), opt, bad = 0;
+    while ((opt = getopt(argc, argv, "rt:")) != -1) {
+        if (opt == 'r')
+            flags |= FSCK_REPAIR;
+        else if (opt == 't')
+            nthreads = atoi(optarg);
+        else
+            bad = 1;
+    }
+    if (bad || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-r] [-t threads] image\n", argv[0]);
+        return 8;
+    }
+
+    /* create_disk would create a missing image */
+    disk *d = access(argv[optind], R_OK | W_OK) == 0
+                  ? create_disk(argv[optind], 0)
+                  : NULL;
+    if (d == NULL) {
+        fprintf(stderr, "%s: can not open %s\n", argv[0], argv[optind]);
+        return 8;
+    }
+    sfs_fsck_report r;
+    int problems = fs_check(d, flags, nthreads, &r);
+    fclose(d->data);
+    free_disk(d);
+    if (problems == -1) {
+        fprintf(stderr, "%s: %s is not a readable SFS image\n", argv[0],
+                argv[optind]);
+        return 8;
+    }
+
+    printf("%u inodes, %u directories, %u files, %u data blocks\n", r.inodes,
+           r.directories, r.files, r.data_blocks);
+    struct {
+        char *what;
+        uint32_t n;
+    } found[] = {{"journal transactions not replayed", r.journal_pending},
+                 {"inodes with a bad size or block pointer", r.bad_inodes},
+                 {"data blocks used more than once", r.duplicate_blocks},
+                 {"bad directory entries", r.bad_entries},
+                 {"inodes linked more than once", r.linked_twice},
+                 {"orphan inodes", r.orphan_inodes},
+                 {"leaked inodes", r.leaked_inodes},
+                 {"inodes in use marked free", r.lost_inodes},
+                 {"leaked data blocks", r.leaked_blocks},
+                 {"data blocks in use marked free", r.lost_blocks},
+                 {"problems fixed", r.repaired}};
+    for (int i = 0; i < sizeof(found) / sizeof(found[0]); ++i)
+        if (found[i].n > 0) printf("%u %s\n", found[i].n, found[i].what);
+
+    if (problems == 0) return 0;
+    return r.repaired == problems ? 1 : 4;
+}
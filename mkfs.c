@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "sfs.h"
+
+/* sfs_mkfs [-b block-size] [-i bytes-per-inode] [-r reserved-blocks]
+            [-g blocks-per-group | -F] [-j journal-blocks] [-l]
+            [-s size] image
+
+   Formats a disk image with an SFS file system (see fs_format_opts). The
+   image is created with size bytes if it does not exist. -F lays the disk
+   out as a single group, -j 0 adds a journal of the default size and -l
+   leaves the groups to be initialized after mount. Sizes take a K, M or G
+   suffix. Exits with 0 on success and 1 on error.
+*/
+
+/* Parses a number with an optional K, M or G suffix, -1 if malformed */
+long long parse_size(char *arg) {
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+    if (end == arg || n < 0) return -1;
+    if (*end == 'K' || *end == 'k')
+        n <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        n <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        n <<= 30;
+    else if (*end != '\0')
+        return -1;
+    if (*end != '\0' && end[1] != '\0') return -1;
+    return n;
+}
+
+int main(int argc, char **argv) {
+    sfs_format_opts o;
+    memset(&o, 0, sizeof(o));
+    long long size = 0, n = 0;
+    int opt, bad = 0;
+    while ((opt = getopt(argc, argv, "b:i:r:g:Fj:ls:")) != -1) {
+        n = strchr("birgjs", opt) != NULL ? parse_size(optarg) : 0;
+        if (n < 0 || n > UINT32_MAX) bad = 1;
+        if (opt == 'b')
+            o.block_size = n;
+        else if (opt == 'i')
+            o.bytes_per_inode = n;
+        else if (opt == 'r')
+            o.reserved_blocks = n;
+        else if (opt == 'g')
+            o.group_blocks = n;
+        else if (opt == 'F')
+            o.layout = SFS_LAYOUT_FLAT;
+        else if (opt == 'j')
+            o.journal_blocks = n > 0 ? n : -1;
+        else if (opt == 'l')
+            o.lazy = 1;
+        else if (opt == 's')
+            size = n;
+        else
+            bad = 1;
+    }
+    if (bad || optind != argc - 1 || size > 0x7fffffff) {
+        fprintf(stderr,
+                "usage: %s [-b block-size] [-i bytes-per-inode] "
+                "[-r reserved-blocks] [-g blocks-per-group | -F] "
+                "[-j journal-blocks] [-l] [-s size] image\n",
+                argv[0]);
+        return 1;
+    }
+
+    /* create_disk would create a missing image with size 0 */
+    char *image = argv[optind];
+    if (access(image, F_OK) != 0 && size == 0) {
+        fprintf(stderr, "%s: %s does not exist, give its size with -s\n",
+                argv[0], image);
+        return 1;
+    }
+    disk *d = create_disk(image, size);
+    if (d == NULL) {
+        fprintf(stderr, "%s: can not open %s\n", argv[0], image);
+        return 1;
+    }
+    int ret = fs_format_opts(d, &o);
+    super_block s;
+    char buf[BLOCKSIZE];
+    if (ret == 0) ret = read_block(d, 0, buf);
+    fclose(d->data);
+    free_disk(d);
+    if (ret == -1) {
+        fprintf(stderr, "%s: can not format %s with these parameters\n",
+                argv[0], image);
+        return 1;
+    }
+
+    memcpy(&s, buf, sizeof(super_block));
+    printf("%u blocks of %d bytes, %u groups of %u blocks\n", s.blocks,
+           BLOCKSIZE, s.groups, s.group_blocks);
+    printf("%u inodes in %u blocks, %u data blocks (%u reserved)\n", s.inodes,
+           s.inode_blocks, s.data_blocks, s.reserved_blocks);
+    if (s.journal_blocks > 0) printf("%u journal blocks\n", s.journal_blocks);
+    if (s.uninit_groups > 0)
+        printf("%u groups initialized after mount\n", s.uninit_groups);
+    return 0;
+}
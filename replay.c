@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+/* sfs_replay [-f] trace image
+
+   Replays a block I/O trace (see disk_trace_start) against a disk image:
+   every read, write and sync is issued again, at the pace it was recorded
+   or, with -f, as fast as possible. The contents written are not in the
+   trace, the blocks written get a pattern: replay against a copy. Records
+   beyond the end of the image are skipped. Exits with 0 on success and 1 on
+   error.
+*/
+
+#define CHUNK 4096 // records read at a time
+
+int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int fast = 0, opt, bad = 0;
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        if (opt == 'f')
+            fast = 1;
+        else
+            bad = 1;
+    }
+    if (bad || optind != argc - 2) {
+        fprintf(stderr, "usage: %s [-f] trace image\n", argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[optind], "r");
+    disk_trace_header h;
+    if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1 ||
+        h.magic != DISK_TRACE_MAGIC || h.block_size != BLOCKSIZE ||
+        h.record_size != sizeof(disk_trace_record)) {
+        fprintf(stderr, "%s: %s is not a block I/O trace\n", argv[0],
+                argv[optind]);
+        return 1;
+    }
+    /* create_disk would create a missing image */
+    disk *d = access(argv[optind + 1], R_OK | W_OK) == 0
+                  ? create_disk(argv[optind + 1], 0)
+                  : NULL;
+    if (d == NULL) {
+        fprintf(stderr, "%s: can not open %s\n", argv[0], argv[optind + 1]);
+        return 1;
+    }
+
+    disk_trace_record *records =
+        (disk_trace_record *)malloc(CHUNK * sizeof(disk_trace_record));
+    char buf[BLOCKSIZE];
+    uint64_t count[3] = {0, 0, 0}, skipped = 0, errors = 0, last_ns = 0;
+    double late_ns = 0;
+    int64_t start = clock_ns();
+    size_t n;
+    while ((n = fread(records, sizeof(disk_trace_record), CHUNK, fp)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            disk_trace_record *r = &records[i];
+            if (r->op > DISK_TRACE_SYNC ||
+                (r->op != DISK_TRACE_SYNC && r->block >= d->blocks)) {
+                skipped++;
+                continue;
+            }
+            int64_t due = start + r->ns, now = clock_ns();
+            if (!fast && due > now) {
+                struct timespec ts = {(due - now) / 1000000000LL,
+                                      (due - now) % 1000000000LL};
+                nanosleep(&ts, NULL);
+            } else if (!fast) {
+                late_ns += now - due;
+            }
+
+            int ret = 0;
+            if (r->op == DISK_TRACE_READ) {
+                ret = read_block(d, r->block, buf);
+            } else if (r->op == DISK_TRACE_WRITE) {
+                memset(buf, 0, BLOCKSIZE);
+                memcpy(buf, &r->block, sizeof(r->block));
+                ret = write_block(d, r->block, buf);
+            } else {
+                ret = sync_disk(d);
+            }
+            errors += ret == -1;
+            count[r->op]++;
+            last_ns = r->ns;
+        }
+    }
+    double elapsed = (clock_ns() - start) / 1e9;
+    uint64_t total = count[0] + count[1] + count[2];
+    fclose(fp);
+    free(records);
+    fclose(d->data);
+    free_disk(d);
+
+    printf("%lu reads, %lu writes, %lu syncs replayed in %.3f s (traced "
+           "in %.3f s), %.0f ops/s\n",
+           count[DISK_TRACE_READ], count[DISK_TRACE_WRITE],
+           count[DISK_TRACE_SYNC], elapsed, last_ns / 1e9,
+           total / (elapsed > 0 ? elapsed : 1e-9));
+    if (!fast && total > 0)
+        printf("%.1f us late on average\n", late_ns / total / 1e3);
+    if (skipped > 0) printf("%lu records skipped\n", skipped);
+    if (errors > 0) printf("%lu I/O errors\n", errors);
+    return errors > 0;
+}
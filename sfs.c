@@ -5,16 +5,472 @@
 
 #include <time.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "disk.h"
 #include "sfs.h"
 
-/* the mounted disk storage */
-disk *mounted_diskptr = NULL;
-
 /* invalid (out of range) block pointer*/
 #define INVALID UINT32_MAX
 
+/* valid field of a directory whose subtree is being removed */
+#define INODE_DYING 2
+
+/* An open file. Pins the resolved inode and its block map so that reads and
+   writes through the handle only cost the data block I/O
+*/
+typedef struct file_handle {
+    int used;             // slot in use
+    int stale;            // cached inode / block map must be reloaded
+    uint32_t inumber;     // inode no of the open file
+    int pos;              // current file position
+    super_block s;        // superblock of the mounted disk
+    inode in;             // cached inode
+    uint32_t blocks[1029]; // cached block map (see get_all_data_blocks)
+} file_handle;
+
+/* An open directory being read, see sfs_readdir */
+typedef struct dir_handle {
+    int used;              // slot in use
+    int indexed;           // directory has a hashed index
+    file_handle h;         // pinned directory inode, h.pos is the cursor
+    int cached_lb;         // directory block held in block (-1 if none)
+    char *block;           // last directory block read
+} dir_handle;
+
+void dir_iter_close(dir_handle *dh);
+
+/* names longer than this are not cached */
+#define DCACHE_NAME_LEN 32
+
+/* A cached directory lookup: name (of type type) in directory parent. A
+   negative entry (inumber == INVALID) records that the name is absent
+*/
+typedef struct dentry {
+    uint32_t generation;            // slot in use if dcache_generation
+    uint32_t parent;                // inode no of the directory
+    int type;                       // directory or file
+    int length;                     // length of the name
+    char name[DCACHE_NAME_LEN + 1]; // name of the item
+    uint32_t inumber;               // inode no of the item or INVALID
+} dentry;
+
+/* no of slots in the (direct mapped) dentry cache */
+#define DCACHE_SIZE 4096
+
+/* max no of directories waiting for compaction */
+#define COMPACT_QUEUE_SIZE 64
+
+/* Locking. Every inode has a reader / writer lock (inodes are mapped to a
+   fixed set of locks by number) held by the public functions while they
+   read or update the file or directory. Inode table blocks and the bitmaps
+   of every allocation group have mutexes held only while a block is read,
+   modified and written back, and the remaining shared tables have a mutex
+   each. Inode locks are taken before any other lock, several inode locks
+   in increasing lock order. A journal handle (see txn_begin) is opened
+   before any lock.
+*/
+#define INODE_LOCKS 1024 // no of inode locks
+#define BLOCK_LOCKS 256  // no of inode table block locks
+#define DCACHE_LOCKS 64  // no of dentry cache locks
+
+/* blocks per allocation group of a newly formatted disk */
+#define GROUP_BLOCKS 8192
+
+/* Bitmaps of an allocation group */
+#define BMP_INODES 0 // inode bitmap
+#define BMP_DATA 1   // data block bitmap
+
+/* In-memory state of an allocation group. The free counts are rebuilt from
+   the bitmaps at mount, changed under the lock of the bitmap and may be
+   read without it as a hint.
+*/
+typedef struct alloc_group {
+    pthread_mutex_t locks[2]; // inode bitmap / data bitmap (BMP_*)
+    uint32_t free[2];         // no of free inodes / data blocks
+} alloc_group;
+
+/* Per thread allocation pools. A thread reserves POOL_SIZE inodes / data
+   blocks at a time from the bitmaps of a group (the bits are set on disk)
+   and hands them out without touching the bitmaps or their locks. The lock
+   of a pool is only taken by other threads when they return reservations
+   left idle, so it is not contended.
+*/
+#define POOL_SIZE 64                 // no of inodes / data blocks reserved at once
+#define POOL_IDLE_NS 1000000000LL    // reservations idle for longer are returned
+
+typedef struct alloc_pool {
+    pthread_mutex_t lock;
+    sfs_fs *fs;                     // file system the pool belongs to
+    uint32_t items[2][POOL_SIZE];   // reserved inodes / data blocks (BMP_*)
+    int next[2];                    // first reservation not handed out yet
+    int count[2];                   // no of reservations
+    uint32_t group[2];              // group the reservations were made for
+    int64_t used_ns;                // time of the last allocation
+    int handles;                    // nesting depth of txn_begin
+    struct alloc_pool *prev, *next_pool; // pools of the file system
+} alloc_pool;
+
+/* Metadata journal (see fs_format_journaled). Metadata blocks (inode table,
+   bitmaps, directory and indirect blocks) are not written in place: every
+   modifying operation joins the running transaction through a handle (see
+   txn_begin) and its blocks are logged in it. The journal thread commits the
+   running transaction JOURNAL_COMMIT_NS after its first block, so the
+   operations of that time share one flush, and writes committed blocks in
+   place later (checkpoint). Until then the latest version of a block is in
+   the block map, which is consulted by every read. File data is written in
+   place directly. A handle adds a few blocks at most (JOURNAL_CREDITS), so
+   operations on many inodes (remove_tree, create_bulk) take several
+   handles, one transaction each at most.
+*/
+#define JOURNAL_COMMIT_NS 5000000LL // running transaction committed after 5 ms
+#define JMAP_SIZE 4096              // buckets of the journal block map
+#define JMAP_LOCKS 64               // no of journal block map locks
+#define JOURNAL_MIN 128             // smallest journal, in blocks
+#define JOURNAL_MAX 8192            // largest default journal, in blocks
+#define JOURNAL_CREDITS 16          // blocks a handle may add to a transaction
+
+/* A block logged or revoked by a transaction not checkpointed yet */
+typedef struct jbuf {
+    uint32_t block;    // home block no
+    uint32_t sequence; // last transaction that logged or revoked it
+    char *data;        // latest contents, NULL if revoked (block freed)
+    int running;       // on the list of the running transaction
+    struct jbuf *next; // hash chain
+} jbuf;
+
+/* A committed transaction waiting for checkpoint */
+typedef struct jtxn {
+    uint32_t sequence;
+    uint32_t length;   // no of log blocks taken, commit block included
+    int count;         // no of tags (as in the descriptors)
+    uint32_t *tags;
+    char *data;        // contents of the logged blocks, in tag order
+    struct jtxn *next;
+} jtxn;
+
+typedef struct journal {
+    pthread_mutex_t lock;  // all the fields but the block map
+    pthread_cond_t cond;   // signalled on every change of state
+    pthread_t thread;      // commit / checkpoint thread
+    int stop;              // the thread must exit
+    int error;             // a commit or checkpoint failed
+    uint32_t start;        // first block of the log
+    uint32_t size;         // no of log blocks
+    uint32_t head;         // log offset of the next transaction
+    uint32_t used;         // no of log blocks not checkpointed
+    uint32_t sequence;     // the running transaction
+    uint32_t committed;    // last transaction whose commit is durable
+    uint32_t checkpointed; // last transaction checkpointed
+    uint32_t sync_request; // last transaction asked for by fs_sync
+    int handles;           // handles open on the running transaction
+    int waiting;           // handles waiting to be opened
+    int locked;            // being committed, new handles wait
+    int txn_max;           // blocks of a transaction, see journal_enter
+    jbuf **running;        // blocks of the running transaction
+    int nrunning, running_cap;
+    int64_t started_ns;    // time of the first block of the running one
+    jtxn *pending, *pending_last; // committed, not checkpointed
+    int blocked;           // checkpoint held up until the next commit
+    jbuf *map[JMAP_SIZE];  // the block map
+    pthread_mutex_t map_locks[JMAP_LOCKS];
+    int entries;           // no of jbufs in the block map
+} journal;
+
+/* Write-back cache (see SFS_MOUNT_WRITEBACK). Blocks written in place (file
+   data, and metadata without a journal) are only copied to the cache; the
+   flusher thread writes them to the disk later in increasing block order:
+   the ones dirty for WB_EXPIRE_NS, or all of them once more than
+   WB_BACKGROUND are dirty. Writers wait while more than WB_LIMIT blocks are
+   dirty. Reads look in the cache before the disk. With a journal every
+   commit writes the cache first, so that committed metadata never points to
+   data that is not on the disk.
+*/
+#define WB_SIZE 4096                 // buckets of the write-back cache
+#define WB_LOCKS 64                  // no of write-back cache locks
+#define WB_LIMIT 8192                // dirty blocks at which writers wait
+#define WB_BACKGROUND 2048           // dirty blocks at which all are written
+#define WB_EXPIRE_NS 1000000000LL    // dirty blocks older are written
+#define WB_WAKE_NS 100000000LL       // period of the flusher age checks
+
+/* A dirty block of the write-back cache */
+typedef struct wbuf {
+    uint32_t block;
+    int64_t dirtied_ns; // time of the first write since it was last written
+    char *data;
+    struct wbuf *next;  // hash chain
+} wbuf;
+
+typedef struct wcache {
+    pthread_mutex_t lock;       // stop, signalling of cond / space
+    pthread_cond_t cond;        // wakes the flusher thread
+    pthread_cond_t space;       // signalled when dirty blocks are written
+    pthread_mutex_t flush_lock; // one pass of wb_flush at a time
+    pthread_t thread;           // the flusher thread
+    int stop;                   // the thread must exit
+    int dirty;                  // no of dirty blocks (atomic)
+    wbuf *map[WB_SIZE];
+    pthread_mutex_t map_locks[WB_LOCKS];
+} wcache;
+
+/* Asynchronous requests (see fs_submit_read). They are run by up to
+   IO_THREADS threads, started on the first submit, so the submitting thread
+   never waits for the disk and the block I/O of different requests
+   overlaps.
+*/
+#define IO_THREADS 8 // no of threads running asynchronous requests
+
+typedef struct io_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;              // request submitted or stop
+    pthread_cond_t done;              // request completed
+    pthread_t threads[IO_THREADS];
+    int nthreads;                     // no of threads started
+    int stop;                         // the threads must exit once idle
+    sfs_io *head, *tail;              // submitted, not started
+    sfs_io *done_head, *done_tail;    // completed, waiting for fs_reap
+    int ndone;                        // no of requests on the done list
+    int pending;                      // submitted without callback, not
+                                      // completed yet
+} io_queue;
+
+/* A mounted file system: the disk, its superblock and all the in-memory
+   state. Every volume mounted by a process has its own.
+*/
+struct sfs_fs {
+    disk *diskptr; // the mounted disk storage
+    super_block s; // cached superblock
+
+    file_handle open_files[MAX_OPEN_FILES]; // the open file table
+    dir_handle open_dirs[MAX_OPEN_DIRS];    // the open directory table
+    pthread_mutex_t handles_lock;           // open file / directory tables
+
+    dentry dcache[DCACHE_SIZE];   // the dentry cache
+    uint32_t dcache_generation;   // older entries are dropped, see dcache_flush
+    pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+
+    /* directories left sparse by removals (see compact_dirs) */
+    uint32_t compact_queue[COMPACT_QUEUE_SIZE];
+    int compact_queued;
+    pthread_mutex_t compact_lock;
+
+    pthread_rwlock_t inode_locks[INODE_LOCKS];
+    pthread_mutex_t itable_locks[BLOCK_LOCKS];
+    alloc_group *groups; // s.groups allocation groups
+    pthread_key_t pool_key;       // allocation pool of the calling thread
+    alloc_pool *pools;            // allocation pools of all the threads
+    pthread_mutex_t pools_lock;   // pools list
+    uint32_t dir_rotor;  // spreads directories in the root, see dir_group
+    journal *j;          // metadata journal, NULL if the disk has none
+    wcache *wb;          // write-back cache, NULL if not mounted with one
+    /* initialization of the groups left uninitialized by fs_format_lazy */
+    uint32_t uninit_groups;     // as s.uninit_groups, but kept up to date
+    pthread_mutex_t lazy_lock;  // initialization of groups, lazy_stop
+    pthread_cond_t lazy_cond;   // wakes the lazy init thread to stop
+    pthread_t lazy_thread;
+    int lazy_running, lazy_stop;
+    io_queue io;                // asynchronous requests
+    /* serialises renames, so that directories can not be moved into each
+       other */
+    pthread_mutex_t rename_lock;
+};
+
+/* traced (see sfs_trace_enable), defined with the other entry points */
+int name_to_inode(sfs_fs *fs, char *path, int type);
+int alloc_bit(sfs_fs *fs, int kind, uint32_t goal);
+int map_data_blocks(sfs_fs *fs, super_block *s, inode *in, uint32_t *res);
+
+/* the file system used by the legacy API (mount, read_i, ...) */
+sfs_fs *mounted_fs = NULL;
+
+void init_locks(sfs_fs *fs) {
+    pthread_mutex_init(&fs->handles_lock, NULL);
+    pthread_mutex_init(&fs->compact_lock, NULL);
+    pthread_mutex_init(&fs->rename_lock, NULL);
+    pthread_mutex_init(&fs->pools_lock, NULL);
+    pthread_mutex_init(&fs->lazy_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fs->lazy_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&fs->io.lock, NULL);
+    pthread_cond_init(&fs->io.cond, NULL);
+    pthread_cond_init(&fs->io.done, NULL);
+    for (int i = 0; i < INODE_LOCKS; ++i)
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    for (int i = 0; i < BLOCK_LOCKS; ++i)
+        pthread_mutex_init(&fs->itable_locks[i], NULL);
+    for (int g = 0; g < fs->s.groups; ++g) {
+        pthread_mutex_init(&fs->groups[g].locks[BMP_INODES], NULL);
+        pthread_mutex_init(&fs->groups[g].locks[BMP_DATA], NULL);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; ++i)
+        pthread_mutex_init(&fs->dcache_locks[i], NULL);
+}
+
+void destroy_locks(sfs_fs *fs) {
+    pthread_mutex_destroy(&fs->handles_lock);
+    pthread_mutex_destroy(&fs->compact_lock);
+    pthread_mutex_destroy(&fs->rename_lock);
+    pthread_mutex_destroy(&fs->pools_lock);
+    pthread_mutex_destroy(&fs->lazy_lock);
+    pthread_cond_destroy(&fs->lazy_cond);
+    pthread_mutex_destroy(&fs->io.lock);
+    pthread_cond_destroy(&fs->io.cond);
+    pthread_cond_destroy(&fs->io.done);
+    for (int i = 0; i < INODE_LOCKS; ++i)
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    for (int i = 0; i < BLOCK_LOCKS; ++i)
+        pthread_mutex_destroy(&fs->itable_locks[i]);
+    for (int g = 0; g < fs->s.groups; ++g) {
+        pthread_mutex_destroy(&fs->groups[g].locks[BMP_INODES]);
+        pthread_mutex_destroy(&fs->groups[g].locks[BMP_DATA]);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; ++i)
+        pthread_mutex_destroy(&fs->dcache_locks[i]);
+}
+
+void inode_rdlock(sfs_fs *fs, uint32_t inumber) {
+    pthread_rwlock_rdlock(&fs->inode_locks[inumber % INODE_LOCKS]);
+}
+
+void inode_wrlock(sfs_fs *fs, uint32_t inumber) {
+    pthread_rwlock_wrlock(&fs->inode_locks[inumber % INODE_LOCKS]);
+}
+
+void inode_unlock(sfs_fs *fs, uint32_t inumber) {
+    pthread_rwlock_unlock(&fs->inode_locks[inumber % INODE_LOCKS]);
+}
+
+int compare_int(const void *a, const void *b) {
+    int x = *(int *)a, y = *(int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Write locks (lock = 1) or unlocks (lock = 0) the n inodes, taking every
+   lock once and in increasing order
+*/
+void inode_wrlock_set(sfs_fs *fs, uint32_t *inodes, int n, int lock) {
+    int ids[n + 1];
+    for (int i = 0; i < n; ++i)
+        ids[i] = inodes[i] % INODE_LOCKS;
+    qsort(ids, n, sizeof(int), compare_int);
+    for (int i = 0; i < n; ++i) {
+        if (i > 0 && ids[i] == ids[i - 1]) continue;
+        if (lock)
+            pthread_rwlock_wrlock(&fs->inode_locks[ids[i]]);
+        else
+            pthread_rwlock_unlock(&fs->inode_locks[ids[i]]);
+    }
+}
+
+pthread_mutex_t *itable_lock(sfs_fs *fs, int block) {
+    return &fs->itable_locks[block % BLOCK_LOCKS];
+}
+
+pthread_mutex_t *bitmap_lock(sfs_fs *fs, int kind, uint32_t g) {
+    return &fs->groups[g].locks[kind];
+}
+
+/* Hash of a file/directory name (FNV-1a). Stored on disk in directory
+   blocks and indexes
+*/
+uint32_t name_hash(const char *name, int length) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < length; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    h ^= length;
+    h *= 16777619u;
+    return h;
+}
+
+/* Returns the dentry cache slot of a (parent, name, type) key */
+int dcache_slot(uint32_t parent, const char *name, int length, int type) {
+    uint32_t h = name_hash(name, length);
+    h ^= parent * 2654435761u;
+    h ^= type;
+    return h % DCACHE_SIZE;
+}
+
+/* Looks up name in directory parent. Returns 1 and sets inumber (INVALID for
+   a cached negative entry) on a hit and 0 on a miss
+*/
+int dcache_lookup(sfs_fs *fs, uint32_t parent, const char *name, int length, int type,
+                  uint32_t *inumber) {
+    if (length > DCACHE_NAME_LEN) return 0;
+    int slot = dcache_slot(parent, name, length, type);
+    dentry *d = &fs->dcache[slot];
+    int hit = 0;
+    pthread_mutex_lock(&fs->dcache_locks[slot % DCACHE_LOCKS]);
+    if (d->generation == __atomic_load_n(&fs->dcache_generation, __ATOMIC_ACQUIRE) &&
+        d->parent == parent && d->type == type && d->length == length &&
+        memcmp(d->name, name, length) == 0) {
+        *inumber = d->inumber;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&fs->dcache_locks[slot % DCACHE_LOCKS]);
+    return hit;
+}
+
+/* Caches the result of looking up name in directory parent */
+void dcache_insert(sfs_fs *fs, uint32_t parent, const char *name, int length, int type,
+                   uint32_t inumber) {
+    if (length > DCACHE_NAME_LEN) return;
+    int slot = dcache_slot(parent, name, length, type);
+    dentry *d = &fs->dcache[slot];
+    pthread_mutex_lock(&fs->dcache_locks[slot % DCACHE_LOCKS]);
+    d->generation = __atomic_load_n(&fs->dcache_generation, __ATOMIC_ACQUIRE);
+    d->parent = parent;
+    d->type = type;
+    d->length = length;
+    memcpy(d->name, name, length);
+    d->name[length] = '\0';
+    d->inumber = inumber;
+    pthread_mutex_unlock(&fs->dcache_locks[slot % DCACHE_LOCKS]);
+}
+
+/* Drops the cached lookup of name in directory parent */
+void dcache_invalidate(sfs_fs *fs, uint32_t parent, const char *name, int length,
+                       int type) {
+    if (length > DCACHE_NAME_LEN) return;
+    int slot = dcache_slot(parent, name, length, type);
+    dentry *d = &fs->dcache[slot];
+    pthread_mutex_lock(&fs->dcache_locks[slot % DCACHE_LOCKS]);
+    if (d->parent == parent && d->type == type && d->length == length &&
+        memcmp(d->name, name, length) == 0)
+        d->generation = 0;
+    pthread_mutex_unlock(&fs->dcache_locks[slot % DCACHE_LOCKS]);
+}
+
+/* Drops every cached lookup */
+void dcache_flush(sfs_fs *fs) {
+    __atomic_add_fetch(&fs->dcache_generation, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Marks every open handle on inumber (except handle skip_fd) as stale, so the
+   next operation through it reloads the inode from disk
+*/
+void invalidate_handles(sfs_fs *fs, uint32_t inumber, int skip_fd) {
+    pthread_mutex_lock(&fs->handles_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+        if (fs->open_files[fd].used && fs->open_files[fd].inumber == inumber &&
+            fd != skip_fd)
+            fs->open_files[fd].stale = 1;
+    }
+    for (int dd = 0; dd < MAX_OPEN_DIRS; ++dd) {
+        if (fs->open_dirs[dd].used && fs->open_dirs[dd].h.inumber == inumber)
+            fs->open_dirs[dd].h.stale = 1;
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+}
+
 /* Print Inode summary */
 void print_inode(int inumber, inode *i) {
     printf("Inode Summary (%d): \n", inumber);
@@ -37,6 +493,564 @@ int get_super_block(disk *diskptr, super_block *s) {
     return 0;
 }
 
+/* First block of allocation group g */
+uint32_t group_start(super_block *s, uint32_t g) {
+    return 1 + g * s->group_blocks;
+}
+
+/* Block holding block b of the inode table (inodes b * 128 onwards), the
+   inode table being the concatenation of the slices of all the groups
+*/
+uint32_t itable_block(super_block *s, uint32_t b) {
+    uint32_t per_group = s->group_inodes / (BLOCKSIZE / sizeof(inode));
+    return group_start(s, b / per_group) + (s->inode_block_idx - 1) +
+           b % per_group;
+}
+
+/* Block holding data block index */
+uint32_t data_block(super_block *s, uint32_t index) {
+    return group_start(s, index / s->group_data_blocks) +
+           (s->data_block_idx - 1) + index % s->group_data_blocks;
+}
+
+/* no of inodes / data blocks (kind BMP_*) per group */
+uint32_t group_span(super_block *s, int kind) {
+    return kind == BMP_INODES ? s->group_inodes : s->group_data_blocks;
+}
+
+/* no of bits in use of the inode / data bitmap of group g */
+uint32_t group_bits(super_block *s, int kind, uint32_t g) {
+    uint32_t span = group_span(s, kind);
+    uint32_t total = kind == BMP_INODES ? s->inodes : s->data_blocks;
+    return total - g * span < span ? total - g * span : span;
+}
+
+/* First block of the inode / data bitmap of group g */
+uint32_t bitmap_start(super_block *s, int kind, uint32_t g) {
+    uint32_t offset = kind == BMP_INODES ? s->inode_bitmap_block_idx
+                                         : s->data_block_bitmap_idx;
+    return group_start(s, g) + offset - 1;
+}
+
+/* Group whose bitmaps or inode table hold block, -1 if none */
+int meta_group(super_block *s, uint32_t block) {
+    if (block < 1) return -1;
+    uint32_t g = (block - 1) / s->group_blocks;
+    if (g >= s->groups || (block - 1) % s->group_blocks >= s->data_block_idx - 1)
+        return -1;
+    return g;
+}
+
+/* Class of block blocknr of the mounted file system arg (SFS_BLOCK_*), for
+   the block I/O trace of its disk
+*/
+int block_class(void *arg, int blocknr) {
+    super_block *s = &((sfs_fs *)arg)->s;
+    if (blocknr == 0) return SFS_BLOCK_SUPER;
+    if (s->journal_blocks > 0 && blocknr >= s->journal_block_idx &&
+        blocknr < s->journal_block_idx + s->journal_blocks)
+        return SFS_BLOCK_JOURNAL;
+    if (blocknr < 1 || blocknr > s->blocks) return SFS_BLOCK_OTHER;
+    uint32_t offset = (blocknr - 1) % s->group_blocks + 1;
+    if (offset < s->data_block_bitmap_idx) return SFS_BLOCK_INODE_BITMAP;
+    if (offset < s->inode_block_idx) return SFS_BLOCK_DATA_BITMAP;
+    if (offset < s->data_block_idx) return SFS_BLOCK_INODE_TABLE;
+    return SFS_BLOCK_DATA;
+}
+
+/* Whether block is a bitmap or inode table block of one of the last uninit
+   groups, not initialized yet (see fs_format_lazy). Such blocks read as zero
+*/
+int uninit_block(super_block *s, uint32_t uninit, uint32_t block) {
+    if (uninit == 0) return 0;
+    int g = meta_group(s, block);
+    return g != -1 && g >= s->groups - uninit;
+}
+
+pthread_mutex_t *jmap_lock(journal *j, uint32_t block) {
+    return &j->map_locks[block % JMAP_SIZE % JMAP_LOCKS];
+}
+
+/* Entry of block in the journal block map, NULL if none. Called with its
+   block map lock held
+*/
+jbuf *jmap_find(journal *j, uint32_t block) {
+    jbuf *e = j->map[block % JMAP_SIZE];
+    while (e != NULL && e->block != block)
+        e = e->next;
+    return e;
+}
+
+/* Removes the entry of block from the block map. Called with its block map
+   lock held
+*/
+void jmap_remove(journal *j, jbuf *e) {
+    jbuf **p = &j->map[e->block % JMAP_SIZE];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    free(e->data);
+    free(e);
+    __atomic_sub_fetch(&j->entries, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the entry of block, creating it. Called with its block map lock
+   held. Returns NULL if out of memory
+*/
+jbuf *jmap_get(journal *j, uint32_t block) {
+    jbuf *e = jmap_find(j, block);
+    if (e != NULL) return e;
+    e = (jbuf *)calloc(1, sizeof(jbuf));
+    if (e == NULL) return NULL;
+    e->block = block;
+    e->next = j->map[block % JMAP_SIZE];
+    j->map[block % JMAP_SIZE] = e;
+    __atomic_add_fetch(&j->entries, 1, __ATOMIC_RELEASE);
+    return e;
+}
+
+int64_t clock_ns();
+
+/* Adds a block map entry to the running transaction */
+int journal_add(journal *j, jbuf *e) {
+    pthread_mutex_lock(&j->lock);
+    if (j->nrunning == j->running_cap) {
+        int cap = j->running_cap ? 2 * j->running_cap : 256;
+        jbuf **running = (jbuf **)realloc(j->running, cap * sizeof(jbuf *));
+        if (running == NULL) {
+            pthread_mutex_unlock(&j->lock);
+            return -1;
+        }
+        j->running = running;
+        j->running_cap = cap;
+    }
+    if (j->nrunning == 0) {
+        j->started_ns = clock_ns();
+        pthread_cond_broadcast(&j->cond);
+    }
+    j->running[j->nrunning++] = e;
+    if (j->nrunning + JOURNAL_CREDITS == j->txn_max + 1)
+        pthread_cond_broadcast(&j->cond); // full, see journal_thread
+    pthread_mutex_unlock(&j->lock);
+    return 0;
+}
+
+pthread_mutex_t *wb_lock(wcache *w, uint32_t block) {
+    return &w->map_locks[block % WB_SIZE % WB_LOCKS];
+}
+
+/* Dirty entry of block in the write-back cache, NULL if none. Called with
+   its lock held
+*/
+wbuf *wb_find(wcache *w, uint32_t block) {
+    wbuf *e = w->map[block % WB_SIZE];
+    while (e != NULL && e->block != block)
+        e = e->next;
+    return e;
+}
+
+/* Removes an entry from the write-back cache. Called with its lock held */
+void wb_remove(wcache *w, wbuf *e) {
+    wbuf **p = &w->map[e->block % WB_SIZE];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    free(e->data);
+    free(e);
+    __atomic_sub_fetch(&w->dirty, 1, __ATOMIC_RELEASE);
+}
+
+/* Copies block from the write-back cache to buf. Returns 1 if it was there
+   and 0 if not
+*/
+int wb_read(wcache *w, uint32_t block, void *buf) {
+    if (__atomic_load_n(&w->dirty, __ATOMIC_ACQUIRE) == 0) return 0;
+    pthread_mutex_lock(wb_lock(w, block));
+    wbuf *e = wb_find(w, block);
+    if (e != NULL) memcpy(buf, e->data, BLOCKSIZE);
+    pthread_mutex_unlock(wb_lock(w, block));
+    return e != NULL;
+}
+
+/* Copies buf to the write-back cache entry of block, then waits while the
+   cache is over WB_LIMIT dirty blocks. Returns -1 if out of memory
+*/
+int wb_write(wcache *w, uint32_t block, void *buf) {
+    pthread_mutex_lock(wb_lock(w, block));
+    wbuf *e = wb_find(w, block);
+    int added = e == NULL;
+    if (added) {
+        e = (wbuf *)malloc(sizeof(wbuf));
+        char *data = (char *)malloc(BLOCKSIZE);
+        if (e == NULL || data == NULL) {
+            pthread_mutex_unlock(wb_lock(w, block));
+            free(e);
+            free(data);
+            return -1;
+        }
+        e->block = block;
+        e->data = data;
+        e->dirtied_ns = clock_ns();
+        e->next = w->map[block % WB_SIZE];
+        w->map[block % WB_SIZE] = e;
+    }
+    memcpy(e->data, buf, BLOCKSIZE);
+    pthread_mutex_unlock(wb_lock(w, block));
+    if (!added) return 0;
+
+    int dirty = __atomic_add_fetch(&w->dirty, 1, __ATOMIC_RELEASE);
+    if (dirty == 1 || dirty == WB_BACKGROUND + 1 || dirty > WB_LIMIT) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->cond);
+        while (__atomic_load_n(&w->dirty, __ATOMIC_ACQUIRE) > WB_LIMIT &&
+               !w->stop)
+            pthread_cond_wait(&w->space, &w->lock);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return 0;
+}
+
+/* Drops the dirty contents of a freed block from the write-back cache, so
+   that they are not written over a later use of the block
+*/
+void wb_discard(wcache *w, uint32_t block) {
+    if (__atomic_load_n(&w->dirty, __ATOMIC_ACQUIRE) == 0) return;
+    pthread_mutex_lock(wb_lock(w, block));
+    wbuf *e = wb_find(w, block);
+    if (e != NULL) wb_remove(w, e);
+    pthread_mutex_unlock(wb_lock(w, block));
+}
+
+int compare_u32(const void *a, const void *b);
+
+/* Writes dirty blocks of the write-back cache in place, in increasing block
+   order: all of them, or only the ones dirty for WB_EXPIRE_NS if all is 0.
+   Blocks dirtied during the pass are left to the next one. Returns -1 on
+   error
+*/
+int wb_flush(sfs_fs *fs, int all) {
+    wcache *w = fs->wb;
+    pthread_mutex_lock(&w->flush_lock);
+    int64_t expired = clock_ns() - WB_EXPIRE_NS;
+    uint32_t *blocks = NULL;
+    int n = 0, cap = 0, ret = 0;
+    for (int b = 0; b < WB_SIZE && ret == 0; ++b) {
+        pthread_mutex_lock(wb_lock(w, b));
+        for (wbuf *e = w->map[b]; e != NULL; e = e->next) {
+            if (!all && e->dirtied_ns > expired) continue;
+            if (n == cap) {
+                cap = cap ? 2 * cap : 256;
+                uint32_t *p = (uint32_t *)realloc(blocks, cap * sizeof(uint32_t));
+                if (p == NULL) {
+                    ret = -1;
+                    break;
+                }
+                blocks = p;
+            }
+            blocks[n++] = e->block;
+        }
+        pthread_mutex_unlock(wb_lock(w, b));
+    }
+    qsort(blocks, n, sizeof(uint32_t), compare_u32);
+
+    /* the block is written with its lock held: it can not be freed and
+       reused meanwhile */
+    for (int i = 0; i < n; ++i) {
+        pthread_mutex_lock(wb_lock(w, blocks[i]));
+        wbuf *e = wb_find(w, blocks[i]);
+        if (e != NULL) {
+            if (write_block(fs->diskptr, e->block, (void *)e->data) == -1)
+                ret = -1;
+            else
+                wb_remove(w, e);
+        }
+        pthread_mutex_unlock(wb_lock(w, blocks[i]));
+        if (i % 64 == 63 || i == n - 1) {
+            pthread_mutex_lock(&w->lock);
+            pthread_cond_broadcast(&w->space);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    free(blocks);
+    pthread_mutex_unlock(&w->flush_lock);
+    return ret;
+}
+
+/* The flusher thread. Writes all the dirty blocks while there are more than
+   WB_BACKGROUND, and the expired ones every WB_WAKE_NS
+*/
+void *wb_thread(void *arg) {
+    sfs_fs *fs = (sfs_fs *)arg;
+    wcache *w = fs->wb;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        int dirty = __atomic_load_n(&w->dirty, __ATOMIC_ACQUIRE);
+        if (dirty == 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+        wb_flush(fs, dirty > WB_BACKGROUND);
+        pthread_mutex_lock(&w->lock);
+        if (__atomic_load_n(&w->dirty, __ATOMIC_ACQUIRE) <= WB_BACKGROUND &&
+            !w->stop) {
+            int64_t due = clock_ns() + WB_WAKE_NS;
+            struct timespec ts = {due / 1000000000LL, due % 1000000000LL};
+            pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Sets up the write-back cache of a mounted file system and starts the
+   flusher thread. Returns -1 on error
+*/
+int wb_start(sfs_fs *fs) {
+    wcache *w = (wcache *)calloc(1, sizeof(wcache));
+    if (w == NULL) return -1;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->flush_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&w->space, NULL);
+    for (int i = 0; i < WB_LOCKS; ++i)
+        pthread_mutex_init(&w->map_locks[i], NULL);
+
+    fs->wb = w;
+    if (pthread_create(&w->thread, NULL, wb_thread, fs) != 0) {
+        fs->wb = NULL;
+        free(w);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops the flusher thread, writes every dirty block and frees the cache */
+void wb_stop(sfs_fs *fs) {
+    wcache *w = fs->wb;
+    if (w == NULL) return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_cond_broadcast(&w->space);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    wb_flush(fs, 1);
+    sync_disk(fs->diskptr);
+
+    fs->wb = NULL;
+    for (int b = 0; b < WB_SIZE; ++b) {
+        while (w->map[b] != NULL) {
+            wbuf *e = w->map[b];
+            w->map[b] = e->next;
+            free(e->data);
+            free(e);
+        }
+    }
+    for (int i = 0; i < WB_LOCKS; ++i)
+        pthread_mutex_destroy(&w->map_locks[i]);
+    pthread_cond_destroy(&w->space);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->flush_lock);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+/* Writes a block of a mounted file system in place, through the write-back
+   cache if it has one. Returns -1 on error
+*/
+int write_inplace(sfs_fs *fs, int block, void *buf) {
+    if (fs->wb == NULL) return write_block(fs->diskptr, block, buf);
+    if (block < 0 || block >= fs->diskptr->blocks) return -1;
+    return wb_write(fs->wb, block, buf);
+}
+
+#define LAZY_INIT_PAUSE_NS 10000000LL // lazy init thread: pause between groups
+
+/* Writes zeros over the bitmaps and inode table of the first uninitialized
+   group, then counts it as initialized in the superblock. Called with
+   lazy_lock held. Returns -1 on error
+*/
+int lazy_init_group(sfs_fs *fs) {
+    super_block s = fs->s;
+    uint32_t g = s.groups - fs->uninit_groups;
+    char buf[BLOCKSIZE];
+    memset(buf, 0, BLOCKSIZE);
+    for (uint32_t b = 0; b < s.data_block_idx - 1; ++b)
+        if (write_block(fs->diskptr, group_start(&s, g) + b, (void *)buf) == -1)
+            return -1;
+
+    /* the zeros reach the disk before the superblock counting them, and
+       the superblock before anything else is written to the group */
+    s.uninit_groups = fs->uninit_groups - 1;
+    memcpy(buf, &s, sizeof(super_block));
+    if (sync_disk(fs->diskptr) == -1 ||
+        write_block(fs->diskptr, 0, (void *)buf) == -1 ||
+        sync_disk(fs->diskptr) == -1)
+        return -1;
+    __atomic_store_n(&fs->uninit_groups, s.uninit_groups, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Called before block is written: if it belongs to a group not initialized
+   yet, initializes the groups up to that one. Returns -1 on error
+*/
+int lazy_init(sfs_fs *fs, uint32_t block) {
+    uint32_t uninit = __atomic_load_n(&fs->uninit_groups, __ATOMIC_ACQUIRE);
+    if (!uninit_block(&fs->s, uninit, block)) return 0;
+    int ret = 0;
+    pthread_mutex_lock(&fs->lazy_lock);
+    while (ret == 0 && uninit_block(&fs->s, fs->uninit_groups, block))
+        ret = lazy_init_group(fs);
+    pthread_mutex_unlock(&fs->lazy_lock);
+    return ret;
+}
+
+/* The lazy init thread. Initializes the groups left by fs_format_lazy one
+   at a time, pausing LAZY_INIT_PAUSE_NS between them, until all are or the
+   file system is unmounted
+*/
+void *lazy_thread(void *arg) {
+    sfs_fs *fs = (sfs_fs *)arg;
+    pthread_mutex_lock(&fs->lazy_lock);
+    while (!fs->lazy_stop && fs->uninit_groups > 0) {
+        if (lazy_init_group(fs) == -1) break;
+        int64_t due = clock_ns() + LAZY_INIT_PAUSE_NS;
+        struct timespec ts = {due / 1000000000LL, due % 1000000000LL};
+        while (!fs->lazy_stop &&
+               pthread_cond_timedwait(&fs->lazy_cond, &fs->lazy_lock, &ts) == 0)
+            ;
+    }
+    pthread_mutex_unlock(&fs->lazy_lock);
+    return NULL;
+}
+
+/* Reads a block of a mounted file system, the latest version logged in the
+   journal or held by the write-back cache if there is one. Returns -1 on
+   error
+*/
+int bread(sfs_fs *fs, int block, void *buf) {
+    if (uninit_block(&fs->s,
+                     __atomic_load_n(&fs->uninit_groups, __ATOMIC_ACQUIRE),
+                     block)) {
+        memset(buf, 0, BLOCKSIZE);
+        return 0;
+    }
+    journal *j = fs->j;
+    if (j != NULL && __atomic_load_n(&j->entries, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(jmap_lock(j, block));
+        jbuf *e = jmap_find(j, block);
+        if (e != NULL && e->data != NULL) {
+            memcpy(buf, e->data, BLOCKSIZE);
+            pthread_mutex_unlock(jmap_lock(j, block));
+            return 0;
+        }
+        pthread_mutex_unlock(jmap_lock(j, block));
+    }
+    if (fs->wb != NULL && wb_read(fs->wb, block, buf)) return 0;
+    return read_block(fs->diskptr, block, buf);
+}
+
+/* Writes a metadata block of a mounted file system. With a journal the block
+   is logged in the running transaction instead, which is joined with
+   txn_begin. Returns -1 on error
+*/
+int bwrite(sfs_fs *fs, int block, void *buf) {
+    if (lazy_init(fs, block) == -1) return -1;
+    journal *j = fs->j;
+    if (j == NULL) return write_inplace(fs, block, buf);
+    if (block < 0 || block >= fs->diskptr->blocks) return -1;
+
+    pthread_mutex_lock(jmap_lock(j, block));
+    jbuf *e = jmap_get(j, block);
+    if (e != NULL && e->data == NULL) e->data = (char *)malloc(BLOCKSIZE);
+    if (e == NULL || e->data == NULL) {
+        pthread_mutex_unlock(jmap_lock(j, block));
+        return -1;
+    }
+    memcpy(e->data, buf, BLOCKSIZE);
+    e->sequence = __atomic_load_n(&j->sequence, __ATOMIC_RELAXED);
+    int add = !e->running;
+    e->running = 1;
+    pthread_mutex_unlock(jmap_lock(j, block));
+    return add ? journal_add(j, e) : 0;
+}
+
+/* Called when a data block is freed. A version of the block logged by a
+   transaction not checkpointed yet must not be written in place, nor be
+   replayed over later contents after a crash: it is dropped and the block
+   revoked in the running transaction. Its dirty contents in the write-back
+   cache are dropped too
+*/
+void brevoke(sfs_fs *fs, int block) {
+    if (fs->wb != NULL) wb_discard(fs->wb, block);
+    journal *j = fs->j;
+    if (j == NULL || __atomic_load_n(&j->entries, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    pthread_mutex_lock(jmap_lock(j, block));
+    jbuf *e = jmap_find(j, block);
+    if (e == NULL) {
+        pthread_mutex_unlock(jmap_lock(j, block));
+        return;
+    }
+    free(e->data);
+    e->data = NULL;
+    e->sequence = __atomic_load_n(&j->sequence, __ATOMIC_RELAXED);
+    int add = !e->running;
+    e->running = 1;
+    pthread_mutex_unlock(jmap_lock(j, block));
+    if (add) journal_add(j, e);
+}
+
+/* Opens a handle on the running transaction. A handle may add up to
+   JOURNAL_CREDITS blocks to it: it waits while the transaction is being
+   committed or has no room left for that many blocks from every open handle
+   and this one, so that a transaction never outgrows txn_max blocks by much
+*/
+void journal_enter(journal *j) {
+    pthread_mutex_lock(&j->lock);
+    j->waiting++;
+    while (j->locked ||
+           j->nrunning + (j->handles + 1) * JOURNAL_CREDITS > j->txn_max)
+        pthread_cond_wait(&j->cond, &j->lock);
+    j->waiting--;
+    j->handles++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_leave(journal *j) {
+    pthread_mutex_lock(&j->lock);
+    if ((--j->handles == 0 && j->locked) || j->waiting > 0)
+        pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+}
+
+alloc_pool *thread_pool(sfs_fs *fs);
+
+/* Starts an operation whose metadata updates must reach the disk together:
+   they all go to the same transaction. Called by the modifying public
+   functions before taking any lock, may be nested. Every txn_begin is
+   matched by a txn_end
+*/
+void txn_begin(sfs_fs *fs) {
+    if (fs->j == NULL) return;
+    alloc_pool *p = thread_pool(fs);
+    if (p != NULL && p->handles++ > 0) return;
+    journal_enter(fs->j);
+}
+
+void txn_end(sfs_fs *fs) {
+    if (fs->j == NULL) return;
+    alloc_pool *p = thread_pool(fs);
+    if (p != NULL && --p->handles > 0) return;
+    journal_leave(fs->j);
+}
+
 /* Read inode structure for inumber inode */
 int get_inode(disk *diskptr, int inumber, inode *in) {
     super_block s;
@@ -51,167 +1065,1051 @@ int get_inode(disk *diskptr, int inumber, inode *in) {
     int block_offset = inumber / (BLOCKSIZE / sizeof(inode));
     int block_offset_index = inumber % (BLOCKSIZE / sizeof(inode));
     char buf[BLOCKSIZE];
-    ret = read_block(diskptr, s.inode_block_idx + block_offset, (void *)buf);
-    if (ret == -1) {
+    uint32_t block = itable_block(&s, block_offset);
+    if (uninit_block(&s, s.uninit_groups, block))
+        memset(buf, 0, BLOCKSIZE);
+    else if (read_block(diskptr, block, (void *)buf) == -1)
         return -1;
-    }
+
+    *in = *(inode *)(buf + block_offset_index * sizeof(inode));
+    return 0;
+}
+
+/* Reads inode inumber of a mounted file system */
+int load_inode(sfs_fs *fs, int inumber, inode *in) {
+    /*Check if valid file */
+    if (inumber >= fs->s.inodes || inumber < 0) return -1;
+
+    int block_offset = inumber / (BLOCKSIZE / sizeof(inode));
+    int block_offset_index = inumber % (BLOCKSIZE / sizeof(inode));
+    char buf[BLOCKSIZE];
+    int ret = bread(fs, itable_block(&fs->s, block_offset),
+                         (void *)buf);
+    if (ret == -1) return -1;
 
     *in = *(inode *)(buf + block_offset_index * sizeof(inode));
     return 0;
 }
 
 /* Writes the inode to disk */
-int write_inode_to_disk(disk *diskptr, int inumber, inode *in) {
+int write_inode_to_disk(sfs_fs *fs, int inumber, inode *in) {
     super_block s;
     int ret;
 
-    ret = get_super_block(diskptr, &s);
-    if (ret == -1) return -1;
+    s = fs->s;
 
     int block_offset = inumber / (BLOCKSIZE / sizeof(inode));
     int block_offset_index = inumber % (BLOCKSIZE / sizeof(inode));
     char buf[BLOCKSIZE];
-    ret = read_block(diskptr, s.inode_block_idx + block_offset, (void *)buf);
+    pthread_mutex_t *lock = itable_lock(fs, block_offset);
+    pthread_mutex_lock(lock);
+    ret = bread(fs, itable_block(&s, block_offset), (void *)buf);
     if (ret == -1) {
+        pthread_mutex_unlock(lock);
         return -1;
     }
     /* Update */
     memcpy(buf + block_offset_index * sizeof(inode), in, sizeof(inode));
 
     /* Write to disk */
-    ret = write_block(diskptr, s.inode_block_idx + block_offset, (void *)buf);
+    ret = bwrite(fs, itable_block(&s, block_offset), (void *)buf);
+    pthread_mutex_unlock(lock);
     return ret;
 }
 
-/* Read all data blocks for a inode file. Returns an ordered view
-   of all the datablocks (from direct and indirect pointers) which
-   are used by the file
+/* Builds the ordered view of all the datablocks (from direct and indirect
+   pointers) used by an already loaded inode, whose indirect block (if
+   uses_indirect) has been read into indirect. res is a 5 + 1024 = 1029
+   element array, unused entries are set to INVALID
 */
-int get_all_data_blocks(disk *diskptr, int inumber, int *res) {
-    /* res is a 5 + 1024 = 1029 element array */
-    int ret;
-    super_block s;
-    ret = get_super_block(diskptr, &s);
-    if (ret == -1) return -1;
-
-    inode in;
-    ret = get_inode(diskptr, inumber, &in);
-    if (ret == -1) return -1;
-
+void map_blocks(super_block *s, inode *in, char *indirect, uint32_t *res) {
     int c = 0;
 
-    if (in.size == 0) {
+    if (in->size == 0) {
         for (int i = 0; i < 1029; ++i)
             res[i] = INVALID;
-        return 0;
+        return;
     }
 
     int cumsum = 0;
     /* Read direct pointers */
     for (int i = 0; i < 5; ++i) {
-        if (in.direct[i] >= 0 && in.direct[i] < s.data_blocks) {
-            res[c++] = in.direct[i];
+        if (in->direct[i] >= 0 && in->direct[i] < s->data_blocks) {
+            res[c++] = in->direct[i];
             cumsum += BLOCKSIZE;
-            if (cumsum >= in.size) break;
+            if (cumsum >= in->size) break;
         }
     }
 
     /* Read indirect pointers */
-    if (in.indirect >= 0 && in.indirect < s.data_blocks && cumsum < in.size) {
-        char buf[BLOCKSIZE];
-        ret = read_block(diskptr, s.data_block_idx + in.indirect, (void *)buf);
-        if (ret == -1) return -1;
-
+    if (indirect != NULL && cumsum < in->size) {
         for (int i = 0; i < 1024; i++) {
-            int x = *(int *)(buf + i * 4);
-            if (x >= 0 && x < s.data_blocks) {
+            uint32_t x = *(uint32_t *)(indirect + i * 4);
+            if (x >= 0 && x < s->data_blocks) {
                 res[c++] = x;
                 cumsum += BLOCKSIZE;
-                if (cumsum >= in.size) break;
+                if (cumsum >= in->size) break;
             }
         }
     }
 
     for (int i = c; i < 1029; ++i)
         res[i] = INVALID;
+}
+
+/* Whether some blocks of the inode are listed in its indirect block */
+int uses_indirect(super_block *s, inode *in) {
+    return in->indirect >= 0 && in->indirect < s->data_blocks &&
+           in->size > 5 * BLOCKSIZE;
+}
+
+/* Builds the block map (see map_blocks) of an inode of a mounted file
+   system. Returns -1 on error
+*/
+int do_map_data_blocks(sfs_fs *fs, super_block *s, inode *in, uint32_t *res) {
+    char buf[BLOCKSIZE];
+    if (uses_indirect(s, in) &&
+        bread(fs, data_block(s, in->indirect), (void *)buf) == -1)
+        return -1;
+    map_blocks(s, in, uses_indirect(s, in) ? buf : NULL, res);
     return 0;
 }
 
-/* Operate  on inode / data bitmap
-    mode = 0 => Reset
-    mode = 1 => Set
-    mode = 2 => read
+/* Read all data blocks for a inode file. Returns an ordered view
+   of all the datablocks (from direct and indirect pointers) which
+   are used by the file
 */
-int operate_bitmap(disk *diskptr, int bitmap_base, int bitmap_offset,
-                   int mode) {
+int get_all_data_blocks(disk *diskptr, int inumber, uint32_t *res) {
+    /* res is a 5 + 1024 = 1029 element array */
     int ret;
-    int block_no = bitmap_offset / (8 * BLOCKSIZE);
-    int block_offset = bitmap_offset % (8 * BLOCKSIZE);
-    int block_byte_offset = block_offset / 8;
-    int block_byte_bit_offset = block_offset % 8;
-    char buf[BLOCKSIZE];
-    /* Read */
-    ret = read_block(diskptr, bitmap_base + block_no, (void *)buf);
+    super_block s;
+    ret = get_super_block(diskptr, &s);
     if (ret == -1) return -1;
 
-    /* Update */
-    if (mode == 0) {
-        buf[block_byte_offset] = buf[block_byte_offset] &
-                                 (~(1 << (7 - block_byte_bit_offset)));
+    inode in;
+    ret = get_inode(diskptr, inumber, &in);
+    if (ret == -1) return -1;
+
+    char buf[BLOCKSIZE];
+    if (uses_indirect(&s, &in) &&
+        read_block(diskptr, data_block(&s, in.indirect), (void *)buf) == -1)
+        return -1;
+    map_blocks(&s, &in, uses_indirect(&s, &in) ? buf : NULL, res);
+    return 0;
+}
+
+/* Returns minimum of x, y*/
+int get_min(int x, int y) {
+    if (x <= y) return x;
+    return y;
+}
+
+/* Returns maximum of x, y*/
+int get_max(int x, int y) {
+    if (x >= y) return x;
+    return y;
+}
+
+/* Operate  on inode / data bitmap (kind BMP_INODES / BMP_DATA), on the
+   bit of inode / data block index
+    mode = 0 => Reset
+    mode = 1 => Set
+    mode = 2 => read
+*/
+int operate_bitmap(sfs_fs *fs, int kind, uint32_t index, int mode) {
+    int ret;
+    uint32_t g = index / group_span(&fs->s, kind);
+    uint32_t bitmap_offset = index % group_span(&fs->s, kind);
+    int block_no = bitmap_start(&fs->s, kind, g) + bitmap_offset / (8 * BLOCKSIZE);
+    int block_offset = bitmap_offset % (8 * BLOCKSIZE);
+    int block_byte_offset = block_offset / 8;
+    int block_byte_bit_offset = block_offset % 8;
+    char mask = 1 << (7 - block_byte_bit_offset);
+    char buf[BLOCKSIZE];
+    pthread_mutex_t *lock = bitmap_lock(fs, kind, g);
+    pthread_mutex_lock(lock);
+    /* Read */
+    ret = bread(fs, block_no, (void *)buf);
+    if (ret == -1) {
+        pthread_mutex_unlock(lock);
+        return -1;
+    }
+
+    /* Update, keeping the free count of the group */
+    int was_set = (buf[block_byte_offset] & mask) != 0;
+    if (mode == 0) {
+        buf[block_byte_offset] = buf[block_byte_offset] & (~mask);
+        if (was_set)
+            __atomic_add_fetch(&fs->groups[g].free[kind], 1, __ATOMIC_RELAXED);
+        if (kind == BMP_DATA) brevoke(fs, data_block(&fs->s, index));
     } else if (mode == 1) {
-        buf[block_byte_offset] = buf[block_byte_offset] |
-                                 ((1 << (7 - block_byte_bit_offset)));
+        buf[block_byte_offset] = buf[block_byte_offset] | mask;
+        if (!was_set)
+            __atomic_sub_fetch(&fs->groups[g].free[kind], 1, __ATOMIC_RELAXED);
     } else if (mode == 2) {
-        return buf[block_byte_offset] & ((1 << (7 - block_byte_bit_offset)));
+        pthread_mutex_unlock(lock);
+        return buf[block_byte_offset] & mask;
     }
 
     /* Write */
-    ret = write_block(diskptr, bitmap_base + block_no, (void *)buf);
+    ret = bwrite(fs, block_no, (void *)buf);
+    pthread_mutex_unlock(lock);
     return ret;
 }
 
-/* Finds a free bitmap, sets it and returns index */
-int get_free_bitmap(disk *diskptr, int bmp_start, int bmp_end) {
+/* Finds up to count free bits with group relative index in [from, to) in
+   the inode / data bitmap of group g, sets them and stores the inode / data
+   block indexes in ascending order in res. Every bitmap block is read and
+   written at most once. Called with the bitmap lock held. Returns the no of
+   bits set and -1 on error
+*/
+int take_group_bits(sfs_fs *fs, int kind, uint32_t g, uint32_t from,
+                    uint32_t to, int count, uint32_t *res) {
+    super_block *s = &fs->s;
+    uint32_t base = g * group_span(s, kind);
+    uint32_t per_block = 8 * BLOCKSIZE;
     char buf[BLOCKSIZE];
-    int ret;
+    int ret, c = 0;
+
+    for (uint32_t b = from / per_block; b * per_block < to && c < count; ++b) {
+        int block = bitmap_start(s, kind, g) + b;
+        ret = bread(fs, block, (void *)buf);
+        if (ret == -1) break;
+
+        int changed = 0;
+        uint32_t end = get_min(to, (b + 1) * per_block);
+        for (uint32_t i = get_max(from, b * per_block); i < end && c < count;
+             ++i) {
+            uint32_t k = i % per_block;
+            if (k % 8 == 0 && (unsigned char)buf[k / 8] == 0xff) {
+                i += 7;
+                continue;
+            }
+            if (!(buf[k / 8] & (1 << (7 - k % 8)))) {
+                buf[k / 8] = buf[k / 8] | (1 << (7 - k % 8));
+                res[c++] = base + i;
+                changed = 1;
+            }
+        }
 
-    for (int b = bmp_start; b < bmp_end; ++b) {
-        ret = read_block(diskptr, b, (void *)buf);
-        if (ret == -1) return -1;
-        for (int byte = 0; byte < BLOCKSIZE; ++byte) {
-            for (int bit = 0; bit < 8; ++bit) {
-                if (!(buf[byte] & (1 << (7 - bit)))) {
-                    int index = (b - bmp_start) * 4096 + byte * 8 + bit;
-                    buf[byte] = buf[byte] | (1 << (7 - bit));
-                    ret = write_block(diskptr, b, (void *)buf);
-                    if (ret == -1) return -1;
-                    return index;
+        ret = changed ? bwrite(fs, block, (void *)buf) : 0;
+        if (ret == -1) break;
+    }
+    __atomic_sub_fetch(&fs->groups[g].free[kind], c, __ATOMIC_RELAXED);
+    return ret == -1 ? -1 : c;
+}
+
+/* Allocates up to count inodes / data blocks (kind BMP_*) near index goal:
+   from goal to the end of its group first, then in the following groups
+   (wrapping around) and last in the start of the group of goal. Groups
+   without free bits are skipped without taking their lock, so threads
+   allocating in different groups do not contend. The indexes are stored in
+   res. Returns the no allocated and -1 on error
+*/
+int alloc_bits(sfs_fs *fs, int kind, uint32_t goal, int count,
+               uint32_t *res) {
+    super_block *s = &fs->s;
+    uint32_t span = group_span(s, kind);
+    uint32_t g0 = goal / span;
+    if (g0 >= s->groups) g0 = goal = 0;
+
+    int c = 0;
+    for (uint32_t i = 0; i <= s->groups && c < count; ++i) {
+        uint32_t g = (g0 + i) % s->groups;
+        uint32_t from = 0, to = group_bits(s, kind, g);
+        if (i == 0)
+            from = goal % span;
+        else if (i == s->groups)
+            to = goal % span;
+        if (from >= to ||
+            __atomic_load_n(&fs->groups[g].free[kind], __ATOMIC_RELAXED) == 0)
+            continue;
+
+        pthread_mutex_lock(bitmap_lock(fs, kind, g));
+        int n = take_group_bits(fs, kind, g, from, to, count - c, res + c);
+        pthread_mutex_unlock(bitmap_lock(fs, kind, g));
+        if (n == -1) return -1;
+        c += n;
+    }
+    return c;
+}
+
+int clear_bitmap_bits(sfs_fs *fs, int kind, uint32_t *bits, int n);
+
+/* Current time in ns */
+int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Returns the unused inode / data block reservations of pool p to the
+   bitmaps. Called with the pool lock held
+*/
+void pool_return(alloc_pool *p, int kind) {
+    if (p->next[kind] < p->count[kind])
+        clear_bitmap_bits(p->fs, kind, p->items[kind] + p->next[kind],
+                          p->count[kind] - p->next[kind]);
+    p->next[kind] = p->count[kind] = 0;
+}
+
+/* Returns the reservations of the pools of fs other than self, of all of
+   them or (idle_only) of those unused for POOL_IDLE_NS. Pools busy
+   allocating are skipped
+*/
+void reclaim_pools(sfs_fs *fs, alloc_pool *self, int idle_only) {
+    int64_t now = clock_ns();
+    txn_begin(fs);
+    pthread_mutex_lock(&fs->pools_lock);
+    for (alloc_pool *p = fs->pools; p != NULL; p = p->next_pool) {
+        if (p == self || pthread_mutex_trylock(&p->lock) != 0) continue;
+        if (!idle_only || now - p->used_ns >= POOL_IDLE_NS) {
+            pool_return(p, BMP_INODES);
+            pool_return(p, BMP_DATA);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    pthread_mutex_unlock(&fs->pools_lock);
+    txn_end(fs);
+}
+
+/* Destructor of the pool of an exiting thread, returns its reservations */
+void pool_exit(void *arg) {
+    alloc_pool *p = (alloc_pool *)arg;
+    sfs_fs *fs = p->fs;
+    pthread_mutex_lock(&fs->pools_lock);
+    if (p->prev != NULL)
+        p->prev->next_pool = p->next_pool;
+    else
+        fs->pools = p->next_pool;
+    if (p->next_pool != NULL) p->next_pool->prev = p->prev;
+    pthread_mutex_unlock(&fs->pools_lock);
+
+    /* no longer reachable by other threads. The thread has no handle open
+       and its pool is gone, so it joins the transaction directly */
+    if (fs->j != NULL) journal_enter(fs->j);
+    pool_return(p, BMP_INODES);
+    pool_return(p, BMP_DATA);
+    if (fs->j != NULL) journal_leave(fs->j);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+/* Returns the allocation pool of the calling thread, creating it on first
+   use. Returns NULL if out of memory
+*/
+alloc_pool *thread_pool(sfs_fs *fs) {
+    alloc_pool *p = (alloc_pool *)pthread_getspecific(fs->pool_key);
+    if (p != NULL) return p;
+
+    p = (alloc_pool *)calloc(1, sizeof(alloc_pool));
+    if (p == NULL) return NULL;
+    p->fs = fs;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_lock(&fs->pools_lock);
+    p->next_pool = fs->pools;
+    if (fs->pools != NULL) fs->pools->prev = p;
+    fs->pools = p;
+    pthread_mutex_unlock(&fs->pools_lock);
+    pthread_setspecific(fs->pool_key, p);
+    return p;
+}
+
+/* Allocates an inode / data block near goal and returns its index. It is
+   taken from the pool of the calling thread if the pool holds reservations
+   for the group of goal, else the pool is refilled near goal (see
+   alloc_bits). Returns -2 if there are none left and -1 on error
+*/
+int do_alloc_bit(sfs_fs *fs, int kind, uint32_t goal) {
+    uint32_t index;
+    alloc_pool *p = thread_pool(fs);
+    if (p == NULL) {
+        int ret = alloc_bits(fs, kind, goal, 1, &index);
+        if (ret <= 0) return ret == 0 ? -2 : -1;
+        return index;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    uint32_t g = goal / group_span(&fs->s, kind);
+    if (p->next[kind] < p->count[kind] && p->group[kind] != g)
+        pool_return(p, kind);
+
+    int ret = 0;
+    if (p->next[kind] == p->count[kind]) {
+        /* Refill, returning reservations other threads left idle first */
+        reclaim_pools(fs, p, 1);
+        ret = alloc_bits(fs, kind, goal, POOL_SIZE, p->items[kind]);
+        if (ret == 0) {
+            /* Disk full unless other threads hold reservations */
+            reclaim_pools(fs, p, 0);
+            ret = alloc_bits(fs, kind, goal, POOL_SIZE, p->items[kind]);
+        }
+        p->next[kind] = 0;
+        p->count[kind] = get_max(ret, 0);
+        p->group[kind] = g;
+    }
+
+    if (p->next[kind] < p->count[kind])
+        ret = p->items[kind][p->next[kind]++];
+    else if (ret == 0)
+        ret = -2;
+    p->used_ns = clock_ns();
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+/* Returns the inodes and data blocks reserved by the allocation pools of
+   all the threads to the bitmaps, so that they show as free
+*/
+void fs_release_reservations(sfs_fs *fs) {
+    if (fs == NULL) return;
+    reclaim_pools(fs, NULL, 0);
+}
+
+/* Group for a new directory in directory parent (Orlov style). Directories
+   in the root are spread over the groups with at least the average no of
+   free inodes and data blocks, other directories stay in the group of their
+   parent unless it is fuller than average
+*/
+uint32_t dir_group(sfs_fs *fs, uint32_t parent) {
+    super_block *s = &fs->s;
+    /* only over the groups initialized already (see fs_format_lazy) */
+    uint32_t groups = get_max(
+        1, s->groups - __atomic_load_n(&fs->uninit_groups, __ATOMIC_ACQUIRE));
+    uint64_t inodes = 0, blocks = 0;
+    for (uint32_t g = 0; g < groups; ++g) {
+        inodes += __atomic_load_n(&fs->groups[g].free[BMP_INODES],
+                                  __ATOMIC_RELAXED);
+        blocks += __atomic_load_n(&fs->groups[g].free[BMP_DATA],
+                                  __ATOMIC_RELAXED);
+    }
+
+    uint32_t pg = parent / s->group_inodes, start = pg;
+    if (parent == 0)
+        start = __atomic_fetch_add(&fs->dir_rotor, 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < groups; ++i) {
+        uint32_t g = (start + i) % groups;
+        uint64_t fi = __atomic_load_n(&fs->groups[g].free[BMP_INODES],
+                                      __ATOMIC_RELAXED);
+        uint64_t fb = __atomic_load_n(&fs->groups[g].free[BMP_DATA],
+                                      __ATOMIC_RELAXED);
+        if (fi > 0 && fi >= inodes / groups && fb >= blocks / groups)
+            return g;
+    }
+    return pg;
+}
+
+/* Index of the first inode to try for a new item of type type in directory
+   parent: files go to the group of their directory
+*/
+uint32_t inode_goal(sfs_fs *fs, uint32_t parent, int type) {
+    if (parent >= fs->s.inodes) parent = 0;
+    uint32_t g = type == SFS_TYPE_D ? dir_group(fs, parent)
+                                    : parent / fs->s.group_inodes;
+    return g * fs->s.group_inodes;
+}
+
+/* Index of the first data block to try for block index of a file whose
+   blocks (see get_all_data_blocks) are res: right after the previous block
+   of the file, or the start of the group of its inode
+*/
+uint32_t data_goal(super_block *s, uint32_t inumber, uint32_t *res,
+                   int index) {
+    if (index > 0 && res[index - 1] < s->data_blocks) return res[index - 1] + 1;
+    return inumber / s->group_inodes * s->group_data_blocks;
+}
+
+/* Returns 1 if file data may not take another data block: the free data
+   blocks are down to the reserved blocks of the superblock, which are kept
+   for directories. Blocks held by allocation pools count as used
+*/
+int data_reserved(sfs_fs *fs) {
+    super_block *s = &fs->s;
+    if (s->reserved_blocks == 0) return 0;
+    uint64_t blocks = 0;
+    for (uint32_t g = 0; g < s->groups; ++g)
+        blocks += __atomic_load_n(&fs->groups[g].free[BMP_DATA],
+                                  __ATOMIC_RELAXED);
+    return blocks <= s->reserved_blocks;
+}
+
+/* Sets up the allocation groups of a mounted file system, counting the free
+   inodes and data blocks of every group. Returns -1 on error
+*/
+int load_groups(sfs_fs *fs) {
+    super_block *s = &fs->s;
+    uint32_t per_block = 8 * BLOCKSIZE;
+    unsigned char buf[BLOCKSIZE];
+
+    fs->groups = (alloc_group *)calloc(s->groups, sizeof(alloc_group));
+    if (fs->groups == NULL) return -1;
+    for (uint32_t g = 0; g < s->groups; ++g) {
+        for (int kind = BMP_INODES; kind <= BMP_DATA; ++kind) {
+            uint32_t bits = group_bits(s, kind, g), used = 0;
+            for (uint32_t b = 0; b * per_block < bits; ++b) {
+                if (bread(fs, bitmap_start(s, kind, g) + b,
+                               (void *)buf) == -1)
+                    return -1;
+                uint32_t n = get_min(per_block, bits - b * per_block);
+                for (uint32_t byte = 0; byte < n / 8; ++byte)
+                    used += __builtin_popcount(buf[byte]);
+                if (n % 8)
+                    used += __builtin_popcount(buf[n / 8] &
+                                               (0xff << (8 - n % 8)) & 0xff);
+            }
+            fs->groups[g].free[kind] = bits - used;
+        }
+    }
+    return 0;
+}
+
+/* no of tags of a journal descriptor block */
+#define JOURNAL_TAGS ((BLOCKSIZE - sizeof(journal_desc)) / sizeof(uint32_t))
+
+/* Adds a block to a journal checksum (FNV-1a over 32 bit words), starting
+   from 2166136261
+*/
+uint32_t journal_checksum(uint32_t sum, char *block) {
+    uint32_t *w = (uint32_t *)block;
+    for (int i = 0; i < BLOCKSIZE / 4; ++i)
+        sum = (sum ^ w[i]) * 16777619;
+    return sum;
+}
+
+/* Writes the journal header and makes it durable. Returns -1 on error */
+int journal_write_header(disk *diskptr, super_block *s, uint32_t tail,
+                         uint32_t sequence) {
+    char buf[BLOCKSIZE];
+    memset(buf, 0, BLOCKSIZE);
+    journal_header *h = (journal_header *)buf;
+    h->magic = JOURNAL_MAGIC;
+    h->tail = tail;
+    h->sequence = sequence;
+    if (write_block(diskptr, s->journal_block_idx, (void *)buf) == -1)
+        return -1;
+    return sync_disk(diskptr);
+}
+
+/* Appends a committed transaction taking length log blocks up to log
+   offset head to the transactions waiting for checkpoint
+*/
+void journal_queue(journal *j, jtxn *t, uint32_t head) {
+    pthread_mutex_lock(&j->lock);
+    j->head = head;
+    j->used += t->length;
+    j->committed = t->sequence;
+    j->blocked = 0;
+    if (j->pending_last != NULL)
+        j->pending_last->next = t;
+    else
+        j->pending = t;
+    j->pending_last = t;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* Writes the blocks of the committed transactions in place and frees their
+   log space. A block logged or revoked since by a transaction that is
+   committed is skipped, that one holds its latest version. A block logged
+   since by a transaction not committed yet is written: it must be found on
+   the disk if that one is lost in a crash. A block freed since by a
+   transaction not committed yet may be in use again, and can be neither
+   written nor dropped from the log: the log space of its transaction and the
+   ones after it is kept until a later checkpoint. Called by the journal
+   thread. Returns -1 on error
+*/
+int journal_checkpoint(sfs_fs *fs) {
+    journal *j = fs->j;
+    pthread_mutex_lock(&j->lock);
+    jtxn *list = j->pending;
+    j->pending = j->pending_last = NULL;
+    uint32_t committed = j->committed;
+    pthread_mutex_unlock(&j->lock);
+    if (list == NULL) return 0;
+
+    int ret = 0;
+    uint32_t length = 0, last = 0;
+    jtxn *kept = NULL; // the first transaction whose log space is kept
+    for (jtxn *t = list; t != NULL; t = t->next) {
+        char *data = t->data;
+        int held = 0;
+        for (int i = 0; i < t->count; ++i) {
+            if (t->tags[i] & JOURNAL_REVOKE) continue;
+            uint32_t block = t->tags[i];
+            pthread_mutex_lock(jmap_lock(j, block));
+            jbuf *e = jmap_find(j, block);
+            int newer = e == NULL || e->sequence != t->sequence;
+            if (newer && (e == NULL || e->sequence <= committed)) {
+                /* a committed transaction has a later version */
+            } else if (newer && e->data == NULL) {
+                held = 1;
+            } else if (write_block(fs->diskptr, block, (void *)data) == -1) {
+                ret = -1;
+            }
+            pthread_mutex_unlock(jmap_lock(j, block));
+            data += BLOCKSIZE;
+        }
+        if (held && kept == NULL) kept = t;
+        if (kept == NULL) {
+            length += t->length;
+            last = t->sequence;
+        }
+    }
+    if (sync_disk(fs->diskptr) == -1) ret = -1;
+
+    /* the transactions are no longer replayed, their log space is free */
+    int freed = kept != list;
+    if (freed) {
+        pthread_mutex_lock(&j->lock);
+        j->used -= length;
+        uint32_t tail = (j->head + j->size - j->used) % j->size;
+        pthread_mutex_unlock(&j->lock);
+        if (journal_write_header(fs->diskptr, &fs->s, tail, last + 1) == -1)
+            ret = -1;
+    }
+
+    /* drop the block map entries of blocks not logged again since */
+    while (list != kept) {
+        jtxn *t = list;
+        for (int i = 0; i < t->count; ++i) {
+            uint32_t block = t->tags[i] & ~JOURNAL_REVOKE;
+            pthread_mutex_lock(jmap_lock(j, block));
+            jbuf *e = jmap_find(j, block);
+            if (e != NULL && e->sequence == t->sequence && !e->running)
+                jmap_remove(j, e);
+            pthread_mutex_unlock(jmap_lock(j, block));
+        }
+        list = t->next;
+        free(t->tags);
+        free(t->data);
+        free(t);
+    }
+
+    pthread_mutex_lock(&j->lock);
+    if (kept != NULL) {
+        /* back in front of the ones committed meanwhile */
+        jtxn *end = kept;
+        while (end->next != NULL) end = end->next;
+        end->next = j->pending;
+        if (j->pending == NULL) j->pending_last = end;
+        j->pending = kept;
+        j->blocked = 1;
+    }
+    if (freed) j->checkpointed = last;
+    if (ret == -1) j->error = 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    return ret;
+}
+
+/* Commits the running transaction: its blocks are logged after descriptor
+   blocks listing them, followed by a commit block with a checksum of all of
+   them, and made durable with a single flush. When the log has no room for
+   it, the committed transactions are checkpointed first. Nothing is ever
+   written in place without being logged: a transaction that still does not
+   fit fails the journal (see journal_enter for the bound on its size).
+   Called by the journal thread. Returns -1 on error
+*/
+int journal_commit(sfs_fs *fs) {
+    journal *j = fs->j;
+    pthread_mutex_lock(&j->lock);
+    if (j->nrunning == 0) {
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+
+    /* wait for the open handles, new ones join the next transaction */
+    j->locked = 1;
+    while (j->handles > 0)
+        pthread_cond_wait(&j->cond, &j->lock);
+    int n = j->nrunning;
+    jtxn *t = (jtxn *)calloc(1, sizeof(jtxn));
+    if (t != NULL) {
+        t->tags = (uint32_t *)malloc(n * sizeof(uint32_t));
+        t->data = (char *)malloc((size_t)n * BLOCKSIZE);
+    }
+    if (t == NULL || t->tags == NULL || t->data == NULL) {
+        j->locked = 0;
+        j->error = 1;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+        if (t != NULL) {
+            free(t->tags);
+            free(t->data);
+            free(t);
+        }
+        return -1;
+    }
+    int logged = 0;
+    for (int i = 0; i < n; ++i) {
+        jbuf *e = j->running[i];
+        pthread_mutex_lock(jmap_lock(j, e->block));
+        if (e->data != NULL) {
+            t->tags[t->count++] = e->block;
+            memcpy(t->data + (size_t)logged++ * BLOCKSIZE, e->data, BLOCKSIZE);
+        } else {
+            t->tags[t->count++] = JOURNAL_REVOKE | e->block;
+        }
+        e->running = 0;
+        pthread_mutex_unlock(jmap_lock(j, e->block));
+    }
+    t->sequence = j->sequence;
+    j->nrunning = 0;
+    __atomic_store_n(&j->sequence, j->sequence + 1, __ATOMIC_RELAXED);
+    j->locked = 0;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+
+    /* the file data written by the transaction goes to the disk first */
+    int ret = 0;
+    if (fs->wb != NULL && wb_flush(fs, 1) == -1) ret = -1;
+
+    int ndesc = (t->count + JOURNAL_TAGS - 1) / JOURNAL_TAGS;
+    t->length = ndesc + logged + 1;
+    if (j->used + t->length > j->size && journal_checkpoint(fs) == -1)
+        ret = -1;
+    if (j->used + t->length > j->size) {
+        /* the log space is still held by older transactions */
+        pthread_mutex_lock(&j->lock);
+        j->error = 1;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+        free(t->tags);
+        free(t->data);
+        free(t);
+        return -1;
+    }
+
+    char buf[BLOCKSIZE];
+    char *data = t->data;
+    uint32_t sum = 2166136261u, pos = j->head;
+    for (int d = 0; d < ndesc; ++d) {
+        memset(buf, 0, BLOCKSIZE);
+        journal_desc *desc = (journal_desc *)buf;
+        desc->magic = JOURNAL_DESC_MAGIC;
+        desc->sequence = t->sequence;
+        desc->count = get_min(JOURNAL_TAGS, t->count - d * JOURNAL_TAGS);
+        memcpy(desc->tags, t->tags + d * JOURNAL_TAGS,
+               desc->count * sizeof(uint32_t));
+        sum = journal_checksum(sum, buf);
+        if (write_block(fs->diskptr, j->start + pos, (void *)buf) == -1)
+            ret = -1;
+        pos = (pos + 1) % j->size;
+
+        for (int i = 0; i < desc->count; ++i) {
+            if (desc->tags[i] & JOURNAL_REVOKE) continue;
+            sum = journal_checksum(sum, data);
+            if (write_block(fs->diskptr, j->start + pos, (void *)data) == -1)
+                ret = -1;
+            pos = (pos + 1) % j->size;
+            data += BLOCKSIZE;
+        }
+    }
+
+    memset(buf, 0, BLOCKSIZE);
+    journal_commit_block *c = (journal_commit_block *)buf;
+    c->magic = JOURNAL_COMMIT_MAGIC;
+    c->sequence = t->sequence;
+    c->blocks = ndesc + logged;
+    c->checksum = sum;
+    if (write_block(fs->diskptr, j->start + pos, (void *)buf) == -1) ret = -1;
+    pos = (pos + 1) % j->size;
+    if (sync_disk(fs->diskptr) == -1) ret = -1;
+
+    journal_queue(j, t, pos);
+    if (ret == -1) {
+        pthread_mutex_lock(&j->lock);
+        j->error = 1;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+    }
+    return ret;
+}
+
+/* The journal thread. Commits the running transaction once it is
+   JOURNAL_COMMIT_NS old, has no room for another handle (see journal_enter)
+   or is waited for by fs_sync, and checkpoints when the log is half full or
+   on fs_sync. Commits and checkpoints everything before exiting
+*/
+void *journal_thread(void *arg) {
+    sfs_fs *fs = (sfs_fs *)arg;
+    journal *j = fs->j;
+    pthread_mutex_lock(&j->lock);
+    while (1) {
+        int64_t due = j->started_ns + JOURNAL_COMMIT_NS;
+        int full = j->nrunning + JOURNAL_CREDITS > j->txn_max;
+        int commit = j->nrunning > 0 &&
+                     (j->stop || full || j->sync_request >= j->sequence ||
+                      clock_ns() >= due);
+        int checkpoint = j->pending != NULL &&
+                         !j->blocked &&
+                         (j->stop || j->used > j->size / 2 ||
+                          j->sync_request > j->checkpointed);
+        if (commit || checkpoint) {
+            pthread_mutex_unlock(&j->lock);
+            if (commit)
+                journal_commit(fs);
+            else
+                journal_checkpoint(fs);
+            pthread_mutex_lock(&j->lock);
+        } else if (j->stop) {
+            break;
+        } else if (j->nrunning > 0) {
+            struct timespec ts = {due / 1000000000LL, due % 1000000000LL};
+            pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+        } else {
+            pthread_cond_wait(&j->cond, &j->lock);
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+/* Sets up the journal of a mounted file system (recovered already, see
+   journal_recover) and starts the journal thread. Returns -1 on error
+*/
+int journal_start(sfs_fs *fs) {
+    super_block *s = &fs->s;
+    if (s->journal_blocks == 0) return 0;
+    if (s->journal_blocks < JOURNAL_MIN) return -1;
+
+    char buf[BLOCKSIZE];
+    if (read_block(fs->diskptr, s->journal_block_idx, (void *)buf) == -1)
+        return -1;
+    journal_header h = *(journal_header *)buf;
+
+    journal *j = (journal *)calloc(1, sizeof(journal));
+    if (j == NULL) return -1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&j->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int i = 0; i < JMAP_LOCKS; ++i)
+        pthread_mutex_init(&j->map_locks[i], NULL);
+    j->start = s->journal_block_idx + 1;
+    j->size = s->journal_blocks - 1;
+    j->head = h.tail;
+    j->sequence = h.sequence;
+    j->committed = j->checkpointed = j->sync_request = h.sequence - 1;
+    /* a transaction with its descriptor and commit blocks takes a quarter
+       of the log at most: the one being committed always fits beside the
+       ones left when the log is checkpointed at half full */
+    j->txn_max = j->size / 4 - j->size / (4 * JOURNAL_TAGS) - 2;
+
+    fs->j = j;
+    if (pthread_create(&j->thread, NULL, journal_thread, fs) != 0) {
+        fs->j = NULL;
+        free(j);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops the journal thread once everything is checkpointed and frees the
+   journal
+*/
+void journal_stop(sfs_fs *fs) {
+    journal *j = fs->j;
+    if (j == NULL) return;
+    pthread_mutex_lock(&j->lock);
+    j->stop = 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->thread, NULL);
+
+    fs->j = NULL;
+    for (int b = 0; b < JMAP_SIZE; ++b) {
+        while (j->map[b] != NULL) {
+            jbuf *e = j->map[b];
+            j->map[b] = e->next;
+            free(e->data);
+            free(e);
+        }
+    }
+    free(j->running);
+    for (int i = 0; i < JMAP_LOCKS; ++i)
+        pthread_mutex_destroy(&j->map_locks[i]);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+/* Commits the running transaction, checkpoints the committed ones and
+   writes the write-back cache, so that every update made so far is on the
+   disk in place. Returns -1 on error
+*/
+int do_sync(sfs_fs *fs) {
+    if (fs == NULL) return -1;
+    journal *j = fs->j;
+    int ret = 0;
+    if (j != NULL) {
+        pthread_mutex_lock(&j->lock);
+        uint32_t target = j->nrunning > 0 ? j->sequence : j->sequence - 1;
+        if (target > j->sync_request) j->sync_request = target;
+        pthread_cond_broadcast(&j->cond);
+        /* a failed commit or checkpoint may never reach the target */
+        while (j->checkpointed < target && !j->error)
+            pthread_cond_wait(&j->cond, &j->lock);
+        if (j->error) ret = -1;
+        pthread_mutex_unlock(&j->lock);
+    }
+    /* file data not committed yet, everything without a journal */
+    if (fs->wb != NULL && wb_flush(fs, 1) == -1) ret = -1;
+    if ((j == NULL || fs->wb != NULL) && sync_disk(fs->diskptr) == -1)
+        ret = -1;
+    return ret;
+}
+
+/* Block revoked by journal transactions, see journal_recover */
+typedef struct jrevoke {
+    uint32_t block;
+    uint32_t sequence; // last transaction revoking it
+} jrevoke;
+
+typedef struct jrevokes {
+    jrevoke *items;
+    int n, cap;
+} jrevokes;
+
+int compare_jrevoke(const void *a, const void *b) {
+    uint32_t x = ((jrevoke *)a)->block, y = ((jrevoke *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/* Whether block is revoked by transaction sequence or a later one. The
+   revokes are sorted by block, one per block
+*/
+int jrevoked(jrevokes *rv, uint32_t block, uint32_t sequence) {
+    jrevoke key = {block, 0};
+    jrevoke *r = (jrevoke *)bsearch(&key, rv->items, rv->n, sizeof(jrevoke),
+                                    compare_jrevoke);
+    return r != NULL && r->sequence >= sequence;
+}
+
+/* Reads the transaction sequence starting at log offset *pos, checking it
+   is complete and its checksum matches. If replay is set its blocks are
+   written in place, except those revoked by it or a later transaction (see
+   jrevoked), else its revokes are added to rv. Returns 1 (moving *pos past
+   it) if it is complete, 0 if not and -1 on error
+*/
+int journal_scan(disk *diskptr, super_block *s, uint32_t *pos,
+                 uint32_t sequence, jrevokes *rv, int replay) {
+    uint32_t start = s->journal_block_idx + 1, size = s->journal_blocks - 1;
+    char buf[BLOCKSIZE], block[BLOCKSIZE];
+    uint32_t p = *pos, sum = 2166136261u, blocks = 0;
+    int revokes = rv->n;
+
+    while (blocks < size) {
+        if (read_block(diskptr, start + p, (void *)buf) == -1) return -1;
+        journal_commit_block *c = (journal_commit_block *)buf;
+        if (c->magic == JOURNAL_COMMIT_MAGIC && c->sequence == sequence) {
+            if (c->blocks != blocks || c->checksum != sum) break;
+            *pos = (p + 1) % size;
+            return 1;
+        }
+        journal_desc *desc = (journal_desc *)buf;
+        if (desc->magic != JOURNAL_DESC_MAGIC || desc->sequence != sequence ||
+            desc->count > JOURNAL_TAGS)
+            break;
+        sum = journal_checksum(sum, buf);
+        p = (p + 1) % size;
+        blocks++;
+
+        for (uint32_t i = 0; i < desc->count && blocks < size; ++i) {
+            uint32_t tag = desc->tags[i];
+            if (tag & JOURNAL_REVOKE) {
+                if (replay) continue;
+                if (rv->n == rv->cap) {
+                    int cap = rv->cap ? 2 * rv->cap : 256;
+                    jrevoke *items = (jrevoke *)realloc(
+                        rv->items, cap * sizeof(jrevoke));
+                    if (items == NULL) return -1;
+                    rv->items = items;
+                    rv->cap = cap;
                 }
+                rv->items[rv->n].block = tag & ~JOURNAL_REVOKE;
+                rv->items[rv->n++].sequence = sequence;
+                continue;
             }
+            if (read_block(diskptr, start + p, (void *)block) == -1) return -1;
+            sum = journal_checksum(sum, block);
+            p = (p + 1) % size;
+            blocks++;
+            if (replay && !jrevoked(rv, tag, sequence) &&
+                write_block(diskptr, tag, (void *)block) == -1)
+                return -1;
         }
     }
+    /* incomplete, its revokes do not count */
+    rv->n = revokes;
+    return 0;
+}
+
+/* Replays the transactions committed to the journal of the disk but not
+   checkpointed, in order, then empties the journal. Called at mount.
+   Returns -1 on error
+*/
+int journal_recover(disk *diskptr, super_block *s) {
+    if (s->journal_blocks == 0) return 0;
+    char buf[BLOCKSIZE];
+    if (read_block(diskptr, s->journal_block_idx, (void *)buf) == -1)
+        return -1;
+    journal_header h = *(journal_header *)buf;
+    if (h.magic != JOURNAL_MAGIC || h.tail >= s->journal_blocks - 1)
+        return -1;
+
+    /* Find the complete transactions, collecting their revokes */
+    jrevokes rv = {NULL, 0, 0};
+    uint32_t pos = h.tail, sequence = h.sequence;
+    int ret;
+    while ((ret = journal_scan(diskptr, s, &pos, sequence, &rv, 0)) == 1)
+        sequence++;
+    if (ret == -1 || sequence == h.sequence) {
+        free(rv.items);
+        return ret;
+    }
 
-    /* end of disk - no inode available */
-    return -2;
+    /* one revoke per block, by the last transaction */
+    qsort(rv.items, rv.n, sizeof(jrevoke), compare_jrevoke);
+    int n = 0;
+    for (int i = 0; i < rv.n; ++i) {
+        if (n > 0 && rv.items[n - 1].block == rv.items[i].block)
+            rv.items[n - 1].sequence =
+                get_max(rv.items[n - 1].sequence, rv.items[i].sequence);
+        else
+            rv.items[n++] = rv.items[i];
+    }
+    rv.n = n;
+
+    /* Replay */
+    pos = h.tail;
+    ret = 1;
+    for (uint32_t seq = h.sequence; seq < sequence && ret == 1; ++seq)
+        ret = journal_scan(diskptr, s, &pos, seq, &rv, 1);
+    free(rv.items);
+    if (ret != 1 || sync_disk(diskptr) == -1) return -1;
+    return journal_write_header(diskptr, s, pos, sequence);
 }
 
 /* Prints no of inodes and data blocks used */
-void show_stats() {
-    int ret;
-    super_block s;
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return;
+void fs_show_stats(sfs_fs *fs) {
+    if (fs == NULL) return;
+    super_block s = fs->s;
+
+    /* reserved but unused inodes and data blocks are free */
+    reclaim_pools(fs, NULL, 0);
 
     int consumed_db = 0;
     for (int i = 0; i < s.data_blocks; ++i) {
-        if (operate_bitmap(mounted_diskptr, s.data_block_bitmap_idx, i, 2)) {
+        if (operate_bitmap(fs, BMP_DATA, i, 2)) {
             consumed_db++;
         }
     }
 
     int consumed_in = 0;
     for (int i = 0; i < s.inode_blocks; ++i) {
-        if (operate_bitmap(mounted_diskptr, s.inode_bitmap_block_idx, i, 2)) {
+        if (operate_bitmap(fs, BMP_INODES, i, 2)) {
             consumed_in++;
         }
     }
@@ -222,142 +2120,256 @@ void show_stats() {
     printf("Used Data Blocks: %d / %d\n", consumed_db, s.data_blocks);
     printf("\n        Disk Statistics:       \n");
     printf("=================================\n");
-    printf("# Blocks: %d\n", mounted_diskptr->blocks);
-    printf("# Bytes %d\n", mounted_diskptr->size);
-    printf("# Reads: %d\n", mounted_diskptr->reads);
-    printf("# Writes: %d\n\n", mounted_diskptr->writes);
+    printf("# Blocks: %d\n", fs->diskptr->blocks);
+    printf("# Bytes %d\n", fs->diskptr->size);
+    printf("# Reads: %d\n", fs->diskptr->reads);
+    printf("# Writes: %d\n\n", fs->diskptr->writes);
 }
 
-/* Returns minimum of x, y*/
-int get_min(int x, int y) {
-    if (x <= y) return x;
-    return y;
-}
-
-/* Returns maximum of x, y*/
-int get_max(int x, int y) {
-    if (x >= y) return x;
-    return y;
-}
-
-int create_root_directory();
+int create_root_directory(sfs_fs *fs);
 
 /* Formats the file system properly setting up superblock, bitmaps and
-inodes. Return -1 on error and 0 on success
+inodes as set by opts (see sfs_format_opts, defaults if NULL). Return -1 on
+error and 0 on success
 */
-int format(disk *diskptr) {
+int do_format_opts(disk *diskptr, sfs_format_opts *opts) {
     int ret = -1;
+    sfs_format_opts o;
+    memset(&o, 0, sizeof(o));
+    if (opts != NULL) o = *opts;
+    if (o.block_size != 0 && o.block_size != BLOCKSIZE) return -1;
+    if (o.layout != SFS_LAYOUT_GROUPS && o.layout != SFS_LAYOUT_FLAT)
+        return -1;
+
+    int journal_blocks = o.journal_blocks;
+    if (journal_blocks == -1)
+        journal_blocks = get_max(JOURNAL_MIN,
+                                 get_min(JOURNAL_MAX, diskptr->blocks / 16));
+    if (journal_blocks < 0 ||
+        (journal_blocks > 0 && journal_blocks < JOURNAL_MIN) ||
+        journal_blocks > diskptr->blocks / 2)
+        return -1;
 
-    /* one block reserved for superblock */
-    int M = diskptr->blocks - 1;
-    /* no of inode blocks */
-    int I = (int)floor(0.1 * M);
-    /* no of inodes */
-    int nInodes = I * 128;
+    /* one block reserved for superblock, the journal at the end */
+    int M = diskptr->blocks - 1 - journal_blocks;
+    /* blocks per allocation group, a small disk is a single group */
+    int GB = M;
+    if (o.layout == SFS_LAYOUT_GROUPS)
+        GB = get_min(M, o.group_blocks > 0 ? o.group_blocks : GROUP_BLOCKS);
+    /* no of inode blocks per group */
+    int I = (int)floor(0.1 * GB);
+    if (o.bytes_per_inode > 0)
+        I = (int)ceil(1.0 * GB * BLOCKSIZE / o.bytes_per_inode /
+                      (BLOCKSIZE / sizeof(inode)));
+    /* no of inodes per group */
+    int nInodes = I * (BLOCKSIZE / sizeof(inode));
     /* no of blocks reserved for inode bitmap */
-    int IB = (int)ceil(1.0 * nInodes / (8 * 4096));
+    int IB = (int)ceil(1.0 * nInodes / (8 * BLOCKSIZE));
     /* no of data blocks + data blocks bitmap */
-    int R = M - I - IB;
+    int R = GB - I - IB;
     /* no of data blocks bitmap */
-    int DBB = (int)ceil(1.0 * R / (8 * 4096));
-    /* no of data blocks */
+    int DBB = (int)ceil(1.0 * R / (8 * BLOCKSIZE));
+    /* no of data blocks per group */
     int DB = R - DBB;
+    if (M <= 0 || I <= 0 || DB <= 0) return -1;
+
+    /* no of groups. The blocks left over form a last, shorter group if they
+       hold more than its bitmaps and inode table */
+    int G = M / GB;
+    int rest = M - G * GB;
+    int last_DB = DB;
+    if (rest > IB + DBB + I) {
+        G++;
+        last_DB = rest - IB - DBB - I;
+    }
 
     super_block s;
+    memset(&s, 0, sizeof(s));
     s.magic_number = MAGIC;
     s.blocks = M;
-    s.inode_blocks = I;
-    s.inodes = nInodes;
+    s.inode_blocks = G * I;
+    s.inodes = G * nInodes;
     s.inode_bitmap_block_idx = 1;
     s.inode_block_idx = 1 + IB + DBB;
     s.data_block_bitmap_idx = 1 + IB;
     s.data_block_idx = 1 + IB + DBB + I;
-    s.data_blocks = DB;
+    s.data_blocks = (G - 1) * DB + last_DB;
+    s.groups = G;
+    s.group_blocks = GB;
+    s.group_inodes = nInodes;
+    s.group_data_blocks = DB;
+    s.journal_block_idx = journal_blocks > 0 ? 1 + M : 0;
+    s.journal_blocks = journal_blocks;
+    s.uninit_groups = o.lazy ? G : 0;
+    s.reserved_blocks = o.reserved_blocks;
+    if (s.reserved_blocks >= s.data_blocks) return -1;
 
     /* Write superblock to disk */
-    write_block(diskptr, 0, (void *)&s);
+    char sb[BLOCKSIZE];
+    memset(sb, 0, BLOCKSIZE);
+    memcpy(sb, &s, sizeof(super_block));
+    ret = write_block(diskptr, 0, (void *)sb);
+    if (ret == -1) return -1;
 
-    /* initialize bitmaps
+    /* initialize bitmaps and inodes of every group
        empty block */
     char eb[BLOCKSIZE];
     memset(eb, 0, BLOCKSIZE);
 
-    /* initialize inode bitmaps */
-    for (int b = s.inode_bitmap_block_idx; b < s.data_block_bitmap_idx; ++b) {
-        ret = write_block(diskptr, b, (void *)eb);
-        if (ret == -1) return -1;
-    }
-
-    /* initialize data bitmaps */
-    for (int b = s.data_block_bitmap_idx; b < s.inode_block_idx; ++b) {
-        ret = write_block(diskptr, b, (void *)eb);
-        if (ret == -1) return -1;
+    for (int g = 0; g < G - s.uninit_groups; ++g) {
+        /* inode bitmap, data bitmap and inode table (all invalid inodes) */
+        int start = group_start(&s, g);
+        for (int b = start; b < start + s.data_block_idx - 1; ++b) {
+            ret = write_block(diskptr, b, (void *)eb);
+            if (ret == -1) return -1;
+        }
     }
 
-    /* initialize inodes */
-    for (int b = s.inode_block_idx; b < s.data_block_idx; ++b) {
-        char ib[BLOCKSIZE];
-        memset(ib, 0, BLOCKSIZE);
-        for (int i = 0; i < BLOCKSIZE / sizeof(inode); ++i) {
-            inode in;
-            in.valid = 0;
-            memcpy(ib + (i * sizeof(inode)), &in, sizeof(inode));
-        }
-        /* put block in disk */
-        ret = write_block(diskptr, b, (void *)ib);
+    /* empty journal */
+    for (int b = 1; b < journal_blocks; ++b) {
+        ret = write_block(diskptr, s.journal_block_idx + b, (void *)eb);
         if (ret == -1) return -1;
     }
+    if (journal_blocks > 0) return journal_write_header(diskptr, &s, 0, 1);
 
     return 0;
 }
 
-/* Mounts the filesystem for use */
-int mount(disk *diskptr, int mount_root_directory_flg) {
+/* Formats the disk without a journal. Return -1 on error and 0 on success */
+int fs_format(disk *diskptr) { return fs_format_opts(diskptr, NULL); }
+
+/* Formats the disk without a journal, writing only the superblock: the
+   bitmaps and inode tables of the groups are initialized after mount, by a
+   background thread or before their first write if sooner. Until then they
+   read as zero. Return -1 on error and 0 on success
+*/
+int fs_format_lazy(disk *diskptr) {
+    sfs_format_opts o;
+    memset(&o, 0, sizeof(o));
+    o.lazy = 1;
+    return fs_format_opts(diskptr, &o);
+}
+
+/* Formats the disk with a metadata journal of journal_blocks blocks (at
+   least JOURNAL_MIN), or of 1/16 of the disk (between JOURNAL_MIN and
+   JOURNAL_MAX blocks) if 0.
+   Return -1 on error and 0 on success
+*/
+int fs_format_journaled(disk *diskptr, int journal_blocks) {
+    sfs_format_opts o;
+    memset(&o, 0, sizeof(o));
+    o.journal_blocks = journal_blocks > 0 ? journal_blocks : -1;
+    return fs_format_opts(diskptr, &o);
+}
+
+/* Mounts the file system on the disk for use, creating an empty root
+   directory if mount_root_directory_flg has MRD_Y set and buffering the
+   writes in a write-back cache if it has SFS_MOUNT_WRITEBACK set. Returns
+   the mounted file system and NULL on error
+*/
+sfs_fs *do_mount(disk *diskptr, int mount_root_directory_flg) {
     /* Read superblock (first block and check magic number */
     super_block s;
     int ret = get_super_block(diskptr, &s);
-    if (ret == -1) {
-        return -1;
+    if (ret == -1 || s.magic_number != MAGIC) return NULL;
+    /* updates committed to the journal before a crash */
+    if (journal_recover(diskptr, &s) == -1) return NULL;
+
+    sfs_fs *fs = (sfs_fs *)calloc(1, sizeof(sfs_fs));
+    if (fs == NULL) return NULL;
+    fs->diskptr = diskptr;
+    fs->s = s;
+    fs->uninit_groups = s.uninit_groups;
+    fs->dcache_generation = 1;
+    if (load_groups(fs) == -1) {
+        free(fs->groups);
+        free(fs);
+        return NULL;
     }
-
-    if (s.magic_number != MAGIC) {
-        return -1;
+    init_locks(fs);
+    disk_trace_classify(diskptr, block_class, fs);
+    pthread_key_create(&fs->pool_key, pool_exit);
+    if (((mount_root_directory_flg & SFS_MOUNT_WRITEBACK) &&
+         wb_start(fs) == -1) ||
+        journal_start(fs) == -1) {
+        fs_unmount(fs);
+        return NULL;
     }
+    /* groups left by fs_format_lazy, also initialized on demand if the
+       thread can not start */
+    if (fs->uninit_groups > 0 &&
+        pthread_create(&fs->lazy_thread, NULL, lazy_thread, fs) == 0)
+        fs->lazy_running = 1;
 
-    mounted_diskptr = diskptr;
-
-    if (mount_root_directory_flg) {
+    if (mount_root_directory_flg & MRD_Y) {
         /* Create root directory and make fs ready for read/write files
-           create_root_directory() is implemented later in this file, along
+           create_root_directory(fs) is implemented later in this file, along
            with other Part C functions.
         */
-        ret = create_root_directory();
-        return ret;
+        if (create_root_directory(fs) == -1) {
+            fs_unmount(fs);
+            return NULL;
+        }
     }
 
-    return 0;
+    return fs;
 }
 
-/* Creates the file and returns its inode. On error returns -1 */
-int create_file() {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
-
-    super_block s;
-    int ret;
+void io_stop(sfs_fs *fs);
 
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
+/* Unmounts the file system, closing its open files and directories. The
+   asynchronous requests submitted are run first
+*/
+void do_unmount(sfs_fs *fs) {
+    if (fs == NULL) return;
+    if (fs->lazy_running) {
+        pthread_mutex_lock(&fs->lazy_lock);
+        fs->lazy_stop = 1;
+        pthread_cond_signal(&fs->lazy_cond);
+        pthread_mutex_unlock(&fs->lazy_lock);
+        pthread_join(fs->lazy_thread, NULL);
+    }
+    io_stop(fs);
+    for (int dd = 0; dd < MAX_OPEN_DIRS; ++dd)
+        if (fs->open_dirs[dd].used) dir_iter_close(&fs->open_dirs[dd]);
+    /* return the reservations of the threads still running, then write
+       everything in place */
+    reclaim_pools(fs, NULL, 0);
+    journal_stop(fs);
+    wb_stop(fs);
+    pthread_key_delete(fs->pool_key);
+    disk_trace_classify(fs->diskptr, NULL, NULL);
+    while (fs->pools != NULL) {
+        alloc_pool *p = fs->pools;
+        fs->pools = p->next_pool;
+        pool_return(p, BMP_INODES);
+        pool_return(p, BMP_DATA);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+    }
+    destroy_locks(fs);
+    free(fs->groups);
+    free(fs);
+}
+
+/* Creates an empty file / directory (of type type) that will be added to
+   directory parent, placing its inode near the parent (see inode_goal).
+   Returns its inode and -1 on error
+*/
+int new_inode(sfs_fs *fs, uint32_t parent, int type) {
+    super_block s;
+    int ret;
+
+    s = fs->s;
 
     /* Scan through inode bitmap to find empty inode (and set it) */
-    int inode_index = get_free_bitmap(mounted_diskptr, s.inode_bitmap_block_idx,
-                                      s.data_block_bitmap_idx);
+    int inode_index = alloc_bit(fs, BMP_INODES, inode_goal(fs, parent, type));
 
     /* disk full */
-    if (inode_index == -2) return -1;
+    if (inode_index < 0) return -1;
 
     inode in;
-    ret = get_inode(mounted_diskptr, inode_index, &in);
+    ret = load_inode(fs, inode_index, &in);
     if (ret == -1) return -1;
 
     /* Initialize file */
@@ -372,23 +2384,36 @@ int create_file() {
     int block_offset = inode_index / (BLOCKSIZE / sizeof(inode));
     int block_offset_index = inode_index % (BLOCKSIZE / sizeof(inode));
     char buf[BLOCKSIZE];
-    ret = read_block(mounted_diskptr, s.inode_block_idx + block_offset,
+    pthread_mutex_lock(itable_lock(fs, block_offset));
+    ret = bread(fs, itable_block(&s, block_offset),
                      (void *)buf);
     memcpy(buf + block_offset_index * sizeof(inode), &in, sizeof(inode));
 
-    ret = write_block(mounted_diskptr, s.inode_block_idx + block_offset,
+    ret = bwrite(fs, itable_block(&s, block_offset),
                       (void *)buf);
+    pthread_mutex_unlock(itable_lock(fs, block_offset));
 
     return inode_index;
 }
 
-/* Removes the file freeing up inodes and bitmaps.
- Returns 0 on success and -1 on error
-*/
-int remove_file(int inumber) {
+/* Creates the file and returns its inode. On error returns -1 */
+int do_create_file(sfs_fs *fs) {
     /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+    if (fs == NULL) return -1;
+
+    /* not in any directory yet, placed like the files of the root */
+    txn_begin(fs);
+    int ret = new_inode(fs, 0, SFS_TYPE_F);
+    txn_end(fs);
+    return ret;
+}
+
+void compact_dequeue(sfs_fs *fs, uint32_t dir);
 
+/* Removes the file freeing up inodes and bitmaps. Called with the inode
+ lock held. Returns 0 on success and -1 on error
+*/
+int release_inode(sfs_fs *fs, int inumber) {
     /* To remove file
         1. Set inode valid to 0
         2. Reset inode and data bitmaps
@@ -397,56 +2422,74 @@ int remove_file(int inumber) {
     /* Get superblock and the file inode */
     int ret;
     super_block s;
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
+    s = fs->s;
 
     inode in;
-    ret = get_inode(mounted_diskptr, inumber, &in);
+    ret = load_inode(fs, inumber, &in);
     if (ret == -1) return -1;
 
     in.valid = 0;
 
     /* update inode bitmap */
     /* free Bitmap */
-    ret = operate_bitmap(mounted_diskptr, s.inode_bitmap_block_idx, inumber, 0);
+    ret = operate_bitmap(fs, BMP_INODES, inumber, 0);
     if (ret == -1) return -1;
 
     /* update data bitmap */
     uint32_t res[1029];
-    ret = get_all_data_blocks(mounted_diskptr, inumber, res);
+    ret = map_data_blocks(fs, &s, &in, res);
     if (ret == -1) return -1;
 
     for (int i = 0; i < 1029; ++i) {
         if (res[i] >= 0 && res[i] < s.data_blocks) {
             /* Free Bitmap */
-            ret = operate_bitmap(mounted_diskptr, s.data_block_bitmap_idx,
-                                 res[i], 0);
+            ret = operate_bitmap(fs, BMP_DATA, res[i], 0);
         }
     }
 
     /* Free indirect pointer */
     if (in.indirect >= 0 && in.indirect < s.data_blocks) {
-        ret = operate_bitmap(mounted_diskptr, s.data_block_bitmap_idx,
-                             in.indirect, 0);
+        ret = operate_bitmap(fs, BMP_DATA, in.indirect, 0);
     }
 
+    invalidate_handles(fs, inumber, -1);
+    compact_dequeue(fs, inumber);
+
     /* Write inode to disk */
-    return write_inode_to_disk(mounted_diskptr, inumber, &in);
+    return write_inode_to_disk(fs, inumber, &in);
+}
+
+/* Removes the file freeing up inodes and bitmaps.
+ Returns 0 on success and -1 on error
+*/
+int do_remove_file(sfs_fs *fs, int inumber) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    txn_begin(fs);
+    inode_wrlock(fs, inumber);
+    int ret = release_inode(fs, inumber);
+    inode_unlock(fs, inumber);
+    txn_end(fs);
+    return ret;
 }
 
 /* Outputs the stats of the inode */
-int stat(int inumber) {
+int do_stat(sfs_fs *fs, int inumber) {
     /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+    if (fs == NULL) return -1;
 
     /* Get superblock and the file inode */
     int ret;
     super_block s;
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
+    s = fs->s;
 
     inode in;
-    ret = get_inode(mounted_diskptr, inumber, &in);
+    uint32_t res[1029];
+    inode_rdlock(fs, inumber);
+    ret = load_inode(fs, inumber, &in);
+    if (ret != -1) ret = map_data_blocks(fs, &s, &in, res);
+    inode_unlock(fs, inumber);
 
     if (ret == -1) {
         return -1;
@@ -456,11 +2499,6 @@ int stat(int inumber) {
     printf("=======================\n");
     printf("Valid Bit: %d\n", in.valid);
 
-    uint32_t res[1029];
-    ret = get_all_data_blocks(mounted_diskptr, inumber, res);
-
-    if (ret == -1) return -1;
-
     int c = 0;
     for (int i = 0; i < 1029; ++i) {
         if (res[i] >= 0 && res[i] < s.data_blocks) c++;
@@ -484,44 +2522,31 @@ int stat(int inumber) {
     return 0;
 }
 
-/* Starting from offset position in file, read length bytes form file to data
- * buffer file. Return -1 on error and other wise returns no of bytes read
- */
-int read_i(int inumber, char *data, int length, int offset) {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
-
-    /* Get superblock and the file inode */
-    int ret;
-    super_block s;
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
-
-    inode in;
-    ret = get_inode(mounted_diskptr, inumber, &in);
-
+/* Reads length bytes starting at offset from a file whose inode and block
+   map are already loaded. Return -1 on error and other wise returns no of
+   bytes read
+*/
+int read_mapped(sfs_fs *fs, super_block *s, inode *in, uint32_t *res,
+                char *data, int length, int offset) {
     /* Validation */
-    if (ret == -1 || in.valid == 0 || offset < 0 || offset > in.size ||
-        length < 0)
+    if (in->valid == 0 || offset < 0 || offset > in->size || length < 0)
         return -1;
 
     int bytes_to_read = 0;
-    if (length >= (in.size - offset))
-        bytes_to_read = (in.size - offset);
+    if (length >= (in->size - offset))
+        bytes_to_read = (in->size - offset);
     else
         bytes_to_read = length;
+    int total = bytes_to_read;
 
-    uint32_t res[1029];
-    ret = get_all_data_blocks(mounted_diskptr, inumber, res);
-    int st = offset, c = 0, r = 0;
+    int ret, st = offset, c = 0;
     char buf[BLOCKSIZE];
     while (bytes_to_read > 0) {
         int i = st / BLOCKSIZE;
         int j = st % BLOCKSIZE;
         int k = BLOCKSIZE - j;
         int r = get_min(bytes_to_read, k);
-        ret = read_block(mounted_diskptr, s.data_block_idx + res[i],
-                         (void *)buf);
+        ret = bread(fs, data_block(s, res[i]), (void *)buf);
         if (ret == -1) return -1;
         memcpy(data + c, buf + j, r);
 
@@ -530,566 +2555,3793 @@ int read_i(int inumber, char *data, int length, int offset) {
         c += r;
     }
 
-    return length - bytes_to_read; // no of bytes read
+    return total; // no of bytes read
 }
 
-/* Starting from offset position in file, write length bytes form data to the
- * file. Return -1 on error and other wise returns no of bytes written
- */
-int write_i(int inumber, char *data, int length, int offset) {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+/* Writes length bytes from data starting at offset to a file whose inode and
+   block map are already loaded. Newly allocated blocks are recorded in res and
+   the inode (and its indirect block) is written back only if the block map or
+   the size changed. The blocks of a directory (meta) are metadata, those of
+   a file are written in place. Return -1 on error and other wise returns no
+   of bytes written
+*/
+int write_mapped(sfs_fs *fs, super_block *s, int inumber, inode *in,
+                 uint32_t *res, char *data, int length, int offset, int meta) {
+    /* Validation */
+    if (in->valid == 0 || offset < 0 || offset > in->size || length < 0)
+        return -1;
 
     /* Nothing to write if length is 0 */
     if (length == 0) return 0;
 
-    /* Get superblock and the file inode */
-    int ret;
-    super_block s;
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
-
-    inode in;
-    ret = get_inode(mounted_diskptr, inumber, &in);
-    if (ret == -1) return -1;
-
-    /* Validation */
-    if (in.valid == 0 || offset > in.size) return -1;
-
-    uint32_t res[1029], c = 0;
-    ret = get_all_data_blocks(mounted_diskptr, inumber, res);
+    int ret, c = 0, allocated = 0, failed = 0;
     int index = offset / BLOCKSIZE;
     int index_off = offset % BLOCKSIZE;
 
     int bytes_to_write = length;
     char buf[BLOCKSIZE];
 
-    while (bytes_to_write > 0) {
+    while (bytes_to_write > 0 && index < 1029) {
+        int fresh = 0;
         if (res[index] == INVALID) {
-            /* Empty block so allocate data block */
-            int db_index = get_free_bitmap(
-                mounted_diskptr, s.data_block_bitmap_idx, s.inode_block_idx);
-            if (db_index == -2) return length - bytes_to_write; // disk full
-            if (db_index == -1) return -1;
+            /* Empty block so allocate data block, files stay out of the
+               reserved blocks */
+            if (!meta && data_reserved(fs)) {
+                failed = -2;
+                break;
+            }
+            int db_index = alloc_bit(fs, BMP_DATA,
+                                     data_goal(s, inumber, res, index));
+            if (db_index < 0) {
+                /* disk full (-2) or IO error (-1) */
+                failed = db_index;
+                break;
+            }
             res[index] = db_index;
+            allocated = 1;
+            fresh = 1;
         }
 
-        ret = read_block(mounted_diskptr, s.data_block_idx + res[index],
-                         (void *)buf);
         int k = get_min(bytes_to_write, BLOCKSIZE - index_off);
 
+        if (fresh) {
+            /* Newly allocated block, nothing worth reading */
+            memset(buf, 0, BLOCKSIZE);
+        } else if (k < BLOCKSIZE) {
+            /* Partial block, read modify write */
+            ret = bread(fs, data_block(s, res[index]),
+                             (void *)buf);
+            if (ret == -1) {
+                failed = -1;
+                break;
+            }
+        }
+
         memcpy(buf + index_off, data + c, k);
         c += k;
 
-        ret = write_block(mounted_diskptr, s.data_block_idx + res[index],
-                          (void *)buf);
-        if (ret == -1) return -1;
+        if (meta)
+            ret = bwrite(fs, data_block(s, res[index]), (void *)buf);
+        else
+            ret = write_inplace(fs, data_block(s, res[index]), (void *)buf);
+        if (ret == -1) {
+            failed = -1;
+            break;
+        }
         bytes_to_write -= k;
 
         index += 1;
         index_off = 0;
     }
 
-    /* Fit modified res back to inode */
-    memset(buf, 0, BLOCKSIZE);
-    int wr = 0;
-    for (int i = 0; i < 1029; ++i) {
-        if (i < 5) {
-            in.direct[i] = res[i];
-        } else if (i >= 5 && (res[i] >= 0 && res[i] < s.data_blocks)) {
-            memcpy(buf + (i - 5) * sizeof(int), (char *)&(res[i]), sizeof(int));
-            wr += 1;
+    int written = length - bytes_to_write;
+    int new_size = get_max(offset + written, in->size);
+
+    if (allocated) {
+        /* Fit modified res back to inode */
+        memset(buf, 0xff, BLOCKSIZE);
+        int wr = 0;
+        for (int i = 0; i < 1029; ++i) {
+            if (i < 5) {
+                in->direct[i] = res[i];
+            } else if (res[i] >= 0 && res[i] < s->data_blocks) {
+                memcpy(buf + (i - 5) * sizeof(uint32_t), (char *)&(res[i]),
+                       sizeof(uint32_t));
+                wr += 1;
+            }
         }
-    }
 
-    if (wr > 0) {
-        if (in.indirect >= 0 && in.indirect < s.data_blocks) {
-            ret = write_block(mounted_diskptr, s.data_block_idx + in.indirect,
+        if (wr > 0 && !(in->indirect >= 0 && in->indirect < s->data_blocks)) {
+            int ib = alloc_bit(fs, BMP_DATA, data_goal(s, inumber, res, 5));
+            if (ib < 0) {
+                /* The blocks past the direct ones, all allocated by this
+                   call, can not be mapped: they are released and only the
+                   bytes of the direct blocks count as written */
+                for (int i = 5; i < 1029; ++i) {
+                    if (res[i] >= 0 && res[i] < s->data_blocks)
+                        operate_bitmap(fs, BMP_DATA, res[i], 0);
+                    res[i] = INVALID;
+                }
+                written = get_max(get_min(written, 5 * BLOCKSIZE - offset), 0);
+                new_size = get_max(offset + written, in->size);
+                failed = ib;
+                wr = 0;
+            } else {
+                in->indirect = ib;
+            }
+        }
+        if (wr > 0) {
+            ret = bwrite(fs, data_block(s, in->indirect),
                               (void *)buf);
             if (ret == -1) return -1;
         } else {
-            in.indirect = get_free_bitmap(
-                mounted_diskptr, s.data_block_bitmap_idx, s.inode_block_idx);
-            if (in.indirect >= 0) {
-                ret = write_block(mounted_diskptr,
-                                  s.data_block_idx + in.indirect, (void *)buf);
+            in->indirect = INVALID;
+        }
+    }
+
+    /* Update size and write inode to disk */
+    if (allocated || new_size != in->size) {
+        in->size = new_size;
+        ret = write_inode_to_disk(fs, inumber, in);
+        if (ret == -1) return -1;
+    }
+
+    if (failed == -1) return -1;
+    return written; // no of bytes written
+}
+
+/* Starting from offset position in file, read length bytes form file to data
+ * buffer file. Return -1 on error and other wise returns no of bytes read
+ */
+int do_read_i(sfs_fs *fs, int inumber, char *data, int length, int offset) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    /* Get superblock and the file inode */
+    int ret;
+    super_block s;
+    s = fs->s;
+
+    inode in;
+    uint32_t res[1029];
+    inode_rdlock(fs, inumber);
+    ret = load_inode(fs, inumber, &in);
+    if (ret != -1 && in.valid == 0) ret = -1;
+    if (ret != -1) ret = map_data_blocks(fs, &s, &in, res);
+    if (ret != -1)
+        ret = read_mapped(fs, &s, &in, res, data, length, offset);
+    inode_unlock(fs, inumber);
+    return ret;
+}
+
+/* Starting from offset position in file, write length bytes form data to the
+ * file. Return -1 on error and other wise returns no of bytes written
+ */
+int do_write_i(sfs_fs *fs, int inumber, char *data, int length, int offset) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    /* Nothing to write if length is 0 */
+    if (length == 0) return 0;
+
+    /* Get superblock and the file inode */
+    int ret;
+    super_block s;
+    s = fs->s;
+
+    inode in;
+    uint32_t res[1029];
+    txn_begin(fs);
+    inode_wrlock(fs, inumber);
+    ret = load_inode(fs, inumber, &in);
+    if (ret != -1 && in.valid == 0) ret = -1;
+    if (ret != -1) ret = map_data_blocks(fs, &s, &in, res);
+    if (ret != -1) {
+        ret = write_mapped(fs, &s, inumber, &in, res, data,
+                           length, offset, 0);
+        invalidate_handles(fs, inumber, -1);
+    }
+    inode_unlock(fs, inumber);
+    txn_end(fs);
+    return ret;
+}
+
+/* Truncates the file to specified size. Called with the inode lock held.
+   Returns 0 on success and -1 on error
+*/
+int truncate_inode(sfs_fs *fs, int inumber, int size) {
+    /* Get superblock and inode */
+    int ret;
+    inode in;
+    super_block s;
+
+    s = fs->s;
+
+    ret = load_inode(fs, inumber, &in);
+    if (ret == -1) return -1;
+
+    if (in.size > size) {
+        /* no of blocks to keep. remove any blocks in excess of this */
+        int nblocks = (int)ceil(1.0 * size / BLOCKSIZE);
+
+        uint32_t res[1029];
+        ret = map_data_blocks(fs, &s, &in, res);
+        if (ret == -1) return -1;
+
+        /* Removes blocks after nblocks */
+        for (int i = nblocks; i < 1029; ++i) {
+            if (res[i] >= 0 && res[i] < s.data_blocks)
+                operate_bitmap(fs, BMP_DATA, res[i], 0);
+            res[i] = INVALID;
+        }
+
+        for (int i = 0; i < 5; ++i)
+            in.direct[i] = res[i];
+
+        if (in.indirect >= 0 && in.indirect < s.data_blocks) {
+            if (nblocks <= 5) {
+                /* indirect block no longer needed */
+                operate_bitmap(fs, BMP_DATA, in.indirect, 0);
+                in.indirect = INVALID;
+            } else {
+                /* keep the first nblocks - 5 indirect pointers */
+                char buf[BLOCKSIZE];
+                memset(buf, 0xff, BLOCKSIZE);
+                memcpy(buf, res + 5, (nblocks - 5) * sizeof(uint32_t));
+                ret = bwrite(fs,
+                                  data_block(&s, in.indirect), (void *)buf);
                 if (ret == -1) return -1;
             }
         }
-    } else {
-        in.indirect = INVALID;
+
+        in.size = size;
+        /* Update inode on disk */
+        ret = write_inode_to_disk(fs, inumber, &in);
+        invalidate_handles(fs, inumber, -1);
+        if (ret == -1) return -1;
+    }
+    return 0;
+}
+
+/* Truncates the file to specified size.
+   Returns 0 on success and -1 on error
+*/
+int do_fit_to_size(sfs_fs *fs, int inumber, int size) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    txn_begin(fs);
+    inode_wrlock(fs, inumber);
+    int ret = truncate_inode(fs, inumber, size);
+    inode_unlock(fs, inumber);
+    txn_end(fs);
+    return ret;
+}
+
+/* Initialises to an invalid inode */
+void initialise_inode(inode *in) {
+    in->valid = 1;
+    in->size = 0;
+    in->direct[0] = in->direct[1] = in->direct[2] = INVALID;
+    in->direct[3] = in->direct[4] = INVALID;
+    in->indirect = INVALID;
+}
+
+/* Initialises n freshly allocated inodes (in ascending order) as empty
+   files. Every inode table block is read and written once.
+   Return -1 on error
+*/
+int init_inodes(sfs_fs *fs, super_block *s, uint32_t *inumbers, int n) {
+    int per_block = BLOCKSIZE / sizeof(inode);
+    char buf[BLOCKSIZE];
+    int ret;
+
+    for (int i = 0; i < n;) {
+        int b = inumbers[i] / per_block;
+        pthread_mutex_lock(itable_lock(fs, b));
+        ret = bread(fs, itable_block(s, b), (void *)buf);
+        for (; ret != -1 && i < n && inumbers[i] / per_block == b; ++i) {
+            inode in;
+            initialise_inode(&in);
+            memcpy(buf + (inumbers[i] % per_block) * sizeof(inode), &in,
+                   sizeof(inode));
+        }
+        if (ret != -1)
+            ret = bwrite(fs, itable_block(s, b), (void *)buf);
+        pthread_mutex_unlock(itable_lock(fs, b));
+        if (ret == -1) return -1;
+    }
+    return 0;
+}
+
+/* Path component iterator. Returns the next component of the path pointed to
+   by *path (NULL if there are none left) and stores its length. *path is
+   advanced past the component. The path is neither copied nor modified.
+*/
+const char *next_component(const char **path, int *length) {
+    const char *p = *path;
+    while (*p == '/')
+        p++;
+    if (*p == '\0') {
+        *path = p;
+        return NULL;
+    }
+
+    const char *start = p;
+    while (*p != '/' && *p != '\0')
+        p++;
+    *length = p - start;
+    *path = p;
+    return start;
+}
+
+/* Returns 1 if no components are left in the rest of a path */
+int is_last_component(const char *rest) {
+    while (*rest == '/')
+        rest++;
+    return *rest == '\0';
+}
+
+/* bytes taken in a directory block by an entry whose name has length bytes:
+   its slot, the inode no and the name */
+#define DIRENT_SPACE(length)                                                   \
+    (sizeof(dirent_slot) + sizeof(uint32_t) + (length))
+/* no of entries in a directory index block */
+#define DX_LIMIT ((BLOCKSIZE - sizeof(dx_header)) / sizeof(dx_entry))
+/* leaves built when indexing a directory are left partly empty (bytes) */
+#define DX_FILL (BLOCKSIZE * 3 / 4)
+
+/* A directory entry in memory. name points into a directory block or into a
+   caller supplied string and is not NUL terminated
+*/
+typedef struct dir_entry {
+    uint32_t hash;    // name_hash of the name
+    uint32_t inumber; // inode no of the directory / file
+    int type;         // directory or file
+    int length;       // length of the name
+    const char *name; // the name
+} dir_entry;
+
+/* Fills e with name (of given length) */
+void make_entry(dir_entry *e, const char *name, int length, int type,
+                uint32_t inumber) {
+    e->hash = name_hash(name, length);
+    e->inumber = inumber;
+    e->type = type;
+    e->length = length;
+    e->name = name;
+}
+
+dirent_slot *db_slots(char *block) {
+    return (dirent_slot *)(block + sizeof(dirent_block));
+}
+
+/* Initialises an empty directory block */
+void db_init(char *block) {
+    memset(block, 0, BLOCKSIZE);
+    ((dirent_block *)block)->names = BLOCKSIZE;
+}
+
+/* Fills e from slot i of a directory block */
+void db_entry(char *block, int i, dir_entry *e) {
+    dirent_slot *s = &db_slots(block)[i];
+    e->hash = s->hash;
+    e->type = s->type;
+    e->length = s->length;
+    memcpy(&e->inumber, block + s->offset, sizeof(uint32_t));
+    e->name = block + s->offset + sizeof(uint32_t);
+}
+
+/* Returns 1 if the record of slot s in a directory block holds name */
+int db_name_is(char *block, dirent_slot *s, const char *name, int length) {
+    return memcmp(block + s->offset + sizeof(uint32_t), name, length) == 0;
+}
+
+/* db_find one slot at a time */
+int db_find_scalar(char *block, uint32_t hash, const char *name, int length,
+                   int type) {
+    dirent_block *b = (dirent_block *)block;
+    dirent_slot *s = db_slots(block);
+    for (int i = 0; i < b->count; ++i) {
+        if (s[i].hash == hash && s[i].length == length && s[i].type == type &&
+            db_name_is(block, &s[i], name, length))
+            return i;
+    }
+    return -1;
+}
+
+/* Returns the slot of name (of type type, hash hash) in a directory block or
+   -1 if not present. The hashes of eight slots are compared at once, the
+   rest of a slot and the name are only compared for candidates
+*/
+int db_find(char *block, uint32_t hash, const char *name, int length,
+            int type) {
+#ifdef __SSE2__
+    dirent_block *b = (dirent_block *)block;
+    dirent_slot *s = db_slots(block);
+    __m128i key = _mm_set1_epi32(hash);
+
+    int i = 0;
+    for (; i + 8 <= b->count; i += 8) {
+        /* Gather the hashes (first word of each slot) of slots i..i+7 */
+        __m128 s0 = _mm_loadu_ps((float *)(s + i));
+        __m128 s1 = _mm_loadu_ps((float *)(s + i + 2));
+        __m128 s2 = _mm_loadu_ps((float *)(s + i + 4));
+        __m128 s3 = _mm_loadu_ps((float *)(s + i + 6));
+        __m128i h0 = _mm_castps_si128(_mm_shuffle_ps(s0, s1, 0x88));
+        __m128i h1 = _mm_castps_si128(_mm_shuffle_ps(s2, s3, 0x88));
+        uint32_t bits =
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(h0, key))) |
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(h1, key))) << 4;
+
+        for (; bits != 0; bits &= bits - 1) {
+            dirent_slot *c = &s[i + __builtin_ctz(bits)];
+            if (c->length == length && c->type == type &&
+                db_name_is(block, c, name, length))
+                return c - s;
+        }
+    }
+    for (; i < b->count; ++i) {
+        if (s[i].hash == hash && s[i].length == length && s[i].type == type &&
+            db_name_is(block, &s[i], name, length))
+            return i;
+    }
+    return -1;
+#else
+    return db_find_scalar(block, hash, name, length, type);
+#endif
+}
+
+/* Moves the records of a directory block together against its end,
+   reclaiming the space left by removed entries. Slots keep their positions
+*/
+void db_repack(char *block) {
+    dirent_block *b = (dirent_block *)block;
+    dirent_slot *s = db_slots(block);
+    char copy[BLOCKSIZE];
+    memcpy(copy, block, BLOCKSIZE);
+
+    int names = BLOCKSIZE;
+    for (int i = 0; i < b->count; ++i) {
+        if (s[i].length == 0) continue;
+        int size = sizeof(uint32_t) + s[i].length;
+        names -= size;
+        memcpy(block + names, copy + s[i].offset, size);
+        s[i].offset = names;
+    }
+    b->names = names;
+}
+
+/* Adds e to a directory block, reusing the slot of a removed entry if any.
+   Return -1 if it does not fit
+*/
+int db_insert(char *block, dir_entry *e) {
+    dirent_block *b = (dirent_block *)block;
+    dirent_slot *s = db_slots(block);
+    int i = 0;
+    while (i < b->count && s[i].length != 0)
+        i++;
+
+    int slots_end =
+        sizeof(dirent_block) + get_max(b->count, i + 1) * sizeof(dirent_slot);
+    int size = sizeof(uint32_t) + e->length;
+    if (slots_end + b->used + size > BLOCKSIZE) return -1;
+    if (slots_end + size > b->names) db_repack(block);
+
+    b->names -= size;
+    memcpy(block + b->names, &e->inumber, sizeof(uint32_t));
+    memcpy(block + b->names + sizeof(uint32_t), e->name, e->length);
+    s[i].hash = e->hash;
+    s[i].offset = b->names;
+    s[i].length = e->length;
+    s[i].type = e->type;
+    if (i == b->count) b->count++;
+    b->live++;
+    b->used += size;
+    return 0;
+}
+
+/* Removes the entry in slot i of a directory block */
+void db_remove(char *block, int i) {
+    dirent_block *b = (dirent_block *)block;
+    dirent_slot *s = db_slots(block);
+    int size = sizeof(uint32_t) + s[i].length;
+    if (s[i].offset == b->names) b->names += size;
+    s[i].length = 0;
+    b->live--;
+    b->used -= size;
+
+    /* Trailing removed slots are dropped */
+    while (b->count > 0 && s[b->count - 1].length == 0)
+        b->count--;
+    if (b->live == 0) b->names = BLOCKSIZE;
+}
+
+/* Returns the bytes taken by the live entries of a directory block */
+int db_size(char *block) {
+    dirent_block *b = (dirent_block *)block;
+    return sizeof(dirent_block) + b->live * sizeof(dirent_slot) + b->used;
+}
+
+/* Returns 1 if a directory block is an index root or interior node. The
+   first word of a directory block (count and names) never matches a magic
+*/
+int db_is_index(char *block) {
+    uint32_t magic = ((dx_header *)block)->magic;
+    return magic == DX_ROOT_MAGIC || magic == DX_NODE_MAGIC;
+}
+
+int load_handle(sfs_fs *fs, file_handle *h);
+void compact_enqueue(sfs_fs *fs, uint32_t dir);
+
+/* Opens directory inumber for internal use. Return -1 on error */
+int dir_open(sfs_fs *fs, uint32_t inumber, file_handle *h) {
+    h->used = 0;
+    h->inumber = inumber;
+    h->pos = 0;
+    return load_handle(fs, h);
+}
+
+/* Reads block lb of an open directory */
+int dir_read_block(sfs_fs *fs, file_handle *h, int lb, char *buf) {
+    if (lb < 0 || lb >= 1029 || h->blocks[lb] == INVALID) return -1;
+    return bread(fs, data_block(&h->s, h->blocks[lb]),
+                      (void *)buf);
+}
+
+/* Writes block lb of an open directory */
+int dir_write_block(sfs_fs *fs, file_handle *h, int lb, char *buf) {
+    if (lb < 0 || lb >= 1029 || h->blocks[lb] == INVALID) return -1;
+    return bwrite(fs, data_block(&h->s, h->blocks[lb]),
+                       (void *)buf);
+}
+
+/* Appends a block to an open (indexed) directory. Returns its block no or -1
+   on error */
+int dir_append_block(sfs_fs *fs, file_handle *h, char *buf) {
+    int lb = h->in.size / BLOCKSIZE;
+    int ret = write_mapped(fs, &h->s, h->inumber, &h->in,
+                           h->blocks, buf, BLOCKSIZE, lb * BLOCKSIZE, 1);
+    invalidate_handles(fs, h->inumber, -1);
+    if (ret != BLOCKSIZE) return -1;
+    return lb;
+}
+
+/* Returns the whole content of a directory. The caller frees it */
+char *dir_contents(sfs_fs *fs, file_handle *h) {
+    char *content = (char *)malloc(h->in.size + 1);
+    int ret = read_mapped(fs, &h->s, &h->in, h->blocks, content,
+                          h->in.size, 0);
+    if (ret == -1) {
+        free(content);
+        return NULL;
+    }
+    return content;
+}
+
+dx_entry *dx_entries(dx_header *hdr) { return (dx_entry *)(hdr + 1); }
+
+/* Returns the position of the last entry of an index block covering hash */
+int dx_search(dx_header *hdr, uint32_t hash) {
+    dx_entry *e = dx_entries(hdr);
+    int lo = 0, hi = hdr->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (e[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Walks the index of a directory (root block in root) down to the leaf
+   covering hash. The index blocks and positions walked through are stored in
+   path_lb / path_pos and their no in depth. If bound is not NULL it is set to
+   the hash (exclusive) up to which the leaf covers. Returns the leaf block no
+   or -1
+*/
+int dx_find_leaf(sfs_fs *fs, file_handle *h, char *root, uint32_t hash, int *path_lb,
+                 int *path_pos, int *depth, uint64_t *bound) {
+    dx_header *r = (dx_header *)root;
+    int pos = dx_search(r, hash);
+    path_lb[0] = 0;
+    path_pos[0] = pos;
+    *depth = 1;
+    int lb = dx_entries(r)[pos].block;
+    uint64_t upper = pos + 1 < r->count ? dx_entries(r)[pos + 1].hash
+                                        : (uint64_t)UINT32_MAX + 1;
+
+    if (r->levels == 1) {
+        char buf[BLOCKSIZE];
+        if (dir_read_block(fs, h, lb, buf) == -1) return -1;
+        dx_header *node = (dx_header *)buf;
+        if (node->magic != DX_NODE_MAGIC) return -1;
+        pos = dx_search(node, hash);
+        path_lb[1] = lb;
+        path_pos[1] = pos;
+        *depth = 2;
+        lb = dx_entries(node)[pos].block;
+        if (pos + 1 < node->count) upper = dx_entries(node)[pos + 1].hash;
+    }
+    if (bound != NULL) *bound = upper;
+    return lb;
+}
+
+/* Looks up name in an indexed directory. Returns the inode no or INVALID */
+uint32_t dx_lookup(sfs_fs *fs, file_handle *h, char *root, const char *name, int length,
+                   int type) {
+    int path_lb[2], path_pos[2], depth;
+    uint32_t hash = name_hash(name, length);
+    int lb = dx_find_leaf(fs, h, root, hash, path_lb, path_pos, &depth, NULL);
+    char buf[BLOCKSIZE];
+    if (lb == -1 || dir_read_block(fs, h, lb, buf) == -1) return INVALID;
+
+    int i = db_find(buf, hash, name, length, type);
+    if (i == -1) return INVALID;
+    dir_entry e;
+    db_entry(buf, i, &e);
+    return e.inumber;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int compare_dir_entry(const void *a, const void *b) {
+    uint32_t x = ((dir_entry *)a)->hash, y = ((dir_entry *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/* Returns the index splitting n entries into two halves taking about the
+   same space
+*/
+int dx_space_mid(dir_entry *items, int n) {
+    int total = 0, sum = 0, mid = 0;
+    for (int i = 0; i < n; ++i)
+        total += DIRENT_SPACE(items[i].length);
+    while (mid < n - 1 && (sum + DIRENT_SPACE(items[mid].length)) * 2 <= total)
+        sum += DIRENT_SPACE(items[mid++].length);
+    return get_max(mid, 1);
+}
+
+/* Returns where to split n hash sorted entries near index mid so that equal
+   hashes stay together. Returns -1 if all hashes are equal
+*/
+int dx_split_point(dir_entry *items, int n, int mid) {
+    int p = mid;
+    while (p < n && items[p].hash == items[p - 1].hash)
+        p++;
+    if (p < n) return p;
+    p = mid;
+    while (p > 0 && items[p].hash == items[p - 1].hash)
+        p--;
+    return p > 0 ? p : -1;
+}
+
+/* Inserts (hash, block) at position pos of an index block which has room */
+void dx_insert_at(dx_header *hdr, int pos, uint32_t hash, uint32_t block) {
+    dx_entry *e = dx_entries(hdr);
+    memmove(e + pos + 1, e + pos, (hdr->count - pos) * sizeof(dx_entry));
+    e[pos].hash = hash;
+    e[pos].block = block;
+    hdr->count++;
+}
+
+/* Splits a full index block after inserting (hash, block) at pos. The upper
+   half is moved into the node block upper. Returns the first hash of upper
+*/
+uint32_t dx_split_block(dx_header *full, int pos, uint32_t hash,
+                        uint32_t block, char *upper) {
+    dx_entry all[DX_LIMIT + 1];
+    dx_entry *e = dx_entries(full);
+    int n = full->count;
+    memcpy(all, e, pos * sizeof(dx_entry));
+    all[pos].hash = hash;
+    all[pos].block = block;
+    memcpy(all + pos + 1, e + pos, (n - pos) * sizeof(dx_entry));
+    n++;
+
+    int half = n / 2;
+    full->count = half;
+    memcpy(e, all, half * sizeof(dx_entry));
+
+    memset(upper, 0, BLOCKSIZE);
+    dx_header *u = (dx_header *)upper;
+    u->magic = DX_NODE_MAGIC;
+    u->levels = 0;
+    u->limit = DX_LIMIT;
+    u->count = n - half;
+    memcpy(dx_entries(u), all + half, (n - half) * sizeof(dx_entry));
+    return all[half].hash;
+}
+
+/* Adds the index entry (hash, block) after the path walked by dx_find_leaf,
+   splitting index blocks as needed. Return -1 on error or if the index is
+   full
+*/
+int dx_insert(sfs_fs *fs, file_handle *h, char *root, int *path_lb, int *path_pos,
+              int depth, uint32_t hash, uint32_t block) {
+    dx_header *r = (dx_header *)root;
+    char buf[BLOCKSIZE], upper[BLOCKSIZE];
+
+    if (depth == 2) {
+        /* Insert into the interior node */
+        if (dir_read_block(fs, h, path_lb[1], buf) == -1) return -1;
+        dx_header *node = (dx_header *)buf;
+        if (node->count < node->limit) {
+            dx_insert_at(node, path_pos[1] + 1, hash, block);
+            return dir_write_block(fs, h, path_lb[1], buf);
+        }
+
+        /* Node full, split it and add the new node to the root */
+        if (r->count >= r->limit) return -1;
+        uint32_t split = dx_split_block(node, path_pos[1] + 1, hash, block,
+                                        upper);
+        int ub = dir_append_block(fs, h, upper);
+        if (ub == -1) return -1;
+        if (dir_write_block(fs, h, path_lb[1], buf) == -1) return -1;
+        dx_insert_at(r, path_pos[0] + 1, split, ub);
+        return dir_write_block(fs, h, 0, root);
+    }
+
+    if (r->count < r->limit) {
+        dx_insert_at(r, path_pos[0] + 1, hash, block);
+        return dir_write_block(fs, h, 0, root);
+    }
+
+    /* Root full, move its entries into two new interior nodes */
+    uint32_t split = dx_split_block(r, path_pos[0] + 1, hash, block, upper);
+    memset(buf, 0, BLOCKSIZE);
+    dx_header *lower = (dx_header *)buf;
+    memcpy(buf, upper, sizeof(dx_header));
+    lower->count = r->count;
+    memcpy(dx_entries(lower), dx_entries(r), r->count * sizeof(dx_entry));
+
+    int lb = dir_append_block(fs, h, buf);
+    if (lb == -1) return -1;
+    int ub = dir_append_block(fs, h, upper);
+    if (ub == -1) return -1;
+
+    r->levels = 1;
+    r->count = 0;
+    dx_insert_at(r, 0, 0, lb);
+    dx_insert_at(r, 1, split, ub);
+    return dir_write_block(fs, h, 0, root);
+}
+
+/* Adds entry to an indexed directory. Return -1 on error */
+int dx_add(sfs_fs *fs, file_handle *h, char *root, dir_entry *entry) {
+    int path_lb[2], path_pos[2], depth;
+    int lb = dx_find_leaf(fs, h, root, entry->hash, path_lb, path_pos, &depth,
+                          NULL);
+    char buf[BLOCKSIZE];
+    if (lb == -1 || dir_read_block(fs, h, lb, buf) == -1) return -1;
+
+    /* Use the free space of the leaf if any */
+    if (db_insert(buf, entry) == 0) return dir_write_block(fs, h, lb, buf);
+
+    /* Leaf full, split it by hash */
+    int count = ((dirent_block *)buf)->count;
+    dir_entry *all = (dir_entry *)malloc(sizeof(dir_entry) * (count + 1));
+    int n = 0;
+    for (int i = 0; i < count; ++i)
+        if (db_slots(buf)[i].length != 0) db_entry(buf, i, &all[n++]);
+    all[n++] = *entry;
+    qsort(all, n, sizeof(dir_entry), compare_dir_entry);
+
+    int split = dx_split_point(all, n, dx_space_mid(all, n));
+    char lower[BLOCKSIZE], upper[BLOCKSIZE];
+    db_init(lower);
+    db_init(upper);
+    int ret = split == -1 ? -1 : 0;
+    for (int i = 0; i < n && ret != -1; ++i)
+        ret = db_insert(i < split ? lower : upper, &all[i]);
+    uint32_t split_hash = ret == -1 ? 0 : all[split].hash;
+    free(all);
+    if (ret == -1) return -1;
+
+    int ub = dir_append_block(fs, h, upper);
+    if (ub == -1) return -1;
+    if (dir_write_block(fs, h, lb, lower) == -1) return -1;
+
+    return dx_insert(fs, h, root, path_lb, path_pos, depth, split_hash, ub);
+}
+
+/* Converts a linear directory (content of nblocks blocks) plus nextra extra
+   entries into an indexed directory. Return -1 on error or if the directory
+   is too large to be indexed
+*/
+int dx_build(sfs_fs *fs, file_handle *h, char *content, int nblocks, dir_entry *extra,
+             int nextra) {
+    int slots = nextra;
+    for (int b = 0; b < nblocks; ++b)
+        slots += ((dirent_block *)(content + b * BLOCKSIZE))->count;
+
+    dir_entry *all = (dir_entry *)malloc(sizeof(dir_entry) * (slots + 1));
+    int n = 0;
+    for (int b = 0; b < nblocks; ++b) {
+        char *block = content + b * BLOCKSIZE;
+        for (int i = 0; i < ((dirent_block *)block)->count; ++i)
+            if (db_slots(block)[i].length != 0) db_entry(block, i, &all[n++]);
+    }
+    for (int i = 0; i < nextra; ++i)
+        all[n++] = extra[i];
+    qsort(all, n, sizeof(dir_entry), compare_dir_entry);
+
+    /* Split into leaves, filling each to DX_FILL */
+    int *starts = (int *)malloc(sizeof(int) * (n + 2));
+    int nleaves = 0, i = 0;
+    do {
+        int end = i, space = sizeof(dirent_block);
+        while (end < n && (end == i || space + DIRENT_SPACE(all[end].length) <=
+                                           DX_FILL))
+            space += DIRENT_SPACE(all[end++].length);
+        while (end < n && all[end].hash == all[end - 1].hash)
+            space += DIRENT_SPACE(all[end++].length);
+        if (space > BLOCKSIZE || nleaves >= 1029) {
+            free(starts);
+            free(all);
+            return -1;
+        }
+        starts[nleaves++] = i;
+        i = end;
+    } while (i < n);
+    starts[nleaves] = n;
+
+    /* Leaves beyond what the root holds get a level of interior nodes */
+    int per_node = DX_LIMIT * 3 / 4;
+    int nnodes = nleaves > DX_LIMIT ? (nleaves + per_node - 1) / per_node : 0;
+    int total = 1 + nnodes + nleaves;
+    if (nnodes > DX_LIMIT || total > 1029) {
+        free(starts);
+        free(all);
+        return -1;
+    }
+
+    int size = total * BLOCKSIZE;
+    char *image = (char *)calloc(total, BLOCKSIZE);
+    dx_header *r = (dx_header *)image;
+    r->magic = DX_ROOT_MAGIC;
+    r->levels = nnodes > 0 ? 1 : 0;
+    r->count = 0;
+    r->limit = DX_LIMIT;
+
+    for (int leaf = 0; leaf < nleaves; ++leaf) {
+        int first = starts[leaf], end = starts[leaf + 1];
+        uint32_t hash = leaf == 0 ? 0 : all[first].hash;
+        int lb = 1 + nnodes + leaf;
+        if (nnodes == 0) {
+            dx_insert_at(r, leaf, hash, lb);
+        } else {
+            int node = leaf / per_node;
+            dx_header *nh = (dx_header *)(image + (1 + node) * BLOCKSIZE);
+            if (leaf % per_node == 0) {
+                nh->magic = DX_NODE_MAGIC;
+                nh->limit = DX_LIMIT;
+                dx_insert_at(r, node, hash, 1 + node);
+            }
+            dx_insert_at(nh, nh->count, hash, lb);
+        }
+        char *leaf_block = image + lb * BLOCKSIZE;
+        db_init(leaf_block);
+        for (int j = first; j < end; ++j)
+            db_insert(leaf_block, &all[j]);
+    }
+    free(starts);
+    free(all);
+
+    int old_size = h->in.size;
+    int ret = write_mapped(fs, &h->s, h->inumber, &h->in,
+                           h->blocks, image, size, 0, 1);
+    free(image);
+    if (ret != size) return -1;
+    if (old_size > size) return truncate_inode(fs, h->inumber, size);
+    invalidate_handles(fs, h->inumber, -1);
+    return 0;
+}
+
+/* Looks up name (of type type) in directory dir. Returns the inode no or
+   INVALID if not present
+*/
+uint32_t dir_lookup(sfs_fs *fs, uint32_t dir, const char *name, int length, int type) {
+    file_handle h;
+    char buf[BLOCKSIZE];
+    if (dir_open(fs, dir, &h) == -1 || h.in.size == 0) return INVALID;
+    if (dir_read_block(fs, &h, 0, buf) == -1) return INVALID;
+
+    if (((dx_header *)buf)->magic == DX_ROOT_MAGIC)
+        return dx_lookup(fs, &h, buf, name, length, type);
+
+    /* Linear directory, search it block by block */
+    uint32_t hash = name_hash(name, length);
+    int nblocks = h.in.size / BLOCKSIZE;
+    for (int lb = 0; lb < nblocks; ++lb) {
+        if (lb > 0 && dir_read_block(fs, &h, lb, buf) == -1) return INVALID;
+        int i = db_find(buf, hash, name, length, type);
+        if (i != -1) {
+            dir_entry e;
+            db_entry(buf, i, &e);
+            return e.inumber;
+        }
+    }
+    return INVALID;
+}
+
+/* Adds entry to directory dir. Linear directories growing past DX_THRESHOLD
+   blocks are converted to indexed ones. Return -1 on error
+*/
+int dir_add(sfs_fs *fs, uint32_t dir, dir_entry *entry) {
+    file_handle h;
+    char buf[BLOCKSIZE];
+    if (dir_open(fs, dir, &h) == -1) return -1;
+
+    if (h.in.size > 0) {
+        if (dir_read_block(fs, &h, 0, buf) == -1) return -1;
+        if (((dx_header *)buf)->magic == DX_ROOT_MAGIC)
+            return dx_add(fs, &h, buf, entry);
+
+        /* Use the free space of a block if any */
+        int nblocks = h.in.size / BLOCKSIZE;
+        for (int lb = 0; lb < nblocks; ++lb) {
+            if (lb > 0 && dir_read_block(fs, &h, lb, buf) == -1) return -1;
+            if (db_insert(buf, entry) == 0) {
+                int ret = dir_write_block(fs, &h, lb, buf);
+                invalidate_handles(fs, dir, -1);
+                return ret;
+            }
+        }
+
+        if (nblocks + 1 > DX_THRESHOLD) {
+            char *content = dir_contents(fs, &h);
+            if (content == NULL) return -1;
+            int ret = dx_build(fs, &h, content, nblocks, entry, 1);
+            free(content);
+            if (ret == 0) return 0;
+            /* Too large to index, keep appending linearly */
+            if (dir_open(fs, dir, &h) == -1) return -1;
+        }
+    }
+
+    db_init(buf);
+    db_insert(buf, entry);
+    int ret = write_mapped(fs, &h.s, dir, &h.in, h.blocks, buf,
+                           BLOCKSIZE, h.in.size, 1);
+    invalidate_handles(fs, dir, -1);
+    return ret == BLOCKSIZE ? 0 : -1;
+}
+
+/* Removes the entries named name (of type type) from directory dir. Entries
+   are removed within their block, which costs a single block write. The
+   directory is queued for compaction if it is left sparse.
+   Return -1 on error
+*/
+int dir_remove(sfs_fs *fs, uint32_t dir, const char *name, int length, int type) {
+    file_handle h;
+    char buf[BLOCKSIZE];
+    if (dir_open(fs, dir, &h) == -1) return -1;
+    if (h.in.size == 0) return 0;
+    if (dir_read_block(fs, &h, 0, buf) == -1) return -1;
+
+    uint32_t hash = name_hash(name, length);
+    int first = 0, last = h.in.size / BLOCKSIZE - 1;
+    if (((dx_header *)buf)->magic == DX_ROOT_MAGIC) {
+        /* Only the leaf covering the hash */
+        int path_lb[2], path_pos[2], depth;
+        first = last = dx_find_leaf(fs, &h, buf, hash, path_lb, path_pos, &depth,
+                                    NULL);
+        if (first == -1 || dir_read_block(fs, &h, first, buf) == -1) return -1;
+    }
+
+    for (int lb = first; lb <= last; ++lb) {
+        if (lb > first && dir_read_block(fs, &h, lb, buf) == -1) return -1;
+        int i, found = 0;
+        while ((i = db_find(buf, hash, name, length, type)) != -1) {
+            db_remove(buf, i);
+            found = 1;
+        }
+        if (!found) continue;
+
+        if (dir_write_block(fs, &h, lb, buf) == -1) return -1;
+        invalidate_handles(fs, dir, -1);
+        if (db_size(buf) <= BLOCKSIZE / 4) compact_enqueue(fs, dir);
+    }
+    return 0;
+}
+
+/* Opens directory dir for streaming its entries. Return -1 on error */
+int dir_iter_open(sfs_fs *fs, uint32_t dir, dir_handle *dh) {
+    char buf[BLOCKSIZE];
+    if (dir_open(fs, dir, &dh->h) == -1) return -1;
+    dh->block = (char *)malloc(BLOCKSIZE);
+    dh->cached_lb = -1;
+    dh->indexed = 0;
+    if (dh->h.in.size > 0) {
+        if (dir_read_block(fs, &dh->h, 0, buf) == -1) {
+            free(dh->block);
+            return -1;
+        }
+        dh->indexed = ((dx_header *)buf)->magic == DX_ROOT_MAGIC;
+    }
+    /* Block 0 of an indexed directory is the index root */
+    dh->h.pos = dh->indexed ? BLOCKSIZE : 0;
+    return 0;
+}
+
+/* Releases an iterator opened by dir_iter_open */
+void dir_iter_close(dir_handle *dh) { free(dh->block); }
+
+/* Makes block lb of the directory the cached block of the iterator */
+int dir_iter_load(sfs_fs *fs, dir_handle *dh, int lb) {
+    if (dh->cached_lb == lb) return 0;
+    if (dir_read_block(fs, &dh->h, lb, dh->block) == -1) return -1;
+    dh->cached_lb = lb;
+    return 0;
+}
+
+/* Copies the next max (at most) valid entries of an open directory to
+   entries and advances past them. Directory blocks are read one at a time,
+   the cursor (h.pos) is the block no * BLOCKSIZE plus the slot no.
+   Returns the no of entries copied, 0 at the end and -1 on error
+*/
+int dir_iter_next(sfs_fs *fs, dir_handle *dh, sfs_dirent *entries, int max) {
+    file_handle *h = &dh->h;
+    if (h->stale) {
+        if (load_handle(fs, h) == -1) return -1;
+        dh->cached_lb = -1;
+    }
+
+    int n = 0;
+    while (n < max && h->pos < h->in.size) {
+        int lb = h->pos / BLOCKSIZE;
+        int slot = h->pos % BLOCKSIZE;
+        if (dir_iter_load(fs, dh, lb) == -1) return -1;
+
+        /* Skip index blocks and move on past the last slot */
+        if (db_is_index(dh->block) ||
+            slot >= ((dirent_block *)dh->block)->count) {
+            h->pos = (lb + 1) * BLOCKSIZE;
+            continue;
+        }
+        h->pos++;
+        if (db_slots(dh->block)[slot].length == 0) continue;
+
+        dir_entry e;
+        db_entry(dh->block, slot, &e);
+        sfs_dirent *d = &entries[n++];
+        d->inumber = e.inumber;
+        d->type = e.type;
+        d->length = e.length;
+        memcpy(d->name, e.name, e.length);
+        d->name[e.length] = '\0';
+    }
+    return n;
+}
+
+/* Fills the inode attributes of n entries, reading every inode table block
+   they live in only once. Return -1 on error
+*/
+int fill_dirent_attrs(sfs_fs *fs, super_block *s, sfs_dirent_plus *entries, int n) {
+    int per_block = BLOCKSIZE / sizeof(inode);
+    char buf[BLOCKSIZE];
+    int loaded = -1;
+
+    /* Visit the entries in inode order */
+    uint64_t order[n];
+    for (int i = 0; i < n; ++i)
+        order[i] = ((uint64_t)entries[i].entry.inumber << 32) | i;
+    qsort(order, n, sizeof(uint64_t), compare_u64);
+
+    for (int k = 0; k < n; ++k) {
+        int i = order[k] & 0xffffffff;
+        uint32_t inumber = entries[i].entry.inumber;
+        if (inumber >= s->inodes) return -1;
+        int b = inumber / per_block;
+        if (b != loaded) {
+            if (bread(fs, itable_block(s, b),
+                           (void *)buf) == -1)
+                return -1;
+            loaded = b;
+        }
+        entries[i].attr = *(inode *)(buf + (inumber % per_block) * sizeof(inode));
+    }
+    return 0;
+}
+
+/* Points the index entry referring to block from (in the root or an interior
+   node) at block to instead. Return -1 on error
+*/
+int dx_repoint(sfs_fs *fs, file_handle *h, char *root, uint32_t from, uint32_t to) {
+    dx_header *r = (dx_header *)root;
+    dx_entry *e = dx_entries(r);
+    for (int i = 0; i < r->count; ++i) {
+        if (e[i].block == from) {
+            e[i].block = to;
+            return dir_write_block(fs, h, 0, root);
+        }
+    }
+
+    if (r->levels == 1) {
+        char buf[BLOCKSIZE];
+        for (int i = 0; i < r->count; ++i) {
+            if (dir_read_block(fs, h, e[i].block, buf) == -1) return -1;
+            dx_header *node = (dx_header *)buf;
+            dx_entry *ne = dx_entries(node);
+            for (int j = 0; j < node->count; ++j) {
+                if (ne[j].block == from) {
+                    ne[j].block = to;
+                    return dir_write_block(fs, h, e[i].block, buf);
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+/* Releases block lb of an indexed directory by moving the last block of the
+   directory into its place and truncating the directory. Return -1 on error
+*/
+int dx_release_block(sfs_fs *fs, file_handle *h, int lb) {
+    char root[BLOCKSIZE], buf[BLOCKSIZE];
+    int last = h->in.size / BLOCKSIZE - 1;
+    if (lb != last) {
+        if (dir_read_block(fs, h, last, buf) == -1) return -1;
+        if (dir_write_block(fs, h, lb, buf) == -1) return -1;
+        if (dir_read_block(fs, h, 0, root) == -1) return -1;
+        if (dx_repoint(fs, h, root, last, lb) == -1) return -1;
+    }
+    return truncate_inode(fs, h->inumber, last * BLOCKSIZE);
+}
+
+/* Rewrites a directory as the nblocks (at most a linear directory worth)
+   linear blocks in content. Return -1 on error
+*/
+int dir_make_linear(sfs_fs *fs, file_handle *h, char *content, int nblocks) {
+    int size = nblocks * BLOCKSIZE;
+    if (size > 0) {
+        int ret = write_mapped(fs, &h->s, h->inumber, &h->in,
+                               h->blocks, content, size, 0, 1);
+        if (ret != size) return -1;
+    }
+    invalidate_handles(fs, h->inumber, -1);
+    return truncate_inode(fs, h->inumber, size);
+}
+
+/* One step of compaction of an indexed directory: merges a pair of adjacent
+   sparse leaves, or turns the directory back into a linear one once its
+   entries fit. Returns 1 if something was done, 0 if the directory is dense
+   and -1 on error
+*/
+int dx_compact_step(sfs_fs *fs, file_handle *h, char *root) {
+    dx_header *r = (dx_header *)root;
+    char ibuf[BLOCKSIZE], left[BLOCKSIZE], right[BLOCKSIZE];
+
+    /* Index blocks whose leaves are examined: the root or its nodes */
+    int nindex = r->levels == 1 ? r->count : 1;
+    for (int x = 0; x < nindex; ++x) {
+        int xlb = r->levels == 1 ? dx_entries(r)[x].block : 0;
+        if (xlb == 0)
+            memcpy(ibuf, root, BLOCKSIZE);
+        else if (dir_read_block(fs, h, xlb, ibuf) == -1)
+            return -1;
+        dx_header *hdr = (dx_header *)ibuf;
+        dx_entry *e = dx_entries(hdr);
+
+        int size_left = -1;
+        for (int p = 0; p < hdr->count; ++p) {
+            if (dir_read_block(fs, h, e[p].block, right) == -1) return -1;
+            int size = db_size(right);
+
+            /* A single leaf is a linear directory block */
+            if (r->levels == 0 && r->count == 1)
+                return dir_make_linear(fs, h, right, 1) == -1 ? -1 : 1;
+
+            if (size_left >= 0 &&
+                size_left + size - sizeof(dirent_block) <= DX_FILL) {
+                /* Merge this leaf into the previous one */
+                char merged[BLOCKSIZE];
+                db_init(merged);
+                for (int k = 0; k < 2; ++k) {
+                    char *block = k == 0 ? left : right;
+                    for (int i = 0; i < ((dirent_block *)block)->count; ++i) {
+                        if (db_slots(block)[i].length == 0) continue;
+                        dir_entry entry;
+                        db_entry(block, i, &entry);
+                        if (db_insert(merged, &entry) == -1) return -1;
+                    }
+                }
+                if (dir_write_block(fs, h, e[p - 1].block, merged) == -1)
+                    return -1;
+
+                uint32_t freed = e[p].block;
+                memmove(e + p, e + p + 1, (hdr->count - p - 1) * sizeof(dx_entry));
+                hdr->count--;
+                if (dir_write_block(fs, h, xlb, ibuf) == -1) return -1;
+                return dx_release_block(fs, h, freed) == -1 ? -1 : 1;
+            }
+
+            memcpy(left, right, BLOCKSIZE);
+            size_left = size;
+        }
+    }
+    return 0;
+}
+
+/* One step of compaction of directory dir. Returns 1 if something was done,
+   0 if the directory is dense and -1 on error
+*/
+int dir_compact_step(sfs_fs *fs, uint32_t dir) {
+    file_handle h;
+    char buf[BLOCKSIZE];
+    if (dir_open(fs, dir, &h) == -1) return -1;
+    if (h.in.size == 0) return 0;
+    if (dir_read_block(fs, &h, 0, buf) == -1) return -1;
+
+    if (((dx_header *)buf)->magic == DX_ROOT_MAGIC)
+        return dx_compact_step(fs, &h, buf);
+
+    /* Linear directory, pack the live entries into as few blocks as
+       possible without removed slots */
+    char *content = dir_contents(fs, &h);
+    if (content == NULL) return -1;
+    int nblocks = h.in.size / BLOCKSIZE;
+    /* Packing in order takes at most twice the blocks */
+    char *packed = (char *)malloc((2 * nblocks + 1) * BLOCKSIZE);
+    int n = 0, changed = 0;
+    db_init(packed);
+    for (int b = 0; b < nblocks; ++b) {
+        char *block = content + b * BLOCKSIZE;
+        for (int i = 0; i < ((dirent_block *)block)->count; ++i) {
+            if (db_slots(block)[i].length == 0) {
+                changed = 1;
+                continue;
+            }
+            dir_entry e;
+            db_entry(block, i, &e);
+            if (db_insert(packed + n * BLOCKSIZE, &e) == -1) {
+                db_init(packed + ++n * BLOCKSIZE);
+                db_insert(packed + n * BLOCKSIZE, &e);
+            }
+        }
+    }
+    /* The last block in use */
+    if (((dirent_block *)(packed + n * BLOCKSIZE))->count > 0) n++;
+
+    int ret = 0;
+    if ((changed || n < nblocks) && n <= nblocks)
+        ret = dir_make_linear(fs, &h, packed, n) == -1 ? -1 : 1;
+    free(packed);
+    free(content);
+    return ret;
+}
+
+/* Queues directory dir for compaction */
+void compact_enqueue(sfs_fs *fs, uint32_t dir) {
+    pthread_mutex_lock(&fs->compact_lock);
+    int i = 0;
+    while (i < fs->compact_queued && fs->compact_queue[i] != dir)
+        i++;
+    /* When full the directory is queued again by a later removal */
+    if (i == fs->compact_queued && fs->compact_queued < COMPACT_QUEUE_SIZE)
+        fs->compact_queue[fs->compact_queued++] = dir;
+    pthread_mutex_unlock(&fs->compact_lock);
+}
+
+/* Drops directory dir from the compaction queue */
+void compact_dequeue(sfs_fs *fs, uint32_t dir) {
+    pthread_mutex_lock(&fs->compact_lock);
+    for (int i = 0; i < fs->compact_queued; ++i) {
+        if (fs->compact_queue[i] == dir) {
+            fs->compact_queue[i] = fs->compact_queue[--fs->compact_queued];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->compact_lock);
+}
+
+/* Returns 1 if directory dir is queued for compaction */
+int compact_is_queued(sfs_fs *fs, uint32_t dir) {
+    int found = 0;
+    pthread_mutex_lock(&fs->compact_lock);
+    for (int i = 0; i < fs->compact_queued && !found; ++i)
+        found = fs->compact_queue[i] == dir;
+    pthread_mutex_unlock(&fs->compact_lock);
+    return found;
+}
+
+int dir_wrlock_live(sfs_fs *fs, uint32_t dir);
+
+/* Incremental compaction of directories left sparse by removals. Performs
+   at most max_steps steps, each bounded to a few block writes, and returns
+   the no of steps performed. 0 means every queued directory is dense.
+*/
+int do_compact_dirs(sfs_fs *fs, int max_steps) {
+    if (fs == NULL) return 0;
+
+    int steps = 0;
+    while (steps < max_steps) {
+        pthread_mutex_lock(&fs->compact_lock);
+        uint32_t dir = fs->compact_queued > 0 ? fs->compact_queue[0] : INVALID;
+        pthread_mutex_unlock(&fs->compact_lock);
+        if (dir == INVALID) break;
+
+        /* Removing a directory dequeues it, so once locked a directory still
+           queued has not been removed (and its inode reused) meanwhile */
+        int ret = 0;
+        txn_begin(fs);
+        if (dir_wrlock_live(fs, dir) == 0) {
+            if (compact_is_queued(fs, dir)) ret = dir_compact_step(fs, dir);
+            inode_unlock(fs, dir);
+        }
+        txn_end(fs);
+        if (ret == 1)
+            steps++;
+        else
+            compact_dequeue(fs, dir); // dense or gone
+    }
+    return steps;
+}
+
+/* Looks up name (of type type) in directory dir through the dentry cache.
+   Called with the lock of dir held. Returns the inode no or INVALID
+*/
+uint32_t lookup_child(sfs_fs *fs, uint32_t dir, const char *name, int length, int type) {
+    uint32_t inumber;
+    if (dcache_lookup(fs, dir, name, length, type, &inumber)) return inumber;
+    inumber = dir_lookup(fs, dir, name, length, type);
+    dcache_insert(fs, dir, name, length, type, inumber);
+    return inumber;
+}
+
+/* Converts a file/directory path to the corresponding inode */
+int do_name_to_inode(sfs_fs *fs, char *path, int type) {
+    const char *rest = path;
+    const char *name;
+    int length;
+
+    uint32_t inode_id = 0;
+
+    while ((name = next_component(&rest, &length)) != NULL) {
+        /* Check for file or directory depending on level
+        in last level need to find file and in other levels
+        need to find the intermediate directories
+        */
+        int check_type = type;
+        if (type == SFS_TYPE_F) {
+            check_type = is_last_component(rest) ? SFS_TYPE_F : SFS_TYPE_D;
+        }
+
+        uint32_t dir = inode_id;
+        inode_rdlock(fs, dir);
+        inode_id = lookup_child(fs, dir, name, length, check_type);
+        inode_unlock(fs, dir);
+
+        /* intermediate directory not found */
+        if (inode_id == INVALID) break;
+    }
+
+    /* After the walk, inode_id is the final inode */
+    return inode_id;
+}
+
+/* Returns 1 if directory dir is live, i.e. neither removed nor having its
+   subtree removed
+*/
+int dir_is_live(sfs_fs *fs, uint32_t dir) {
+    inode in;
+    return load_inode(fs, dir, &in) != -1 && in.valid == 1;
+}
+
+/* Write locks directory dir for adding or removing entries. Fails (with
+   the lock released) if dir is not live any more. Return -1 on error
+*/
+int dir_wrlock_live(sfs_fs *fs, uint32_t dir) {
+    inode_wrlock(fs, dir);
+    if (!dir_is_live(fs, dir)) {
+        inode_unlock(fs, dir);
+        return -1;
+    }
+    return 0;
+}
+
+/* Extracts and returns the parent path of the input path */
+char *get_parent_path(char *child_path) {
+    char *p = strrchr(child_path, '/');
+    char *parent_path = (char *)malloc(sizeof(char) * (p - child_path + 2));
+    strncpy(parent_path, child_path, p - child_path + 1);
+    if (p == child_path) {
+        parent_path[p - child_path + 1] = '\0';
+    } else {
+        parent_path[p - child_path] = '\0';
+    }
+    return parent_path;
+}
+
+/* Adds an empty file to parent directory.
+   Returns file inode no if successful and -1 for other errors.
+   If file already exists then also returns -1
+*/
+int add_file_to_directory(sfs_fs *fs, char *filepath) {
+    int ret;
+    char *parent_path = get_parent_path(filepath);
+    uint32_t parent_inode_no = name_to_inode(fs, parent_path, SFS_TYPE_D);
+    free(parent_path);
+    if (parent_inode_no == INVALID) return -1;
+
+    /* File already exists */
+    char *chldname = strrchr(filepath, '/') + 1;
+    int length = strlen(chldname);
+    if (length == 0 || length > MAX_FILENAME) return -1;
+    txn_begin(fs);
+    if (dir_wrlock_live(fs, parent_inode_no) == -1) {
+        txn_end(fs);
+        return -1;
+    }
+    if (lookup_child(fs, parent_inode_no, chldname, length, SFS_TYPE_F) !=
+        INVALID) {
+        inode_unlock(fs, parent_inode_no);
+        txn_end(fs);
+        return -1;
+    }
+
+    /*Parent exists - Create file and update parent*/
+    ret = new_inode(fs, parent_inode_no, SFS_TYPE_F);
+    if (ret == -1) {
+        inode_unlock(fs, parent_inode_no);
+        txn_end(fs);
+        return -1;
+    }
+    uint32_t inumber = ret;
+
+    /* Update parent */
+    dir_entry entry;
+    make_entry(&entry, chldname, length, SFS_TYPE_F, inumber);
+
+    ret = dir_add(fs, parent_inode_no, &entry);
+    if (ret == -1)
+        release_inode(fs, inumber);
+    else
+        dcache_insert(fs, parent_inode_no, chldname, length, SFS_TYPE_F, inumber);
+    inode_unlock(fs, parent_inode_no);
+    txn_end(fs);
+    if (ret == -1) return -1;
+
+    /* All ok return inode of newly added file */
+    return inumber;
+}
+
+/*Removes an item/file from the directory listing*/
+int remove_item_from_directory_file(sfs_fs *fs, int inumber, char *name, int type) {
+    dcache_invalidate(fs, inumber, name, strlen(name), type);
+    return dir_remove(fs, inumber, name, strlen(name), type);
+}
+
+/*  Function to create root directory. Sets inode 0 for the / directory
+    Returns 0 on success and -1 on error
+*/
+int create_root_directory(sfs_fs *fs) {
+    /* Root directory is always assigned inode 0 */
+
+    /* Fetch superblock and inode 0 */
+    int ret;
+    super_block s;
+    inode in;
+
+    s = fs->s;
+    txn_begin(fs);
+    ret = load_inode(fs, 0, &in);
+
+    /*Delete existing file*/
+    if (in.valid) {
+        fs_remove_file(fs, 0);
+    }
+
+    operate_bitmap(fs, BMP_INODES, 0, 1);
+    initialise_inode(&in);
+    dcache_flush(fs);
+    ret = write_inode_to_disk(fs, 0, &in);
+    txn_end(fs);
+
+    if (ret == -1) return -1;
+
+    /* All ok */
+    return 0;
+}
+
+/*  Read the file - length bytes starting from offset.
+    Returns no of bytes read from file
+*/
+int do_read_file(sfs_fs *fs, char *filepath, char *data, int length, int offset) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    uint32_t inumber = name_to_inode(fs, filepath, SFS_TYPE_F);
+    if (inumber == INVALID) return -1;
+    int ret = fs_read_i(fs, inumber, data, length, offset);
+    return ret;
+};
+
+/* Writes length bytes from data to the file specified (offset position onwards)
+   If file is not present, the file is created.
+   Return no of bytes writtent to file
+*/
+int do_write_file(sfs_fs *fs, char *filepath, char *data, int length, int offset) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    int ret;
+    /* creation and write go to the same transaction */
+    txn_begin(fs);
+    uint32_t inumber = name_to_inode(fs, filepath, SFS_TYPE_F);
+    if (inumber == INVALID) {
+        /* File does not exists, create an emtpy file*/
+        ret = add_file_to_directory(fs, filepath);
+        /* unless another thread created it meanwhile */
+        if (ret == -1) ret = name_to_inode(fs, filepath, SFS_TYPE_F);
+        if (ret == -1) {
+            txn_end(fs);
+            return -1;
+        }
+        inumber = ret;
+    }
+    ret = fs_write_i(fs, inumber, data, length, offset);
+    txn_end(fs);
+    return ret;
+};
+
+/*  Creates the directory (other than root directory).
+    To create root directory internal function create_root_directory(fs) (which
+    is called after mounting) should be used.
+    Only adds the directory if the immediate parent directory is present.
+    Return -1 on errors, otherwise returns inode  number of directory
+    created
+*/
+int do_create_dir(sfs_fs *fs, char *dirpath) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    int c, ret;
+    /* Update parent directory and create empty file */
+    char *parent_path = get_parent_path(dirpath);
+
+    if (strcmp(dirpath, "/") == 0) {
+        /* This function should not be used to create root directory,
+           create_root_directory(fs) function should be used, which is called
+           in mount() funtion.
+        */
+        free(parent_path);
+        return -1;
+    } else {
+        int parent_inode_no = name_to_inode(fs, parent_path, SFS_TYPE_D);
+        if (parent_inode_no == INVALID) {
+            /* Didnot find parent directory */
+            free(parent_path);
+            return -1;
+        }
+        char *chldname = strrchr(dirpath, '/') + 1;
+        int length = strlen(chldname);
+        if (length == 0 || length > MAX_FILENAME) {
+            free(parent_path);
+            return -1;
+        }
+        txn_begin(fs);
+        if (dir_wrlock_live(fs, parent_inode_no) == -1) {
+            txn_end(fs);
+            free(parent_path);
+            return -1;
+        }
+        int child_inode_no = new_inode(fs, parent_inode_no, SFS_TYPE_D);
+        if (child_inode_no == -1) {
+            inode_unlock(fs, parent_inode_no);
+            txn_end(fs);
+            free(parent_path);
+            return -1;
+        }
+        /* Add directory entry to the file */
+        dir_entry entry;
+        make_entry(&entry, chldname, length, SFS_TYPE_D, child_inode_no);
+
+        ret = dir_add(fs, parent_inode_no, &entry);
+        if (ret == -1)
+            release_inode(fs, child_inode_no);
+        else
+            dcache_invalidate(fs, parent_inode_no, chldname, length, SFS_TYPE_D);
+        inode_unlock(fs, parent_inode_no);
+        txn_end(fs);
+
+        free(parent_path);
+        if (ret == -1)
+            return INVALID;
+        else
+            return child_inode_no;
+    }
+
+    return ret;
+}
+
+/* no of inodes gathered by a subtree delete before they are freed */
+#define DELETE_BATCH 4096
+/* no of inode table blocks whose inodes are freed in one transaction */
+#define DELETE_STEP 4
+
+/* A subtree delete (see remove_tree). Directories waiting to be walked are
+   kept on a stack, the inodes found are freed in batches
+*/
+typedef struct delete_state {
+    sfs_fs *fs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t *dirs;    // directories waiting to be walked
+    int ndirs;         // no of waiting directories
+    int dirs_cap;      // capacity of dirs
+    int busy;          // no of directories being walked
+    uint32_t *inodes;  // inodes gathered for freeing
+    int ninodes;       // no of gathered inodes
+    int error;         // set on the first error
+} delete_state;
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Clears the bits of the n inodes / data blocks (kind BMP_*) in bits
+   (sorted). Every bitmap block is read and written once. Return -1 on error
+*/
+int clear_bitmap_bits(sfs_fs *fs, int kind, uint32_t *bits, int n) {
+    char buf[BLOCKSIZE];
+    uint32_t span = group_span(&fs->s, kind);
+    int per_block = 8 * BLOCKSIZE;
+    for (int i = 0; i < n;) {
+        uint32_t g = bits[i] / span;
+        int b = bits[i] % span / per_block;
+        int block = bitmap_start(&fs->s, kind, g) + b;
+        int freed = 0;
+        pthread_mutex_lock(bitmap_lock(fs, kind, g));
+        int ret = bread(fs, block, (void *)buf);
+        for (; ret != -1 && i < n && bits[i] / span == g &&
+               bits[i] % span / per_block == b;
+             ++i) {
+            int bit = bits[i] % span % per_block;
+            if (buf[bit / 8] & (1 << (7 - bit % 8))) freed++;
+            buf[bit / 8] &= ~(1 << (7 - bit % 8));
+            if (kind == BMP_DATA) brevoke(fs, data_block(&fs->s, bits[i]));
+        }
+        if (ret != -1) ret = bwrite(fs, block, (void *)buf);
+        __atomic_add_fetch(&fs->groups[g].free[kind], freed, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(bitmap_lock(fs, kind, g));
+        if (ret == -1) return -1;
+    }
+    return 0;
+}
+
+/* Frees n inodes along with their data blocks. Every inode table block and
+   bitmap block involved is read and written once. The inodes are write
+   locked while they are freed. Return -1 on error
+*/
+int free_inodes(sfs_fs *fs, super_block *s, uint32_t *inodes, int n) {
+    int per_block = BLOCKSIZE / sizeof(inode);
+    char buf[BLOCKSIZE];
+    int nblocks = 0, cap = 1030, ret = 0;
+    uint32_t *blocks = (uint32_t *)malloc(sizeof(uint32_t) * cap);
+
+    qsort(inodes, n, sizeof(uint32_t), compare_u32);
+    inode_wrlock_set(fs, inodes, n, 1);
+    for (int i = 0; i < n && ret != -1;) {
+        int b = inodes[i] / per_block;
+        pthread_mutex_lock(itable_lock(fs, b));
+        ret = bread(fs, itable_block(s, b), (void *)buf);
+        for (; ret != -1 && i < n && inodes[i] / per_block == b; ++i) {
+            inode *in = (inode *)(buf + (inodes[i] % per_block) * sizeof(inode));
+            if (!in->valid) continue;
+
+            /* Gather the data blocks and the indirect block */
+            if (nblocks + 1030 > cap) {
+                cap = 2 * cap + 1030;
+                blocks = (uint32_t *)realloc(blocks, sizeof(uint32_t) * cap);
+            }
+            ret = map_data_blocks(fs, s, in, blocks + nblocks);
+            while (nblocks < cap && blocks[nblocks] != INVALID)
+                nblocks++;
+            if (in->indirect < s->data_blocks) blocks[nblocks++] = in->indirect;
+            in->valid = 0;
+        }
+        if (ret != -1)
+            ret = bwrite(fs, itable_block(s, b),
+                              (void *)buf);
+        pthread_mutex_unlock(itable_lock(fs, b));
+    }
+
+    qsort(blocks, nblocks, sizeof(uint32_t), compare_u32);
+    if (ret != -1)
+        ret = clear_bitmap_bits(fs, BMP_INODES, inodes, n);
+    if (ret != -1)
+        ret = clear_bitmap_bits(fs, BMP_DATA, blocks, nblocks);
+    free(blocks);
+
+    for (int i = 0; i < n; ++i) {
+        invalidate_handles(fs, inodes[i], -1);
+        compact_dequeue(fs, inodes[i]);
+    }
+    inode_wrlock_set(fs, inodes, n, 0);
+    return ret;
+}
+
+/* Frees n inodes (see free_inodes) in steps, the inodes of DELETE_STEP
+   inode table blocks at a time, each step a transaction of its own. Called
+   without any lock held. Return -1 on error
+*/
+int free_inodes_steps(sfs_fs *fs, uint32_t *inodes, int n) {
+    int per_block = BLOCKSIZE / sizeof(inode);
+    int ret = 0;
+    qsort(inodes, n, sizeof(uint32_t), compare_u32);
+    for (int i = 0, j; i < n && ret != -1; i = j) {
+        uint32_t end = (inodes[i] / per_block + DELETE_STEP) * per_block;
+        for (j = i; j < n && inodes[j] < end; ++j)
+            ;
+        txn_begin(fs);
+        ret = free_inodes(fs, &fs->s, inodes + i, j - i);
+        txn_end(fs);
+    }
+    return ret;
+}
+
+/* Adds inode inumber to the inodes to free, freeing the batch once it is
+   full. Called with st->lock held, which is dropped while the batch is freed
+*/
+void delete_gather(delete_state *st, uint32_t inumber) {
+    st->inodes[st->ninodes++] = inumber;
+    if (st->ninodes < DELETE_BATCH) return;
+
+    uint32_t batch[DELETE_BATCH];
+    memcpy(batch, st->inodes, sizeof(batch));
+    st->ninodes = 0;
+    pthread_mutex_unlock(&st->lock);
+    int ret = free_inodes_steps(st->fs, batch, DELETE_BATCH);
+    pthread_mutex_lock(&st->lock);
+    if (ret == -1) st->error = 1;
+}
+
+/* Walks directory dir: its files are gathered, its sub-directories are
+   queued for walking and the directory itself is gathered last. The
+   directory is marked dying first, so that entries can not be added or
+   removed behind the walk. Return -1 on error
+*/
+int delete_walk_dir(delete_state *st, uint32_t dir) {
+    sfs_fs *fs = st->fs;
+    inode in;
+    dir_handle dh;
+    txn_begin(fs);
+    inode_wrlock(fs, dir);
+    int ret = load_inode(fs, dir, &in);
+    if (ret != -1 && in.valid) {
+        in.valid = INODE_DYING;
+        ret = write_inode_to_disk(fs, dir, &in);
+    }
+    if (ret != -1) ret = dir_iter_open(fs, dir, &dh);
+    inode_unlock(fs, dir);
+    txn_end(fs);
+    if (ret == -1) return -1;
+
+    sfs_dirent batch[64];
+    int n;
+    while (1) {
+        inode_rdlock(fs, dir);
+        n = dir_iter_next(fs, &dh, batch, 64);
+        inode_unlock(fs, dir);
+        if (n <= 0) break;
+
+        pthread_mutex_lock(&st->lock);
+        for (int i = 0; i < n; i++) {
+            if (batch[i].type == SFS_TYPE_D) {
+                if (st->ndirs == st->dirs_cap) {
+                    st->dirs_cap *= 2;
+                    st->dirs = (uint32_t *)realloc(
+                        st->dirs, sizeof(uint32_t) * st->dirs_cap);
+                }
+                st->dirs[st->ndirs++] = batch[i].inumber;
+            } else {
+                delete_gather(st, batch[i].inumber);
+            }
+        }
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+    dir_iter_close(&dh);
+    if (n == -1) return -1;
+
+    /* The directory blocks are only freed once they have been walked */
+    pthread_mutex_lock(&st->lock);
+    delete_gather(st, dir);
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+/* Walks directories until none are left and none are being walked */
+void *delete_worker(void *arg) {
+    delete_state *st = (delete_state *)arg;
+    pthread_mutex_lock(&st->lock);
+    while (1) {
+        while (st->ndirs == 0 && st->busy > 0 && !st->error)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->ndirs == 0 || st->error) break;
+
+        uint32_t dir = st->dirs[--st->ndirs];
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+        int ret = delete_walk_dir(st, dir);
+        pthread_mutex_lock(&st->lock);
+        st->busy--;
+        if (ret == -1) st->error = 1;
+        pthread_cond_broadcast(&st->cond);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/* Frees the subtree rooted at directory inumber (already unlinked from its
+   parent). The tree is walked by nthreads threads (the caller included);
+   memory use is bounded by DELETE_BATCH inodes plus the directories
+   waiting to be walked. With a journal the subtree is freed by many small
+   transactions (see free_inodes_steps). Return -1 on error
+*/
+int delete_tree(sfs_fs *fs, uint32_t inumber, int nthreads) {
+    delete_state st;
+    st.fs = fs;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    st.dirs_cap = 64;
+    st.dirs = (uint32_t *)malloc(sizeof(uint32_t) * st.dirs_cap);
+    st.dirs[0] = inumber;
+    st.ndirs = 1;
+    st.busy = 0;
+    st.inodes = (uint32_t *)malloc(sizeof(uint32_t) * DELETE_BATCH);
+    st.ninodes = 0;
+    st.error = 0;
+
+    int nworkers = get_max(nthreads, 1) - 1;
+    pthread_t workers[nworkers + 1];
+    for (int i = 0; i < nworkers; ++i)
+        if (pthread_create(&workers[i], NULL, delete_worker, &st) != 0)
+            nworkers = i;
+    delete_worker(&st);
+    for (int i = 0; i < nworkers; ++i)
+        pthread_join(workers[i], NULL);
+
+    if (free_inodes_steps(fs, st.inodes, st.ninodes) == -1) st.error = 1;
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    free(st.dirs);
+    free(st.inodes);
+
+    /* Removed inodes may be reused, drop every lookup under the subtree */
+    dcache_flush(fs);
+    return st.error ? -1 : 0;
+}
+
+/* Removes the directory at dirpath with its complete subtree, walking the
+   tree with nthreads threads. Returns 0 on success and -1 otherwise
+*/
+int do_remove_tree(sfs_fs *fs, char *dirpath, int nthreads) {
+
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    int ret;
+    inode in;
+
+    /* Get dirpath inode */
+    uint32_t inode_no = name_to_inode(fs, dirpath, SFS_TYPE_D);
+    if (inode_no == INVALID) return -1;
+
+    /* Get dirpath inode */
+    ret = load_inode(fs, inode_no, &in);
+    if (ret == -1) return -1;
+
+    /* Update Parent (if not root itself) */
+    if (strcmp(dirpath, "/") != 0) {
+        char *parent_path = get_parent_path(dirpath);
+        char *child_name = strrchr(dirpath, '/') + 1;
+
+        uint32_t parent_inode_no = name_to_inode(fs, parent_path, SFS_TYPE_D);
+        free(parent_path);
+        if (parent_inode_no == INVALID) return -1;
+
+        /* Unlink the entry found under the lock of the parent */
+        txn_begin(fs);
+        ret = dir_wrlock_live(fs, parent_inode_no);
+        if (ret != -1) {
+            inode_no = lookup_child(fs, parent_inode_no, child_name,
+                                    strlen(child_name), SFS_TYPE_D);
+            ret = -1;
+            if (inode_no != INVALID)
+                ret = remove_item_from_directory_file(fs, parent_inode_no,
+                                                      child_name, SFS_TYPE_D);
+            inode_unlock(fs, parent_inode_no);
+        }
+        txn_end(fs);
+        if (ret == -1) return -1;
+    }
+
+    /* Free the subtree in bulk */
+    return delete_tree(fs, inode_no, nthreads);
+}
+
+/* Removes directory and recursively deleting all sub-directories and files.
+   Hence this function removes the complete subtree rooted at dirpath
+   Returns 0 on success and -1 otherwise
+*/
+int do_remove_dir(sfs_fs *fs, char *dirpath) {
+    return fs_remove_tree(fs, dirpath, 1);
+}
+
+/* Loads (or reloads) the inode and block map pinned by a handle */
+int load_handle(sfs_fs *fs, file_handle *h) {
+    int ret;
+    h->s = fs->s;
+
+    ret = load_inode(fs, h->inumber, &h->in);
+    if (ret == -1 || h->in.valid == 0) return -1;
+
+    ret = map_data_blocks(fs, &h->s, &h->in, h->blocks);
+    if (ret == -1) return -1;
+
+    h->stale = 0;
+    return 0;
+}
+
+/* Returns the open handle for fd or NULL */
+file_handle *get_handle(sfs_fs *fs, int fd) {
+    if (fs == NULL) return NULL;
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !fs->open_files[fd].used) return NULL;
+    return &fs->open_files[fd];
+}
+
+/* Reloads the handle if it is stale. Called with the inode lock held.
+   Return -1 on error
+*/
+int refresh_handle(sfs_fs *fs, file_handle *h) {
+    if (h->stale) return load_handle(fs, h);
+    return 0;
+}
+
+/* Opens the file at filepath and returns a handle (file descriptor) for it.
+   If SFS_O_CREAT is set in flags a missing file is created.
+   Returns -1 on error
+*/
+int do_open(sfs_fs *fs, char *filepath, int flags) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    uint32_t inumber = name_to_inode(fs, filepath, SFS_TYPE_F);
+    if (inumber == INVALID) {
+        if (!(flags & SFS_O_CREAT)) return -1;
+        int ret = add_file_to_directory(fs, filepath);
+        /* unless another thread created it meanwhile */
+        if (ret == -1) ret = name_to_inode(fs, filepath, SFS_TYPE_F);
+        if (ret == -1) return -1;
+        inumber = ret;
+    }
+
+    /* Find a free slot in the open file table */
+    int fd = -1;
+    pthread_mutex_lock(&fs->handles_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (!fs->open_files[i].used) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd != -1) {
+        fs->open_files[fd].used = 1;
+        fs->open_files[fd].inumber = inumber;
+        fs->open_files[fd].stale = 1;
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+    if (fd == -1) return -1;
+
+    file_handle *h = &fs->open_files[fd];
+    h->pos = 0;
+    inode_rdlock(fs, inumber);
+    int ret = load_handle(fs, h);
+    inode_unlock(fs, inumber);
+    if (ret == -1) {
+        fs_close(fs, fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Reads length bytes from the current position of the handle and advances it.
+   Returns no of bytes read and -1 on error
+*/
+int do_read(sfs_fs *fs, int fd, char *data, int length) {
+    file_handle *h = get_handle(fs, fd);
+    if (h == NULL) return -1;
+
+    inode_rdlock(fs, h->inumber);
+    int ret = refresh_handle(fs, h);
+    if (ret != -1)
+        ret = read_mapped(fs, &h->s, &h->in, h->blocks, data,
+                          length, h->pos);
+    inode_unlock(fs, h->inumber);
+    if (ret == -1) return -1;
+
+    h->pos += ret;
+    return ret;
+}
+
+/* Writes length bytes at the current position of the handle and advances it.
+   Returns no of bytes written and -1 on error
+*/
+int do_write(sfs_fs *fs, int fd, char *data, int length) {
+    file_handle *h = get_handle(fs, fd);
+    if (h == NULL) return -1;
+
+    txn_begin(fs);
+    inode_wrlock(fs, h->inumber);
+    int ret = refresh_handle(fs, h);
+    if (ret != -1) {
+        ret = write_mapped(fs, &h->s, h->inumber, &h->in,
+                           h->blocks, data, length, h->pos, 0);
+        invalidate_handles(fs, h->inumber, fd);
+        /* Block map may be partially updated, reload on next use */
+        if (ret == -1) h->stale = 1;
+    }
+    inode_unlock(fs, h->inumber);
+    txn_end(fs);
+    if (ret == -1) return -1;
+
+    h->pos += ret;
+    return ret;
+}
+
+/* Moves the position of the handle. whence is one of SFS_SEEK_SET,
+   SFS_SEEK_CUR and SFS_SEEK_END. The position can not go past the end of
+   the file. Returns the new position and -1 on error
+*/
+int do_seek(sfs_fs *fs, int fd, int offset, int whence) {
+    file_handle *h = get_handle(fs, fd);
+    if (h == NULL) return -1;
+
+    inode_rdlock(fs, h->inumber);
+    int size = refresh_handle(fs, h) == -1 ? -1 : (int)h->in.size;
+    inode_unlock(fs, h->inumber);
+    if (size == -1) return -1;
+
+    int pos;
+    if (whence == SFS_SEEK_SET)
+        pos = offset;
+    else if (whence == SFS_SEEK_CUR)
+        pos = h->pos + offset;
+    else if (whence == SFS_SEEK_END)
+        pos = size + offset;
+    else
+        return -1;
+
+    if (pos < 0 || pos > size) return -1;
+
+    h->pos = pos;
+    return pos;
+}
+
+/* Closes the handle. Returns 0 on success and -1 on error */
+int do_close(sfs_fs *fs, int fd) {
+    if (fs == NULL) return -1;
+
+    int ret = -1;
+    pthread_mutex_lock(&fs->handles_lock);
+    if (fd >= 0 && fd < MAX_OPEN_FILES && fs->open_files[fd].used) {
+        fs->open_files[fd].used = 0;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+    return ret;
+}
+
+/* Inserts the hash sorted entries items[0..n) into an indexed directory.
+   Entries going to the same leaf are added with a single write of the leaf,
+   full leaves are split one entry at a time. Returns the no of entries
+   inserted (a prefix of items)
+*/
+int dx_add_sorted(sfs_fs *fs, file_handle *h, dir_entry *items, int n) {
+    char root[BLOCKSIZE], leaf[BLOCKSIZE];
+    int i = 0;
+    while (i < n) {
+        int path_lb[2], path_pos[2], depth;
+        uint64_t bound;
+        if (dir_read_block(fs, h, 0, root) == -1) break;
+        int lb = dx_find_leaf(fs, h, root, items[i].hash, path_lb, path_pos,
+                              &depth, &bound);
+        if (lb == -1 || dir_read_block(fs, h, lb, leaf) == -1) break;
+
+        int j = i;
+        while (j < n && items[j].hash < bound && db_insert(leaf, &items[j]) == 0)
+            j++;
+
+        if (j > i) {
+            if (dir_write_block(fs, h, lb, leaf) == -1) break;
+            i = j;
+        } else {
+            /* Leaf full, split it */
+            if (dx_add(fs, h, root, &items[i]) == -1) break;
+            i++;
+        }
+    }
+    return i;
+}
+
+/* Returns the first index of the hash sorted items[lo..hi) with hash not
+   less than hash
+*/
+int hashed_lower_bound(dir_entry *items, int lo, int hi, uint32_t hash) {
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (items[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns 1 if the entries a and b have the same name and type */
+int same_entry(dir_entry *a, dir_entry *b) {
+    return a->hash == b->hash && a->type == b->type &&
+           a->length == b->length && memcmp(a->name, b->name, a->length) == 0;
+}
+
+/* Marks (type = -1) the entries of the hash sorted items[lo..hi) which have
+   the same name and type as e
+*/
+void mark_duplicates(dir_entry *items, int lo, int hi, dir_entry *e) {
+    for (int i = hashed_lower_bound(items, lo, hi, e->hash);
+         i < hi && items[i].hash == e->hash; ++i) {
+        if (same_entry(&items[i], e)) items[i].type = -1;
+    }
+}
+
+/* Marks the entries of the hash sorted items[lo..hi) already present in the
+   directory block block
+*/
+void mark_present(dir_entry *items, int lo, int hi, char *block) {
+    for (int i = 0; i < ((dirent_block *)block)->count; ++i) {
+        if (db_slots(block)[i].length == 0) continue;
+        dir_entry e;
+        db_entry(block, i, &e);
+        mark_duplicates(items, lo, hi, &e);
+    }
+}
+
+/* Adds the entries items[0..n) to the linear directory open as h, writing
+   the directory once. Converts it to an indexed directory if it grows past
+   DX_THRESHOLD blocks. Return -1 on error
+*/
+int linear_add_all(sfs_fs *fs, file_handle *h, dir_entry *items, int n) {
+    int nblocks = h->in.size / BLOCKSIZE;
+    /* A new block is left with less room than the largest record only */
+    size_t bytes = 0;
+    for (int i = 0; i < n; ++i)
+        bytes += sizeof(dirent_slot) + sizeof(uint32_t) + items[i].length;
+    size_t room = BLOCKSIZE - sizeof(dirent_block) -
+                  (sizeof(dirent_slot) + sizeof(uint32_t) + MAX_FILENAME);
+    size_t blocks = nblocks + bytes / room + 1;
+    char *image = (char *)malloc(blocks * BLOCKSIZE);
+    if (image == NULL) return -1;
+    if (nblocks > 0 &&
+        read_mapped(fs, &h->s, &h->in, h->blocks, image,
+                    h->in.size, 0) == -1) {
+        free(image);
+        return -1;
+    }
+
+    /* Fill the free space of the existing blocks first, then append: only
+       the last new block can have room */
+    int total = nblocks;
+    for (int i = 0; i < n; ++i) {
+        int b = total > nblocks ? total - 1 : 0;
+        while (b < total &&
+               db_insert(image + (size_t)b * BLOCKSIZE, &items[i]) == -1)
+            b++;
+        if (b == total) {
+            db_init(image + (size_t)total++ * BLOCKSIZE);
+            db_insert(image + (size_t)b * BLOCKSIZE, &items[i]);
+        }
+    }
+
+    int ret = 0;
+    if (total <= DX_THRESHOLD || dx_build(fs, h, image, total, NULL, 0) == -1) {
+        /* Small enough, or too large to index */
+        int size = total * BLOCKSIZE;
+        if (load_handle(fs, h) == -1 ||
+            write_mapped(fs, &h->s, h->inumber, &h->in,
+                         h->blocks, image, size, 0, 1) != size)
+            ret = -1;
+        invalidate_handles(fs, h->inumber, -1);
+    }
+    free(image);
+    return ret;
+}
+
+/* Creates n empty files / directories (names[i] of type types[i]) in
+   directory parent in a single pass: the inodes are reserved with one scan
+   of the inode bitmap, every inode table block is written once and the
+   directory entries are appended together. inumbers[i] is set to the new inode no, or -1 if names[i] was
+   not created (already present, repeated or invalid name, or no space).
+   Called with the lock of parent held. Returns the no of items created and
+   -1 on error
+*/
+int create_bulk(sfs_fs *fs, uint32_t parent, char **names, int *types, int n,
+                int *inumbers) {
+    file_handle h;
+    char buf[BLOCKSIZE];
+    if (dir_open(fs, parent, &h) == -1) return -1;
+
+    /* New entries sorted by hash. inumber temporarily holds the index */
+    dir_entry *items = (dir_entry *)malloc(sizeof(dir_entry) * (n + 1));
+    if (items == NULL) return -1;
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        inumbers[i] = -1;
+        int length = strlen(names[i]);
+        if (length == 0 || length > MAX_FILENAME) continue;
+        if (strchr(names[i], '/') != NULL) continue;
+        if (types[i] != SFS_TYPE_F && types[i] != SFS_TYPE_D) continue;
+        make_entry(&items[m++], names[i], length, types[i], i);
+    }
+    qsort(items, m, sizeof(dir_entry), compare_dir_entry);
+
+    /* Names repeated within the batch */
+    for (int i = 0; i < m; ++i) {
+        for (int j = i + 1; j < m && items[j].hash == items[i].hash; ++j)
+            if (items[i].type != -1 && same_entry(&items[j], &items[i]))
+                items[j].type = -1;
+    }
+
+    /* Names already in the directory */
+    int indexed = 0;
+    if (h.in.size > 0) {
+        if (dir_read_block(fs, &h, 0, buf) == -1) {
+            free(items);
+            return -1;
+        }
+        indexed = ((dx_header *)buf)->magic == DX_ROOT_MAGIC;
+    }
+    char leaf[BLOCKSIZE];
+    for (int i = 0, lb = 0; i < m && lb < h.in.size / BLOCKSIZE;) {
+        int j = m;
+        if (indexed) {
+            /* Read every leaf covering the batch once */
+            int path_lb[2], path_pos[2], depth;
+            uint64_t bound;
+            lb = dx_find_leaf(fs, &h, buf, items[i].hash, path_lb, path_pos,
+                              &depth, &bound);
+            j = bound > UINT32_MAX ? m
+                                   : hashed_lower_bound(items, i, m, bound);
+        }
+        if (lb == -1 || dir_read_block(fs, &h, lb, leaf) == -1) {
+            free(items);
+            return -1;
+        }
+        mark_present(items, i, j, leaf);
+        if (indexed)
+            i = j;
+        else
+            lb++;
+    }
+
+    /* Drop the skipped entries, keeping hash order */
+    int c = 0;
+    for (int i = 0; i < m; ++i)
+        if (items[i].type != -1) items[c++] = items[i];
+    m = c;
+
+    /* One reservation for all the inodes */
+    uint32_t *reserved = (uint32_t *)malloc(sizeof(uint32_t) * (m + 1));
+    if (reserved == NULL) {
+        free(items);
+        return -1;
+    }
+    int got = alloc_bits(fs, BMP_INODES, inode_goal(fs, parent, SFS_TYPE_F),
+                         m, reserved);
+    int *orig = got == -1 ? NULL : (int *)malloc(sizeof(int) * (got + 1));
+    if (orig == NULL || init_inodes(fs, &h.s, reserved, got) == -1) {
+        /* Only the bits are released: the inodes init_inodes did not reach
+           may still point to blocks of their previous files */
+        if (got > 0) {
+            qsort(reserved, got, sizeof(uint32_t), compare_u32);
+            clear_bitmap_bits(fs, BMP_INODES, reserved, got);
+        }
+        free(orig);
+        free(reserved);
+        free(items);
+        return -1;
+    }
+    /* Out of inodes, create what fits */
+    m = got;
+    for (int i = 0; i < m; ++i) {
+        orig[i] = items[i].inumber;
+        items[i].inumber = reserved[i];
+    }
+
+    /* Add all the entries to the directory */
+    int added;
+    if (indexed)
+        added = dx_add_sorted(fs, &h, items, m);
+    else
+        added = linear_add_all(fs, &h, items, m) == -1 ? 0 : m;
+
+    for (int i = 0; i < m; ++i) {
+        dir_entry *e = &items[i];
+        if (i < added) {
+            inumbers[orig[i]] = e->inumber;
+            dcache_insert(fs, parent, e->name, e->length, e->type, e->inumber);
+        } else {
+            release_inode(fs, e->inumber);
+        }
+    }
+
+    free(orig);
+    free(reserved);
+    free(items);
+    return added;
+}
+
+/* no of items created in one transaction by a bulk creation on a journaled
+   file system
+*/
+#define BULK_STEP 4
+
+/* Creates n empty files / directories (names[i] of type types[i]) in the
+   directory at dirpath, see create_bulk. With a journal they are created
+   BULK_STEP at a time, each step a transaction of its own. Returns the no
+   of items created and -1 on error
+*/
+int do_create_bulk(sfs_fs *fs, char *dirpath, char **names, int *types, int n,
+                    int *inumbers) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL || n < 0) return -1;
+
+    uint32_t parent = name_to_inode(fs, dirpath, SFS_TYPE_D);
+    if (parent == INVALID) return -1;
+
+    int step = fs->j != NULL ? BULK_STEP : get_max(n, 1);
+    int created = 0;
+    for (int i = 0; i < n || i == 0; i += step) {
+        int m = get_min(step, n - i);
+        txn_begin(fs);
+        int ret = dir_wrlock_live(fs, parent);
+        if (ret != -1) {
+            ret = create_bulk(fs, parent, names + i, types + i, m,
+                              inumbers + i);
+            inode_unlock(fs, parent);
+        }
+        txn_end(fs);
+        if (ret == -1) return -1;
+        created += ret;
+    }
+    return created;
+}
+
+/* Returns 1 if the path inner lies inside (or is) the path outer */
+int path_within(char *outer, char *inner) {
+    const char *o = outer, *i = inner;
+    const char *oname, *iname;
+    int olength, ilength;
+    while ((oname = next_component(&o, &olength)) != NULL) {
+        iname = next_component(&i, &ilength);
+        if (iname == NULL || ilength != olength ||
+            memcmp(iname, oname, olength) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Moves entry old_name (of type type, inode inumber) of directory
+   old_parent to new_name in directory new_parent. Called with fs->rename_lock
+   and the locks of both directories held. The inode of a replaced file is
+   stored in target (INVALID if none). Returns 0 on success and -1 on error
+*/
+int rename_entry(sfs_fs *fs, uint32_t old_parent, char *old_name, uint32_t new_parent,
+                 char *new_name, int type, uint32_t inumber,
+                 uint32_t *target) {
+    int old_length = strlen(old_name);
+    int new_length = strlen(new_name);
+    *target = INVALID;
+
+    /* The source may have changed since it was resolved */
+    if (lookup_child(fs, old_parent, old_name, old_length, type) != inumber)
+        return -1;
+
+    /* An existing directory is never replaced, an existing file only by a
+       file */
+    uint32_t existing = lookup_child(fs, new_parent, new_name, new_length, type);
+    if (existing == inumber) return 0;
+    if (lookup_child(fs, new_parent, new_name, new_length,
+                     type == SFS_TYPE_F ? SFS_TYPE_D : SFS_TYPE_F) != INVALID)
+        return -1;
+    if (existing != INVALID && type == SFS_TYPE_D) return -1;
+
+    int ret;
+    if (existing != INVALID) {
+        dcache_invalidate(fs, new_parent, new_name, new_length, type);
+        ret = dir_remove(fs, new_parent, new_name, new_length, type);
+        if (ret == -1) return -1;
+        *target = existing;
+    }
+
+    dir_entry entry;
+    make_entry(&entry, new_name, new_length, type, inumber);
+
+    ret = dir_add(fs, new_parent, &entry);
+    if (ret == -1) return -1;
+    dcache_insert(fs, new_parent, new_name, new_length, type, inumber);
+
+    dcache_invalidate(fs, old_parent, old_name, old_length, type);
+    return dir_remove(fs, old_parent, old_name, old_length, type);
+}
+
+/* Renames (moves) the file or directory at oldpath to newpath. Only the two
+   directory entries change, the inode and its data blocks stay in place. An
+   existing file at newpath is replaced. The new entry is added before the
+   old one is removed, so the item is never unreachable.
+   Returns 0 on success and -1 on error
+*/
+int do_rename(sfs_fs *fs, char *oldpath, char *newpath) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    /* Renames are serialised, so that the paths checked below stay valid */
+    txn_begin(fs);
+    pthread_mutex_lock(&fs->rename_lock);
+
+    int type = SFS_TYPE_F;
+    uint32_t inumber = name_to_inode(fs, oldpath, SFS_TYPE_F);
+    if (inumber == INVALID) {
+        type = SFS_TYPE_D;
+        inumber = name_to_inode(fs, oldpath, SFS_TYPE_D);
+    }
+
+    char *old_parent_path = get_parent_path(oldpath);
+    char *new_parent_path = get_parent_path(newpath);
+    uint32_t parents[2];
+    parents[0] = name_to_inode(fs, old_parent_path, SFS_TYPE_D);
+    parents[1] = name_to_inode(fs, new_parent_path, SFS_TYPE_D);
+    free(old_parent_path);
+    free(new_parent_path);
+
+    char *new_name = strrchr(newpath, '/') + 1;
+    int new_length = strlen(new_name);
+
+    int ret = -1;
+    uint32_t target = INVALID;
+    /* Missing source, or the root directory. A directory can not be moved
+       inside itself */
+    if (inumber != INVALID && inumber != 0 && parents[0] != INVALID &&
+        parents[1] != INVALID && new_length > 0 &&
+        new_length <= MAX_FILENAME &&
+        !(type == SFS_TYPE_D && path_within(oldpath, newpath))) {
+        inode_wrlock_set(fs, parents, 2, 1);
+        if (dir_is_live(fs, parents[0]) && dir_is_live(fs, parents[1]))
+            ret = rename_entry(fs, parents[0], strrchr(oldpath, '/') + 1,
+                               parents[1], new_name, type, inumber, &target);
+        inode_wrlock_set(fs, parents, 2, 0);
+    }
+    pthread_mutex_unlock(&fs->rename_lock);
+
+    /* Release the replaced file */
+    if (ret == 0 && target != INVALID) fs_remove_file(fs, target);
+    txn_end(fs);
+    return ret;
+}
+
+/* Returns the open directory handle for dd (or NULL) */
+dir_handle *get_dir_handle(sfs_fs *fs, int dd) {
+    if (fs == NULL) return NULL;
+    if (dd < 0 || dd >= MAX_OPEN_DIRS || !fs->open_dirs[dd].used) return NULL;
+    return &fs->open_dirs[dd];
+}
+
+/* Opens the directory at dirpath for reading its entries. Returns a
+   directory handle and -1 on error
+*/
+int do_opendir(sfs_fs *fs, char *dirpath) {
+    /* Check if filesystem is mounted */
+    if (fs == NULL) return -1;
+
+    uint32_t inumber = name_to_inode(fs, dirpath, SFS_TYPE_D);
+    if (inumber == INVALID) return -1;
+
+    /* Read the directory before taking a slot, the table lock is never
+       held with an inode lock */
+    dir_handle dh;
+    inode_rdlock(fs, inumber);
+    int ret = dir_iter_open(fs, inumber, &dh);
+    inode_unlock(fs, inumber);
+    if (ret == -1) return -1;
+
+    int dd = -1;
+    pthread_mutex_lock(&fs->handles_lock);
+    for (int i = 0; i < MAX_OPEN_DIRS; ++i) {
+        if (!fs->open_dirs[i].used) {
+            dd = i;
+            break;
+        }
+    }
+    if (dd != -1) {
+        fs->open_dirs[dd] = dh;
+        fs->open_dirs[dd].used = 1;
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+    if (dd == -1) dir_iter_close(&dh);
+    return dd;
+}
+
+/* Reads the next batch of (at most max) entries of an open directory.
+   Returns the no of entries read, 0 at the end and -1 on error
+*/
+int do_readdir(sfs_fs *fs, int dd, sfs_dirent *entries, int max) {
+    dir_handle *dh = get_dir_handle(fs, dd);
+    if (dh == NULL || max < 0) return -1;
+    inode_rdlock(fs, dh->h.inumber);
+    int ret = dir_iter_next(fs, dh, entries, max);
+    inode_unlock(fs, dh->h.inumber);
+    return ret;
+}
+
+/* Like sfs_readdir but also returns the inode of every entry. The inode
+   table blocks of a batch are each read once.
+*/
+int do_readdirplus(sfs_fs *fs, int dd, sfs_dirent_plus *entries, int max) {
+    dir_handle *dh = get_dir_handle(fs, dd);
+    if (dh == NULL || max < 0) return -1;
+
+    /* Read the names in small batches, then fetch the inodes */
+    sfs_dirent batch[64];
+    int n = 0;
+    while (n < max) {
+        int ret = fs_readdir(fs, dd, batch, get_min(64, max - n));
+        if (ret == -1) return -1;
+        if (ret == 0) break;
+        for (int i = 0; i < ret; ++i)
+            entries[n + i].entry = batch[i];
+        n += ret;
+    }
+
+    if (fill_dirent_attrs(fs, &dh->h.s, entries, n) == -1) return -1;
+    return n;
+}
+
+/* Rewinds an open directory to its first entry. Return -1 on error */
+int do_rewinddir(sfs_fs *fs, int dd) {
+    dir_handle *dh = get_dir_handle(fs, dd);
+    if (dh == NULL) return -1;
+    dh->h.pos = dh->indexed ? BLOCKSIZE : 0;
+    return 0;
+}
+
+/* Closes an open directory. Returns 0 on success and -1 on error */
+int do_closedir(sfs_fs *fs, int dd) {
+    if (fs == NULL) return -1;
+
+    int ret = -1;
+    pthread_mutex_lock(&fs->handles_lock);
+    if (dd >= 0 && dd < MAX_OPEN_DIRS && fs->open_dirs[dd].used) {
+        dir_iter_close(&fs->open_dirs[dd]);
+        fs->open_dirs[dd].used = 0;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&fs->handles_lock);
+    return ret;
+}
+
+/* Consistency check (see fs_check). The inode table is scanned group by
+   group, each group read sequentially by one worker, recording the valid
+   inodes and the data blocks they use in bitsets. The directory tree is then
+   walked by the workers from a shared queue of directories, recording the
+   inodes reached. Last every bitmap block is compared with the bitsets.
+*/
+#define FSCK_MAX_THREADS 64
+
+typedef struct fsck_state {
+    sfs_fs *fs;           // unmounted file system over the disk
+    int repair;
+    sfs_fsck_report *r;   // counters, updated atomically
+    uint64_t *valid;      // valid inodes
+    uint64_t *reached;    // inodes reached from the root
+    uint64_t *used;       // data blocks used by valid inodes
+    uint32_t next_group;  // next group of the inode table scan
+    int error;            // a read or write failed
+
+    /* directory walk */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t *queue;      // directories to walk
+    int queued, queue_cap;
+    int busy;             // workers walking a directory
+} fsck_state;
+
+/* Sets bit i of a bitset, returning its previous value */
+int bit_set(uint64_t *set, uint32_t i) {
+    uint64_t mask = 1ULL << (i % 64);
+    return (__atomic_fetch_or(&set[i / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+int bit_test(uint64_t *set, uint32_t i) {
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+void fsck_count(uint32_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Records the data blocks used by a valid inode */
+void fsck_inode(fsck_state *st, uint32_t inumber, inode *in) {
+    super_block *s = &st->fs->s;
+    sfs_fsck_report *r = st->r;
+    uint32_t res[1029];
+    bit_set(st->valid, inumber);
+    fsck_count(&r->inodes);
+    if (map_data_blocks(st->fs, s, in, res) == -1) {
+        st->error = 1;
+        return;
+    }
+
+    int n = 0;
+    while (n < 1029 && res[n] != INVALID)
+        n++;
+    if (in->indirect < s->data_blocks) res[n++] = in->indirect;
+    if (in->size > 1029 * BLOCKSIZE ||
+        n < (in->size + BLOCKSIZE - 1) / BLOCKSIZE)
+        fsck_count(&r->bad_inodes);
+    for (int i = 0; i < n; ++i) {
+        if (bit_set(st->used, res[i]))
+            fsck_count(&r->duplicate_blocks);
+        else
+            fsck_count(&r->data_blocks);
+    }
+}
+
+/* Inode table scan worker: takes groups until none is left */
+void *fsck_scan(void *arg) {
+    fsck_state *st = (fsck_state *)arg;
+    super_block *s = &st->fs->s;
+    uint32_t per_block = BLOCKSIZE / sizeof(inode);
+    uint32_t per_group = s->group_inodes / per_block;
+    uint32_t table = (s->inodes + per_block - 1) / per_block;
+    char buf[BLOCKSIZE];
+    uint32_t g;
+    while ((g = __atomic_fetch_add(&st->next_group, 1, __ATOMIC_RELAXED)) <
+           s->groups) {
+        for (uint32_t b = g * per_group; b < (g + 1) * per_group && b < table;
+             ++b) {
+            if (bread(st->fs, itable_block(s, b), (void *)buf) == -1) {
+                st->error = 1;
+                continue;
+            }
+            for (uint32_t i = 0; i < per_block; ++i) {
+                inode *in = (inode *)buf + i;
+                uint32_t inumber = b * per_block + i;
+                if (in->valid && inumber < s->inodes)
+                    fsck_inode(st, inumber, in);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Adds directory dir to the walk queue */
+void fsck_push(fsck_state *st, uint32_t dir) {
+    pthread_mutex_lock(&st->lock);
+    if (st->queued == st->queue_cap) {
+        int cap = st->queue_cap ? 2 * st->queue_cap : 256;
+        uint32_t *queue = (uint32_t *)realloc(st->queue, cap * sizeof(uint32_t));
+        if (queue == NULL) {
+            st->error = 1;
+            pthread_mutex_unlock(&st->lock);
+            return;
+        }
+        st->queue = queue;
+        st->queue_cap = cap;
+    }
+    st->queue[st->queued++] = dir;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* Checks the entries of directory dir, queueing its subdirectories. With
+   repair entries of invalid inodes are removed
+*/
+void fsck_walk_dir(fsck_state *st, uint32_t dir) {
+    sfs_fs *fs = st->fs;
+    super_block *s = &fs->s;
+    sfs_fsck_report *r = st->r;
+    inode in;
+    uint32_t res[1029];
+    char buf[BLOCKSIZE];
+    if (load_inode(fs, dir, &in) == -1 ||
+        map_data_blocks(fs, s, &in, res) == -1) {
+        st->error = 1;
+        return;
+    }
+
+    for (int lb = 0; lb < 1029 && res[lb] != INVALID; ++lb) {
+        uint32_t block = data_block(s, res[lb]);
+        if (bread(fs, block, (void *)buf) == -1) {
+            st->error = 1;
+            continue;
+        }
+        if (db_is_index(buf)) continue;
+
+        dirent_block *b = (dirent_block *)buf;
+        dirent_slot *slots = db_slots(buf);
+        if (sizeof(dirent_block) + b->count * sizeof(dirent_slot) >
+            BLOCKSIZE) {
+            fsck_count(&r->bad_entries);
+            continue;
+        }
+        int removed = 0;
+        for (int i = 0; i < b->count; ++i) {
+            if (slots[i].length == 0) continue;
+            if (slots[i].offset + sizeof(uint32_t) + slots[i].length >
+                BLOCKSIZE) {
+                fsck_count(&r->bad_entries);
+                continue;
+            }
+            dir_entry e;
+            db_entry(buf, i, &e);
+            if (e.inumber >= s->inodes || !bit_test(st->valid, e.inumber)) {
+                fsck_count(&r->bad_entries);
+                if (st->repair) {
+                    db_remove(buf, i);
+                    fsck_count(&r->repaired);
+                    removed = 1;
+                }
+                continue;
+            }
+            if (bit_set(st->reached, e.inumber)) {
+                fsck_count(&r->linked_twice);
+                continue;
+            }
+            if (e.type == SFS_TYPE_D) {
+                fsck_count(&r->directories);
+                fsck_push(st, e.inumber);
+            } else {
+                fsck_count(&r->files);
+            }
+        }
+        if (removed && bwrite(fs, block, (void *)buf) == -1) st->error = 1;
+    }
+}
+
+/* Directory walk worker: walks queued directories until the queue is empty
+   and no other worker can add to it
+*/
+void *fsck_walk(void *arg) {
+    fsck_state *st = (fsck_state *)arg;
+    pthread_mutex_lock(&st->lock);
+    while (1) {
+        while (st->queued == 0 && st->busy > 0)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->queued == 0) break;
+        uint32_t dir = st->queue[--st->queued];
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+        fsck_walk_dir(st, dir);
+        pthread_mutex_lock(&st->lock);
+        if (--st->busy == 0 && st->queued == 0)
+            pthread_cond_broadcast(&st->cond);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/* Compares the inode / data bitmaps (kind BMP_*) with the bitset of what is
+   in use, fixing them with repair
+*/
+void fsck_bitmaps(fsck_state *st, int kind) {
+    sfs_fs *fs = st->fs;
+    super_block *s = &fs->s;
+    sfs_fsck_report *r = st->r;
+    uint64_t *set = kind == BMP_INODES ? st->valid : st->used;
+    uint32_t *leaked = kind == BMP_INODES ? &r->leaked_inodes
+                                          : &r->leaked_blocks;
+    uint32_t *lost = kind == BMP_INODES ? &r->lost_inodes : &r->lost_blocks;
+    uint32_t per_block = 8 * BLOCKSIZE;
+    unsigned char buf[BLOCKSIZE];
+
+    for (uint32_t g = 0; g < s->groups; ++g) {
+        uint32_t bits = group_bits(s, kind, g);
+        uint32_t first = g * group_span(s, kind);
+        for (uint32_t b = 0; b * per_block < bits; ++b) {
+            uint32_t block = bitmap_start(s, kind, g) + b;
+            if (bread(fs, block, (void *)buf) == -1) {
+                st->error = 1;
+                continue;
+            }
+            int fixed = 0;
+            uint32_t n = get_min(per_block, bits - b * per_block);
+            for (uint32_t i = 0; i < n; ++i) {
+                unsigned char mask = 1 << (7 - i % 8);
+                int in_use = bit_test(set, first + b * per_block + i);
+                if (((buf[i / 8] & mask) != 0) == in_use) continue;
+                (*(in_use ? lost : leaked))++;
+                if (st->repair) {
+                    buf[i / 8] ^= mask;
+                    fixed++;
+                }
+            }
+            if (fixed > 0) {
+                if (bwrite(fs, block, (void *)buf) == -1) st->error = 1;
+                r->repaired += fixed;
+            }
+        }
+    }
+}
+
+/* The passes of fs_check, see fsck_state */
+void fsck_run(fsck_state *st, int nthreads) {
+    super_block *s = &st->fs->s;
+    sfs_fsck_report *r = st->r;
+    pthread_t threads[FSCK_MAX_THREADS];
+    for (int t = 1; t < nthreads; ++t)
+        pthread_create(&threads[t], NULL, fsck_scan, st);
+    fsck_scan(st);
+    for (int t = 1; t < nthreads; ++t)
+        pthread_join(threads[t], NULL);
+
+    /* the root directory is inode 0 */
+    if (bit_test(st->valid, 0)) {
+        bit_set(st->reached, 0);
+        r->directories++;
+        fsck_push(st, 0);
+    }
+    for (int t = 1; t < nthreads; ++t)
+        pthread_create(&threads[t], NULL, fsck_walk, st);
+    fsck_walk(st);
+    for (int t = 1; t < nthreads; ++t)
+        pthread_join(threads[t], NULL);
+
+    for (uint32_t i = 0; i < s->inodes; ++i)
+        if (bit_test(st->valid, i) && !bit_test(st->reached, i))
+            r->orphan_inodes++;
+    fsck_bitmaps(st, BMP_INODES);
+    fsck_bitmaps(st, BMP_DATA);
+    if (st->repair && r->repaired > 0 && sync_disk(st->fs->diskptr) == -1)
+        st->error = 1;
+}
+
+/* Checks the file system of an unmounted disk with nthreads threads (one if
+   0): every valid inode must have its blocks in range and not shared with
+   another one, be reachable from the root by exactly one entry, and the
+   bitmaps must match the inodes and blocks in use. With FSCK_REPAIR in
+   flags a journal is replayed first, entries of invalid inodes are removed
+   and the bitmaps fixed; orphans, shared blocks and damaged inodes are only
+   reported. The findings are stored in r. Returns the no of problems found
+   and -1 on error
+*/
+int do_check(disk *diskptr, int flags, int nthreads, sfs_fsck_report *r) {
+    super_block s;
+    if (diskptr == NULL || r == NULL) return -1;
+    if (get_super_block(diskptr, &s) == -1 || s.magic_number != MAGIC)
+        return -1;
+    memset(r, 0, sizeof(sfs_fsck_report));
+    int repair = (flags & FSCK_REPAIR) != 0;
+    nthreads = get_max(1, get_min(nthreads, FSCK_MAX_THREADS));
+
+    if (s.journal_blocks > 0 && repair) {
+        if (journal_recover(diskptr, &s) == -1) return -1;
+    } else if (s.journal_blocks > 0) {
+        /* count what a mount would replay, the check sees the disk without
+           it */
+        char buf[BLOCKSIZE];
+        if (read_block(diskptr, s.journal_block_idx, (void *)buf) == -1)
+            return -1;
+        journal_header h = *(journal_header *)buf;
+        jrevokes rv = {NULL, 0, 0};
+        uint32_t pos = h.tail;
+        while (h.magic == JOURNAL_MAGIC && h.tail < s.journal_blocks - 1 &&
+               journal_scan(diskptr, &s, &pos, h.sequence + r->journal_pending,
+                            &rv, 0) == 1)
+            r->journal_pending++;
+        free(rv.items);
+    }
+
+    sfs_fs *fs = (sfs_fs *)calloc(1, sizeof(sfs_fs));
+    if (fs != NULL)
+        fs->groups = (alloc_group *)calloc(s.groups, sizeof(alloc_group));
+    if (fs == NULL || fs->groups == NULL) {
+        free(fs);
+        return -1;
+    }
+    fs->diskptr = diskptr;
+    fs->s = s;
+    fs->uninit_groups = s.uninit_groups;
+    init_locks(fs);
+
+    fsck_state st;
+    memset(&st, 0, sizeof(st));
+    st.fs = fs;
+    st.repair = repair;
+    st.r = r;
+    st.valid = (uint64_t *)calloc(s.inodes / 64 + 1, sizeof(uint64_t));
+    st.reached = (uint64_t *)calloc(s.inodes / 64 + 1, sizeof(uint64_t));
+    st.used = (uint64_t *)calloc(s.data_blocks / 64 + 1, sizeof(uint64_t));
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    int ret = -1;
+    if (st.valid != NULL && st.reached != NULL && st.used != NULL) {
+        fsck_run(&st, nthreads);
+        if (!st.error)
+            ret = r->bad_inodes + r->duplicate_blocks + r->bad_entries +
+                  r->linked_twice + r->orphan_inodes + r->leaked_inodes +
+                  r->lost_inodes + r->leaked_blocks + r->lost_blocks;
+    }
+    free(st.valid);
+    free(st.reached);
+    free(st.used);
+    free(st.queue);
+    pthread_cond_destroy(&st.cond);
+    pthread_mutex_destroy(&st.lock);
+    destroy_locks(fs);
+    free(fs->groups);
+    free(fs);
+    return ret;
+}
+
+/* Fragmentation (see fs_fragmentation) and online defragmentation. A file
+   is defragmented by copying its data blocks to a run of free blocks of one
+   group, in order, then pointing the inode and its indirect block at the
+   copies and freeing the old blocks, all under the inode lock and in one
+   transaction: readers see the old or the new block map, and after a crash
+   with a journal the file has one or the other
+*/
+
+/* No of extents of the n data blocks (indexes) of a block map */
+uint32_t map_extents(super_block *s, uint32_t *res, int n) {
+    uint32_t extents = n > 0;
+    for (int i = 1; i < n; ++i)
+        if (data_block(s, res[i]) != data_block(s, res[i - 1]) + 1) extents++;
+    return extents;
+}
+
+/* Counts the free runs of data bitmap block b of group g into r, run being
+   the length of the run left open by the previous block of the group.
+   Called with the data bitmap lock of g held. Returns -1 on error
+*/
+int count_free_runs(sfs_fs *fs, uint32_t g, uint32_t b, uint32_t *run,
+                    sfs_frag_report *r) {
+    char buf[BLOCKSIZE];
+    uint32_t per_block = 8 * BLOCKSIZE;
+    if (bread(fs, bitmap_start(&fs->s, BMP_DATA, g) + b, (void *)buf) == -1)
+        return -1;
+    uint32_t end = get_min(group_bits(&fs->s, BMP_DATA, g), (b + 1) * per_block);
+    for (uint32_t i = b * per_block; i < end; ++i) {
+        uint32_t k = i % per_block;
+        if (buf[k / 8] & (1 << (7 - k % 8))) {
+            *run = 0;
+            continue;
+        }
+        if ((*run)++ == 0) r->free_extents++;
+        r->free_blocks++;
+        r->largest_free = get_max(r->largest_free, *run);
+    }
+    return 0;
+}
+
+/* Fills r with the fragmentation of the files and of the free space of the
+   file system and calls each (if not NULL) with that of every valid inode.
+   Files are mapped one at a time under their inode lock, so the report is
+   consistent per file only. Data blocks reserved by allocation pools count
+   as used. Returns -1 on error
+*/
+int do_fragmentation(sfs_fs *fs, sfs_frag_report *r,
+                     void (*each)(void *arg, sfs_frag_file *f), void *arg) {
+    if (fs == NULL || r == NULL) return -1;
+    memset(r, 0, sizeof(sfs_frag_report));
+    super_block s = fs->s;
+    uint32_t per_block = BLOCKSIZE / sizeof(inode);
+    uint32_t table = (s.inodes + per_block - 1) / per_block;
+    uint32_t res[1029];
+    char buf[BLOCKSIZE];
+
+    for (uint32_t b = 0; b < table; ++b) {
+        if (bread(fs, itable_block(&s, b), (void *)buf) == -1) return -1;
+        for (uint32_t i = 0; i < per_block; ++i) {
+            uint32_t inumber = b * per_block + i;
+            if (((inode *)buf)[i].valid != 1 || inumber >= s.inodes) continue;
+
+            inode in;
+            inode_rdlock(fs, inumber);
+            int ret = load_inode(fs, inumber, &in);
+            if (ret != -1 && in.valid == 1)
+                ret = map_data_blocks(fs, &s, &in, res);
+            inode_unlock(fs, inumber);
+            if (ret == -1) return -1;
+            if (in.valid != 1) continue; // removed meanwhile
+
+            sfs_frag_file f;
+            f.inumber = inumber;
+            f.size = in.size;
+            f.blocks = 0;
+            while (f.blocks < 1029 && res[f.blocks] != INVALID) f.blocks++;
+            f.extents = map_extents(&s, res, f.blocks);
+            r->files++;
+            r->mapped += f.blocks > 0;
+            r->fragmented += f.extents > 1;
+            r->blocks += f.blocks;
+            r->extents += f.extents;
+            if (each != NULL) each(arg, &f);
+        }
+    }
+
+    /* free runs do not span groups, the group metadata lies between */
+    uint32_t per_bitmap = 8 * BLOCKSIZE;
+    for (uint32_t g = 0; g < s.groups; ++g) {
+        uint32_t run = 0, bits = group_bits(&s, BMP_DATA, g);
+        pthread_mutex_lock(bitmap_lock(fs, BMP_DATA, g));
+        int ret = 0;
+        for (uint32_t b = 0; b * per_bitmap < bits && ret != -1; ++b)
+            ret = count_free_runs(fs, g, b, &run, r);
+        pthread_mutex_unlock(bitmap_lock(fs, BMP_DATA, g));
+        if (ret == -1) return -1;
+    }
+    return 0;
+}
+
+/* Finds the first run of n free data blocks of group g, sets their bits and
+   returns the index of the first block. Called with the data bitmap lock of
+   g held. Returns -2 if there is no such run and -1 on error
+*/
+int take_group_run(sfs_fs *fs, uint32_t g, int n) {
+    super_block *s = &fs->s;
+    uint32_t bits = group_bits(s, BMP_DATA, g), per_block = 8 * BLOCKSIZE;
+    int nblocks = (bits + per_block - 1) / per_block;
+    char *map = (char *)malloc(nblocks * BLOCKSIZE);
+    if (map == NULL) return -1;
+
+    int ret = 0;
+    for (int b = 0; b < nblocks && ret != -1; ++b)
+        ret = bread(fs, bitmap_start(s, BMP_DATA, g) + b,
+                    (void *)(map + b * BLOCKSIZE));
+    int run = 0;
+    uint32_t i = 0;
+    for (; ret != -1 && i < bits && run < n; ++i) {
+        if (i % 8 == 0 && (unsigned char)map[i / 8] == 0xff) {
+            run = 0;
+            i += 7;
+            continue;
+        }
+        run = map[i / 8] & (1 << (7 - i % 8)) ? 0 : run + 1;
+    }
+    if (ret == -1 || run < n) {
+        free(map);
+        return ret == -1 ? -1 : -2;
+    }
+
+    uint32_t first = i - n;
+    for (i = first; i < first + n; ++i)
+        map[i / 8] = map[i / 8] | (1 << (7 - i % 8));
+    for (uint32_t b = first / per_block; b <= (first + n - 1) / per_block &&
+                                         ret != -1;
+         ++b)
+        ret = bwrite(fs, bitmap_start(s, BMP_DATA, g) + b,
+                     (void *)(map + b * BLOCKSIZE));
+    free(map);
+    if (ret == -1) return -1;
+    __atomic_sub_fetch(&fs->groups[g].free[BMP_DATA], n, __ATOMIC_RELAXED);
+    return g * s->group_data_blocks + first;
+}
+
+/* Allocates a run of n data blocks consecutive on disk, in the group of
+   goal or else the first group after it with one (see alloc_bits). Returns
+   the index of the first block, -2 if no group has such a run and -1 on
+   error
+*/
+int alloc_run(sfs_fs *fs, uint32_t goal, int n) {
+    super_block *s = &fs->s;
+    uint32_t g0 = goal / s->group_data_blocks;
+    if (g0 >= s->groups) g0 = 0;
+    for (uint32_t i = 0; i < s->groups; ++i) {
+        uint32_t g = (g0 + i) % s->groups;
+        if (__atomic_load_n(&fs->groups[g].free[BMP_DATA], __ATOMIC_RELAXED) <
+            n)
+            continue;
+        pthread_mutex_lock(bitmap_lock(fs, BMP_DATA, g));
+        int ret = take_group_run(fs, g, n);
+        pthread_mutex_unlock(bitmap_lock(fs, BMP_DATA, g));
+        if (ret != -2) return ret;
+    }
+    return -2;
+}
+
+/* Moves the data blocks of inode inumber to a run of free blocks (see
+   alloc_run) if they form more than one extent. Called with the inode lock
+   held. Returns the no of blocks moved, 0 if the blocks were left in place
+   (one extent, or no run large enough) and -1 on error
+*/
+int defrag_inode(sfs_fs *fs, int inumber) {
+    super_block s = fs->s;
+    inode in;
+    uint32_t res[1029], run[1029];
+    if (load_inode(fs, inumber, &in) == -1) return -1;
+    if (in.valid != 1) return 0;
+    if (map_data_blocks(fs, &s, &in, res) == -1) return -1;
+    int n = 0;
+    while (n < 1029 && res[n] != INVALID) n++;
+    if (map_extents(&s, res, n) <= 1) return 0;
+
+    int first = alloc_run(fs, data_goal(&s, inumber, res, 0), n);
+    if (first < 0) return first == -2 ? 0 : -1;
+    for (int i = 0; i < n; ++i) run[i] = first + i;
+
+    /* Copy, in place for files as for directories: the copies are only
+       reached through the new block map, logged with the freeing of the
+       old blocks */
+    char buf[BLOCKSIZE];
+    int ret = 0;
+    for (int i = 0; i < n && ret != -1; ++i) {
+        ret = bread(fs, data_block(&s, res[i]), (void *)buf);
+        if (ret != -1)
+            ret = write_inplace(fs, data_block(&s, run[i]), (void *)buf);
+    }
+    if (ret == -1) {
+        clear_bitmap_bits(fs, BMP_DATA, run, n);
+        return -1;
+    }
+
+    for (int i = 0; i < 5; ++i) in.direct[i] = i < n ? run[i] : INVALID;
+    if (n > 5) {
+        memset(buf, 0xff, BLOCKSIZE);
+        memcpy(buf, run + 5, (n - 5) * sizeof(uint32_t));
+        if (bwrite(fs, data_block(&s, in.indirect), (void *)buf) == -1)
+            return -1;
+    }
+    if (write_inode_to_disk(fs, inumber, &in) == -1) return -1;
+    invalidate_handles(fs, inumber, -1);
+
+    qsort(res, n, sizeof(uint32_t), compare_u32);
+    if (clear_bitmap_bits(fs, BMP_DATA, res, n) == -1) return -1;
+    return n;
+}
+
+/* Defragments inode inumber (see defrag_inode), file or directory, on a
+   mounted file system. Returns the no of blocks moved and -1 on error
+*/
+int do_defrag_i(sfs_fs *fs, int inumber) {
+    if (fs == NULL || inumber < 0 || inumber >= fs->s.inodes) return -1;
+    txn_begin(fs);
+    inode_wrlock(fs, inumber);
+    int ret = defrag_inode(fs, inumber);
+    inode_unlock(fs, inumber);
+    txn_end(fs);
+    return ret;
+}
+
+/* Defragments every file and directory of a mounted file system, one at a
+   time, while it stays in use. Unless blocks_per_s is 0 the caller sleeps
+   between files to move at most blocks_per_s blocks per second on average.
+   Returns the no of blocks moved and -1 on error
+*/
+int do_defrag(sfs_fs *fs, int blocks_per_s) {
+    if (fs == NULL || blocks_per_s < 0) return -1;
+    super_block s = fs->s;
+    uint32_t per_block = BLOCKSIZE / sizeof(inode);
+    uint32_t table = (s.inodes + per_block - 1) / per_block;
+    char buf[BLOCKSIZE];
+    int64_t start = clock_ns();
+    int moved = 0;
+
+    for (uint32_t b = 0; b < table; ++b) {
+        if (bread(fs, itable_block(&s, b), (void *)buf) == -1) return -1;
+        for (uint32_t i = 0; i < per_block; ++i) {
+            uint32_t inumber = b * per_block + i;
+            inode *in = (inode *)buf + i;
+            /* files of one block are never fragmented */
+            if (in->valid != 1 || in->size <= BLOCKSIZE ||
+                inumber >= s.inodes)
+                continue;
+            int ret = do_defrag_i(fs, inumber);
+            if (ret == -1) return -1;
+            moved += ret;
+
+            int64_t wait = blocks_per_s == 0
+                               ? 0
+                               : start + moved * 1000000000LL / blocks_per_s -
+                                     clock_ns();
+            if (ret > 0 && wait > 0) {
+                struct timespec ts = {wait / 1000000000LL,
+                                      wait % 1000000000LL};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    return moved;
+}
+
+/* An asynchronous request thread. Runs the submitted requests in order,
+   until the file system is unmounted
+*/
+void *io_thread(void *arg) {
+    sfs_fs *fs = (sfs_fs *)arg;
+    io_queue *q = &fs->io;
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->head == NULL && !q->stop)
+            pthread_cond_wait(&q->cond, &q->lock);
+        sfs_io *io = q->head;
+        if (io == NULL) break;
+        q->head = io->next;
+        if (q->head == NULL) q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        if (io->op == SFS_IO_READ)
+            io->result =
+                io->inumber >= 0
+                    ? fs_read_i(fs, io->inumber, io->data, io->length,
+                                io->offset)
+                    : fs_read_file(fs, io->path, io->data, io->length,
+                                   io->offset);
+        else
+            io->result =
+                io->inumber >= 0
+                    ? fs_write_i(fs, io->inumber, io->data, io->length,
+                                 io->offset)
+                    : fs_write_file(fs, io->path, io->data, io->length,
+                                    io->offset);
+
+        io->next = NULL;
+        if (io->done != NULL) {
+            io->done(io);
+            pthread_mutex_lock(&q->lock);
+            continue;
+        }
+        pthread_mutex_lock(&q->lock);
+        if (q->done_tail != NULL)
+            q->done_tail->next = io;
+        else
+            q->done_head = io;
+        q->done_tail = io;
+        q->ndone++;
+        q->pending--;
+        pthread_cond_broadcast(&q->done);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* Queues request io of operation op, starting a thread if all the started
+   ones may be busy. Returns -1 on error
+*/
+int io_submit(sfs_fs *fs, sfs_io *io, int op) {
+    if (fs == NULL || io == NULL || io->data == NULL || io->length < 0 ||
+        (io->inumber < 0 && io->path == NULL))
+        return -1;
+    io_queue *q = &fs->io;
+    io->op = op;
+    io->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->stop ||
+        (q->nthreads == 0 &&
+         pthread_create(&q->threads[0], NULL, io_thread, fs) != 0)) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    if (q->nthreads == 0) q->nthreads = 1;
+    if (q->head != NULL && q->nthreads < IO_THREADS &&
+        pthread_create(&q->threads[q->nthreads], NULL, io_thread, fs) == 0)
+        q->nthreads++;
+
+    if (q->tail != NULL)
+        q->tail->next = io;
+    else
+        q->head = io;
+    q->tail = io;
+    if (io->done == NULL) q->pending++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Submits an asynchronous read of io->length bytes at io->offset of the
+   file io->inumber, or io->path if it is -1, into io->data (see sfs_io). On
+   completion io->result holds the no of bytes read as fs_read_i /
+   fs_read_file return it. Returns -1 if the request is not valid and 0 if
+   it was submitted
+*/
+int fs_submit_read(sfs_fs *fs, sfs_io *io) {
+    return io_submit(fs, io, SFS_IO_READ);
+}
+
+/* Submits an asynchronous write, as fs_submit_read (see fs_write_i /
+   fs_write_file). Requests are started in the order submitted, but run
+   concurrently: the order of writes to the same file is kept only if each
+   is submitted after the completion of the previous one
+*/
+int fs_submit_write(sfs_fs *fs, sfs_io *io) {
+    return io_submit(fs, io, SFS_IO_WRITE);
+}
+
+/* Takes up to max completed requests submitted without callback, in order
+   of completion, storing them in done. Waits until at least min have
+   completed, or until none is left to complete. Returns the no of requests
+   stored and -1 on error
+*/
+int fs_reap(sfs_fs *fs, sfs_io **done, int max, int min) {
+    if (fs == NULL || done == NULL || max < 0) return -1;
+    io_queue *q = &fs->io;
+    pthread_mutex_lock(&q->lock);
+    while (q->ndone < get_min(min, max) && q->pending > 0)
+        pthread_cond_wait(&q->done, &q->lock);
+    int n = 0;
+    while (n < max && q->done_head != NULL) {
+        done[n++] = q->done_head;
+        q->done_head = q->done_head->next;
+    }
+    if (q->done_head == NULL) q->done_tail = NULL;
+    q->ndone -= n;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/* Runs the asynchronous requests left and stops their threads */
+void io_stop(sfs_fs *fs) {
+    io_queue *q = &fs->io;
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; ++i)
+        pthread_join(q->threads[i], NULL);
+}
+
+/* Call tracing (see sfs_trace_enable). Every entry point is a wrapper of
+   the function doing the work (do_*) that reads the clock and the block I/O
+   counters of the thread around it, only while tracing is enabled. The
+   counters are shared by all the threads and updated atomically
+*/
+int trace_enabled = 0;
+sfs_call_stats trace_stats[SFS_CALLS];
+
+const char *call_names[SFS_CALLS] = {
+    "format",       "mount",           "unmount",     "create_file",
+    "remove_file",  "stat",            "read_i",      "write_i",
+    "fit_to_size",  "read_file",       "write_file",  "create_dir",
+    "remove_dir",   "remove_tree",     "rename",      "create_bulk",
+    "compact_dirs", "open",            "read",        "write",
+    "seek",         "close",           "opendir",     "readdir",
+    "readdirplus",  "rewinddir",       "closedir",    "sync",
+    "check",        "fragmentation",   "defrag_i",    "defrag",
+    "name_to_inode", "alloc_bit",      "map_data_blocks"};
+
+/* State of a traced call, start_ns is 0 if tracing was disabled */
+typedef struct trace_call {
+    int64_t start_ns;
+    uint64_t reads, writes;
+} trace_call;
+
+trace_call trace_begin() {
+    trace_call t = {0, 0, 0};
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) return t;
+    t.start_ns = clock_ns();
+    t.reads = thread_reads;
+    t.writes = thread_writes;
+    return t;
+}
+
+/* Records the call begun with t, returns ret */
+int trace_end(trace_call *t, int call, int ret) {
+    if (t->start_ns == 0) return ret;
+    uint64_t ns = clock_ns() - t->start_ns, us = ns / 1000;
+    sfs_call_stats *c = &trace_stats[call];
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    bucket = get_min(bucket, SFS_TRACE_BUCKETS - 1);
+    __atomic_add_fetch(&c->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->reads, thread_reads - t->reads, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->writes, thread_writes - t->writes,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->hist[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&c->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+        ;
+    return ret;
+}
+
+/* Enables (on 1) or disables (on 0) call tracing, for all the file systems
+   of the process. The statistics are kept until sfs_trace_reset
+*/
+void sfs_trace_enable(int on) {
+    __atomic_store_n(&trace_enabled, on != 0, __ATOMIC_RELAXED);
+}
+
+/* Copies the statistics of the traced calls to t. Calls running meanwhile
+   may be counted in some fields only
+*/
+void sfs_trace_snapshot(sfs_trace *t) {
+    for (int i = 0; i < SFS_CALLS; ++i) {
+        sfs_call_stats *from = &trace_stats[i], *to = &t->calls[i];
+        to->calls = __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+        to->total_ns = __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+        to->max_ns = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+        to->reads = __atomic_load_n(&from->reads, __ATOMIC_RELAXED);
+        to->writes = __atomic_load_n(&from->writes, __ATOMIC_RELAXED);
+        for (int b = 0; b < SFS_TRACE_BUCKETS; ++b)
+            to->hist[b] = __atomic_load_n(&from->hist[b], __ATOMIC_RELAXED);
     }
+}
 
-    /* Update size and write inode to disk */
-    in.size = get_max(offset + length, in.size);
-    ret = write_inode_to_disk(mounted_diskptr, inumber, &in);
-    if (ret == -1) return -1;
+/* Clears the statistics of the traced calls */
+void sfs_trace_reset() {
+    for (int i = 0; i < SFS_CALLS; ++i) {
+        sfs_call_stats *c = &trace_stats[i];
+        __atomic_store_n(&c->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->reads, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->writes, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < SFS_TRACE_BUCKETS; ++b)
+            __atomic_store_n(&c->hist[b], 0, __ATOMIC_RELAXED);
+    }
+}
 
-    return length - bytes_to_write; // no of bytes written
+/* Name of traced call call (see sfs_call), NULL if out of range */
+const char *sfs_call_name(int call) {
+    return call >= 0 && call < SFS_CALLS ? call_names[call] : NULL;
 }
 
-/* Truncates the file to specified size.
-   Returns 0 on success and -1 on error
+/* Writes the statistics of the calls made since the last reset to buf as
+   a JSON object, truncated to size bytes (terminating 0 included):
+     {"calls": [{"call": name, "calls": n, "total_ns": n, "max_ns": n,
+                 "reads": n, "writes": n, "histogram_us": [n, ...]}, ...]}
+   Returns the length of the whole object, as snprintf
 */
-int fit_to_size(int inumber, int size) {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+int sfs_trace_json(char *buf, int size) {
+    sfs_trace t;
+    sfs_trace_snapshot(&t);
+    int n = 0;
+    char *sep = "";
+    n += snprintf(buf, size, "{\"calls\": [");
+    for (int i = 0; i < SFS_CALLS; ++i) {
+        sfs_call_stats *c = &t.calls[i];
+        if (c->calls == 0) continue;
+        n += snprintf(buf + get_min(n, size), get_max(size - n, 0),
+                      "%s{\"call\": \"%s\", \"calls\": %lu, \"total_ns\": "
+                      "%lu, \"max_ns\": %lu, \"reads\": %lu, \"writes\": "
+                      "%lu, \"histogram_us\": [",
+                      sep, call_names[i], c->calls, c->total_ns, c->max_ns,
+                      c->reads, c->writes);
+        for (int b = 0; b < SFS_TRACE_BUCKETS; ++b)
+            n += snprintf(buf + get_min(n, size), get_max(size - n, 0),
+                          b == 0 ? "%lu" : ", %lu", c->hist[b]);
+        n += snprintf(buf + get_min(n, size), get_max(size - n, 0), "]}");
+        sep = ", ";
+    }
+    n += snprintf(buf + get_min(n, size), get_max(size - n, 0), "]}");
+    return n;
+}
 
-    /* Get superblock and inode */
-    int ret;
-    inode in;
-    super_block s;
+/* The traced entry points */
+int fs_format_opts(disk *diskptr, sfs_format_opts *opts) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_FORMAT, do_format_opts(diskptr, opts));
+}
 
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
+sfs_fs *fs_mount(disk *diskptr, int mount_root_directory_flg) {
+    trace_call t = trace_begin();
+    sfs_fs *fs = do_mount(diskptr, mount_root_directory_flg);
+    trace_end(&t, SFS_CALL_MOUNT, 0);
+    return fs;
+}
 
-    ret = get_inode(mounted_diskptr, inumber, &in);
-    if (ret == -1) return -1;
+void fs_unmount(sfs_fs *fs) {
+    trace_call t = trace_begin();
+    do_unmount(fs);
+    trace_end(&t, SFS_CALL_UNMOUNT, 0);
+}
 
-    if (in.size > size) {
-        /* no of blocks to keep. remove any blocks in excess of this */
-        int nblocks = (int)ceil(1.0 * size / BLOCKSIZE);
+int fs_create_file(sfs_fs *fs) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_CREATE_FILE, do_create_file(fs));
+}
 
-        /* Removes blocks after nblocks */
-        if (nblocks <= 5) {
-            for (int b = nblocks + 1; b <= 5; ++b) {
-                int db_array_index = b - 1;
-                operate_bitmap(mounted_diskptr, s.data_block_bitmap_idx,
-                               in.direct[db_array_index], 0);
-            }
-        }
+int fs_remove_file(sfs_fs *fs, int inumber) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_REMOVE_FILE, do_remove_file(fs, inumber));
+}
 
-        /* no of indirect blocks to keep*/
-        int rem = nblocks - 5;
+int fs_stat(sfs_fs *fs, int inumber) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_STAT, do_stat(fs, inumber));
+}
 
-        double buf[BLOCKSIZE];
-        memset(buf, -1, BLOCKSIZE);
+int fs_read_i(sfs_fs *fs, int inumber, char *data, int length, int offset) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_READ_I,
+                     do_read_i(fs, inumber, data, length, offset));
+}
 
-        if (in.indirect >= 0 && in.indirect < s.data_blocks) {
-            double blk[BLOCKSIZE];
-            int ret = read_block(mounted_diskptr,
-                                 s.data_block_idx + in.indirect, (void *)blk);
-            if (ret == -1) return -1;
+int fs_write_i(sfs_fs *fs, int inumber, char *data, int length, int offset) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_WRITE_I,
+                     do_write_i(fs, inumber, data, length, offset));
+}
 
-            for (int i = 0; i < 1024; ++i) {
-                if (i >= rem) {
-                    int x = *(int *)(blk + i * 4);
-                    if (x >= 0 && x < s.data_blocks)
-                        operate_bitmap(mounted_diskptr, s.data_block_bitmap_idx,
-                                       x, 0);
-                }
-            }
-            memcpy(buf, blk, rem * 4);
-            ret = write_block(mounted_diskptr, s.data_block_idx + in.indirect,
-                              (void *)buf);
-            if (ret == -1) return -1;
-        }
+int fs_fit_to_size(sfs_fs *fs, int inumber, int size) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_FIT_TO_SIZE,
+                     do_fit_to_size(fs, inumber, size));
+}
 
-        in.size = size;
-        /* Update inode on disk */
-        ret = write_inode_to_disk(mounted_diskptr, inumber, &in);
-        if (ret == -1) return -1;
-    }
-    return 0;
+int fs_read_file(sfs_fs *fs, char *filepath, char *data, int length,
+                 int offset) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_READ_FILE,
+                     do_read_file(fs, filepath, data, length, offset));
 }
 
-/* Initialises to an invalid inode */
-void initialise_inode(inode *in) {
-    in->valid = 1;
-    in->size = 0;
-    in->direct[0] = in->direct[1] = in->direct[2] = INVALID;
-    in->direct[3] = in->direct[4] = INVALID;
-    in->indirect = INVALID;
+int fs_write_file(sfs_fs *fs, char *filepath, char *data, int length,
+                  int offset) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_WRITE_FILE,
+                     do_write_file(fs, filepath, data, length, offset));
 }
 
-/* Returns the entire contents of the file pointed by inode
-   in a string
-*/
-char *read_file_contents(int inumber, int *content_size) {
-    int ret;
-    inode in;
-    ret = get_inode(mounted_diskptr, inumber, &in);
+int fs_create_dir(sfs_fs *fs, char *dirpath) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_CREATE_DIR, do_create_dir(fs, dirpath));
+}
+
+int fs_remove_dir(sfs_fs *fs, char *dirpath) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_REMOVE_DIR, do_remove_dir(fs, dirpath));
+}
 
-    char *content = (char *)malloc(sizeof(char) * in.size);
-    ret = read_i(inumber, content, in.size, 0);
-    if (ret == -1) return NULL;
+int fs_remove_tree(sfs_fs *fs, char *dirpath, int nthreads) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_REMOVE_TREE,
+                     do_remove_tree(fs, dirpath, nthreads));
+}
 
-    /* set content size */
-    *content_size = ret;
-    return content;
+int fs_rename(sfs_fs *fs, char *oldpath, char *newpath) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_RENAME, do_rename(fs, oldpath, newpath));
 }
 
-/* Parses the content of a directory file, and returns
-   the list of children (files/sub-directories) of the directory
-*/
-child *parse_content(int filesize, char *content) {
-    int nitems = (int)(1.0 * filesize / sizeof(child));
-    child *items = (child *)malloc(sizeof(child) * nitems);
-    for (int i = 0; i < nitems; ++i) {
-        items[i] = *(child *)(content + i * sizeof(child));
-    }
-    return items;
+int fs_create_bulk(sfs_fs *fs, char *dirpath, char **names, int *types, int n,
+                   int *inumbers) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_CREATE_BULK,
+                     do_create_bulk(fs, dirpath, names, types, n, inumbers));
 }
 
-/* Returns the walk from root to the item and stores length
-   in the parameter passed.
-*/
-char **get_walk_from_root(char *path, int *length) {
-    /*Max string length of walk is MAX_FILENAME * no of inodes*/
-    int ret;
-    super_block s;
-    ret = get_super_block(mounted_diskptr, &s);
-    int max_path_length = MAX_FILENAME * s.inodes;
+int fs_compact_dirs(sfs_fs *fs, int max_steps) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_COMPACT_DIRS, do_compact_dirs(fs, max_steps));
+}
 
-    char path_cp[max_path_length];
-    strcpy(path_cp, path);
+int fs_open(sfs_fs *fs, char *filepath, int flags) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_OPEN, do_open(fs, filepath, flags));
+}
 
-    char **token = (char **)(malloc(sizeof(char *) * s.inodes));
-    for (int i = 0; i < s.inodes; ++i) {
-        token[i] = (char *)malloc(sizeof(char) * MAX_FILENAME);
-    }
+int fs_read(sfs_fs *fs, int fd, char *data, int length) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_READ, do_read(fs, fd, data, length));
+}
 
-    char *tok = strtok(path_cp, "/");
-    int c = 0;
-    while (tok != NULL) {
-        strcpy(token[c++], tok);
-        tok = strtok(NULL, "/");
-    }
-    *length = c;
-    return token;
+int fs_write(sfs_fs *fs, int fd, char *data, int length) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_WRITE, do_write(fs, fd, data, length));
 }
 
-/* Converts a file/directory path to the corresponding inode */
-int name_to_inode(char *path, int type) {
-    int c = 0;
-    char **tok = get_walk_from_root(path, &c);
+int fs_seek(sfs_fs *fs, int fd, int offset, int whence) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_SEEK, do_seek(fs, fd, offset, whence));
+}
 
-    int inode_id = 0, level = 0;
-    int ret;
-    inode in;
+int fs_close(sfs_fs *fs, int fd) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_CLOSE, do_close(fs, fd));
+}
 
-    while (level < c) {
-        int content_size;
-        char *content = read_file_contents(inode_id, &content_size);
+int fs_opendir(sfs_fs *fs, char *dirpath) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_OPENDIR, do_opendir(fs, dirpath));
+}
 
-        ret = get_inode(mounted_diskptr, inode_id, &in);
-        if (ret == -1) return INVALID;
+int fs_readdir(sfs_fs *fs, int dd, sfs_dirent *entries, int max) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_READDIR, do_readdir(fs, dd, entries, max));
+}
 
-        child *items = parse_content(in.size, content);
-        int nitems = (int)(1.0 * in.size / sizeof(child));
-        int found = 0;
+int fs_readdirplus(sfs_fs *fs, int dd, sfs_dirent_plus *entries, int max) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_READDIRPLUS,
+                     do_readdirplus(fs, dd, entries, max));
+}
 
-        /* Check for file or directory depending on level
-        in last level need to find file and in other levels
-        need to find the intermediate directories
-        */
-        int check_type = type;
-        if (type == SFS_TYPE_F) {
-            check_type = (level < c - 1) ? SFS_TYPE_D : SFS_TYPE_F;
-        }
+int fs_rewinddir(sfs_fs *fs, int dd) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_REWINDDIR, do_rewinddir(fs, dd));
+}
 
-        /* Crawl through items at each level */
-        for (int i = 0; i < nitems; ++i) {
-            if (strcmp(items[i].name, tok[level]) == 0 &&
-                items[i].type == check_type) {
-                /* Found directory */
-                inode_id = items[i].inumber;
-                level++;
-                found = 1;
-                break;
-            }
-        }
+int fs_closedir(sfs_fs *fs, int dd) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_CLOSEDIR, do_closedir(fs, dd));
+}
 
-        free(content);
-        free(items);
+int fs_sync(sfs_fs *fs) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_SYNC, do_sync(fs));
+}
 
-        if (found == 0) {
-            /* intermediate directory not found */
-            inode_id = INVALID;
-            break;
-        }
-    }
+int fs_check(disk *diskptr, int flags, int nthreads, sfs_fsck_report *r) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_CHECK, do_check(diskptr, flags, nthreads, r));
+}
 
-    /* Cleanup */
-    for (int i = 0; i < c; ++i)
-        free(tok[i]);
+int fs_fragmentation(sfs_fs *fs, sfs_frag_report *r,
+                     void (*each)(void *arg, sfs_frag_file *f), void *arg) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_FRAGMENTATION,
+                     do_fragmentation(fs, r, each, arg));
+}
 
-    /* After the walk, inode_id is the final inode */
-    return inode_id;
+int fs_defrag_i(sfs_fs *fs, int inumber) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_DEFRAG_I, do_defrag_i(fs, inumber));
 }
 
-/* Extracts and returns the parent path of the input path */
-char *get_parent_path(char *child_path) {
-    char *p = strrchr(child_path, '/');
-    char *parent_path = (char *)malloc(sizeof(char) * (p - child_path + 2));
-    strncpy(parent_path, child_path, p - child_path + 1);
-    if (p == child_path) {
-        parent_path[p - child_path + 1] = '\0';
-    } else {
-        parent_path[p - child_path] = '\0';
-    }
-    return parent_path;
+int fs_defrag(sfs_fs *fs, int blocks_per_s) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_DEFRAG, do_defrag(fs, blocks_per_s));
 }
 
-/* Adds an empty file to parent directory.
-   Returns file inode no if successful and -1 for other errors.
-   If file already exists then also returns -1
-*/
-int add_file_to_directory(char *filepath) {
-    int ret;
-    uint32_t inumber = name_to_inode(filepath, SFS_TYPE_F);
-    if (inumber == INVALID) {
-        /* File does not exist */
-        char *parent_path = get_parent_path(filepath);
-        uint32_t parent_inode_no = name_to_inode(parent_path, SFS_TYPE_D);
-        if (parent_inode_no == INVALID) return -1;
+int name_to_inode(sfs_fs *fs, char *path, int type) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_NAME_TO_INODE,
+                     do_name_to_inode(fs, path, type));
+}
 
-        /*Parent exists - Create file and update parent*/
-        ret = create_file();
-        if (ret == -1) return -1;
-        inumber = ret;
+int alloc_bit(sfs_fs *fs, int kind, uint32_t goal) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_ALLOC_BIT, do_alloc_bit(fs, kind, goal));
+}
 
-        /* Update parent */
-        child entry;
-        entry.inumber = inumber;
-        entry.type = SFS_TYPE_F;
-        entry.valid = 1;
-        char *chldname = strstr(filepath, parent_path) + strlen(parent_path) +
-                         1;
-        strncpy(entry.name, chldname, MAX_FILENAME);
-        entry.length = strlen(chldname);
-        inode parent_inode;
-
-        ret = get_inode(mounted_diskptr, parent_inode_no, &parent_inode);
-        if (ret == -1) return -1;
+int map_data_blocks(sfs_fs *fs, super_block *s, inode *in, uint32_t *res) {
+    trace_call t = trace_begin();
+    return trace_end(&t, SFS_CALL_MAP_DATA_BLOCKS,
+                     do_map_data_blocks(fs, s, in, res));
+}
 
-        ret = write_i(parent_inode_no, (char *)&entry, sizeof(entry),
-                      parent_inode.size);
-        if (ret == -1) return ret;
+/* Legacy API. The functions below operate on mounted_fs, the file system
+   mounted last by mount
+*/
 
-        /* All ok return inode of newly added file */
-        return inumber;
+/* Formats the disk, see fs_format. A mount of the disk is renewed, its
+   cached lookups and handles refer to the old file system
+*/
+int format(disk *diskptr) {
+    int ret = fs_format(diskptr);
+    if (ret == 0 && mounted_fs != NULL && mounted_fs->diskptr == diskptr) {
+        fs_unmount(mounted_fs);
+        mounted_fs = fs_mount(diskptr, MRD_N);
     }
-    /* File already exists */
-    return -1;
+    return ret;
 }
 
-/*Removes an item/file from the directory listing*/
-int remove_item_from_directory_file(int inumber, char *name, int type) {
-    int ret;
-    inode current;
-    ret = get_inode(mounted_diskptr, inumber, &current);
-    if (ret == -1) return -1;
-
-    int content_size;
-    char *content = read_file_contents(inumber, &content_size);
-    int sz = current.size;
-    int nitems = sz / sizeof(child);
+/* Mounts the filesystem for use, replacing the previous mount */
+int mount(disk *diskptr, int mount_root_directory_flg) {
+    sfs_fs *fs = fs_mount(diskptr, mount_root_directory_flg);
+    if (fs == NULL) return -1;
+    fs_unmount(mounted_fs);
+    mounted_fs = fs;
+    return 0;
+}
 
-    char modified_content[sz];
-    int c = 0;
+int create_file() { return fs_create_file(mounted_fs); }
 
-    for (int i = 0; i < nitems; ++i) {
-        child e = *(child *)(content + i * sizeof(child));
-        if ((strcmp(e.name, name) == 0) && e.type == type) {
-            /* Skip writing to modified content to delete */
-            continue;
-        }
-        memcpy(modified_content + c, &e, sizeof(child));
-        c += sizeof(child);
-    }
+int remove_file(int inumber) { return fs_remove_file(mounted_fs, inumber); }
 
-    /* Update parent directory file */
-    fit_to_size(inumber, 0);
-    ret = write_i(inumber, modified_content, c, 0);
-    if (ret == -1) return -1;
+int stat(int inumber) { return fs_stat(mounted_fs, inumber); }
 
-    /* All ok */
-    return 0;
+int read_i(int inumber, char *data, int length, int offset) {
+    return fs_read_i(mounted_fs, inumber, data, length, offset);
 }
 
-/*  Function to create root directory. Sets inode 0 for the / directory
-    Returns 0 on success and -1 on error
-*/
-int create_root_directory() {
-    /* Root directory is always assigned inode 0 */
+int write_i(int inumber, char *data, int length, int offset) {
+    return fs_write_i(mounted_fs, inumber, data, length, offset);
+}
 
-    /* Fetch superblock and inode 0 */
-    int ret;
-    super_block s;
-    inode in;
+int fit_to_size(int inumber, int size) {
+    return fs_fit_to_size(mounted_fs, inumber, size);
+}
 
-    ret = get_super_block(mounted_diskptr, &s);
-    ret = get_inode(mounted_diskptr, 0, &in);
+int read_file(char *filepath, char *data, int length, int offset) {
+    return fs_read_file(mounted_fs, filepath, data, length, offset);
+}
 
-    /*Delete existing file*/
-    if (in.valid) {
-        remove_file(0);
-    }
+int write_file(char *filepath, char *data, int length, int offset) {
+    return fs_write_file(mounted_fs, filepath, data, length, offset);
+}
 
-    operate_bitmap(mounted_diskptr, s.inode_bitmap_block_idx, 0, 1);
-    initialise_inode(&in);
-    ret = write_inode_to_disk(mounted_diskptr, 0, &in);
+int create_dir(char *dirpath) { return fs_create_dir(mounted_fs, dirpath); }
 
-    if (ret == -1) return -1;
+int remove_dir(char *dirpath) { return fs_remove_dir(mounted_fs, dirpath); }
 
-    /* All ok */
-    return 0;
+int sfs_remove_tree(char *dirpath, int nthreads) {
+    return fs_remove_tree(mounted_fs, dirpath, nthreads);
 }
 
-/*  Read the file - length bytes starting from offset.
-    Returns no of bytes read from file
-*/
-int read_file(char *filepath, char *data, int length, int offset) {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+int sfs_rename(char *oldpath, char *newpath) {
+    return fs_rename(mounted_fs, oldpath, newpath);
+}
 
-    uint32_t inumber = name_to_inode(filepath, SFS_TYPE_F);
-    if (inumber == INVALID) return -1;
-    int ret = read_i(inumber, data, length, offset);
-    return ret;
-};
+int sfs_create_bulk(char *dirpath, char **names, int *types, int n,
+                    int *inumbers) {
+    return fs_create_bulk(mounted_fs, dirpath, names, types, n, inumbers);
+}
 
-/* Writes length bytes from data to the file specified (offset position onwards)
-   If file is not present, the file is created.
-   Return no of bytes writtent to file
-*/
-int write_file(char *filepath, char *data, int length, int offset) {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+int compact_dirs(int max_steps) {
+    return fs_compact_dirs(mounted_fs, max_steps);
+}
 
-    int ret;
-    uint32_t inumber = name_to_inode(filepath, SFS_TYPE_F);
-    if (inumber == INVALID) {
-        /* File does not exists, create an emtpy file*/
-        ret = add_file_to_directory(filepath);
-        if (ret == -1) return -1;
-        inumber = ret;
-    }
-    ret = write_i(inumber, data, length, offset);
-    return ret;
-};
+int sfs_open(char *filepath, int flags) {
+    return fs_open(mounted_fs, filepath, flags);
+}
 
-/*  Creates the directory (other than root directory).
-    To create root directory internal function create_root_directory() (which
-    is called after mounting) should be used.
-    Only adds the directory if the immediate parent directory is present.
-    Return -1 on errors, otherwise returns inode  number of directory
-    created
-*/
-int create_dir(char *dirpath) {
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+int sfs_read(int fd, char *data, int length) {
+    return fs_read(mounted_fs, fd, data, length);
+}
 
-    int c, ret;
-    /* Update parent directory and create empty file */
-    char *parent_path = get_parent_path(dirpath);
+int sfs_write(int fd, char *data, int length) {
+    return fs_write(mounted_fs, fd, data, length);
+}
 
-    if (strcmp(dirpath, "/") == 0) {
-        /* This function should not be used to create root directory,
-           create_root_directory() function should be used, which is called
-           in mount() funtion.
-        */
-        return -1;
-    } else {
-        int parent_inode_no = name_to_inode(parent_path, SFS_TYPE_D);
-        if (parent_inode_no == INVALID) {
-            /* Didnot find parent directory */
-            free(parent_path);
-            return -1;
-        }
-        int child_inode_no = create_file();
-        /* Add directory entry to the file */
-        child entry;
-        entry.inumber = child_inode_no;
-        entry.type = SFS_TYPE_D;
-        char *chldname = strrchr(dirpath, '/') + 1;
-        strncpy(entry.name, chldname, MAX_FILENAME);
-        entry.valid = 1;
-        entry.length = strlen(chldname);
+int sfs_seek(int fd, int offset, int whence) {
+    return fs_seek(mounted_fs, fd, offset, whence);
+}
 
-        inode parent_inode;
-        ret = get_inode(mounted_diskptr, parent_inode_no, &parent_inode);
+int sfs_close(int fd) { return fs_close(mounted_fs, fd); }
 
-        if (ret != -1)
-            ret = write_i(parent_inode_no, (char *)&entry, sizeof(entry),
-                          parent_inode.size);
+int sfs_submit_read(sfs_io *io) { return fs_submit_read(mounted_fs, io); }
 
-        free(parent_path);
-        if (ret == -1)
-            return INVALID;
-        else
-            return child_inode_no;
-    }
+int sfs_submit_write(sfs_io *io) { return fs_submit_write(mounted_fs, io); }
 
-    return ret;
+int sfs_reap(sfs_io **done, int max, int min) {
+    return fs_reap(mounted_fs, done, max, min);
 }
 
-/* Removes directory and recursively deleting all sub-directories and files.
-   Hence this function removes the complete subtree rooted at dirpath
-   Returns 0 on success and -1 otherwise
-*/
-int remove_dir(char *dirpath) {
+int sfs_opendir(char *dirpath) { return fs_opendir(mounted_fs, dirpath); }
 
-    /* Check if filesystem is mounted */
-    if (mounted_diskptr == NULL) return -1;
+int sfs_readdir(int dd, sfs_dirent *entries, int max) {
+    return fs_readdir(mounted_fs, dd, entries, max);
+}
 
-    int ret;
-    inode in;
-    super_block s;
+int sfs_readdirplus(int dd, sfs_dirent_plus *entries, int max) {
+    return fs_readdirplus(mounted_fs, dd, entries, max);
+}
 
-    /* Get dirpath inode */
-    uint32_t inode_no = name_to_inode(dirpath, SFS_TYPE_D);
-    if (inode_no == INVALID) return -1;
+int sfs_rewinddir(int dd) { return fs_rewinddir(mounted_fs, dd); }
 
-    /*Get superblock */
+int sfs_closedir(int dd) { return fs_closedir(mounted_fs, dd); }
 
-    ret = get_super_block(mounted_diskptr, &s);
-    if (ret == -1) return -1;
+void show_stats() { fs_show_stats(mounted_fs); }
 
-    /* Get dirpath inode */
-    ret = get_inode(mounted_diskptr, inode_no, &in);
-    if (ret == -1) return -1;
+void sfs_release_reservations() { fs_release_reservations(mounted_fs); }
 
-    /* Update Parent (if not root itself) */
-    if (strcmp(dirpath, "/") != 0) {
-        char *parent_path = get_parent_path(dirpath);
-        char *child_name = strrchr(dirpath, '/') + 1;
+int sfs_sync() { return fs_sync(mounted_fs); }
 
-        uint32_t parent_inode_no = name_to_inode(parent_path, SFS_TYPE_D);
-        ret = remove_item_from_directory_file(parent_inode_no, child_name,
-                                              SFS_TYPE_D);
-        if (ret == -1) return -1;
-    }
+int sfs_fragmentation(sfs_frag_report *r,
+                      void (*each)(void *arg, sfs_frag_file *f), void *arg) {
+    return fs_fragmentation(mounted_fs, r, each, arg);
+}
 
-    /* Bread First Deletion */
-
-    /* Inode Queue */
-    uint32_t Q[s.inodes + 1];
-    int left = 0, right = 1;
-    Q[0] = inode_no;
-
-    while (left < right) {
-        uint32_t head = Q[left++];
-        /* Arrived at head */
-        int content_size;
-        char *content = read_file_contents(head, &content_size);
-        if (content != NULL) {
-            child entry;
-            for (int i = 0; i < content_size / sizeof(child); i++) {
-                entry = *(child *)(content + i * sizeof(child));
-                if (entry.type == SFS_TYPE_F && entry.valid == 1) {
-                    /* Delete file */
-                    remove_file(entry.inumber);
-                } else if (entry.type == SFS_TYPE_D && entry.valid == 1) {
-                    /* Mark sub-directory for deletion */
-                    Q[right++] = entry.inumber;
-                }
-            }
-        }
-        /* Delete current directory */
-        remove_file(head);
-    }
+int sfs_defrag_i(int inumber) { return fs_defrag_i(mounted_fs, inumber); }
 
-    return 0;
-}
\ No newline at end of file
+int sfs_defrag(int blocks_per_s) { return fs_defrag(mounted_fs, blocks_per_s); }
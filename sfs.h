@@ -4,11 +4,19 @@
 #include <stdint.h>
 
 /* Max length of a file/directory name*/
-#define MAX_FILENAME 20 // max length of file/directory name
+#define MAX_FILENAME 255 // max length of file/directory name
 #define SFS_TYPE_D 1    // Type for directories
 #define SFS_TYPE_F 0    // Type for files
 #define MRD_Y 1         // create new root directory
 #define MRD_N 0         // use existing root directory
+#define SFS_MOUNT_WRITEBACK 2 // fs_mount: buffer writes (see fs_sync)
+
+#define MAX_OPEN_FILES 64 // max no of simultaneously open file handles
+#define MAX_OPEN_DIRS 16  // max no of simultaneously open directories
+#define SFS_O_CREAT 1     // sfs_open: create the file if it does not exist
+#define SFS_SEEK_SET 0    // sfs_seek: offset from start of file
+#define SFS_SEEK_CUR 1    // sfs_seek: offset from current position
+#define SFS_SEEK_END 2    // sfs_seek: offset from end of file
 
 const static uint32_t MAGIC = 12345;
 
@@ -19,12 +27,20 @@ typedef struct inode {
     uint32_t indirect;  // indirect pointer
 } inode;
 
+/* The disk is divided in allocation groups of group_blocks blocks, each
+   laid out as inode bitmap, data bitmap, inode table and data blocks (the
+   last group may have fewer data blocks). The *_idx fields locate the
+   structures of group 0, the same offsets are used within every group.
+   Inodes and data blocks are numbered across groups: group g holds inodes
+   [g * group_inodes, (g + 1) * group_inodes) and data blocks
+   [g * group_data_blocks, ...).
+*/
 typedef struct super_block {
     uint32_t magic_number; // File system magic number
     uint32_t blocks; // Number of blocks in file system (except super block)
 
-    uint32_t
-        inode_blocks; // Number of blocks reserved for inodes == 10% of Blocks
+    uint32_t inode_blocks; // Number of blocks reserved for inodes, 10% of
+                           // the blocks by default (see sfs_format_opts)
     uint32_t
         inodes; // Number of inodes in file system == length of inode bit map
     uint32_t
@@ -35,17 +51,336 @@ typedef struct super_block {
         data_block_bitmap_idx; // Block number of the first data bitmap block
     uint32_t data_block_idx;   // Block number of the first data block
     uint32_t data_blocks;      // Number of blocks reserved as data blocks
+
+    uint32_t groups;            // Number of allocation groups
+    uint32_t group_blocks;      // Number of blocks per group
+    uint32_t group_inodes;      // Number of inodes per group
+    uint32_t group_data_blocks; // Number of data blocks per (full) group
+
+    uint32_t journal_block_idx; // Block number of the first journal block
+    uint32_t journal_blocks;    // Number of journal blocks, 0 if no journal
+
+    uint32_t uninit_groups; // Number of groups at the end whose bitmaps and
+                            // inode table are not initialized yet and read
+                            // as zero (see fs_format_lazy)
+    uint32_t reserved_blocks; // Number of data blocks file data may not use
 } super_block;
 
-/* This is the structure written to directories */
-typedef struct child {
-    int valid;               // valid or not
-    int type;                // directory or file
-    char name[MAX_FILENAME]; // Maximum length of a directory/file name
-    int length;              // length of the directory / file name
-    int inumber;             // inode no of the directory / file
-} child;
+/* Classes of the blocks of a mounted file system in block I/O traces (see
+   disk_trace_start)
+*/
+#define SFS_BLOCK_OTHER 0        // unused or not mounted
+#define SFS_BLOCK_SUPER 1        // superblock
+#define SFS_BLOCK_INODE_BITMAP 2 // inode bitmap
+#define SFS_BLOCK_DATA_BITMAP 3  // data block bitmap
+#define SFS_BLOCK_INODE_TABLE 4  // inode table
+#define SFS_BLOCK_DATA 5         // data block, of a file or directory
+#define SFS_BLOCK_JOURNAL 6      // journal
+#define SFS_BLOCK_CLASSES 7
+
+/* Format parameters (see fs_format_opts). A field left 0 takes the default
+   of fs_format
+*/
+#define SFS_LAYOUT_GROUPS 0 // allocation groups of group_blocks blocks
+#define SFS_LAYOUT_FLAT 1   // a single group spanning the disk
+
+typedef struct sfs_format_opts {
+    uint32_t bytes_per_inode; // disk bytes per inode, default 10% of the
+                              // blocks hold inodes (320 bytes per inode)
+    uint32_t block_size;      // must be BLOCKSIZE, fixed at compile time
+    uint32_t reserved_blocks; // data blocks kept for directories, file
+                              // writes fail with less free
+    int layout;               // SFS_LAYOUT_*
+    uint32_t group_blocks;    // SFS_LAYOUT_GROUPS: blocks per group
+    int journal_blocks;       // journal size, -1 for the default size of
+                              // fs_format_journaled, 0 for none
+    int lazy;                 // initialize the groups after mount
+} sfs_format_opts;
+
+/* Metadata journal (see fs_format_journaled), at the end of the disk. The
+   first journal block holds the journal_header, the others form a circular
+   log of transactions. A transaction is written as descriptor blocks, each
+   followed by the blocks it tags, and a commit block with a checksum of all
+   of them; it is replayed at mount only if the checksum matches.
+*/
+#define JOURNAL_MAGIC 0x4a524e4c        // first word of the journal header
+#define JOURNAL_DESC_MAGIC 0x4a445343   // first word of a descriptor block
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54 // first word of a commit block
+#define JOURNAL_REVOKE 0x80000000       // tag flag: block freed, not logged
+
+typedef struct journal_header {
+    uint32_t magic;    // JOURNAL_MAGIC
+    uint32_t tail;     // log offset of the oldest transaction to replay
+    uint32_t sequence; // sequence no of that transaction
+} journal_header;
+
+typedef struct journal_desc {
+    uint32_t magic;    // JOURNAL_DESC_MAGIC
+    uint32_t sequence; // transaction
+    uint32_t count;    // no of tags
+    uint32_t tags[];   // home block no of each logged block that follows, or
+                       // JOURNAL_REVOKE | block no of a freed block
+} journal_desc;
+
+typedef struct journal_commit_block {
+    uint32_t magic;    // JOURNAL_COMMIT_MAGIC
+    uint32_t sequence; // transaction
+    uint32_t blocks;   // no of descriptor and logged blocks
+    uint32_t checksum; // of the descriptor and logged blocks, in log order
+} journal_commit_block;
+
+/* Directory blocks hold variable length entries. The dirent_block header
+   is followed by an array of fixed size slots, one per entry, and the
+   records (inode no followed by the name) are packed downwards from the
+   end of the block. Removed entries keep their slot with length 0 until it
+   is reused.
+*/
+typedef struct dirent_block {
+    uint16_t count; // no of slots, including removed ones
+    uint16_t names; // offset of the lowest record in the block
+    uint16_t live;  // no of entries in use
+    uint16_t used;  // bytes taken by the records of the entries in use
+} dirent_block;
+
+typedef struct dirent_slot {
+    uint32_t hash;   // hash of the name
+    uint16_t offset; // offset of the record in the block
+    uint8_t length;  // length of the name, 0 if removed
+    uint8_t type;    // directory or file
+} dirent_slot;
+
+/* Directories larger than DX_THRESHOLD blocks are converted to an htree
+   style hashed index. Block 0 of an indexed directory holds the index root,
+   index entries map ranges of name hashes to leaf blocks, which are
+   directory blocks. Large indexes get one level of interior index nodes.
+*/
+#define DX_THRESHOLD 1           // max blocks of a linear directory
+#define DX_ROOT_MAGIC 0x44585230 // first word of an index root block
+#define DX_NODE_MAGIC 0x44584e30 // first word of an interior index block
+
+/* Header of a directory index block, followed by dx_entry records */
+typedef struct dx_header {
+    uint32_t magic;  // DX_ROOT_MAGIC or DX_NODE_MAGIC
+    uint32_t levels; // root: 0 if entries point to leaves, 1 if to nodes
+    uint32_t count;  // no of entries in use
+    uint32_t limit;  // max no of entries in the block
+} dx_header;
+
+/* Index entry, sorted by hash. The first entry of a block covers hash 0 */
+typedef struct dx_entry {
+    uint32_t hash;  // lowest name hash covered by the block
+    uint32_t block; // block no within the directory file
+} dx_entry;
+
+/* Directory entry returned by sfs_readdir */
+typedef struct sfs_dirent {
+    uint32_t inumber;            // inode no of the directory / file
+    int type;                    // directory or file
+    int length;                  // length of the name
+    char name[MAX_FILENAME + 1]; // name
+} sfs_dirent;
+
+/* Directory entry along with its inode, returned by sfs_readdirplus */
+typedef struct sfs_dirent_plus {
+    sfs_dirent entry;
+    inode attr;
+} sfs_dirent_plus;
+
+/* Result of a consistency check (see fs_check). Every problem is counted
+   once per inode, entry or bitmap bit
+*/
+#define FSCK_REPAIR 1 // fs_check: fix what can be fixed
+
+typedef struct sfs_fsck_report {
+    uint32_t inodes;            // valid inodes
+    uint32_t directories;       // directories reachable from the root
+    uint32_t files;             // files reachable from the root
+    uint32_t data_blocks;       // data blocks used by valid inodes
+    uint32_t journal_pending;   // committed transactions not replayed
+    uint32_t bad_inodes;        // size or block pointers out of range
+    uint32_t duplicate_blocks;  // data blocks used by several inodes
+    uint32_t bad_entries;       // entries to invalid inodes, damaged blocks
+    uint32_t linked_twice;      // inodes reached by more than one entry
+    uint32_t orphan_inodes;     // valid inodes not reachable from the root
+    uint32_t leaked_inodes;     // set in the inode bitmap but invalid
+    uint32_t lost_inodes;       // valid but clear in the inode bitmap
+    uint32_t leaked_blocks;     // set in the data bitmap but not used
+    uint32_t lost_blocks;       // used but clear in the data bitmap
+    uint32_t repaired;          // problems fixed
+} sfs_fsck_report;
+
+/* Fragmentation of a mounted file system (see fs_fragmentation). An extent
+   is a run of data blocks of a file that are consecutive on the disk, in
+   the order of the file
+*/
+typedef struct sfs_frag_file {
+    uint32_t inumber; // inode no of the file or directory
+    uint32_t size;    // size of the file
+    uint32_t blocks;  // no of data blocks, the indirect block not included
+    uint32_t extents; // no of extents of the data blocks
+} sfs_frag_file;
+
+typedef struct sfs_frag_report {
+    uint32_t files;        // valid inodes, files and directories
+    uint32_t mapped;       // of them, with at least one data block
+    uint32_t fragmented;   // of them, with more than one extent
+    uint32_t blocks;       // data blocks of all the files
+    uint32_t extents;      // extents of all the files
+    uint32_t free_blocks;  // free data blocks
+    uint32_t free_extents; // runs of free data blocks consecutive on disk
+    uint32_t largest_free; // longest such run
+} sfs_frag_report;
+
+/* Asynchronous read / write of a file (see fs_submit_read), by inode or by
+   path. The request and its buffer belong to the file system from submit
+   until completion, when result is set and done is called, from another
+   thread, or the request is queued for fs_reap if done is NULL
+*/
+#define SFS_IO_READ 0  // sfs_io: read_i / read_file
+#define SFS_IO_WRITE 1 // sfs_io: write_i / write_file
+
+typedef struct sfs_io {
+    int op;                          // SFS_IO_*, set by the submit function
+    int inumber;                     // inode of the file, -1 to use path
+    char *path;                      // path of the file if inumber is -1
+    char *data;                      // buffer
+    int length;                      // no of bytes to read / write
+    int offset;                      // offset in the file
+    void (*done)(struct sfs_io *io); // completion callback or NULL
+    void *arg;                       // for the caller
+    int result;                      // no of bytes read / written, -1 on error
+    struct sfs_io *next;             // used by the file system
+} sfs_io;
 
+/* Call tracing (see sfs_trace_enable). The entry points of this file and a
+   few internals are timed while tracing is enabled, with the block I/Os the
+   calling thread issued meanwhile. Times and I/Os include those of the
+   traced calls they make
+*/
+enum sfs_call {
+    SFS_CALL_FORMAT, // fs_format_opts and the fs_format variants
+    SFS_CALL_MOUNT,
+    SFS_CALL_UNMOUNT,
+    SFS_CALL_CREATE_FILE,
+    SFS_CALL_REMOVE_FILE,
+    SFS_CALL_STAT,
+    SFS_CALL_READ_I,
+    SFS_CALL_WRITE_I,
+    SFS_CALL_FIT_TO_SIZE,
+    SFS_CALL_READ_FILE,
+    SFS_CALL_WRITE_FILE,
+    SFS_CALL_CREATE_DIR,
+    SFS_CALL_REMOVE_DIR,
+    SFS_CALL_REMOVE_TREE,
+    SFS_CALL_RENAME,
+    SFS_CALL_CREATE_BULK,
+    SFS_CALL_COMPACT_DIRS,
+    SFS_CALL_OPEN,
+    SFS_CALL_READ,
+    SFS_CALL_WRITE,
+    SFS_CALL_SEEK,
+    SFS_CALL_CLOSE,
+    SFS_CALL_OPENDIR,
+    SFS_CALL_READDIR,
+    SFS_CALL_READDIRPLUS,
+    SFS_CALL_REWINDDIR,
+    SFS_CALL_CLOSEDIR,
+    SFS_CALL_SYNC,
+    SFS_CALL_CHECK,
+    SFS_CALL_FRAGMENTATION,
+    SFS_CALL_DEFRAG_I,
+    SFS_CALL_DEFRAG,
+    SFS_CALL_NAME_TO_INODE,   // path lookup
+    SFS_CALL_ALLOC_BIT,       // inode / data block allocation
+    SFS_CALL_MAP_DATA_BLOCKS, // block map of an inode
+    SFS_CALLS
+};
+
+#define SFS_TRACE_BUCKETS 24 // latency histogram: bucket 0 counts the calls
+                             // under 1 us, bucket i those of [2^(i-1), 2^i)
+                             // us, the last one all the longer calls
+
+typedef struct sfs_call_stats {
+    uint64_t calls;                   // no of calls
+    uint64_t total_ns;                // cumulative latency
+    uint64_t max_ns;                  // longest call
+    uint64_t reads;                   // block reads issued during the calls
+    uint64_t writes;                  // block writes issued during the calls
+    uint64_t hist[SFS_TRACE_BUCKETS]; // calls by latency
+} sfs_call_stats;
+
+typedef struct sfs_trace {
+    sfs_call_stats calls[SFS_CALLS]; // indexed by sfs_call
+} sfs_trace;
+
+/* A mounted file system (see fs_mount). Every function of the fs_ API takes
+   the file system it operates on, so a process can use several volumes at
+   once.
+*/
+typedef struct sfs_fs sfs_fs;
+
+int fs_format(disk *diskptr);
+int fs_format_journaled(disk *diskptr, int journal_blocks);
+int fs_format_lazy(disk *diskptr);
+int fs_format_opts(disk *diskptr, sfs_format_opts *opts);
+
+sfs_fs *fs_mount(disk *diskptr, int mount_root_directory_flg);
+void fs_unmount(sfs_fs *fs);
+
+int fs_create_file(sfs_fs *fs);
+int fs_remove_file(sfs_fs *fs, int inumber);
+int fs_stat(sfs_fs *fs, int inumber);
+int fs_read_i(sfs_fs *fs, int inumber, char *data, int length, int offset);
+int fs_write_i(sfs_fs *fs, int inumber, char *data, int length, int offset);
+int fs_fit_to_size(sfs_fs *fs, int inumber, int size);
+
+int fs_read_file(sfs_fs *fs, char *filepath, char *data, int length,
+                 int offset);
+int fs_write_file(sfs_fs *fs, char *filepath, char *data, int length,
+                  int offset);
+int fs_create_dir(sfs_fs *fs, char *dirpath);
+int fs_remove_dir(sfs_fs *fs, char *dirpath);
+int fs_remove_tree(sfs_fs *fs, char *dirpath, int nthreads);
+
+int fs_rename(sfs_fs *fs, char *oldpath, char *newpath);
+int fs_create_bulk(sfs_fs *fs, char *dirpath, char **names, int *types, int n,
+                   int *inumbers);
+
+int fs_compact_dirs(sfs_fs *fs, int max_steps);
+
+int fs_open(sfs_fs *fs, char *filepath, int flags);
+int fs_read(sfs_fs *fs, int fd, char *data, int length);
+int fs_write(sfs_fs *fs, int fd, char *data, int length);
+int fs_seek(sfs_fs *fs, int fd, int offset, int whence);
+int fs_close(sfs_fs *fs, int fd);
+
+int fs_submit_read(sfs_fs *fs, sfs_io *io);
+int fs_submit_write(sfs_fs *fs, sfs_io *io);
+int fs_reap(sfs_fs *fs, sfs_io **done, int max, int min);
+
+int fs_opendir(sfs_fs *fs, char *dirpath);
+int fs_readdir(sfs_fs *fs, int dd, sfs_dirent *entries, int max);
+int fs_readdirplus(sfs_fs *fs, int dd, sfs_dirent_plus *entries, int max);
+int fs_rewinddir(sfs_fs *fs, int dd);
+int fs_closedir(sfs_fs *fs, int dd);
+
+void fs_show_stats(sfs_fs *fs);
+void fs_release_reservations(sfs_fs *fs);
+int fs_sync(sfs_fs *fs);
+int fs_check(disk *diskptr, int flags, int nthreads, sfs_fsck_report *r);
+
+int fs_fragmentation(sfs_fs *fs, sfs_frag_report *r,
+                     void (*each)(void *arg, sfs_frag_file *f), void *arg);
+int fs_defrag_i(sfs_fs *fs, int inumber);
+int fs_defrag(sfs_fs *fs, int blocks_per_s);
+
+void sfs_trace_enable(int on);
+void sfs_trace_snapshot(sfs_trace *t);
+void sfs_trace_reset();
+int sfs_trace_json(char *buf, int size);
+const char *sfs_call_name(int call);
+
+/* Legacy API, operating on the file system mounted last by mount */
 int format(disk *diskptr);
 
 int mount(disk *diskptr, int mount_roo_directory_flg);
@@ -66,7 +401,37 @@ int read_file(char *filepath, char *data, int length, int offset);
 int write_file(char *filepath, char *data, int length, int offset);
 int create_dir(char *dirpath);
 int remove_dir(char *dirpath);
+int sfs_remove_tree(char *dirpath, int nthreads);
+
+int sfs_rename(char *oldpath, char *newpath);
+int sfs_create_bulk(char *dirpath, char **names, int *types, int n,
+                    int *inumbers);
+
+int compact_dirs(int max_steps);
+
+int sfs_open(char *filepath, int flags);
+int sfs_read(int fd, char *data, int length);
+int sfs_write(int fd, char *data, int length);
+int sfs_seek(int fd, int offset, int whence);
+int sfs_close(int fd);
+
+int sfs_submit_read(sfs_io *io);
+int sfs_submit_write(sfs_io *io);
+int sfs_reap(sfs_io **done, int max, int min);
+
+int sfs_opendir(char *dirpath);
+int sfs_readdir(int dd, sfs_dirent *entries, int max);
+int sfs_readdirplus(int dd, sfs_dirent_plus *entries, int max);
+int sfs_rewinddir(int dd);
+int sfs_closedir(int dd);
 
 void show_stats();
+void sfs_release_reservations();
+int sfs_sync();
+
+int sfs_fragmentation(sfs_frag_report *r,
+                      void (*each)(void *arg, sfs_frag_file *f), void *arg);
+int sfs_defrag_i(int inumber);
+int sfs_defrag(int blocks_per_s);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+#define N 300           // no of requests in flight
+#define SIZE (2 * 4096) // bytes per request
+
+int called = 0;
+
+/* Completion callback, counts the requests that went as expected */
+void done(sfs_io *io) {
+    if (io->result == io->length)
+        __atomic_add_fetch(&called, 1, __ATOMIC_RELEASE);
+}
+
+int main() {
+    remove("async_test_data");
+    disk *d = create_disk("async_test_data", 64 * 1024 * 1024);
+    fs_format(d);
+    sfs_fs *fs = fs_mount(d, MRD_Y);
+    fs_create_dir(fs, "/a");
+
+    /* N writes by path submitted from one thread, reaped from the queue */
+    static sfs_io io[N];
+    static char data[N][SIZE], buf[N][SIZE];
+    static char paths[N][32];
+    for (int i = 0; i < N; ++i) {
+        memset(data[i], 'a' + i % 26, sizeof(data[i]));
+        sprintf(paths[i], "/a/f%d", i);
+        memset(&io[i], 0, sizeof(sfs_io));
+        io[i].inumber = -1;
+        io[i].path = paths[i];
+        io[i].data = data[i];
+        io[i].length = sizeof(data[i]);
+        io[i].arg = (void *)(long)i;
+    }
+    int ok = 1;
+    for (int i = 0; i < N; ++i) ok &= fs_submit_write(fs, &io[i]) == 0;
+    check(ok, "writes submitted");
+    sfs_io *completed[N];
+    int n = 0, seen[N];
+    memset(seen, 0, sizeof(seen));
+    while (n < N) {
+        int got = fs_reap(fs, completed + n, N - n, 1);
+        if (got <= 0) break;
+        n += got;
+    }
+    ok = n == N;
+    for (int i = 0; i < n; ++i) {
+        ok &= completed[i]->result == SIZE;
+        seen[(long)completed[i]->arg]++;
+    }
+    for (int i = 0; i < N; ++i) ok &= seen[i] == 1;
+    check(ok, "every write completed once");
+    check(fs_reap(fs, completed, N, 1) == 0, "nothing left to reap");
+
+    /* Reads by inode with a callback */
+    for (int i = 0; i < N; ++i) {
+        io[i].inumber = name_to_inode(fs, paths[i], SFS_TYPE_F);
+        io[i].data = buf[i];
+        io[i].done = done;
+        fs_submit_read(fs, &io[i]);
+    }
+    while (__atomic_load_n(&called, __ATOMIC_ACQUIRE) < N) {
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+    check(memcmp(buf, data, sizeof(buf)) == 0, "data read back");
+
+    /* Errors are reported in the result */
+    sfs_io bad;
+    memset(&bad, 0, sizeof(bad));
+    bad.inumber = -1;
+    check(fs_submit_read(fs, &bad) == -1, "request without buffer refused");
+    bad.path = "/a/missing";
+    bad.data = buf[0];
+    bad.length = BLOCKSIZE;
+    sfs_io *one;
+    check(fs_submit_read(fs, &bad) == 0 && fs_reap(fs, &one, 1, 1) == 1 &&
+              one == &bad && bad.result == -1,
+          "error completed");
+
+    /* Unmount runs the requests still submitted */
+    for (int i = 0; i < N; ++i) {
+        memset(data[i], 'A' + i % 26, sizeof(data[i]));
+        io[i].inumber = -1;
+        io[i].data = data[i];
+        io[i].done = NULL;
+        fs_submit_write(fs, &io[i]);
+    }
+    fs_unmount(fs);
+    fs = fs_mount(d, MRD_N);
+    ok = 1;
+    for (int i = 0; i < N; ++i)
+        ok &= fs_read_file(fs, paths[i], buf[i], sizeof(buf[i]), 0) ==
+                  sizeof(buf[i]) &&
+              memcmp(buf[i], data[i], sizeof(buf[i])) == 0;
+    check(ok, "submitted writes done at unmount");
+    fs_unmount(fs);
+
+    sfs_fsck_report r;
+    check(fs_check(d, 0, 2, &r) == 0 && r.files == N, "consistent");
+
+    fclose(d->data);
+    free_disk(d);
+    remove("async_test_data");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,23 @@
+#ifndef SFS_TEST_CHECK_H
+#define SFS_TEST_CHECK_H
+
+#include <stdio.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+
+/* Shared by the tests: each one reports PASS / FAIL per check and exits
+   with the no of failures */
+
+/* internal to sfs.c */
+int name_to_inode(sfs_fs *fs, char *path, int type);
+int get_super_block(disk *diskptr, super_block *s);
+
+int failures = 0;
+
+void check(int cond, char *what) {
+    printf("%s: %s\n", cond ? "PASS" : "FAIL", what);
+    if (!cond) failures++;
+}
+
+#endif
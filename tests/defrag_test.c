@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+#define FILES 8
+#define BLOCKS 40 // blocks per file, past the direct pointers
+
+sfs_fs *fs;
+int inodes[FILES];
+char data[FILES][BLOCKS * 4096];
+int stop = 0, bad_reads = 0;
+
+/* Writes the files a block at a time in turn, so their blocks interleave */
+void write_interleaved() {
+    char path[32];
+    for (int f = 0; f < FILES; ++f) {
+        sprintf(path, "/f%d", f);
+        fs_write_file(fs, path, "", 0, 0);
+        inodes[f] = name_to_inode(fs, path, SFS_TYPE_F);
+        for (int i = 0; i < sizeof(data[f]); ++i)
+            data[f][i] = 'a' + (f * 7 + i / BLOCKSIZE) % 26;
+    }
+    for (int b = 0; b < BLOCKS; ++b)
+        for (int f = 0; f < FILES; ++f)
+            fs_write_i(fs, inodes[f], data[f] + b * BLOCKSIZE, BLOCKSIZE,
+                       b * BLOCKSIZE);
+}
+
+int files_intact() {
+    static char buf[BLOCKS * 4096];
+    int ok = 1;
+    for (int f = 0; f < FILES; ++f)
+        ok &= fs_read_i(fs, inodes[f], buf, sizeof(buf), 0) == sizeof(buf) &&
+              memcmp(buf, data[f], sizeof(buf)) == 0;
+    return ok;
+}
+
+/* Reads the files through handles while they are moved */
+void *reader(void *arg) {
+    static char buf[BLOCKS * 4096];
+    char path[32];
+    int fd[FILES];
+    for (int f = 0; f < FILES; ++f) {
+        sprintf(path, "/h%d", f);
+        fd[f] = fs_open(fs, path, 0);
+    }
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        for (int f = 0; f < FILES; ++f) {
+            fs_seek(fs, fd[f], 0, SFS_SEEK_SET);
+            if (fs_read(fs, fd[f], buf, sizeof(buf)) != sizeof(buf) ||
+                memcmp(buf, data[f], sizeof(buf)) != 0)
+                bad_reads++;
+        }
+    }
+    for (int f = 0; f < FILES; ++f) fs_close(fs, fd[f]);
+    return NULL;
+}
+
+/* Records the extents of every file in arg */
+void record(void *arg, sfs_frag_file *f) {
+    ((uint32_t *)arg)[f->inumber] = f->extents;
+}
+
+int main() {
+    remove("defrag_test_data");
+    disk *d = create_disk("defrag_test_data", 32 * 1024 * 1024);
+    sfs_frag_report r;
+    static uint32_t extents[65536];
+
+    /* Fragmentation reported per file and for the volume */
+    fs_format(d);
+    fs = fs_mount(d, MRD_Y);
+    check(fs_fragmentation(fs, &r, NULL, NULL) == 0 && r.files == 1 &&
+              r.free_blocks > 0 && r.free_extents == 1 &&
+              r.largest_free == r.free_blocks,
+          "empty volume");
+    write_interleaved();
+    fs_release_reservations(fs);
+    check(fs_fragmentation(fs, &r, record, extents) == 0 &&
+              r.files == FILES + 1 && r.fragmented == FILES &&
+              r.blocks == FILES * BLOCKS + 1, // and the root directory
+          "interleaved files fragmented");
+    int ok = 1;
+    for (int f = 0; f < FILES; ++f) ok &= extents[inodes[f]] == BLOCKS;
+    check(ok, "one extent per block");
+
+    /* One file moved to a single extent */
+    check(fs_defrag_i(fs, inodes[0]) == BLOCKS, "file moved");
+    fs_fragmentation(fs, &r, record, extents);
+    check(extents[inodes[0]] == 1 && r.fragmented == FILES - 1,
+          "file in one extent");
+    check(fs_defrag_i(fs, inodes[0]) == 0, "contiguous file left in place");
+    check(files_intact(), "contents kept");
+    uint32_t free_before = r.free_blocks;
+
+    /* Whole volume, throttled */
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int moved = fs_defrag(fs, 1000);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double seconds = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    check(moved == (FILES - 1) * BLOCKS, "volume defragmented");
+    check(seconds >= moved / 1000.0 * 0.9, "rate limited");
+    fs_fragmentation(fs, &r, NULL, NULL);
+    check(r.fragmented == 0 && r.extents == FILES + 1 &&
+              r.free_blocks == free_before,
+          "no fragmented file, no block leaked");
+    check(files_intact(), "contents kept after defrag");
+    fs_unmount(fs);
+    sfs_fsck_report c;
+    check(fs_check(d, 0, 2, &c) == 0, "consistent after defrag");
+
+    /* Online, with a journal and write-back: readers through open handles
+       see the file before or after it moved, and the result survives a
+       remount */
+    fs_format_journaled(d, 0);
+    fs = fs_mount(d, MRD_Y | SFS_MOUNT_WRITEBACK);
+    char path[64];
+    for (int f = 0; f < FILES; ++f) {
+        sprintf(path, "/h%d", f);
+        fs_write_file(fs, path, "", 0, 0);
+    }
+    fs_create_dir(fs, "/dir");
+    write_interleaved();
+    for (int f = 0; f < FILES; ++f) {
+        sprintf(path, "/h%d", f);
+        fs_write_file(fs, path, data[f], sizeof(data[f]), 0);
+        /* grows the directory between the blocks of the files */
+        for (int i = 0; i < 40; ++i) {
+            snprintf(path, sizeof(path), "/dir/a long name to fill blocks %d-%d",
+                     f, i);
+            fs_write_file(fs, path, "", 0, 0);
+        }
+    }
+    fs_release_reservations(fs);
+    fs_fragmentation(fs, &r, NULL, NULL);
+    check(r.fragmented > FILES, "files and directory fragmented");
+    pthread_t th;
+    pthread_create(&th, NULL, reader, NULL);
+    moved = fs_defrag(fs, 0);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(th, NULL);
+    check(moved > 0 && bad_reads == 0, "reads during defrag");
+    fs_release_reservations(fs);
+    fs_fragmentation(fs, &r, NULL, NULL);
+    check(r.fragmented == 0, "files and directories defragmented");
+    fs_unmount(fs);
+
+    fs = fs_mount(d, MRD_N);
+    static char buf[BLOCKS * 4096];
+    ok = files_intact();
+    for (int f = 0; f < FILES; ++f) {
+        sprintf(path, "/h%d", f);
+        ok &= fs_read_file(fs, path, buf, sizeof(buf), 0) == sizeof(buf) &&
+              memcmp(buf, data[f], sizeof(buf)) == 0;
+    }
+    snprintf(path, sizeof(path), "/dir/a long name to fill blocks %d-%d",
+             FILES - 1, 39);
+    ok &= fs_read_file(fs, path, buf, 1, 0) == 0;
+    check(ok, "contents kept after remount");
+    fs_unmount(fs);
+
+    check(fs_check(d, 0, 2, &c) == 0, "consistent after online defrag");
+
+    fclose(d->data);
+    free_disk(d);
+    remove("defrag_test_data");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
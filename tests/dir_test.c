@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+/* internal to sfs.c */
+int add_file_to_directory(sfs_fs *fs, char *filepath);
+extern sfs_fs *mounted_fs;
+int get_inode(disk *diskptr, int inumber, inode *in);
+int get_all_data_blocks(disk *diskptr, int inumber, uint32_t *res);
+
+disk *d;
+
+/* Returns the size of the directory at path */
+int dir_size(char *path) {
+    inode in;
+    get_inode(d, name_to_inode(mounted_fs, path, SFS_TYPE_D), &in);
+    return in.size;
+}
+
+/* Returns 1 if the file at path can be read and holds data */
+int file_has(char *path, char *data) {
+    char buf[100];
+    memset(buf, 0, 100);
+    int ret = read_file(path, buf, 100, 0);
+    return ret == strlen(data) + 1 && strcmp(buf, data) == 0;
+}
+
+void lookup_cache_test() {
+    create_dir("/a");
+    create_dir("/a/b");
+    create_dir("/a/b/c");
+
+    /* Negative lookup followed by creation */
+    check(read_file("/a/b/c/f.txt", NULL, 0, 0) == -1, "missing file");
+    write_file("/a/b/c/f.txt", "one", 4, 0);
+    check(file_has("/a/b/c/f.txt", "one"), "created after negative lookup");
+
+    /* Repeated lookups are served from the cache: resolving a deep path
+       costs no more block reads than resolving a file in the root */
+    write_file("/g.txt", "root", 5, 0);
+    sfs_close(sfs_open("/a/b/c/f.txt", 0));
+    sfs_close(sfs_open("/g.txt", 0));
+    int r0 = d->reads;
+    sfs_close(sfs_open("/a/b/c/f.txt", 0));
+    int r1 = d->reads;
+    sfs_close(sfs_open("/g.txt", 0));
+    int r2 = d->reads;
+    check(r1 - r0 == r2 - r1, "deep lookup served from cache");
+
+    /* Removal and re-creation of the subtree */
+    remove_dir("/a/b");
+    check(!file_has("/a/b/c/f.txt", "one"), "removed with subtree");
+    check(create_dir("/a/b") != -1 && create_dir("/a/b/c") != -1,
+          "recreate directories");
+    check(!file_has("/a/b/c/f.txt", "one"), "no stale lookup after remove");
+    write_file("/a/b/c/f.txt", "two", 4, 0);
+    check(file_has("/a/b/c/f.txt", "two"), "recreated file");
+}
+
+void large_directory_test() {
+    char path[64];
+    int n = 3000, ok = 1;
+    create_dir("/big");
+    for (int i = 0; i < n; ++i) {
+        sprintf(path, "/big/f%d", i);
+        if (write_file(path, path, strlen(path) + 1, 0) != strlen(path) + 1)
+            ok = 0;
+    }
+    check(ok, "create files in indexed directory");
+    check(write_file("/big/f10", NULL, 0, 0) == 0 &&
+              add_file_to_directory(mounted_fs, "/big/f10") == -1,
+          "duplicate name detected");
+    check(create_dir("/big/sub") != -1 && write_file("/big/sub/x", "x", 2, 0),
+          "sub-directory in indexed directory");
+
+    for (int i = 0; i < n; i += 7) {
+        sprintf(path, "/big/f%d", i);
+        if (!file_has(path, path)) ok = 0;
+    }
+    check(ok, "lookup in indexed directory");
+    check(!file_has("/big/f3000", "/big/f3000"), "missing name");
+
+    remove_dir("/big/sub");
+    check(!file_has("/big/sub/x", "x"), "remove from indexed directory");
+
+    check(remove_dir("/big") == 0 && !file_has("/big/f1", "/big/f1"),
+          "remove indexed directory");
+}
+
+void tombstone_test() {
+    char path[64];
+    create_dir("/t");
+    for (int i = 0; i < 10; ++i) {
+        sprintf(path, "/t/d%d", i);
+        create_dir(path);
+    }
+    int size = dir_size("/t");
+
+    int w0 = d->writes;
+    remove_dir("/t/d3");
+    int w1 = d->writes;
+    remove_dir("/t/d4");
+    int w2 = d->writes;
+    /* removing an empty directory also frees its inode */
+    check(w1 - w0 == w2 - w1 && dir_size("/t") == size,
+          "removal marks the entry in place");
+
+    create_dir("/t/n1");
+    check(dir_size("/t") == size &&
+              name_to_inode(mounted_fs, "/t/n1", SFS_TYPE_D) != -1,
+          "removed slot reused");
+
+    check(compact_dirs(100) >= 1 && dir_size("/t") == size,
+          "compaction squeezes out removed entries");
+    check(name_to_inode(mounted_fs, "/t/d9", SFS_TYPE_D) != -1 &&
+              name_to_inode(mounted_fs, "/t/d4", SFS_TYPE_D) == -1,
+          "entries intact after compaction");
+
+    /* An emptied linear directory releases its block */
+    create_dir("/e");
+    write_file("/e/f", "f", 2, 0);
+    sfs_rename("/e/f", "/f");
+    check(dir_size("/e") == 4096, "emptied directory keeps its block");
+    compact_dirs(100);
+    check(dir_size("/e") == 0, "compaction frees emptied directory block");
+
+    /* An indexed directory emptied again shrinks back */
+    int n = 1000;
+    for (int i = 0; i < n; ++i) {
+        sprintf(path, "/t/m%d", i);
+        create_dir(path);
+    }
+    int big = dir_size("/t");
+    for (int i = 0; i < n; ++i) {
+        sprintf(path, "/t/m%d", i);
+        remove_dir(path);
+    }
+    check(dir_size("/t") == big, "indexed removal keeps blocks");
+    while (compact_dirs(10) > 0)
+        ;
+    check(dir_size("/t") <= size, "compaction shrinks emptied index");
+    check(name_to_inode(mounted_fs, "/t/d9", SFS_TYPE_D) != -1 &&
+              name_to_inode(mounted_fs, "/t/m5", SFS_TYPE_D) == -1,
+          "entries intact after index compaction");
+}
+
+/* Lists the directory at path in batches and checks every entry */
+void readdir_test() {
+    char path[64];
+    int n = 500;
+    create_dir("/ls");
+    for (int i = 0; i < n; ++i) {
+        sprintf(path, "/ls/e%d", i);
+        if (i % 2)
+            write_file(path, path, i, 0);
+        else
+            create_dir(path);
+    }
+    remove_dir("/ls/e8");
+
+    int dd = sfs_opendir("/ls");
+    check(dd >= 0, "opendir");
+    char *seen = (char *)calloc(n, 1);
+    sfs_dirent batch[37];
+    int got, total = 0, ok = 1;
+    while ((got = sfs_readdir(dd, batch, 37)) > 0) {
+        for (int i = 0; i < got; ++i) {
+            int k = atoi(batch[i].name + 1);
+            if (seen[k] || batch[i].type != (k % 2 ? SFS_TYPE_F : SFS_TYPE_D))
+                ok = 0;
+            seen[k] = 1;
+        }
+        total += got;
+    }
+    check(got == 0 && ok && total == n - 1 && !seen[8], "readdir batches");
+
+    check(sfs_rewinddir(dd) == 0, "rewinddir");
+    sfs_dirent_plus plus[50];
+    ok = 1;
+    total = 0;
+    while ((got = sfs_readdirplus(dd, plus, 50)) > 0) {
+        for (int i = 0; i < got; ++i) {
+            int k = atoi(plus[i].entry.name + 1);
+            if (!plus[i].attr.valid || plus[i].attr.size != (k % 2 ? k : 0))
+                ok = 0;
+        }
+        total += got;
+    }
+    check(ok && total == n - 1, "readdirplus attributes");
+    check(sfs_closedir(dd) == 0 && sfs_readdir(dd, batch, 1) == -1,
+          "closedir");
+    free(seen);
+
+    /* Small (linear) directory */
+    dd = sfs_opendir("/a/b");
+    check(sfs_readdir(dd, batch, 37) == 1 && strcmp(batch[0].name, "c") == 0,
+          "readdir of linear directory");
+    sfs_closedir(dd);
+}
+
+void rename_test() {
+    create_dir("/src");
+    create_dir("/src/deep");
+    create_dir("/dst");
+    write_file("/src/deep/f", "deep", 5, 0);
+
+    int length = 100000;
+    char *x = (char *)malloc(length);
+    memset(x, 'r', length);
+    x[length - 1] = '\0';
+    write_file("/src/big", x, length, 0);
+
+    int fd = sfs_open("/src/big", 0);
+    int w0 = d->writes;
+    check(sfs_rename("/src/big", "/dst/moved") == 0, "rename file");
+    check(d->writes - w0 < 5, "rename does not copy data");
+    check(read_file("/src/big", x, 1, 0) == -1 &&
+              read_file("/dst/moved", x, length, 0) == length,
+          "file reachable only at new path");
+    check(sfs_seek(fd, 0, SFS_SEEK_END) == length, "open handle survives");
+    sfs_close(fd);
+
+    check(sfs_rename("/src/deep", "/dst/deep2") == 0 &&
+              file_has("/dst/deep2/f", "deep") &&
+              !file_has("/src/deep/f", "deep"),
+          "rename directory with subtree");
+    check(sfs_rename("/dst", "/dst/deep2/x") == -1,
+          "directory can not move inside itself");
+    check(sfs_rename("/src/none", "/dst/none") == -1, "missing source");
+
+    write_file("/dst/a", "aaa", 4, 0);
+    write_file("/dst/b", "bbb", 4, 0);
+    check(sfs_rename("/dst/a", "/dst/b") == 0 && file_has("/dst/b", "aaa") &&
+              !file_has("/dst/a", "aaa"),
+          "rename replaces existing file");
+    check(sfs_rename("/dst/b", "/dst/deep2") == -1,
+          "file can not replace a directory");
+
+    /* Into and out of an indexed directory */
+    check(sfs_rename("/dst/b", "/big2/b") == -1, "missing target parent");
+    create_dir("/big2");
+    char path[64];
+    for (int i = 0; i < 300; ++i) {
+        sprintf(path, "/big2/d%d", i);
+        create_dir(path);
+    }
+    check(sfs_rename("/dst/b", "/big2/b") == 0 && file_has("/big2/b", "aaa"),
+          "rename into indexed directory");
+    check(sfs_rename("/big2/d7", "/d7") == 0 &&
+              name_to_inode(mounted_fs, "/d7", SFS_TYPE_D) != -1 &&
+              name_to_inode(mounted_fs, "/big2/d7", SFS_TYPE_D) == -1,
+          "rename out of indexed directory");
+    free(x);
+}
+
+void long_name_test() {
+    char name[300], path[320];
+    create_dir("/long");
+
+    /* Names up to MAX_FILENAME */
+    memset(name, 'n', MAX_FILENAME);
+    name[MAX_FILENAME] = '\0';
+    sprintf(path, "/long/%s", name);
+    check(write_file(path, "max", 4, 0) == 4 && file_has(path, "max"),
+          "longest name");
+    strcat(path, "x");
+    check(write_file(path, "x", 2, 0) == -1 && create_dir(path) == -1,
+          "name too long");
+
+    /* Names differing past the old 20 byte limit */
+    check(write_file("/long/a_common_prefix_of_length_1", "1", 2, 0) == 2 &&
+              write_file("/long/a_common_prefix_of_length_2", "2", 2, 0) ==
+                  2 &&
+              file_has("/long/a_common_prefix_of_length_1", "1") &&
+              file_has("/long/a_common_prefix_of_length_2", "2"),
+          "long names kept apart");
+
+    int dd = sfs_opendir("/long");
+    sfs_dirent batch[8];
+    int n = sfs_readdir(dd, batch, 8), ok = 0;
+    for (int i = 0; i < n; ++i)
+        if (batch[i].length == MAX_FILENAME && strcmp(batch[i].name, name) == 0)
+            ok = 1;
+    sfs_closedir(dd);
+    check(n == 3 && ok, "readdir returns full names");
+
+    /* Short names are packed densely: 200 entries fit one block */
+    create_dir("/dense");
+    for (int i = 0; i < 200; ++i) {
+        sprintf(path, "/dense/f%d", i);
+        write_file(path, NULL, 0, 0);
+    }
+    ok = 1;
+    for (int i = 0; i < 200; ++i) {
+        sprintf(path, "/dense/f%d", i);
+        if (name_to_inode(mounted_fs, path, SFS_TYPE_F) == -1) ok = 0;
+    }
+    check(ok && dir_size("/dense") == 4096, "short names packed in a block");
+    check(remove_dir("/long") == 0 && remove_dir("/dense") == 0,
+          "remove long name directories");
+}
+
+void bulk_create_test() {
+    int n = 600;
+    char **names = (char **)malloc(sizeof(char *) * n);
+    int *types = (int *)malloc(sizeof(int) * n);
+    int *inumbers = (int *)malloc(sizeof(int) * n);
+    for (int i = 0; i < n; ++i) {
+        names[i] = (char *)malloc(32);
+        sprintf(names[i], "bulk_entry_%d", i);
+        types[i] = i % 10 == 0 ? SFS_TYPE_D : SFS_TYPE_F;
+    }
+
+    /* Linear directory turned into an indexed one by a single batch */
+    create_dir("/bulk");
+    write_file("/bulk/bulk_entry_1", "old", 4, 0);
+    int w0 = d->writes;
+    int got = sfs_create_bulk("/bulk", names, types, n, inumbers);
+    int w1 = d->writes;
+    check(got == n - 1 && inumbers[1] == -1 && inumbers[0] != -1,
+          "bulk create skips existing names");
+    check(w1 - w0 < n / 10, "bulk create batches the writes");
+
+    int ok = 1;
+    char path[64];
+    for (int i = 0; i < n; ++i) {
+        sprintf(path, "/bulk/%s", names[i]);
+        if (i != 1 && name_to_inode(mounted_fs, path, types[i]) != inumbers[i]) ok = 0;
+    }
+    check(ok && file_has("/bulk/bulk_entry_1", "old"), "bulk entries found");
+    check(write_file("/bulk/bulk_entry_0/x", "x", 2, 0) == 2 &&
+              write_file("/bulk/bulk_entry_5", "five", 5, 0) == 5 &&
+              file_has("/bulk/bulk_entry_5", "five"),
+          "bulk entries usable");
+
+    /* Batch into the indexed directory, repeating names within it */
+    for (int i = 0; i < n; ++i)
+        sprintf(names[i], "more_%d", i % (n / 2));
+    got = sfs_create_bulk("/bulk", names, types, n, inumbers);
+    check(got == n / 2 && inumbers[n / 2] == -1, "bulk create deduplicates");
+    ok = 1;
+    for (int i = 0; i < n / 2; ++i) {
+        sprintf(path, "/bulk/%s", names[i]);
+        if (name_to_inode(mounted_fs, path, types[i]) != inumbers[i]) ok = 0;
+    }
+    check(ok, "bulk into indexed directory");
+
+    sprintf(names[0], "bad/name");
+    check(sfs_create_bulk("/missing", names, types, 1, inumbers) == -1 &&
+              sfs_create_bulk("/bulk", names, types, 1, inumbers) == 0,
+          "bulk create rejects bad paths");
+    check(remove_dir("/bulk") == 0, "remove bulk directory");
+
+    for (int i = 0; i < n; ++i)
+        free(names[i]);
+    free(names);
+    free(types);
+    free(inumbers);
+}
+
+/* Returns the no of bits set in the bitmap stored in blocks [start, end),
+   after returning the reservations of the allocation pools
+*/
+int used_bits(int start, int end) {
+    char buf[4096];
+    int n = 0;
+    sfs_release_reservations();
+    for (int b = start; b < end; ++b) {
+        read_block(d, b, buf);
+        for (int i = 0; i < 4096; ++i)
+            n += __builtin_popcount((unsigned char)buf[i]);
+    }
+    return n;
+}
+
+/* Builds a tree of 4 levels with 4 directories and 20 files (some with
+   data) in every directory. Returns the no of files
+*/
+int build_tree(char *path, int depth) {
+    char child[128];
+    int n = 0;
+    for (int i = 0; i < 20; ++i) {
+        sprintf(child, "%s/f%d", path, i);
+        write_file(child, child, i % 4 == 0 ? strlen(child) + 1 : 0, 0);
+        n++;
+    }
+    for (int i = 0; depth > 1 && i < 4; ++i) {
+        sprintf(child, "%s/d%d", path, i);
+        create_dir(child);
+        n += build_tree(child, depth - 1);
+    }
+    return n;
+}
+
+void remove_tree_test() {
+    super_block s;
+    get_super_block(d, &s);
+    int inodes0 = used_bits(s.inode_bitmap_block_idx, s.data_block_bitmap_idx);
+    int blocks0 = used_bits(s.data_block_bitmap_idx, s.inode_block_idx);
+
+    create_dir("/tree");
+    int files = build_tree("/tree", 4);
+    int w0 = d->writes;
+    check(remove_dir("/tree") == 0, "remove tree");
+    int w1 = d->writes;
+    check(used_bits(s.inode_bitmap_block_idx, s.data_block_bitmap_idx) == inodes0 &&
+              used_bits(s.data_block_bitmap_idx, s.inode_block_idx) == blocks0,
+          "tree inodes and blocks freed");
+    check(w1 - w0 < files / 4, "tree freed with batched writes");
+    check(name_to_inode(mounted_fs, "/tree/d1/f3", SFS_TYPE_F) == -1 &&
+              name_to_inode(mounted_fs, "/tree", SFS_TYPE_D) == -1,
+          "tree gone");
+
+    /* Walk with several threads */
+    create_dir("/tree");
+    build_tree("/tree", 4);
+    check(sfs_remove_tree("/tree", 4) == 0, "remove tree with threads");
+    check(used_bits(s.inode_bitmap_block_idx, s.data_block_bitmap_idx) == inodes0 &&
+              used_bits(s.data_block_bitmap_idx, s.inode_block_idx) == blocks0,
+          "threaded remove frees everything");
+
+    create_dir("/tree");
+    build_tree("/tree", 2);
+    check(file_has("/tree/d2/f4", "/tree/d2/f4") && remove_dir("/tree") == 0,
+          "tree rebuilt");
+}
+
+/* Two volumes mounted at once through the fs_ API, next to the legacy
+   mount */
+void multi_mount_test() {
+    write_file("/v", "/v", 3, 0);
+    remove("dir_test_data_a");
+    remove("dir_test_data_b");
+    disk *da = create_disk("dir_test_data_a", 4096000);
+    disk *db = create_disk("dir_test_data_b", 4096000);
+    fs_format(da);
+    fs_format(db);
+    sfs_fs *a = fs_mount(da, MRD_Y);
+    sfs_fs *b = fs_mount(db, MRD_Y);
+    check(a != NULL && b != NULL, "mount two volumes");
+
+    char buf[16] = {0};
+    fs_create_dir(a, "/v");
+    fs_create_dir(b, "/v");
+    fs_write_file(a, "/v/f", "volume a", 8, 0);
+    fs_write_file(b, "/v/f", "volume b", 8, 0);
+    check(fs_read_file(a, "/v/f", buf, 8, 0) == 8 &&
+              memcmp(buf, "volume a", 8) == 0 &&
+              fs_read_file(b, "/v/f", buf, 8, 0) == 8 &&
+              memcmp(buf, "volume b", 8) == 0,
+          "volumes hold their own files");
+
+    int fd = fs_open(a, "/v/f", 0);
+    check(fd != -1 && fs_remove_dir(b, "/v") == 0 &&
+              fs_read(a, fd, buf, 8) == 8 && memcmp(buf, "volume a", 8) == 0 &&
+              fs_read_file(b, "/v/f", buf, 8, 0) == -1,
+          "removal on one volume leaves the other alone");
+    fs_close(a, fd);
+    check(file_has("/v", "/v"), "legacy mount unaffected");
+
+    fs_unmount(a);
+    fs_unmount(b);
+    fclose(da->data);
+    fclose(db->data);
+    free_disk(da);
+    free_disk(db);
+    remove("dir_test_data_a");
+    remove("dir_test_data_b");
+}
+
+void *create_and_exit(void *arg) {
+    write_file((char *)arg, "x", 1, 0);
+    return NULL;
+}
+
+/* Inodes and data blocks reserved by the allocation pool of a thread */
+void pool_test() {
+    super_block s;
+    get_super_block(d, &s);
+    int inodes0 = used_bits(s.inode_bitmap_block_idx, s.data_block_bitmap_idx);
+    write_file("/pooled", "x", 1, 0);
+    char buf[4096];
+    read_block(d, s.inode_bitmap_block_idx, buf);
+    int reserved = 0;
+    for (int i = 0; i < 4096; ++i)
+        reserved += __builtin_popcount((unsigned char)buf[i]);
+    check(reserved > inodes0 + 1 &&
+              used_bits(s.inode_bitmap_block_idx, s.data_block_bitmap_idx) ==
+                  inodes0 + 1,
+          "pool reserves inodes and returns them");
+
+    pthread_t t;
+    pthread_create(&t, NULL, create_and_exit, "/pooled2");
+    pthread_join(t, NULL);
+    read_block(d, s.inode_bitmap_block_idx, buf);
+    reserved = 0;
+    for (int i = 0; i < 4096; ++i)
+        reserved += __builtin_popcount((unsigned char)buf[i]);
+    check(reserved == inodes0 + 2 &&
+              name_to_inode(mounted_fs, "/pooled2", SFS_TYPE_F) != -1,
+          "exiting thread returns its reservations");
+}
+
+/* Inodes placed by allocation group on a volume of two groups */
+void group_test() {
+    remove("dir_test_data_g");
+    disk *dg = create_disk("dir_test_data_g", 64 * 1024 * 1024);
+    fs_format(dg);
+    sfs_fs *g = fs_mount(dg, MRD_Y);
+    super_block s;
+    get_super_block(dg, &s);
+    check(g != NULL && s.groups == 2, "volume has two groups");
+
+    /* Directories in the root are spread, their contents stay with them */
+    int a = fs_create_dir(g, "/a");
+    int b = fs_create_dir(g, "/b");
+    check(a / s.group_inodes != b / s.group_inodes,
+          "directories spread over groups");
+    int sub = fs_create_dir(g, "/b/sub");
+    char buf[BLOCKSIZE * 8];
+    memset(buf, 'x', sizeof(buf));
+    fs_write_file(g, "/a/f", buf, sizeof(buf), 0);
+    fs_write_file(g, "/b/sub/f", buf, sizeof(buf), 0);
+    int fa = name_to_inode(g, "/a/f", SFS_TYPE_F);
+    int fb = name_to_inode(g, "/b/sub/f", SFS_TYPE_F);
+    check(sub / s.group_inodes == b / s.group_inodes &&
+              fa / s.group_inodes == a / s.group_inodes &&
+              fb / s.group_inodes == b / s.group_inodes,
+          "inodes placed in the group of their parent");
+
+    /* Data blocks follow their inode, contiguously */
+    uint32_t res[1029];
+    int near = 1;
+    get_all_data_blocks(dg, fb, res);
+    for (int i = 0; i < 8; ++i)
+        near = near && res[i] / s.group_data_blocks == fb / s.group_inodes &&
+               (i == 0 || res[i] == res[i - 1] + 1);
+    check(near, "data blocks contiguous in the group of the inode");
+
+    fs_unmount(g);
+    fclose(dg->data);
+    free_disk(dg);
+    remove("dir_test_data_g");
+}
+
+int main() {
+    remove("dir_test_data");
+    d = create_disk("dir_test_data", 16384000);
+    format(d);
+    mount(d, MRD_Y);
+
+    lookup_cache_test();
+    large_directory_test();
+    tombstone_test();
+    readdir_test();
+    rename_test();
+    long_name_test();
+    bulk_create_test();
+    remove_tree_test();
+    multi_mount_test();
+    group_test();
+    pool_test();
+
+    remove("dir_test_data");
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Fills the disk with a byte, as left by an earlier use */
+void scribble(disk *d, char c) {
+    char buf[BLOCKSIZE];
+    memset(buf, c, BLOCKSIZE);
+    for (int b = 0; b < d->blocks; ++b)
+        write_block(d, b, buf);
+}
+
+/* Creates files in directories spread over the groups and reads some back.
+   Returns 1 if all is well
+*/
+int use(sfs_fs *fs) {
+    char data[3 * BLOCKSIZE], buf[3 * BLOCKSIZE], path[64];
+    memset(data, 'u', sizeof(data));
+    int ok = 1;
+    for (int i = 0; i < 8; ++i) {
+        sprintf(path, "/d%d", i);
+        ok &= fs_create_dir(fs, path) != -1;
+        for (int f = 0; f < 50; ++f) {
+            sprintf(path, "/d%d/f%d", i, f);
+            ok &= fs_write_file(fs, path, data, sizeof(data), 0) ==
+                  sizeof(data);
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        sprintf(path, "/d%d/f49", i);
+        ok &= fs_read_file(fs, path, buf, sizeof(buf), 0) == sizeof(buf) &&
+              memcmp(buf, data, sizeof(buf)) == 0;
+    }
+    return ok;
+}
+
+int main() {
+    remove("format_test_data");
+    disk *d = create_disk("format_test_data", 128 * 1024 * 1024);
+    scribble(d, 0x5a);
+
+    /* Lazy format: only the superblock is written */
+    int w0 = d->writes;
+    double t = now_ms();
+    check(fs_format_lazy(d) == 0, "lazy format");
+    t = now_ms() - t;
+    super_block s;
+    get_super_block(d, &s);
+    check(d->writes - w0 == 1 && s.uninit_groups == s.groups && s.groups > 1,
+          "only the superblock written");
+    check(t < 50, "lazy format takes milliseconds");
+
+    /* Uninitialized groups read as zero, and initialize on first write */
+    sfs_fs *fs = fs_mount(d, MRD_Y);
+    check(fs != NULL && use(fs), "files usable before initialization");
+    fs_unmount(fs);
+    get_super_block(d, &s);
+    check(s.uninit_groups < s.groups, "groups initialized on demand");
+    sfs_fsck_report r;
+    check(fs_check(d, 0, 1, &r) == 0 && r.files == 400,
+          "consistent with groups left uninitialized");
+
+    /* The background thread initializes the rest */
+    fs = fs_mount(d, MRD_N);
+    for (int i = 0; i < 200 && s.uninit_groups > 0; ++i) {
+        struct timespec ts = {0, 50 * 1000 * 1000};
+        nanosleep(&ts, NULL);
+        get_super_block(d, &s);
+    }
+    check(s.uninit_groups == 0, "all groups initialized in the background");
+    char buf[BLOCKSIZE];
+    check(fs_read_file(fs, "/d7/f3", buf, BLOCKSIZE, 0) == BLOCKSIZE &&
+              buf[0] == 'u',
+          "files intact after initialization");
+    fs_unmount(fs);
+    check(fs_check(d, 0, 1, &r) == 0 && r.files == 400,
+          "consistent after initialization");
+
+    /* Unmounted half way: the rest is initialized at the next mount */
+    scribble(d, 0x33);
+    fs_format_lazy(d);
+    fs = fs_mount(d, MRD_Y);
+    fs_unmount(fs);
+    fs = fs_mount(d, MRD_N);
+    check(use(fs), "files usable after a remount");
+    fs_unmount(fs);
+    check(fs_check(d, 0, 1, &r) == 0, "consistent after a remount");
+
+    /* Format parameters */
+    sfs_format_opts o;
+    memset(&o, 0, sizeof(o));
+    o.block_size = 1024;
+    check(fs_format_opts(d, &o) == -1, "other block size rejected");
+    o.block_size = BLOCKSIZE;
+    o.bytes_per_inode = 64 * 1024;
+    check(fs_format_opts(d, &o) == 0, "format with bytes per inode");
+    get_super_block(d, &s);
+    check(s.group_inodes == s.group_blocks * BLOCKSIZE / (64 * 1024) &&
+              s.inode_blocks == s.groups * s.group_inodes / 128,
+          "one inode per 64K");
+    o.bytes_per_inode = 0;
+    o.layout = SFS_LAYOUT_FLAT;
+    check(fs_format_opts(d, &o) == 0, "format as a single group");
+    get_super_block(d, &s);
+    check(s.groups == 1 && s.group_blocks == s.blocks &&
+              s.data_block_idx - s.inode_block_idx == s.inode_blocks,
+          "single group layout");
+    fs = fs_mount(d, MRD_Y);
+    check(use(fs), "files usable on a single group");
+    fs_unmount(fs);
+    check(fs_check(d, 0, 2, &r) == 0 && r.files == 400,
+          "consistent on a single group");
+
+    /* File data stays out of the reserved blocks, directories do not */
+    memset(&o, 0, sizeof(o));
+    o.reserved_blocks = 1000;
+    check(fs_format_opts(d, &o) == 0, "format with reserved blocks");
+    fs = fs_mount(d, MRD_Y);
+    int size = 1000 * BLOCKSIZE;
+    char *big = (char *)calloc(size, 1);
+    char path[64];
+    int f = 0;
+    do
+        sprintf(path, "/big%d", f++);
+    while (fs_write_file(fs, path, big, size, 0) == size);
+    check(fs_write_file(fs, "/one", big, BLOCKSIZE, 0) != BLOCKSIZE,
+          "file writes refused at the reserve");
+    fs_unmount(fs);
+    get_super_block(d, &s);
+    check(fs_check(d, 0, 1, &r) == 0 &&
+              s.data_blocks - r.data_blocks + 64 >= 1000 &&
+              s.data_blocks - r.data_blocks <= 1000 + 64,
+          "free blocks down to the reserve");
+    uint32_t used = r.data_blocks;
+    fs = fs_mount(d, MRD_N);
+    int ok = fs_create_dir(fs, "/names") != -1;
+    for (int i = 0; i < 2000; ++i) {
+        sprintf(path, "/names/a rather long name for a file %d", i);
+        ok &= fs_write_file(fs, path, big, 0, 0) == 0;
+    }
+    check(ok, "directories grow into the reserve");
+    fs_unmount(fs);
+    check(fs_check(d, 0, 1, &r) == 0 && r.data_blocks > used,
+          "consistent with the reserve in use");
+    free(big);
+
+    fclose(d->data);
+    free_disk(d);
+    remove("format_test_data");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+/* internal to sfs.c */
+uint32_t itable_block(super_block *s, uint32_t b);
+uint32_t bitmap_start(super_block *s, int kind, uint32_t g);
+
+/* Flips bit index of the inode (kind 0) or data (kind 1) bitmap */
+void flip_bit(disk *d, int kind, uint32_t index) {
+    super_block s;
+    get_super_block(d, &s);
+    uint32_t span = kind == 0 ? s.group_inodes : s.group_data_blocks;
+    uint32_t g = index / span, i = index % span;
+    uint32_t block = bitmap_start(&s, kind, g) + i / (8 * BLOCKSIZE);
+    unsigned char buf[BLOCKSIZE];
+    read_block(d, block, buf);
+    buf[i % (8 * BLOCKSIZE) / 8] ^= 1 << (7 - i % 8);
+    write_block(d, block, buf);
+}
+
+/* Reads (write 0) or writes (write 1) inode inumber in place */
+void raw_inode(disk *d, uint32_t inumber, inode *in, int write) {
+    super_block s;
+    get_super_block(d, &s);
+    uint32_t per_block = BLOCKSIZE / sizeof(inode);
+    char buf[BLOCKSIZE];
+    uint32_t block = itable_block(&s, inumber / per_block);
+    read_block(d, block, buf);
+    inode *p = (inode *)buf + inumber % per_block;
+    if (write) {
+        *p = *in;
+        write_block(d, block, buf);
+    } else {
+        *in = *p;
+    }
+}
+
+/* Copies the disk file src to dst, as the disk would be found after a crash
+   at this point
+*/
+void crash_image(char *src, char *dst) {
+    FILE *in = fopen(src, "r"), *out = fopen(dst, "w");
+    char buf[BLOCKSIZE];
+    size_t n;
+    while ((n = fread(buf, 1, BLOCKSIZE, in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(in);
+    fclose(out);
+}
+
+int main() {
+    remove("fsck_test_data");
+    disk *d = create_disk("fsck_test_data", 32 * 1024 * 1024);
+    fs_format(d);
+    sfs_fs *fs = fs_mount(d, MRD_Y);
+    char data[20 * BLOCKSIZE], path[64];
+    memset(data, 'f', sizeof(data));
+    fs_create_dir(fs, "/home");
+    for (int i = 0; i < 20; ++i) {
+        sprintf(path, "/home/d%d", i);
+        fs_create_dir(fs, path);
+        for (int f = 0; f < 20; ++f) {
+            sprintf(path, "/home/d%d/f%d", i, f);
+            fs_write_file(fs, path, data, (f + 1) * BLOCKSIZE / 2, 0);
+        }
+    }
+    int a = name_to_inode(fs, "/home/d0/f19", SFS_TYPE_F);
+    int b = name_to_inode(fs, "/home/d1/f19", SFS_TYPE_F);
+    fs_unmount(fs);
+
+    sfs_fsck_report r, r4;
+    check(fs_check(d, 0, 1, &r) == 0, "clean file system");
+    check(r.directories == 22 && r.files == 400 && r.inodes == 422,
+          "every inode reached");
+    check(fs_check(d, 0, 4, &r4) == 0 &&
+              memcmp(&r, &r4, sizeof(sfs_fsck_report)) == 0,
+          "same result with 4 threads");
+
+    /* Bitmap bits out of step with the inodes */
+    super_block s;
+    get_super_block(d, &s);
+    flip_bit(d, 1, s.data_blocks - 1);
+    flip_bit(d, 1, r.data_blocks / 2);
+    flip_bit(d, 0, s.inodes - 1);
+    check(fs_check(d, 0, 2, &r) == 3 && r.leaked_blocks == 1 &&
+              r.lost_blocks == 1 && r.leaked_inodes == 1,
+          "leaked and lost bits found");
+    check(fs_check(d, FSCK_REPAIR, 2, &r) == 3 && r.repaired == 3,
+          "bits repaired");
+    check(fs_check(d, 0, 2, &r) == 0, "clean after repair");
+
+    /* A block shared by two files */
+    inode in, other;
+    raw_inode(d, a, &in, 0);
+    raw_inode(d, b, &other, 0);
+    uint32_t old = in.direct[0];
+    in.direct[0] = other.direct[0];
+    raw_inode(d, a, &in, 1);
+    check(fs_check(d, 0, 2, &r) == 2 && r.duplicate_blocks == 1 &&
+              r.leaked_blocks == 1,
+          "shared block found");
+    in.direct[0] = old;
+    raw_inode(d, a, &in, 1);
+
+    /* An entry of a removed inode, an inode without entry */
+    fs = fs_mount(d, MRD_N);
+    int orphan = fs_create_file(fs);
+    fs_remove_file(fs, b);
+    fs_unmount(fs);
+    check(fs_check(d, 0, 2, &r) == 2 && r.bad_entries == 1 &&
+              r.orphan_inodes == 1,
+          "dangling entry and orphan found");
+    check(fs_check(d, FSCK_REPAIR, 2, &r) == 2 && r.repaired == 1,
+          "dangling entry removed");
+    fs = fs_mount(d, MRD_N);
+    check(name_to_inode(fs, "/home/d1/f19", SFS_TYPE_F) == -1 &&
+              name_to_inode(fs, "/home/d1/f18", SFS_TYPE_F) != -1,
+          "directory intact after repair");
+    fs_remove_file(fs, orphan);
+    fs_unmount(fs);
+    check(fs_check(d, 0, 2, &r) == 0, "clean again");
+
+    /* After a crash the reservations of the allocation pools are leaked */
+    fs = fs_mount(d, MRD_N);
+    for (int f = 0; f < 10; ++f) {
+        sprintf(path, "/home/new%d", f);
+        fs_write_file(fs, path, data, BLOCKSIZE, 0);
+    }
+    crash_image("fsck_test_data", "fsck_test_crash");
+    disk *c = create_disk("fsck_test_crash", 0);
+    check(fs_check(c, 0, 2, &r) > 0 && r.leaked_inodes > 0 &&
+              r.leaked_blocks > 0 && r.lost_inodes + r.lost_blocks == 0,
+          "crash leaks reservations");
+    int problems = fs_check(c, FSCK_REPAIR, 2, &r);
+    check(problems > 0 && r.repaired == problems, "leaks repaired");
+    check(fs_check(c, 0, 2, &r) == 0, "crash image clean after repair");
+    fclose(c->data);
+    free_disk(c);
+    fs_unmount(fs);
+
+    fclose(d->data);
+    free_disk(d);
+    remove("fsck_test_data");
+    remove("fsck_test_crash");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
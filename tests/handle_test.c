@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+int main() {
+    remove("handle_test_data");
+    disk *d = create_disk("handle_test_data", 4096000);
+    format(d);
+    mount(d, MRD_Y);
+    create_dir("/home");
+
+    check(sfs_open("/home/missing.txt", 0) == -1, "open missing file");
+
+    int fd = sfs_open("/home/a.txt", SFS_O_CREAT);
+    check(fd >= 0, "open with create");
+
+    /* Many small writes spanning direct and indirect blocks */
+    int length = 10 * 4096 + 123;
+    char *x = (char *)malloc(length);
+    for (int i = 0; i < length; ++i)
+        x[i] = 'a' + i % 26;
+    int written = 0;
+    while (written < length) {
+        int n = length - written < 1000 ? length - written : 1000;
+        written += sfs_write(fd, x + written, n);
+    }
+    check(written == length, "sequential writes through handle");
+
+    char *y = (char *)malloc(length);
+    check(read_file("/home/a.txt", y, length, 0) == length &&
+              memcmp(x, y, length) == 0,
+          "read_file sees handle writes");
+
+    check(sfs_seek(fd, 5000, SFS_SEEK_SET) == 5000, "seek set");
+    char buf[100];
+    check(sfs_read(fd, buf, 100) == 100 && memcmp(buf, x + 5000, 100) == 0,
+          "read after seek");
+    check(sfs_seek(fd, -10, SFS_SEEK_END) == length - 10, "seek end");
+    check(sfs_read(fd, buf, 100) == 10, "short read at end of file");
+    check(sfs_seek(fd, 1, SFS_SEEK_CUR) == -1, "seek past end fails");
+
+    /* Writes through the path API are seen by an open handle */
+    write_file("/home/a.txt", "HELLO", 5, 0);
+    sfs_seek(fd, 0, SFS_SEEK_SET);
+    check(sfs_read(fd, buf, 5) == 5 && memcmp(buf, "HELLO", 5) == 0,
+          "handle sees write_file update");
+
+    /* Two handles on the same file stay coherent */
+    int fd2 = sfs_open("/home/a.txt", 0);
+    sfs_seek(fd2, 0, SFS_SEEK_END);
+    check(sfs_write(fd2, "tail", 4) == 4, "append through second handle");
+    check(sfs_seek(fd, 0, SFS_SEEK_END) == length + 4,
+          "first handle sees new size");
+
+    check(sfs_close(fd) == 0 && sfs_close(fd2) == 0, "close");
+    check(sfs_read(fd, buf, 1) == -1, "read on closed handle fails");
+
+    int n = 0;
+    while (sfs_open("/home/a.txt", 0) != -1)
+        n++;
+    check(n == MAX_OPEN_FILES, "open file table limit");
+
+    remove("handle_test_data");
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
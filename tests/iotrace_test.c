@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+#define MAX_RECORDS (1 << 20)
+
+disk_trace_header h;
+disk_trace_record *records;
+
+/* Reads the trace file, returns the no of records or -1 */
+int load(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    int n = -1;
+    if (fread(&h, sizeof(h), 1, fp) == 1)
+        n = fread(records, sizeof(disk_trace_record), MAX_RECORDS, fp);
+    fclose(fp);
+    return n;
+}
+
+int main() {
+    records = (disk_trace_record *)malloc(MAX_RECORDS * sizeof(*records));
+    remove("iotrace_test_data");
+    remove("iotrace_test_trace");
+    disk *d = create_disk("iotrace_test_data", 16 * 1024 * 1024);
+    fs_format(d);
+
+    /* Every block I/O recorded, in order */
+    check(disk_trace_start(d, "iotrace_test_trace") == 0, "trace started");
+    check(disk_trace_start(d, "iotrace_test_trace") == -1,
+          "one trace at a time");
+    uint32_t reads = d->reads, writes = d->writes;
+    sfs_fs *fs = fs_mount(d, MRD_Y);
+    char data[8 * BLOCKSIZE];
+    memset(data, 'i', sizeof(data));
+    fs_create_dir(fs, "/dir");
+    fs_write_file(fs, "/dir/f", data, sizeof(data), 0);
+    fs_read_file(fs, "/dir/f", data, sizeof(data), 0);
+    read_block(d, 0, data);
+    fs_unmount(fs);
+    reads = d->reads - reads;
+    writes = d->writes - writes;
+    check(disk_trace_stop(d) == 0, "trace stopped");
+    check(disk_trace_stop(d) == -1, "stopped once");
+
+    int n = load("iotrace_test_trace");
+    check(h.magic == DISK_TRACE_MAGIC && h.block_size == BLOCKSIZE &&
+              h.blocks == d->blocks &&
+              h.record_size == sizeof(disk_trace_record),
+          "header");
+    int counts[3] = {0, 0, 0}, ordered = 1, in_range = 1;
+    for (int i = 0; i < n; ++i) {
+        if (records[i].op <= DISK_TRACE_SYNC) counts[records[i].op]++;
+        if (i > 0 && records[i].ns < records[i - 1].ns) ordered = 0;
+        if (records[i].block >= d->blocks) in_range = 0;
+    }
+    check(n > 0 && counts[DISK_TRACE_READ] == reads &&
+              counts[DISK_TRACE_WRITE] == writes,
+          "every read and write recorded");
+    check(ordered && in_range, "records ordered, blocks on the disk");
+
+    /* Blocks classified while the file system is mounted */
+    int classes[SFS_BLOCK_CLASSES];
+    memset(classes, 0, sizeof(classes));
+    for (int i = 0; i < n; ++i)
+        if (records[i].cls < SFS_BLOCK_CLASSES) classes[records[i].cls]++;
+    int super = 1;
+    for (int i = 0; i < n; ++i)
+        if (records[i].cls == SFS_BLOCK_SUPER) super &= records[i].block == 0;
+    check(super && classes[SFS_BLOCK_SUPER] > 0,
+          "superblock classified");
+    check(classes[SFS_BLOCK_INODE_TABLE] > 0 && classes[SFS_BLOCK_DATA] > 0 &&
+              classes[SFS_BLOCK_DATA_BITMAP] > 0,
+          "metadata and data classified");
+    int data_blocks = 0;
+    for (int i = 0; i < n; ++i)
+        data_blocks += records[i].op == DISK_TRACE_WRITE &&
+                       records[i].cls == SFS_BLOCK_DATA;
+    check(data_blocks >= 8, "file data written to data blocks");
+
+    /* Nothing recorded after the trace stopped */
+    fs = fs_mount(d, MRD_N);
+    fs_read_file(fs, "/dir/f", data, sizeof(data), 0);
+    fs_unmount(fs);
+    check(load("iotrace_test_trace") == n, "nothing recorded after stop");
+
+    /* Unclassified once unmounted */
+    disk_trace_start(d, "iotrace_test_trace");
+    read_block(d, 0, data);
+    disk_trace_stop(d);
+    check(load("iotrace_test_trace") == 1 && records[0].cls == 0,
+          "no class without a mount");
+
+    fclose(d->data);
+    free_disk(d);
+    free(records);
+    remove("iotrace_test_data");
+    remove("iotrace_test_trace");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+/* internal to sfs.c */
+void txn_begin(sfs_fs *fs);
+void txn_end(sfs_fs *fs);
+int journal_checkpoint(sfs_fs *fs);
+
+/* Waits long enough for the journal thread to commit the running
+   transaction (but not to checkpoint it) */
+void wait_commit() {
+    struct timespec ts = {0, 100 * 1000 * 1000};
+    nanosleep(&ts, NULL);
+}
+
+/* Copies the disk file src to dst, as the disk would be found after a crash
+   at this point
+*/
+void crash_image(char *src, char *dst) {
+    FILE *in = fopen(src, "r"), *out = fopen(dst, "w");
+    char buf[BLOCKSIZE];
+    size_t n;
+    while ((n = fread(buf, 1, BLOCKSIZE, in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(in);
+    fclose(out);
+}
+
+/* Flips a byte of block b of the disk file */
+void corrupt_block(disk *d, int b) {
+    char buf[BLOCKSIZE];
+    read_block(d, b, buf);
+    buf[100] ^= 0xff;
+    write_block(d, b, buf);
+}
+
+/* Mounts the crash image, checks that path holds data (or is missing if
+   data is NULL) and unmounts it
+*/
+int image_has(char *image, char *path, char *data, int length) {
+    disk *c = create_disk(image, 0);
+    sfs_fs *fs = fs_mount(c, MRD_N);
+    int ok = fs != NULL;
+    if (ok && data == NULL) {
+        ok = name_to_inode(fs, path, SFS_TYPE_F) == -1;
+    } else if (ok) {
+        char *buf = (char *)malloc(length);
+        ok = fs_read_file(fs, path, buf, length, 0) == length &&
+             memcmp(buf, data, length) == 0;
+        free(buf);
+    }
+    fs_unmount(fs);
+    fclose(c->data);
+    free_disk(c);
+    return ok;
+}
+
+int main() {
+    remove("journal_test_data");
+    disk *d = create_disk("journal_test_data", 16 * 1024 * 1024);
+    check(fs_format_journaled(d, 0) == 0, "format with a journal");
+    super_block s;
+    get_super_block(d, &s);
+    check(s.journal_blocks == d->blocks / 16 &&
+              s.journal_block_idx + s.journal_blocks == d->blocks &&
+              s.blocks == d->blocks - 1 - s.journal_blocks,
+          "journal at the end of the disk");
+
+    sfs_fs *fs = fs_mount(d, MRD_Y);
+    check(fs != NULL, "mount");
+    fs_create_dir(fs, "/home");
+
+    /* Metadata of many creations goes to the disk in a few commits */
+    char data[3 * BLOCKSIZE], path[64];
+    for (int i = 0; i < 3 * BLOCKSIZE; ++i)
+        data[i] = 'a' + i % 26;
+    fs_sync(fs);
+    int w0 = d->writes;
+    for (int i = 0; i < 200; ++i) {
+        sprintf(path, "/home/f%d", i);
+        fs_write_file(fs, path, data, BLOCKSIZE, 0);
+    }
+    int w1 = d->writes;
+    fs_sync(fs);
+    int w2 = d->writes;
+    /* 200 data blocks written in place, the rest is logged */
+    check(w1 - w0 < 200 + 40, "creations write little before sync");
+    check(w2 - w0 < 2 * 200, "creations cost less than two writes each");
+    fs_unmount(fs);
+
+    /* Clean remount */
+    fs = fs_mount(d, MRD_N);
+    char buf[BLOCKSIZE];
+    check(fs_read_file(fs, "/home/f199", buf, BLOCKSIZE, 0) == BLOCKSIZE &&
+              memcmp(buf, data, BLOCKSIZE) == 0,
+          "files present after remount");
+
+    /* Committed but not checkpointed: replayed at mount */
+    fs_write_file(fs, "/home/new", data, 3 * BLOCKSIZE, 0);
+    fs_create_dir(fs, "/home/sub");
+    fs_write_file(fs, "/home/sub/g", data, 100, 0);
+    wait_commit();
+    crash_image("journal_test_data", "journal_test_crash");
+    check(image_has("journal_test_crash", "/home/new", data, 3 * BLOCKSIZE),
+          "committed file recovered");
+    check(image_has("journal_test_crash", "/home/sub/g", data, 100),
+          "committed directory recovered");
+    check(image_has("journal_test_crash", "/home/f7", data, BLOCKSIZE),
+          "older files intact after recovery");
+
+    /* A transaction with a damaged block is not replayed */
+    fs_sync(fs);
+    fs_write_file(fs, "/home/torn", data, 100, 0);
+    wait_commit();
+    crash_image("journal_test_data", "journal_test_crash");
+    disk *c = create_disk("journal_test_crash", 0);
+    read_block(c, s.journal_block_idx, buf);
+    journal_header h = *(journal_header *)buf;
+    corrupt_block(c, s.journal_block_idx + 1 + h.tail + 1);
+    fclose(c->data);
+    free_disk(c);
+    check(image_has("journal_test_crash", "/home/torn", NULL, 0),
+          "torn transaction not replayed");
+    check(image_has("journal_test_crash", "/home/new", data, 3 * BLOCKSIZE),
+          "state before the torn transaction kept");
+
+    /* Blocks freed after being logged are not replayed over new data */
+    fs_create_dir(fs, "/tmp");
+    for (int i = 0; i < 300; ++i) {
+        sprintf(path, "/tmp/file_with_a_long_name_%d", i);
+        fs_write_file(fs, path, data, 0, 0);
+    }
+    fs_remove_dir(fs, "/tmp");
+    char big[100 * BLOCKSIZE];
+    for (int i = 0; i < 100 * BLOCKSIZE; ++i)
+        big[i] = 'z' - i % 7;
+    fs_write_file(fs, "/home/big", big, 100 * BLOCKSIZE, 0);
+    wait_commit();
+    crash_image("journal_test_data", "journal_test_crash");
+    check(image_has("journal_test_crash", "/home/big", big, 100 * BLOCKSIZE),
+          "revoked blocks not replayed");
+    check(image_has("journal_test_crash", "/tmp/file_with_a_long_name_5",
+                    NULL, 0),
+          "removed directory stays removed");
+
+    /* Checkpoint while a later transaction holds the same blocks: the
+       committed versions survive a crash before that one commits */
+    fs_sync(fs);
+    fs_write_file(fs, "/home/a", data, 100, 0);
+    fs_create_dir(fs, "/home/held");
+    fs_write_file(fs, "/home/held/x", data, 100, 0);
+    wait_commit();
+    txn_begin(fs); // keeps the next transaction running
+    fs_write_file(fs, "/home/b", data, 100, 0);
+    fs_remove_dir(fs, "/home/held");
+    check(journal_checkpoint(fs) == 0, "checkpoint beside a running one");
+    crash_image("journal_test_data", "journal_test_crash");
+    txn_end(fs);
+    check(image_has("journal_test_crash", "/home/a", data, 100),
+          "blocks logged again kept");
+    check(image_has("journal_test_crash", "/home/held/x", data, 100),
+          "blocks freed again kept");
+    check(image_has("journal_test_crash", "/home/b", NULL, 0),
+          "running transaction lost");
+    fs_sync(fs);
+    crash_image("journal_test_data", "journal_test_crash");
+    check(image_has("journal_test_crash", "/home/held/x", NULL, 0) &&
+              image_has("journal_test_crash", "/home/b", data, 100),
+          "checkpointed once committed");
+
+    fs_unmount(fs);
+    fclose(d->data);
+    free_disk(d);
+
+    /* With the smallest journal, bulk creations and tree removals are split
+       into transactions that fit the log */
+    remove("journal_test_small");
+    d = create_disk("journal_test_small", 16 * 1024 * 1024);
+    check(fs_format_journaled(d, 64) == -1, "journal too small refused");
+    check(fs_format_journaled(d, 128) == 0, "format with the smallest journal");
+    fs = fs_mount(d, MRD_Y);
+    fs_create_dir(fs, "/bulk");
+    int n = 3000;
+    char **names = (char **)malloc(n * sizeof(char *));
+    int *types = (int *)malloc(n * sizeof(int));
+    int *inumbers = (int *)malloc(n * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        names[i] = (char *)malloc(16);
+        sprintf(names[i], "n%d", i);
+        types[i] = i % 10 == 0 ? SFS_TYPE_D : SFS_TYPE_F;
+    }
+    check(fs_create_bulk(fs, "/bulk", names, types, n, inumbers) == n,
+          "bulk creation through a small journal");
+    fs_write_file(fs, "/keep", data, 100, 0);
+    wait_commit();
+    crash_image("journal_test_small", "journal_test_crash");
+    check(image_has("journal_test_crash", "/bulk/n2999", data, 0) &&
+              image_has("journal_test_crash", "/keep", data, 100),
+          "bulk creation recovered");
+
+    check(fs_remove_tree(fs, "/bulk", 4) == 0,
+          "tree removal through a small journal");
+    check(fs_sync(fs) == 0, "small journal never fails");
+    crash_image("journal_test_small", "journal_test_crash");
+    check(image_has("journal_test_crash", "/bulk/n1", NULL, 0) &&
+              image_has("journal_test_crash", "/keep", data, 100),
+          "tree removal recovered");
+    c = create_disk("journal_test_crash", 0);
+    sfs_fsck_report r;
+    /* the bits reserved by the allocation pools of the mounted file system
+       are leaked in the image, nothing else may be wrong */
+    fs_check(c, 0, 1, &r);
+    check(r.files == 1 && r.directories == 1 && r.orphan_inodes == 0 &&
+              r.bad_entries == 0 && r.lost_inodes == 0 && r.lost_blocks == 0,
+          "consistent after recovery");
+    fclose(c->data);
+    free_disk(c);
+    for (int i = 0; i < n; ++i)
+        free(names[i]);
+    free(names);
+    free(types);
+    free(inumbers);
+
+    fs_unmount(fs);
+    fclose(d->data);
+    free_disk(d);
+    remove("journal_test_data");
+    remove("journal_test_small");
+    remove("journal_test_crash");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+#define THREADS 4
+
+sfs_fs *fs;
+int inumber;
+
+void *reader(void *arg) {
+    char buf[BLOCKSIZE];
+    for (int b = 0; b < 16; ++b)
+        fs_read_i(fs, inumber, buf, BLOCKSIZE, b * BLOCKSIZE);
+    return NULL;
+}
+
+/* Sum of the latency histogram of a call */
+uint64_t hist_sum(sfs_call_stats *c) {
+    uint64_t n = 0;
+    for (int b = 0; b < SFS_TRACE_BUCKETS; ++b) n += c->hist[b];
+    return n;
+}
+
+int main() {
+    remove("trace_test_data");
+    disk *d = create_disk("trace_test_data", 16 * 1024 * 1024);
+    sfs_trace t;
+
+    /* Nothing is recorded while disabled */
+    fs_format(d);
+    fs = fs_mount(d, MRD_Y);
+    fs_write_file(fs, "/a", "x", 1, 0);
+    sfs_trace_snapshot(&t);
+    int zero = 1;
+    for (int i = 0; i < SFS_CALLS; ++i) zero &= t.calls[i].calls == 0;
+    check(zero, "nothing recorded while disabled");
+
+    /* Calls counted, with their latency and block I/Os */
+    sfs_trace_enable(1);
+    char data[16 * BLOCKSIZE], path[64];
+    memset(data, 't', sizeof(data));
+    fs_create_dir(fs, "/dir");
+    for (int i = 0; i < 10; ++i) {
+        sprintf(path, "/dir/f%d", i);
+        fs_write_file(fs, path, data, sizeof(data), 0);
+    }
+    sfs_trace_snapshot(&t);
+    sfs_call_stats *w = &t.calls[SFS_CALL_WRITE_FILE];
+    check(w->calls == 10 && hist_sum(w) == 10, "write_file counted");
+    check(w->total_ns >= w->max_ns && w->max_ns > 0, "latency recorded");
+    check(w->writes >= 10 * 16 && w->reads > 0, "block I/Os attributed");
+    check(t.calls[SFS_CALL_NAME_TO_INODE].calls >= 10 &&
+              t.calls[SFS_CALL_ALLOC_BIT].calls >= 10 * 16 &&
+              t.calls[SFS_CALL_CREATE_DIR].calls == 1,
+          "internals and nested calls counted");
+
+    /* The reads of concurrent threads go to their own calls */
+    inumber = fs_create_file(fs);
+    fs_write_i(fs, inumber, data, sizeof(data), 0);
+    sfs_trace_reset();
+    sfs_trace_snapshot(&t);
+    check(t.calls[SFS_CALL_WRITE_FILE].calls == 0 &&
+              t.calls[SFS_CALL_WRITE_I].writes == 0,
+          "reset");
+    uint32_t reads = d->reads;
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; ++i)
+        pthread_create(&threads[i], NULL, reader, NULL);
+    for (int i = 0; i < THREADS; ++i) pthread_join(threads[i], NULL);
+    sfs_trace_snapshot(&t);
+    sfs_call_stats *r = &t.calls[SFS_CALL_READ_I];
+    check(r->calls == THREADS * 16 && r->reads == d->reads - reads &&
+              r->writes == 0,
+          "reads of concurrent threads attributed");
+
+    /* JSON dump */
+    char json[8192], small[16];
+    int n = sfs_trace_json(json, sizeof(json));
+    check(n == strlen(json) && strstr(json, "\"call\": \"read_i\"") != NULL &&
+              strstr(json, "\"calls\": 64") != NULL &&
+              strstr(json, "write_file") == NULL,
+          "JSON dump");
+    check(sfs_trace_json(small, sizeof(small)) == n && strlen(small) == 15 &&
+              strncmp(small, json, 15) == 0,
+          "JSON dump truncated");
+    check(strcmp(sfs_call_name(SFS_CALL_READ_I), "read_i") == 0 &&
+              sfs_call_name(SFS_CALLS) == NULL,
+          "call names");
+
+    sfs_trace_enable(0);
+    sfs_trace_reset();
+    fs_read_i(fs, inumber, data, BLOCKSIZE, 0);
+    sfs_trace_snapshot(&t);
+    check(t.calls[SFS_CALL_READ_I].calls == 0, "disabled again");
+    fs_unmount(fs);
+
+    fclose(d->data);
+    free_disk(d);
+    remove("trace_test_data");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../sfs.h"
+#include "check.h"
+
+/* internal to sfs.c */
+int get_all_data_blocks(disk *diskptr, int inumber, uint32_t *res);
+uint32_t data_block(super_block *s, uint32_t index);
+
+void sleep_ms(int ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/* Fills a block with the pattern of (file, block) */
+void pattern(char *buf, int file, int block) {
+    for (int i = 0; i < BLOCKSIZE; ++i)
+        buf[i] = (char)(file * 31 + block * 7 + i);
+}
+
+/* Copies the disk file src to dst, as the disk would be found after a crash
+   at this point
+*/
+void crash_image(char *src, char *dst) {
+    FILE *in = fopen(src, "r"), *out = fopen(dst, "w");
+    char buf[BLOCKSIZE];
+    size_t n;
+    while ((n = fread(buf, 1, BLOCKSIZE, in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(in);
+    fclose(out);
+}
+
+/* Checks that the blocks of the file of inode inumber hold the patterns of
+   file on the disk itself
+*/
+int on_disk(disk *d, int inumber, int file, int nblocks) {
+    uint32_t res[1029];
+    char buf[BLOCKSIZE], expected[BLOCKSIZE];
+    super_block s;
+    if (get_super_block(d, &s) == -1 ||
+        get_all_data_blocks(d, inumber, res) == -1)
+        return 0;
+    for (int b = 0; b < nblocks; ++b) {
+        pattern(expected, file, b);
+        if (read_block(d, data_block(&s, res[b]), buf) == -1 ||
+            memcmp(buf, expected, BLOCKSIZE) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Writes a file of nblocks blocks of patterns. Returns its inode */
+int make_file(sfs_fs *fs, char *path, int file, int nblocks) {
+    char buf[BLOCKSIZE];
+    for (int b = 0; b < nblocks; ++b) {
+        pattern(buf, file, b);
+        fs_write_file(fs, path, buf, BLOCKSIZE, b * BLOCKSIZE);
+    }
+    return name_to_inode(fs, path, SFS_TYPE_F);
+}
+
+int main() {
+    remove("writeback_test_data");
+    disk *d = create_disk("writeback_test_data", 64 * 1024 * 1024);
+    fs_format(d);
+    sfs_fs *fs = fs_mount(d, MRD_Y | SFS_MOUNT_WRITEBACK);
+    check(fs != NULL, "mount with a write-back cache");
+
+    /* Writes only reach the disk on sync */
+    int w0 = d->writes;
+    int f = make_file(fs, "/f", 0, 64);
+    check(d->writes == w0, "writes return before reaching the disk");
+    char buf[BLOCKSIZE], expected[BLOCKSIZE];
+    pattern(expected, 0, 10);
+    check(fs_read_file(fs, "/f", buf, BLOCKSIZE, 10 * BLOCKSIZE) == BLOCKSIZE &&
+              memcmp(buf, expected, BLOCKSIZE) == 0,
+          "reads see the cached blocks");
+    check(fs_sync(fs) == 0 && on_disk(d, f, 0, 64), "sync writes everything");
+    int w1 = d->writes;
+    check(w1 - w0 < 64 + 10, "every block written once");
+
+    /* Rewrites of a dirty block are absorbed */
+    for (int i = 0; i < 100; ++i) {
+        pattern(buf, 1, 0);
+        fs_write_file(fs, "/g", buf, BLOCKSIZE, 0);
+    }
+    fs_sync(fs);
+    check(d->writes - w1 < 10, "rewrites written once");
+    check(on_disk(d, name_to_inode(fs, "/g", SFS_TYPE_F), 1, 1),
+          "last rewrite on the disk");
+
+    /* Old dirty blocks are written without sync */
+    int w2 = d->writes;
+    pattern(buf, 2, 0);
+    fs_write_file(fs, "/h", buf, BLOCKSIZE, 0);
+    sleep_ms(1500);
+    check(d->writes > w2 &&
+              on_disk(d, name_to_inode(fs, "/h", SFS_TYPE_F), 2, 1),
+          "expired blocks written by the flusher");
+
+    /* Writers are held back once too much is dirty */
+    char path[64];
+    for (int i = 0; i < 10; ++i) {
+        sprintf(path, "/big%d", i);
+        make_file(fs, path, 10 + i, 1000);
+    }
+    check(d->writes - w2 > 1000, "dirty blocks written past the limit");
+    fs_unmount(fs);
+
+    fs = fs_mount(d, MRD_N | SFS_MOUNT_WRITEBACK);
+    int ok = 1;
+    for (int i = 0; i < 10; ++i) {
+        sprintf(path, "/big%d", i);
+        ok &= on_disk(d, name_to_inode(fs, path, SFS_TYPE_F), 10 + i, 1000);
+    }
+    check(ok, "unmount writes everything");
+
+    /* Freed blocks are not written over their next use */
+    fs_create_dir(fs, "/tmp");
+    make_file(fs, "/tmp/dead", 3, 200);
+    fs_remove_dir(fs, "/tmp");
+    f = make_file(fs, "/live", 4, 200);
+    fs_sync(fs);
+    check(on_disk(d, f, 4, 200), "reused blocks hold the new data");
+    fs_unmount(fs);
+
+    /* With a journal, committed files have their data on the disk */
+    fs_format_journaled(d, 0);
+    fs = fs_mount(d, MRD_Y | SFS_MOUNT_WRITEBACK);
+    make_file(fs, "/j", 5, 100);
+    sleep_ms(100);
+    crash_image("writeback_test_data", "writeback_test_crash");
+    disk *c = create_disk("writeback_test_crash", 0);
+    sfs_fs *cfs = fs_mount(c, MRD_N);
+    check(cfs != NULL && on_disk(c, name_to_inode(cfs, "/j", SFS_TYPE_F), 5,
+                                 100),
+          "data written before the commit");
+    fs_unmount(cfs);
+    fclose(c->data);
+    free_disk(c);
+    fs_unmount(fs);
+
+    fclose(d->data);
+    free_disk(d);
+    remove("writeback_test_data");
+    remove("writeback_test_crash");
+    printf("%d failures\n", failures);
+    return failures > 0;
+}